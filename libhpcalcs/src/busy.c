@@ -0,0 +1,158 @@
+/*
+ * libhpcables, libhpcalcs: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file busy.c Cables / Calcs: serialization of the concurrent callers of a handle, in arrival order.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <hpfiles.h>
+#include "busy.h"
+#include "utils.h"
+
+// A handle is handed over directly from the releasing caller to the oldest waiter, so that it stays busy in between:
+// late arrivals can't overtake the waiters, and the waiters are served in order.
+// The waiters live on the stack of their threads, in a circular list: the gate of the handle points to the newest one,
+// whose next field points to the oldest one.
+// Each handle has its own lock, which is only held for a few instructions, never while the handle is in use.
+
+typedef struct _busy_waiter {
+    struct _busy_waiter * next;
+    pthread_t thread;
+    pthread_cond_t wakeup;
+    int granted;
+} busy_waiter;
+
+typedef struct {
+    pthread_mutex_t lock;
+    busy_waiter * waiters;
+    // Thread holding the handle, for refusing nested acquisitions (e.g. from a callback) which would otherwise wait for themselves forever.
+    pthread_t owner;
+} busy_gate;
+
+static void busy_unlink(busy_gate * gate, busy_waiter * waiter) {
+    busy_waiter * newest = gate->waiters;
+    if (waiter->next == waiter) {
+        gate->waiters = NULL;
+    }
+    else {
+        busy_waiter * previous = newest;
+        while (previous->next != waiter) {
+            previous = previous->next;
+        }
+        previous->next = waiter->next;
+        if (newest == waiter) {
+            gate->waiters = previous;
+        }
+    }
+}
+
+void * busy_gate_new(hplibs_malloc_funcs * alloc_funcs) {
+    busy_gate * gate = (busy_gate *)(alloc_funcs->calloc)(1, sizeof(*gate));
+    if (gate != NULL) {
+        pthread_mutex_init(&gate->lock, NULL);
+    }
+    return gate;
+}
+
+void busy_gate_del(void * gate, hplibs_malloc_funcs * alloc_funcs) {
+    if (gate != NULL) {
+        pthread_mutex_destroy(&((busy_gate *)gate)->lock);
+        (alloc_funcs->free)(gate);
+    }
+}
+
+int busy_acquire(int * busy, void * handle_gate, const int * busy_timeout) {
+    busy_gate * gate = (busy_gate *)handle_gate;
+    int timeout = __atomic_load_n(busy_timeout, __ATOMIC_RELAXED);
+    int res = 0;
+
+    pthread_mutex_lock(&gate->lock);
+    if (!*busy) {
+        // Nobody waits for a handle which isn't busy.
+        __atomic_store_n(busy, 1, __ATOMIC_RELEASE);
+        gate->owner = pthread_self();
+    }
+    else if (timeout == 0 || pthread_equal(gate->owner, pthread_self())) {
+        res = 1;
+    }
+    else {
+        busy_waiter self;
+        busy_waiter * newest = gate->waiters;
+        struct timespec deadline;
+
+        cond_init_monotonic(&self.wakeup);
+        self.thread = pthread_self();
+        self.granted = 0;
+        if (newest != NULL) {
+            self.next = newest->next;
+            newest->next = &self;
+        }
+        else {
+            self.next = &self;
+        }
+        gate->waiters = &self;
+
+        if (timeout > 0) {
+            cond_deadline(&deadline, monotonic_now_ns() + (uint64_t)timeout * 1000000);
+        }
+        while (!self.granted) {
+            if (timeout < 0) {
+                pthread_cond_wait(&self.wakeup, &gate->lock);
+            }
+            else if (pthread_cond_timedwait(&self.wakeup, &gate->lock, &deadline) != 0) {
+                break;
+            }
+        }
+        // The handle may have been handed over right when the wait timed out: take it then.
+        if (!self.granted) {
+            busy_unlink(gate, &self);
+            res = 1;
+        }
+        pthread_cond_destroy(&self.wakeup);
+    }
+    pthread_mutex_unlock(&gate->lock);
+    return res;
+}
+
+void busy_release(int * busy, void * handle_gate) {
+    busy_gate * gate = (busy_gate *)handle_gate;
+    busy_waiter * newest;
+
+    pthread_mutex_lock(&gate->lock);
+    newest = gate->waiters;
+    if (newest != NULL) {
+        busy_waiter * oldest = newest->next;
+        busy_unlink(gate, oldest);
+        gate->owner = oldest->thread;
+        oldest->granted = 1;
+        pthread_cond_signal(&oldest->wakeup);
+    }
+    else {
+        __atomic_store_n(busy, 0, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&gate->lock);
+}
@@ -0,0 +1,57 @@
+/*
+ * libhpcables, libhpcalcs: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file busy.h Cables / Calcs: serialization of the concurrent callers of a handle, in arrival order.
+ */
+
+#ifndef __HPLIBS_BUSY_H__
+#define __HPLIBS_BUSY_H__
+
+//! Default value of the busy_timeout field of the handles: callers wait for as long as it takes.
+#define BUSY_TIMEOUT_INFINITE (-1)
+
+/**
+ * \brief Allocates the gate of a handle, which serializes its callers.
+ * \param alloc_funcs the allocator of the library owning the handle.
+ * \return the gate, to be stored in the busy_gate field of the handle, NULL if error.
+ */
+void * busy_gate_new(hplibs_malloc_funcs * alloc_funcs);
+/**
+ * \brief Frees the gate of a handle, which mustn't be in use anymore.
+ * \param gate the busy_gate field of the handle, may be NULL.
+ * \param alloc_funcs the allocator which allocated the gate.
+ */
+void busy_gate_del(void * gate, hplibs_malloc_funcs * alloc_funcs);
+/**
+ * \brief Waits until the handle is free, then marks it busy. Callers are served in the order in which they arrived.
+ * \param busy the busy field of the handle, only written by these functions.
+ * \param gate the busy_gate field of the handle.
+ * \param busy_timeout the busy_timeout field of the handle, read atomically: the longest wait, in ms; 0 doesn't wait, a negative value waits forever.
+ * \return 0 if the handle was acquired, nonzero if it is still busy after the timeout, or already held by the calling thread.
+ */
+int busy_acquire(int * busy, void * gate, const int * busy_timeout);
+/**
+ * \brief Releases a handle acquired by \a busy_acquire, handing it over to the oldest waiter, if any.
+ * \param busy the busy field of the handle.
+ * \param gate the busy_gate field of the handle.
+ */
+void busy_release(int * busy, void * gate);
+
+#endif
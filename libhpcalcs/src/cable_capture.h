@@ -0,0 +1,142 @@
+/*
+ * libhpcables: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file cable_capture.h Cables: traffic capture, recording every report sent and received by a cable into a binary capture file.
+ *
+ * A capture file is a \a cable_capture_header followed by records. Each record is a \a cable_capture_record_header,
+ * followed by the report data, padded with zeros to a multiple of 8 bytes. Fields are in the byte order of the host
+ * which wrote the capture; readers detect foreign byte orders through the version field.
+ * The header's end_offset is updated after each record, so that the records of an interrupted capture can still be read.
+ *
+ * The CABLE_REPLAY cable plays a capture file back: it serves the recorded device-to-host reports through recv, and checks
+ * that send is called with the recorded host-to-device reports. The capture file is set with \a hpcables_options_set_device_path.
+ */
+
+#ifndef __HPLIBS_CABLE_CAPTURE_H__
+#define __HPLIBS_CABLE_CAPTURE_H__
+
+#include <stdint.h>
+
+#include "hplibs.h"
+#include "hpcables.h"
+
+//! Magic number at the beginning of capture files.
+#define CABLE_CAPTURE_MAGIC "HPLPCAP\x1A"
+//! Latest revision of the capture file format.
+#define CABLE_CAPTURE_VERSION (1)
+
+//! Record flag: the operation failed, \a cable_capture_record_header.result holds the error code.
+#define CABLE_CAPTURE_FLAG_ERROR (0x01)
+//! Record flag: the report was sent as part of a batch, timestamp and duration are those of the whole batch.
+#define CABLE_CAPTURE_FLAG_BATCH (0x02)
+
+//! Header of a capture file, 32 bytes.
+typedef struct {
+    uint8_t magic[8]; ///< CABLE_CAPTURE_MAGIC.
+    uint32_t version; ///< CABLE_CAPTURE_VERSION.
+    uint32_t cable_model; ///< Model of the captured cable.
+    uint64_t start_time_ns; ///< Wall-clock time at which the capture started, in nanoseconds since the Epoch.
+    uint64_t end_offset; ///< Offset of the end of the last complete record.
+} cable_capture_header;
+
+//! Header of a capture record, 24 bytes.
+typedef struct {
+    uint64_t timestamp_ns; ///< Start of the operation, in nanoseconds since the start of the capture (monotonic clock).
+    uint32_t duration_ns; ///< Duration of the operation, in nanoseconds, saturated to UINT32_MAX.
+    uint32_t size; ///< Size of the report data following the header.
+    int32_t result; ///< Return value of the cable function.
+    uint8_t direction; ///< PACKET_DIRECTION_SEND or PACKET_DIRECTION_RECV.
+    uint8_t flags; ///< Binary OR of CABLE_CAPTURE_FLAG_* values.
+    uint16_t reserved; ///< Zero.
+} cable_capture_record_header;
+
+//! Callback invoked by \a hpcables_capture_read for each record, with the report data; returning nonzero stops the iteration.
+typedef int (*cable_capture_callback)(const cable_capture_record_header * record, const uint8_t * data, void * user_data);
+
+//! Statistics gathered by a replay cable.
+typedef struct {
+    uint64_t reports_sent; ///< Reports sent by the computer.
+    uint64_t reports_received; ///< Recorded reports served to the computer.
+    uint64_t mismatches; ///< Reports sent which differ from the recorded ones, or go past the end of the capture.
+    uint64_t stalls; ///< Reads which returned nothing, because the computer hadn't sent what preceded the next recorded report, or the capture was exhausted.
+} cable_replay_stats;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief Starts capturing the traffic of an open cable into a file, by wrapping its cable functions.
+ * The capture stops when the cable is closed, or when \a hpcables_capture_stop is called.
+ * \param handle the cable handle, which must be open and not busy.
+ * \param path the capture file, created or truncated.
+ * \return 0 upon success, nonzero otherwise.
+ * \note records are written into a memory mapping of the file, without formatting nor system calls on the hot path, except when the mapping grows.
+ */
+HPEXPORT int HPCALL hpcables_capture_start(cable_handle * handle, const char * path);
+/**
+ * \brief Stops capturing the traffic of a cable, restoring its cable functions and truncating the capture file to its contents.
+ * \param handle the cable handle.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_capture_stop(cable_handle * handle);
+/**
+ * \brief Tells whether the capture wrapper is the outermost wrapper of a cable.
+ * \param handle the cable handle.
+ * \return 1 if the traffic is being captured, 0 otherwise.
+ */
+HPEXPORT int HPCALL hpcables_capture_active(cable_handle * handle);
+/**
+ * \brief Reads the records of a capture file, in order.
+ * \param path the capture file.
+ * \param out_header storage area for the file header, may be NULL.
+ * \param callback function invoked for each record, may be NULL to only validate the file.
+ * \param user_data passed to \a callback.
+ * \return 0 upon success, ERR_CABLE_CAPTURE_FORMAT if the file isn't a valid capture file, another nonzero value otherwise.
+ */
+HPEXPORT int HPCALL hpcables_capture_read(const char * path, cable_capture_header * out_header, cable_capture_callback callback, void * user_data);
+
+/**
+ * \brief Selects the pace of a replay cable: as fast as possible (the default), or at the recorded timing.
+ * \param handle the replay cable handle, which must be open.
+ * \param realtime nonzero to delay each operation until its recorded completion time, relative to the first operation.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_replay_set_realtime(cable_handle * handle, int realtime);
+/**
+ * \brief Restarts a replay cable from the beginning of its capture, e.g. to run a benchmark several times.
+ * \param handle the replay cable handle, which must be open.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_replay_rewind(cable_handle * handle);
+/**
+ * \brief Retrieves the statistics of a replay cable, accumulated since it was opened.
+ * \param handle the replay cable handle, which must be open.
+ * \param out_stats storage area for the statistics.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_replay_get_stats(cable_handle * handle, cable_replay_stats * out_stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
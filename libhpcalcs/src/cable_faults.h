@@ -0,0 +1,99 @@
+/*
+ * libhpcables: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file cable_faults.h Cables: fault injection, disturbing the traffic of a cable in a reproducible way.
+ *
+ * Like the traffic capture wrapper, the fault injection wrapper sits in front of the cable functions of any open cable.
+ * Both wrappers can be stacked; they must then be stopped in the reverse order of their start, and closing the cable stops them all.
+ */
+
+#ifndef __HPLIBS_CABLE_FAULTS_H__
+#define __HPLIBS_CABLE_FAULTS_H__
+
+#include <stdint.h>
+
+#include "hplibs.h"
+#include "hpcables.h"
+
+//! Denominator of the fault rates: a rate of CABLE_FAULTS_RATE_ONE affects every report.
+#define CABLE_FAULTS_RATE_ONE (1000000)
+
+//! Fault injection settings. Rates are in parts per million of the reports going through the cable.
+typedef struct {
+    uint64_t seed; ///< Seed of the pseudo-random generator: the same seed and traffic produce the same faults.
+    uint32_t drop_rate; ///< Received reports silently discarded.
+    uint32_t duplicate_rate; ///< Received reports delivered twice.
+    uint32_t short_read_rate; ///< Received reports truncated to a random shorter size.
+    uint32_t spurious_rate; ///< Spurious 0xFF or 0xFE reports inserted before a received report.
+    uint32_t delay_rate; ///< Received reports delayed by delay_us.
+    uint32_t delay_us; ///< Delay of delayed reports, in microseconds.
+    uint32_t send_drop_rate; ///< Sent reports silently discarded, while reporting success.
+} cable_faults_config;
+
+//! Faults injected since the wrapper was started.
+typedef struct {
+    uint64_t reports_received; ///< Reports received from the wrapped cable.
+    uint64_t reports_sent; ///< Reports sent by the computer.
+    uint64_t dropped;
+    uint64_t duplicated;
+    uint64_t shortened;
+    uint64_t spurious;
+    uint64_t delayed;
+    uint64_t send_dropped;
+} cable_faults_stats;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief Starts injecting faults into the traffic of an open cable, by wrapping its cable functions.
+ * The wrapper is removed when the cable is closed, or when \a hpcables_faults_stop is called.
+ * \param handle the cable handle, which must be open and not busy.
+ * \param config the fault injection settings, copied.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_faults_start(cable_handle * handle, const cable_faults_config * config);
+/**
+ * \brief Stops injecting faults, restoring the cable functions of the cable.
+ * \param handle the cable handle.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_faults_stop(cable_handle * handle);
+/**
+ * \brief Tells whether the fault injection wrapper is the outermost wrapper of a cable.
+ * \param handle the cable handle.
+ * \return 1 if faults are being injected, 0 otherwise.
+ */
+HPEXPORT int HPCALL hpcables_faults_active(cable_handle * handle);
+/**
+ * \brief Retrieves the number of faults injected so far.
+ * \param handle the cable handle, into which faults are being injected.
+ * \param out_stats storage area for the statistics.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_faults_get_stats(cable_handle * handle, cable_faults_stats * out_stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
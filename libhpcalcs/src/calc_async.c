@@ -0,0 +1,788 @@
+/*
+ * libhpcalcs: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file calc_async.c Calcs: asynchronous operations, queued per calculator and run by a shared pool of worker threads.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <hpfiles.h>
+#include <hpcables.h>
+#include <hpcalcs.h>
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+#include "busy.h"
+#include "utils.h"
+
+// Scheduling model:
+// * each calculator has a FIFO of requests, and is "scheduled" while it sits in the ready FIFO, or runs or notifies a request,
+//   which guarantees that requests of a calculator run and are notified one at a time, in order;
+// * workers take the oldest ready calculator, run its oldest request, notify it, and append the calculator back if more requests are queued.
+// The cables block until the calculator answers, so that the pool bounds the number of operations in flight;
+// submitters, and whoever polls the completion queues, never block on a calculator.
+// All state is protected by a single lock: it is only held for queue manipulations, never while an operation runs.
+// Pumped calculators are never scheduled: hpcalcs_async_pump sends the command of their oldest request, then completes it once the
+// reply has come in, in as many calls as needed, so that they can be serviced from an event loop without any thread.
+
+#define ASYNC_DEFAULT_WORKERS (4)
+
+typedef struct _calc_async_state {
+    calc_request * head;
+    calc_request * tail;
+    int scheduled;
+    int ready;
+    struct _calc_async_state * next_ready;
+    calc_handle * handle;
+    int pumped;
+    calc_request * inflight; // Pumped request whose command was sent, and whose reply is awaited.
+} calc_async_state;
+
+struct _calc_request {
+    calc_handle * handle;
+    calc_async_op op;
+    calc_async_callback callback;
+    calc_completion_queue * queue;
+    void * user_data;
+    calc_async_result result;
+    uint32_t refs; // One for the caller, one for the library until notified.
+    int pending; // In the FIFO of the calculator.
+    int done;
+    int deleted;
+    int queued; // In the completion queue.
+    calc_request * next; // In the FIFO of the calculator, then in the completion queue.
+};
+
+struct _calc_completion_queue {
+    calc_request * head;
+    calc_request * tail;
+    pthread_cond_t available;
+};
+
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t async_completed = PTHREAD_COND_INITIALIZER; // Broadcast when a request completes, or a calculator is unscheduled.
+static calc_async_state * async_ready_head;
+static calc_async_state * async_ready_tail;
+static pthread_t * async_threads;
+static uint32_t async_thread_count;
+static uint32_t async_worker_count = ASYNC_DEFAULT_WORKERS;
+static int async_stop;
+
+static void async_free(calc_request * request) {
+    calc_async_result * result = &request->result;
+    (hpcalcs_alloc_funcs.free)(result->data);
+    (hpcalcs_alloc_funcs.free)(result->infos.data);
+    if (result->payload.block != NULL) {
+        hpcalcs_payload_release(&result->payload);
+    }
+    if (result->file != NULL) {
+        hpfiles_ve_delete(result->file);
+    }
+    if (result->vars != NULL) {
+        hpfiles_ve_delete_array(result->vars);
+    }
+    if (request->op.op == CALC_FNCT_SEND_ENCODED_FILE) {
+        hpcalcs_encoded_file_unref(request->op.encoded);
+    }
+    (hpcalcs_alloc_funcs.free)(request);
+}
+
+// Called with the lock held; returns nonzero if the request must be freed once the lock is released.
+static int async_unref(calc_request * request) {
+    return --request->refs == 0;
+}
+
+static void async_push_ready(calc_async_state * state) {
+    state->ready = 1;
+    state->next_ready = NULL;
+    if (async_ready_tail != NULL) {
+        async_ready_tail->next_ready = state;
+    }
+    else {
+        async_ready_head = state;
+    }
+    async_ready_tail = state;
+    pthread_cond_signal(&async_work);
+}
+
+// Called with the lock held; returns NULL upon allocation failure.
+static calc_async_state * async_get_state(calc_handle * handle) {
+    calc_async_state * state = (calc_async_state *)handle->async;
+    if (state == NULL) {
+        state = (calc_async_state *)(hpcalcs_alloc_funcs.calloc)(1, sizeof(*state));
+        if (state != NULL) {
+            state->handle = handle;
+            handle->async = state;
+        }
+    }
+    return state;
+}
+
+// Called with the lock held.
+static void async_unlink_ready(calc_async_state * state) {
+    calc_async_state ** link = &async_ready_head;
+    calc_async_state * previous = NULL;
+    while (*link != NULL && *link != state) {
+        previous = *link;
+        link = &(*link)->next_ready;
+    }
+    if (*link == state) {
+        *link = state->next_ready;
+        if (async_ready_tail == state) {
+            async_ready_tail = previous;
+        }
+        state->ready = 0;
+    }
+}
+
+// Called with the lock held.
+static void async_unlink_completed(calc_request * request) {
+    calc_completion_queue * queue = request->queue;
+    calc_request ** link = &queue->head;
+    calc_request * previous = NULL;
+    while (*link != NULL && *link != request) {
+        previous = *link;
+        link = &(*link)->next;
+    }
+    if (*link == request) {
+        *link = request->next;
+        if (queue->tail == request) {
+            queue->tail = previous;
+        }
+        request->queued = 0;
+    }
+}
+
+static void async_execute(calc_request * request) {
+    calc_handle * handle = request->handle;
+    const calc_async_op * op = &request->op;
+    calc_async_result * result = &request->result;
+
+    switch (op->op) {
+        case CALC_FNCT_CHECK_READY:
+            result->res = hpcalcs_calc_check_ready(handle, &result->data, &result->size);
+            break;
+        case CALC_FNCT_GET_INFOS:
+            result->res = hpcalcs_calc_get_infos(handle, &result->infos);
+            break;
+        case CALC_FNCT_SET_DATE_TIME:
+            result->res = hpcalcs_calc_set_date_time(handle, op->timestamp);
+            break;
+        case CALC_FNCT_RECV_SCREEN:
+            result->res = hpcalcs_calc_recv_screen_payload(handle, op->format, &result->payload);
+            break;
+        case CALC_FNCT_SEND_FILE:
+            result->res = hpcalcs_calc_send_file(handle, op->file);
+            break;
+        case CALC_FNCT_RECV_FILE:
+            result->res = hpcalcs_calc_recv_file(handle, op->file, &result->file);
+            break;
+        case CALC_FNCT_RECV_BACKUP:
+            result->res = hpcalcs_calc_recv_backup(handle, &result->vars);
+            break;
+        case CALC_FNCT_SEND_KEY:
+            result->res = hpcalcs_calc_send_key(handle, op->code);
+            break;
+        case CALC_FNCT_SEND_KEYS:
+            result->res = hpcalcs_calc_send_keys(handle, (const uint8_t *)op->data, op->size);
+            break;
+        case CALC_FNCT_SEND_CHAT:
+            result->res = hpcalcs_calc_send_chat(handle, (const uint16_t *)op->data, op->size);
+            break;
+        case CALC_FNCT_RECV_CHAT:
+            result->res = hpcalcs_calc_recv_chat_payload(handle, &result->payload);
+            break;
+        case CALC_FNCT_SEND_ENCODED_FILE:
+            result->res = hpcalcs_calc_send_encoded_file(handle, op->encoded);
+            break;
+        default:
+            result->res = ERR_INVALID_PARAMETER;
+            break;
+    }
+}
+
+// Marks the request as completed, calls its callback and adds it to its completion queue, unless the caller deleted it meanwhile.
+static void async_notify(calc_request * request) {
+    int deleted;
+    int release;
+
+    pthread_mutex_lock(&async_lock);
+    request->done = 1;
+    deleted = request->deleted;
+    pthread_cond_broadcast(&async_completed);
+    pthread_mutex_unlock(&async_lock);
+
+    if (!deleted && request->callback != NULL) {
+        (*request->callback)(request, request->user_data);
+    }
+
+    pthread_mutex_lock(&async_lock);
+    if (!request->deleted && request->queue != NULL) {
+        calc_completion_queue * queue = request->queue;
+        request->next = NULL;
+        if (queue->tail != NULL) {
+            queue->tail->next = request;
+        }
+        else {
+            queue->head = request;
+        }
+        queue->tail = request;
+        request->queued = 1;
+        pthread_cond_signal(&queue->available);
+    }
+    release = async_unref(request);
+    pthread_mutex_unlock(&async_lock);
+    if (release) {
+        async_free(request);
+    }
+}
+
+static void * async_worker(void * arg) {
+    (void)arg;
+    pthread_mutex_lock(&async_lock);
+    for (;;) {
+        calc_async_state * state;
+        calc_request * request;
+
+        while (!async_stop && async_ready_head == NULL) {
+            pthread_cond_wait(&async_work, &async_lock);
+        }
+        if (async_stop) {
+            break;
+        }
+        state = async_ready_head;
+        async_ready_head = state->next_ready;
+        if (async_ready_head == NULL) {
+            async_ready_tail = NULL;
+        }
+        state->ready = 0;
+
+        request = state->head;
+        if (request != NULL) {
+            state->head = request->next;
+            if (state->head == NULL) {
+                state->tail = NULL;
+            }
+            request->pending = 0;
+            pthread_mutex_unlock(&async_lock);
+
+            async_execute(request);
+            async_notify(request);
+            pthread_mutex_lock(&async_lock);
+        }
+
+        if (state->head != NULL) {
+            async_push_ready(state);
+        }
+        else {
+            state->scheduled = 0;
+            pthread_cond_broadcast(&async_completed);
+        }
+    }
+    pthread_mutex_unlock(&async_lock);
+    return NULL;
+}
+
+// Called with the lock held.
+static int async_start_workers(void) {
+    if (async_thread_count < async_worker_count) {
+        pthread_t * threads = (pthread_t *)(hpcalcs_alloc_funcs.realloc)(async_threads, async_worker_count * sizeof(pthread_t));
+        if (threads == NULL) {
+            hpcalcs_error("%s: couldn't allocate memory for worker threads", __FUNCTION__);
+            return async_thread_count == 0 ? ERR_MALLOC : ERR_SUCCESS;
+        }
+        async_threads = threads;
+        async_stop = 0;
+        while (async_thread_count < async_worker_count) {
+            if (pthread_create(&async_threads[async_thread_count], NULL, async_worker, NULL) != 0) {
+                hpcalcs_error("%s: cannot start worker thread", __FUNCTION__);
+                break;
+            }
+            async_thread_count++;
+        }
+        hpcalcs_info("%s: %" PRIu32 " worker threads", __FUNCTION__, async_thread_count);
+    }
+    return async_thread_count != 0 ? ERR_SUCCESS : ERR_MALLOC;
+}
+
+void hpcalcs_async_exit(void) {
+    uint32_t i;
+    uint32_t count;
+
+    pthread_mutex_lock(&async_lock);
+    async_stop = 1;
+    pthread_cond_broadcast(&async_work);
+    count = async_thread_count;
+    pthread_mutex_unlock(&async_lock);
+
+    for (i = 0; i < count; i++) {
+        pthread_join(async_threads[i], NULL);
+    }
+
+    pthread_mutex_lock(&async_lock);
+    (hpcalcs_alloc_funcs.free)(async_threads);
+    async_threads = NULL;
+    async_thread_count = 0;
+    pthread_mutex_unlock(&async_lock);
+}
+
+HPEXPORT calc_request * HPCALL hpcalcs_async_submit(calc_handle * handle, const calc_async_op * op, calc_async_callback callback, calc_completion_queue * queue, void * user_data) {
+    calc_request * request = NULL;
+    if (handle != NULL && op != NULL) {
+        switch (op->op) {
+            case CALC_FNCT_CHECK_READY:
+            case CALC_FNCT_GET_INFOS:
+            case CALC_FNCT_SET_DATE_TIME:
+            case CALC_FNCT_RECV_SCREEN:
+            case CALC_FNCT_SEND_FILE:
+            case CALC_FNCT_RECV_FILE:
+            case CALC_FNCT_RECV_BACKUP:
+            case CALC_FNCT_SEND_KEY:
+            case CALC_FNCT_SEND_KEYS:
+            case CALC_FNCT_SEND_CHAT:
+            case CALC_FNCT_RECV_CHAT:
+                break;
+            case CALC_FNCT_SEND_ENCODED_FILE:
+                if (op->encoded != NULL) {
+                    break;
+                }
+                // fall through
+            default:
+                hpcalcs_error("%s: unsupported operation %d", __FUNCTION__, op->op);
+                return NULL;
+        }
+
+        request = (calc_request *)(hpcalcs_alloc_funcs.calloc)(1, sizeof(*request));
+        if (request != NULL) {
+            calc_async_state * state;
+            int res;
+
+            request->handle = handle;
+            request->op = *op;
+            request->callback = callback;
+            request->queue = queue;
+            request->user_data = user_data;
+            request->refs = 2;
+            request->pending = 1;
+
+            pthread_mutex_lock(&async_lock);
+            state = async_get_state(handle);
+            if (state == NULL) {
+                res = ERR_MALLOC;
+            }
+            else if (state->pumped) {
+                // Backups are made of many packets, which can't be taken in one reply at a time.
+                // Files are sent whole by the pump call starting the operation: on a real device, that would hold the event loop for the transfer.
+                int send_file = op->op == CALC_FNCT_SEND_FILE || op->op == CALC_FNCT_SEND_ENCODED_FILE;
+                res = ERR_SUCCESS;
+                if (op->op == CALC_FNCT_RECV_BACKUP || (send_file && handle->cable != NULL && handle->cable->model == CABLE_PRIME_HIDRAW)) {
+                    res = ERR_INVALID_PARAMETER;
+                }
+            }
+            else {
+                res = async_start_workers();
+            }
+            if (res == ERR_SUCCESS) {
+                if (op->op == CALC_FNCT_SEND_ENCODED_FILE) {
+                    hpcalcs_encoded_file_ref(op->encoded);
+                }
+                if (state->tail != NULL) {
+                    state->tail->next = request;
+                }
+                else {
+                    state->head = request;
+                }
+                state->tail = request;
+                if (!state->pumped && !state->scheduled) {
+                    state->scheduled = 1;
+                    async_push_ready(state);
+                }
+            }
+            pthread_mutex_unlock(&async_lock);
+
+            if (res != ERR_SUCCESS) {
+                hpcalcs_error("%s: couldn't queue request", __FUNCTION__);
+                (hpcalcs_alloc_funcs.free)(request);
+                request = NULL;
+            }
+        }
+        else {
+            hpcalcs_error("%s: couldn't allocate memory for request", __FUNCTION__);
+        }
+    }
+    else {
+        hpcalcs_error("%s: handle or op is NULL", __FUNCTION__);
+    }
+    return request;
+}
+
+HPEXPORT int HPCALL hpcalcs_async_cancel(calc_handle * handle) {
+    int res;
+    if (handle != NULL) {
+        calc_async_state * state;
+        calc_request * cancelled = NULL;
+        int pumped = 0;
+
+        pthread_mutex_lock(&async_lock);
+        state = (calc_async_state *)handle->async;
+        if (state != NULL) {
+            calc_request * request;
+            pumped = state->pumped;
+            cancelled = state->head;
+            state->head = NULL;
+            state->tail = NULL;
+            for (request = cancelled; request != NULL; request = request->next) {
+                request->pending = 0;
+            }
+            // Nothing left to run: a calculator waiting in the ready FIFO is unscheduled at once.
+            if (state->ready) {
+                async_unlink_ready(state);
+                state->scheduled = 0;
+            }
+            // The running request, if any, is notified before the cancelled ones, so that notifications stay in order.
+            while (state->scheduled) {
+                pthread_cond_wait(&async_completed, &async_lock);
+            }
+        }
+        pthread_mutex_unlock(&async_lock);
+
+        // A pumped request in flight is cancelled as well, along with the rest of its reply, once no pump call uses it.
+        if (pumped && !busy_acquire(&handle->busy, handle->busy_gate, &handle->busy_timeout)) {
+            calc_request * inflight;
+            pthread_mutex_lock(&async_lock);
+            inflight = state->inflight;
+            state->inflight = NULL;
+            pthread_mutex_unlock(&async_lock);
+            if (inflight != NULL && handle->fncts->pump_abort != NULL) {
+                (*handle->fncts->pump_abort)(handle);
+            }
+            busy_release(&handle->busy, handle->busy_gate);
+            if (inflight != NULL) {
+                inflight->result.res = ERR_CALC_CANCELLED;
+                async_notify(inflight);
+            }
+        }
+
+        while (cancelled != NULL) {
+            calc_request * next = cancelled->next;
+            cancelled->result.res = ERR_CALC_CANCELLED;
+            async_notify(cancelled);
+            cancelled = next;
+        }
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_async_set_pumped(calc_handle * handle, int pumped) {
+    int res;
+    if (handle != NULL) {
+        calc_async_state * state;
+
+        pthread_mutex_lock(&async_lock);
+        state = async_get_state(handle);
+        if (state == NULL) {
+            res = ERR_MALLOC;
+        }
+        else if (state->head != NULL || state->scheduled || state->inflight != NULL) {
+            res = ERR_CALC_BUSY;
+        }
+        else if (pumped && (handle->fncts == NULL || handle->fncts->pump_start == NULL || handle->fncts->pump_step == NULL)) {
+            res = ERR_CALC_INVALID_FNCTS;
+        }
+        else {
+            state->pumped = pumped != 0;
+            res = ERR_SUCCESS;
+        }
+        pthread_mutex_unlock(&async_lock);
+        if (res != ERR_SUCCESS) {
+            hpcalcs_error("%s: cannot change mode, operations are queued or the calculator can't be pumped", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_async_pump(calc_handle * handle, uint32_t * out_completed) {
+    int res = ERR_SUCCESS;
+    uint32_t completed = 0;
+    if (handle != NULL) {
+        // Never wait for the calculator: whoever uses it will be done by the next call.
+        static const int no_wait = 0;
+        for (;;) {
+            calc_async_state * state;
+            calc_request * request = NULL;
+            int started = 1;
+            int done = 0;
+
+            if (busy_acquire(&handle->busy, handle->busy_gate, &no_wait)) {
+                res = ERR_CALC_BUSY;
+                hpcalcs_info("%s: calculator busy", __FUNCTION__);
+                break;
+            }
+            pthread_mutex_lock(&async_lock);
+            state = (calc_async_state *)handle->async;
+            if (state != NULL && state->pumped) {
+                request = state->inflight;
+                if (request == NULL && state->head != NULL) {
+                    request = state->head;
+                    state->head = request->next;
+                    if (state->head == NULL) {
+                        state->tail = NULL;
+                    }
+                    request->pending = 0;
+                    state->inflight = request;
+                    started = 0;
+                }
+            }
+            else {
+                res = ERR_INVALID_PARAMETER;
+            }
+            pthread_mutex_unlock(&async_lock);
+
+            if (request != NULL) {
+                calc_async_result * result = &request->result;
+                if (!started) {
+                    result->res = (*handle->fncts->pump_start)(handle, &request->op);
+                    done = result->res != ERR_SUCCESS;
+                }
+                if (!done) {
+                    result->res = (*handle->fncts->pump_step)(handle, &request->op, result, &done);
+                }
+                if (done) {
+                    pthread_mutex_lock(&async_lock);
+                    state->inflight = NULL;
+                    pthread_mutex_unlock(&async_lock);
+                }
+            }
+            busy_release(&handle->busy, handle->busy_gate);
+
+            if (!done) {
+                // Nothing queued, or the reply is still on its way.
+                break;
+            }
+            async_notify(request);
+            completed++;
+        }
+        if (res != ERR_SUCCESS && res != ERR_CALC_BUSY) {
+            hpcalcs_error("%s: calculator isn't pumped", __FUNCTION__);
+        }
+        if (out_completed != NULL) {
+            *out_completed = completed;
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_async_set_workers(uint32_t count) {
+    int res;
+    if (count != 0) {
+        pthread_mutex_lock(&async_lock);
+        if (count > async_worker_count) {
+            async_worker_count = count;
+        }
+        // A running pool grows at once, otherwise upon the next submission.
+        res = async_thread_count != 0 ? async_start_workers() : ERR_SUCCESS;
+        pthread_mutex_unlock(&async_lock);
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: count is 0", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_request_wait(calc_request * request) {
+    int res;
+    if (request != NULL) {
+        pthread_mutex_lock(&async_lock);
+        while (!request->done) {
+            pthread_cond_wait(&async_completed, &async_lock);
+        }
+        res = request->result.res;
+        pthread_mutex_unlock(&async_lock);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: request is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT calc_async_result * HPCALL hpcalcs_request_get_result(calc_request * request) {
+    calc_async_result * result = NULL;
+    if (request != NULL) {
+        pthread_mutex_lock(&async_lock);
+        if (request->done) {
+            result = &request->result;
+        }
+        pthread_mutex_unlock(&async_lock);
+    }
+    else {
+        hpcalcs_error("%s: request is NULL", __FUNCTION__);
+    }
+    return result;
+}
+
+HPEXPORT calc_handle * HPCALL hpcalcs_request_get_handle(calc_request * request) {
+    calc_handle * handle = NULL;
+    if (request != NULL) {
+        handle = request->handle;
+    }
+    else {
+        hpcalcs_error("%s: request is NULL", __FUNCTION__);
+    }
+    return handle;
+}
+
+HPEXPORT void * HPCALL hpcalcs_request_get_user_data(calc_request * request) {
+    void * user_data = NULL;
+    if (request != NULL) {
+        user_data = request->user_data;
+    }
+    else {
+        hpcalcs_error("%s: request is NULL", __FUNCTION__);
+    }
+    return user_data;
+}
+
+HPEXPORT int HPCALL hpcalcs_request_del(calc_request * request) {
+    int res;
+    if (request != NULL) {
+        int release;
+
+        pthread_mutex_lock(&async_lock);
+        request->deleted = 1;
+        if (request->pending) {
+            // Still in the FIFO of the calculator: it will never be notified, so that the library drops its reference here.
+            calc_async_state * state = (calc_async_state *)request->handle->async;
+            calc_request ** link = &state->head;
+            calc_request * previous = NULL;
+            while (*link != request) {
+                previous = *link;
+                link = &(*link)->next;
+            }
+            *link = request->next;
+            if (state->tail == request) {
+                state->tail = previous;
+            }
+            request->pending = 0;
+            request->done = 1;
+            request->refs--;
+        }
+        // A pumped request in flight completes upon a later pump call, which drops it; waiting for it here could wait forever.
+        while (!request->done && ((calc_async_state *)request->handle->async)->inflight != request) {
+            pthread_cond_wait(&async_completed, &async_lock);
+        }
+        if (request->queued) {
+            async_unlink_completed(request);
+        }
+        release = async_unref(request);
+        pthread_mutex_unlock(&async_lock);
+        if (release) {
+            async_free(request);
+        }
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: request is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT calc_completion_queue * HPCALL hpcalcs_completion_queue_new(void) {
+    calc_completion_queue * queue = (calc_completion_queue *)(hpcalcs_alloc_funcs.calloc)(1, sizeof(*queue));
+    if (queue != NULL) {
+        // Timeouts are computed on CLOCK_MONOTONIC, so that changes of the wall clock don't affect them.
+        cond_init_monotonic(&queue->available);
+    }
+    else {
+        hpcalcs_error("%s: couldn't allocate memory for completion queue", __FUNCTION__);
+    }
+    return queue;
+}
+
+HPEXPORT int HPCALL hpcalcs_completion_queue_del(calc_completion_queue * queue) {
+    int res;
+    if (queue != NULL) {
+        calc_request * request;
+        while ((request = hpcalcs_completion_queue_poll(queue, 0)) != NULL) {
+            hpcalcs_request_del(request);
+        }
+        pthread_cond_destroy(&queue->available);
+        (hpcalcs_alloc_funcs.free)(queue);
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: queue is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT calc_request * HPCALL hpcalcs_completion_queue_poll(calc_completion_queue * queue, uint32_t timeout_ms) {
+    calc_request * request = NULL;
+    if (queue != NULL) {
+        pthread_mutex_lock(&async_lock);
+        if (queue->head == NULL && timeout_ms != 0) {
+            struct timespec deadline;
+            cond_deadline(&deadline, monotonic_now_ns() + (uint64_t)timeout_ms * 1000000);
+            while (queue->head == NULL) {
+                if (pthread_cond_timedwait(&queue->available, &async_lock, &deadline) != 0) {
+                    break;
+                }
+            }
+        }
+        request = queue->head;
+        if (request != NULL) {
+            queue->head = request->next;
+            if (queue->head == NULL) {
+                queue->tail = NULL;
+            }
+            request->queued = 0;
+        }
+        pthread_mutex_unlock(&async_lock);
+    }
+    else {
+        hpcalcs_error("%s: queue is NULL", __FUNCTION__);
+    }
+    return request;
+}
@@ -43,7 +43,7 @@ static int calc_none_set_date_time(calc_handle * handle, time_t timestamp) {
     return 0;
 }
 
-static int calc_none_recv_screen(calc_handle * handle, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size) {
+static int calc_none_recv_screen(calc_handle * handle, calc_screenshot_format format, calc_payload * out_payload) {
     return 0;
 }
 
@@ -71,7 +71,7 @@ static int calc_none_send_chat(calc_handle * handle, const uint16_t * data, uint
     return 0;
 }
 
-static int calc_none_recv_chat(calc_handle * handle, uint16_t ** out_data, uint32_t * out_size) {
+static int calc_none_recv_chat(calc_handle * handle, calc_payload * out_payload) {
     return 0;
 }
 
@@ -91,5 +91,14 @@ const calc_fncts calc_none_fncts =
     &calc_none_send_key,
     &calc_none_send_keys,
     &calc_none_send_chat,
-    &calc_none_recv_chat
+    &calc_none_recv_chat,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
 };
@@ -31,8 +31,10 @@
 
 #include <hpcalcs.h>
 #include "logging.h"
+#include "error.h"
 
 #include "prime_cmd.h"
+#include "internal.h"
 
 static int calc_prime_check_ready(calc_handle * handle, uint8_t ** out_data, uint32_t * out_size) {
     int res;
@@ -82,12 +84,12 @@ static int calc_prime_set_date_time(calc_handle * handle, time_t timestamp) {
     return res;
 }
 
-static int calc_prime_recv_screen(calc_handle * handle, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size) {
+static int calc_prime_recv_screen(calc_handle * handle, calc_screenshot_format format, calc_payload * out_payload) {
     int res;
 
     res = calc_prime_s_recv_screen(handle, format);
     if (res == 0) {
-        res = calc_prime_r_recv_screen(handle, format, out_data, out_size);
+        res = calc_prime_r_recv_screen(handle, format, out_payload);
         if (res != 0) {
             hpcalcs_error("%s: r_recv_screen failed", __FUNCTION__);
         }
@@ -98,24 +100,33 @@ static int calc_prime_recv_screen(calc_handle * handle, calc_screenshot_format f
     return res;
 }
 
-static int calc_prime_send_file(calc_handle * handle, files_var_entry * file) {
+// Sends either a file or an encoded file, the other one being NULL.
+static int calc_prime_send_file_common(calc_handle * handle, files_var_entry * file, calc_encoded_file * encoded) {
     int res, disable_res;
+    // send_file uses the new Prime protocol. Unless it is already in use (see calc_prime_negotiate_new_protocol), enable it for the transfer:
+    int temporary = handle->protocol_version == 0;
 
-    // send_file uses the new Prime protocol. Enable it:
-    res = calc_prime_s_enable_new_protocol(handle);
-    if (res == 0) {
-        res = calc_prime_r_enable_new_protocol(handle);
-        if (res != 0) {
-            hpcalcs_error("%s: r_enable_new_protocol failed", __FUNCTION__);
+    if (temporary) {
+        res = calc_prime_s_enable_new_protocol(handle);
+        if (res == 0) {
+            res = calc_prime_r_enable_new_protocol(handle);
+            if (res != 0) {
+                hpcalcs_error("%s: r_enable_new_protocol failed", __FUNCTION__);
+                return res;
+            }
+        }
+        else {
+            hpcalcs_error("%s: s_enable_new_protocol failed", __FUNCTION__);
             return res;
         }
     }
+
+    if (file != NULL) {
+        res = calc_prime_s_send_file(handle, file);
+    }
     else {
-        hpcalcs_error("%s: s_enable_new_protocol failed", __FUNCTION__);
-        return res;
+        res = calc_prime_s_send_encoded_file(handle, encoded);
     }
-
-    res = calc_prime_s_send_file(handle, file);
     if (res == 0) {
         res = calc_prime_r_send_file(handle);
         if (res != 0) {
@@ -125,26 +136,40 @@ static int calc_prime_send_file(calc_handle * handle, files_var_entry * file) {
     else {
         hpcalcs_error("%s: s_send_file failed", __FUNCTION__);
     }
-    
-    // Disable the new protocol
-    disable_res = calc_prime_s_disable_new_protocol(handle);
-    if (disable_res == 0) {
-        disable_res = calc_prime_r_disable_new_protocol(handle);
-        if (disable_res != 0) {
-            hpcalcs_error("%s: r_enable_new_protocol failed", __FUNCTION__);
+
+    if (temporary) {
+        // Disable the new protocol
+        disable_res = calc_prime_s_disable_new_protocol(handle);
+        if (disable_res == 0) {
+            disable_res = calc_prime_r_disable_new_protocol(handle);
+            if (disable_res != 0) {
+                hpcalcs_error("%s: r_enable_new_protocol failed", __FUNCTION__);
+            }
+        }
+        else {
+            hpcalcs_error("%s: s_enable_new_protocol failed", __FUNCTION__);
+        }
+        // Return the disable result if we don't already have an error case.
+        if (!res) {
+            res = disable_res;
         }
     }
-    else {
-        hpcalcs_error("%s: s_enable_new_protocol failed", __FUNCTION__);
-    }
-    // Return the disable result if we don't already have an error case.
-    if (!res) {
-        res = disable_res;
-    }
-    
+
     return res;
 }
 
+static int calc_prime_send_file(calc_handle * handle, files_var_entry * file) {
+    return calc_prime_send_file_common(handle, file, NULL);
+}
+
+static int calc_prime_encode_file(calc_handle * handle, files_var_entry * file, calc_encoded_file ** out_encoded) {
+    return calc_prime_frame_file(file, out_encoded);
+}
+
+static int calc_prime_send_encoded_file(calc_handle * handle, calc_encoded_file * encoded) {
+    return calc_prime_send_file_common(handle, NULL, encoded);
+}
+
 static int calc_prime_recv_file(calc_handle * handle, files_var_entry * request, files_var_entry ** out_file) {
     int res;
 
@@ -177,6 +202,54 @@ static int calc_prime_recv_backup(calc_handle * handle, files_var_entry *** out_
     return res;
 }
 
+static int calc_prime_recv_screen_stream(calc_handle * handle, calc_screenshot_format format, calc_recv_callback callback, void * user_data) {
+    int res;
+
+    res = calc_prime_s_recv_screen(handle, format);
+    if (res == 0) {
+        res = calc_prime_r_recv_screen_stream(handle, format, callback, user_data);
+        if (res != 0) {
+            hpcalcs_error("%s: r_recv_screen_stream failed", __FUNCTION__);
+        }
+    }
+    else {
+        hpcalcs_error("%s: s_recv_screen failed", __FUNCTION__);
+    }
+    return res;
+}
+
+static int calc_prime_recv_file_stream(calc_handle * handle, files_var_entry * request, calc_recv_callback callback, void * user_data) {
+    int res;
+
+    res = calc_prime_s_recv_file(handle, request);
+    if (res == 0) {
+        res = calc_prime_r_recv_file_stream(handle, callback, user_data);
+        if (res != 0) {
+            hpcalcs_error("%s: r_recv_file_stream failed", __FUNCTION__);
+        }
+    }
+    else {
+        hpcalcs_error("%s: s_recv_file failed", __FUNCTION__);
+    }
+    return res;
+}
+
+static int calc_prime_recv_backup_stream(calc_handle * handle, calc_recv_callback callback, void * user_data) {
+    int res;
+
+    res = calc_prime_s_recv_backup(handle);
+    if (res == 0) {
+        res = calc_prime_r_recv_backup_stream(handle, callback, user_data);
+        if (res != 0) {
+            hpcalcs_error("%s: r_recv_backup_stream failed", __FUNCTION__);
+        }
+    }
+    else {
+        hpcalcs_error("%s: s_recv_backup failed", __FUNCTION__);
+    }
+    return res;
+}
+
 static int calc_prime_send_key(calc_handle * handle, uint32_t code) {
     int res;
 
@@ -225,16 +298,203 @@ static int calc_prime_send_chat(calc_handle * handle, const uint16_t * data, uin
     return res;
 }
 
-static int calc_prime_recv_chat(calc_handle * handle, uint16_t ** out_data, uint32_t * out_size) {
+static int calc_prime_recv_chat(calc_handle * handle, calc_payload * out_payload) {
     int res;
 
-    res = calc_prime_r_recv_chat(handle, out_data, out_size);
+    res = calc_prime_r_recv_chat(handle, out_payload);
     if (res != 0) {
         hpcalcs_error("%s: r_recv_chat failed", __FUNCTION__);
     }
     return res;
 }
 
+static int calc_prime_negotiate_protocol(calc_handle * handle) {
+    int res;
+
+    res = calc_prime_negotiate_new_protocol(handle);
+    if (res != 0) {
+        hpcalcs_error("%s: negotiate_new_protocol failed", __FUNCTION__);
+    }
+    return res;
+}
+
+// Pumped operations: the command is sent at once, and the reply, if any, is read report by report as it arrives (see prime_pump_recv),
+// then handed to the same calc_prime_r_* functions as the synchronous operations.
+
+// State of the pumped operation awaiting its reply, pointed to by calc_handle.handle.
+typedef struct {
+    int protocol_version; // Mode in which the reply is received, see prime_pump_recv.
+    int res; // Error of an earlier step, reported once the reply is in, as calc_prime_send_file_common does.
+} calc_prime_pumped;
+
+static int calc_prime_pump_stop(calc_handle * handle) {
+    (hpcalcs_alloc_funcs.free)(handle->handle);
+    handle->handle = NULL;
+    return prime_pump_stop(handle);
+}
+
+static int calc_prime_pump_start(calc_handle * handle, const calc_async_op * op) {
+    int res;
+    uint8_t reply = 0;
+    int protocol_version = handle->protocol_version;
+    int pending_res = 0;
+
+    switch (op->op) {
+        case CALC_FNCT_CHECK_READY:
+            res = calc_prime_s_check_ready(handle);
+            reply = CMD_PRIME_CHECK_READY;
+            break;
+        case CALC_FNCT_GET_INFOS:
+            res = calc_prime_s_get_infos(handle);
+            reply = CMD_PRIME_GET_INFOS;
+            break;
+        case CALC_FNCT_SET_DATE_TIME:
+            res = calc_prime_s_set_date_time(handle, op->timestamp);
+            break;
+        case CALC_FNCT_RECV_SCREEN:
+            res = calc_prime_s_recv_screen(handle, op->format);
+            reply = CMD_PRIME_RECV_SCREEN;
+            break;
+        case CALC_FNCT_SEND_FILE:
+        case CALC_FNCT_SEND_ENCODED_FILE:
+        {
+            // The steps of calc_prime_send_file_common, up to the reply to the command dropping the calculator out of the new protocol mode,
+            // which is pumped. The transfer itself blocks, see hpcalcs_async_pump.
+            int temporary = handle->protocol_version == 0;
+            res = 0;
+            if (temporary) {
+                res = calc_prime_s_enable_new_protocol(handle);
+                if (res == 0) {
+                    res = calc_prime_r_enable_new_protocol(handle);
+                }
+                if (res != 0) {
+                    break;
+                }
+            }
+            if (op->op == CALC_FNCT_SEND_FILE) {
+                res = calc_prime_s_send_file(handle, op->file);
+            }
+            else {
+                res = calc_prime_s_send_encoded_file(handle, op->encoded);
+            }
+            if (res == 0) {
+                res = calc_prime_r_send_file(handle);
+            }
+            if (temporary) {
+                // Disable the new protocol even if the transfer failed; its error is returned once the reply is in.
+                int disable_res = calc_prime_s_disable_new_protocol(handle);
+                if (disable_res == 0) {
+                    pending_res = res;
+                    res = 0;
+                    reply = CMD_PRIME_CHECK_READY;
+                    // See calc_prime_r_disable_new_protocol: the keepalive reports of the new protocol mode may still come in.
+                    protocol_version = 1;
+                }
+                else if (res == 0) {
+                    res = disable_res;
+                }
+            }
+            break;
+        }
+        case CALC_FNCT_RECV_FILE:
+            res = calc_prime_s_recv_file(handle, op->file);
+            reply = CMD_PRIME_RECV_FILE;
+            break;
+        case CALC_FNCT_SEND_KEY:
+            res = calc_prime_s_send_key(handle, op->code);
+            break;
+        case CALC_FNCT_SEND_KEYS:
+            res = calc_prime_s_send_keys(handle, (const uint8_t *)op->data, op->size);
+            break;
+        case CALC_FNCT_SEND_CHAT:
+            res = calc_prime_s_send_chat(handle, (const uint16_t *)op->data, op->size);
+            break;
+        case CALC_FNCT_RECV_CHAT:
+            // Nothing to send: the calculator sends chat data on its own.
+            res = 0;
+            reply = CMD_PRIME_RECV_CHAT;
+            break;
+        default:
+            res = ERR_INVALID_PARAMETER;
+            hpcalcs_error("%s: operation %d can't be pumped", __FUNCTION__, op->op);
+            break;
+    }
+    if (res == 0 && reply != 0) {
+        calc_prime_pumped * pumped = (calc_prime_pumped *)(hpcalcs_alloc_funcs.malloc)(sizeof(*pumped));
+        if (pumped != NULL) {
+            pumped->protocol_version = protocol_version;
+            pumped->res = pending_res;
+            res = prime_pump_start(handle, reply);
+            if (res == 0) {
+                (hpcalcs_alloc_funcs.free)(handle->handle);
+                handle->handle = (void *)pumped;
+            }
+            else {
+                (hpcalcs_alloc_funcs.free)(pumped);
+            }
+        }
+        else {
+            hpcalcs_error("%s: couldn't allocate memory", __FUNCTION__);
+            res = ERR_MALLOC;
+        }
+    }
+    else if (res != 0) {
+        hpcalcs_error("%s: send failed", __FUNCTION__);
+    }
+    return res;
+}
+
+static int calc_prime_pump_step(calc_handle * handle, const calc_async_op * op, calc_async_result * result, int * out_done) {
+    int res = 0;
+    int complete = 1;
+
+    // Operations without a reply are complete as soon as their command is sent.
+    if (handle->pump != NULL) {
+        calc_prime_pumped * pumped = (calc_prime_pumped *)handle->handle;
+        res = prime_pump_recv(handle, pumped->protocol_version, &complete);
+        if (res == 0 && complete) {
+            switch (op->op) {
+                case CALC_FNCT_CHECK_READY:
+                    res = calc_prime_r_check_ready(handle, &result->data, &result->size);
+                    break;
+                case CALC_FNCT_GET_INFOS:
+                    res = calc_prime_r_get_infos(handle, &result->infos);
+                    break;
+                case CALC_FNCT_RECV_SCREEN:
+                    res = calc_prime_r_recv_screen(handle, op->format, &result->payload);
+                    break;
+                case CALC_FNCT_SEND_FILE:
+                case CALC_FNCT_SEND_ENCODED_FILE:
+                    res = calc_prime_r_disable_new_protocol(handle);
+                    if (pumped->res != 0) {
+                        res = pumped->res;
+                    }
+                    break;
+                case CALC_FNCT_RECV_FILE:
+                    res = calc_prime_r_recv_file(handle, &result->file);
+                    break;
+                case CALC_FNCT_RECV_CHAT:
+                    res = calc_prime_r_recv_chat(handle, &result->payload);
+                    break;
+                default:
+                    break;
+            }
+        }
+        if (res != 0 || complete) {
+            calc_prime_pump_stop(handle);
+        }
+        if (res != 0) {
+            hpcalcs_error("%s: recv failed", __FUNCTION__);
+        }
+    }
+    *out_done = res != 0 || complete;
+    return res;
+}
+
+static int calc_prime_pump_abort(calc_handle * handle) {
+    return calc_prime_pump_stop(handle);
+}
+
 const calc_fncts calc_prime_fncts =
 {
     CALC_PRIME,
@@ -242,7 +502,8 @@ const calc_fncts calc_prime_fncts =
     "HP Prime Graphing Calculator",
       CALC_OPS_CHECK_READY | CALC_OPS_GET_INFOS | CALC_OPS_SET_DATE_TIME | CALC_OPS_RECV_SCREEN
     | CALC_OPS_SEND_FILE | CALC_OPS_RECV_FILE | CALC_OPS_RECV_BACKUP | CALC_OPS_SEND_KEY
-    | CALC_OPS_SEND_KEYS | CALC_OPS_SEND_CHAT | CALC_OPS_RECV_CHAT,
+    | CALC_OPS_SEND_KEYS | CALC_OPS_SEND_CHAT | CALC_OPS_RECV_CHAT | CALC_OPS_ENCODE_FILE | CALC_OPS_SEND_ENCODED_FILE
+    | CALC_OPS_RECV_SCREEN_STREAM | CALC_OPS_RECV_FILE_STREAM | CALC_OPS_RECV_BACKUP_STREAM | CALC_OPS_NEGOTIATE_PROTOCOL,
     &calc_prime_check_ready,
     &calc_prime_get_infos,
     &calc_prime_set_date_time,
@@ -253,5 +514,14 @@ const calc_fncts calc_prime_fncts =
     &calc_prime_send_key,
     &calc_prime_send_keys,
     &calc_prime_send_chat,
-    &calc_prime_recv_chat
+    &calc_prime_recv_chat,
+    &calc_prime_encode_file,
+    &calc_prime_send_encoded_file,
+    &calc_prime_recv_screen_stream,
+    &calc_prime_recv_file_stream,
+    &calc_prime_recv_backup_stream,
+    &calc_prime_negotiate_protocol,
+    &calc_prime_pump_start,
+    &calc_prime_pump_step,
+    &calc_prime_pump_abort
 };
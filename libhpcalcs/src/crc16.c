@@ -0,0 +1,351 @@
+/*
+ * libhpcalcs: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file crc16.c Calcs: CRC16-CCITT computation, with several implementations selected at runtime.
+ *
+ * - bytewise: the classic one-table, one-byte-per-step loop. Always available, used as the reference.
+ * - slice8: eight tables, eight bytes per step.
+ * - clmul (x86 PCLMULQDQ) / pmull (ARMv8 PMULL): folds 16-byte blocks using carry-less multiplication
+ *   by x^N mod P, four blocks in parallel, then reduces the remaining 16 bytes and the tail through slice8.
+ *
+ * Every implementation other than bytewise is checked against bytewise at initialization time,
+ * and is not used if the results differ.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <hpcalcs.h>
+#include "logging.h"
+#include "crc16.h"
+
+#include <inttypes.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define CRC16_HAVE_CLMUL 1
+# include <immintrin.h>
+# define CRC16_CLMUL_TARGET __attribute__((target("pclmul,ssse3")))
+#elif defined(__GNUC__) && defined(__aarch64__)
+# define CRC16_HAVE_PMULL 1
+# include <arm_neon.h>
+# if defined(__linux__)
+#  include <sys/auxv.h>
+#  include <asm/hwcap.h>
+# endif
+# if defined(__clang__)
+#  define CRC16_PMULL_TARGET __attribute__((target("aes")))
+# else
+#  define CRC16_PMULL_TARGET __attribute__((target("+crypto")))
+# endif
+#endif
+
+// Below this length, the setup of the folding implementations costs more than it saves.
+#define CRC16_FOLD_MIN_LEN (128)
+
+typedef uint16_t (*crc16_update_fn)(uint16_t crc, const uint8_t * buffer, uint32_t len);
+
+static const uint16_t ccitt_crc16_table[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
+};
+
+// crc16_slice_tables[k][b]: contribution of byte b followed by k zero bytes.
+static uint16_t crc16_slice_tables[8][256];
+// crc16_fold_consts[i]: { x^(N+64) mod P, x^N mod P } for N = 128 * (i + 1).
+static uint64_t crc16_fold_consts[4][2];
+
+static crc16_update_fn crc16_update_impl;
+static const char * crc16_impl_name = "bytewise";
+static int crc16_initialized;
+
+static uint16_t crc16_update_bytewise(uint16_t crc, const uint8_t * buffer, uint32_t len) {
+    while (len--) {
+       crc = ccitt_crc16_table[(crc >> 8) ^ *buffer++] ^ (crc << 8);
+    }
+    return crc;
+}
+
+static uint16_t crc16_update_slice8(uint16_t crc, const uint8_t * buffer, uint32_t len) {
+    while (len >= 8) {
+        crc = crc16_slice_tables[7][buffer[0] ^ (crc >> 8)] ^ crc16_slice_tables[6][buffer[1] ^ (crc & 0xFF)]
+            ^ crc16_slice_tables[5][buffer[2]] ^ crc16_slice_tables[4][buffer[3]]
+            ^ crc16_slice_tables[3][buffer[4]] ^ crc16_slice_tables[2][buffer[5]]
+            ^ crc16_slice_tables[1][buffer[6]] ^ crc16_slice_tables[0][buffer[7]];
+        buffer += 8;
+        len -= 8;
+    }
+    return crc16_update_bytewise(crc, buffer, len);
+}
+
+// x^n mod P, P = x^16 + x^12 + x^5 + 1.
+static uint64_t crc16_xpow_mod(uint32_t n) {
+    uint32_t r = 1;
+    while (n--) {
+        r <<= 1;
+        if (r & 0x10000) {
+            r ^= 0x11021;
+        }
+    }
+    return r;
+}
+
+#if defined(CRC16_HAVE_CLMUL)
+CRC16_CLMUL_TARGET
+static inline __m128i crc16_load_be_clmul(const uint8_t * buffer) {
+    const __m128i bswap = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)buffer), bswap);
+}
+
+// Returns a value congruent to a * x^N mod P, using k = crc16_fold_consts for N.
+CRC16_CLMUL_TARGET
+static inline __m128i crc16_fold_clmul(__m128i a, const uint64_t * k) {
+    __m128i kv = _mm_loadu_si128((const __m128i *)k);
+    return _mm_xor_si128(_mm_clmulepi64_si128(a, kv, 0x01), _mm_clmulepi64_si128(a, kv, 0x10));
+}
+
+CRC16_CLMUL_TARGET
+static uint16_t crc16_update_clmul(uint16_t crc, const uint8_t * buffer, uint32_t len) {
+    const __m128i bswap = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    __m128i a0, a1, a2, a3;
+    uint8_t folded[16];
+
+    if (len < CRC16_FOLD_MIN_LEN) {
+        return crc16_update_slice8(crc, buffer, len);
+    }
+
+    // The incoming CRC is XORed into the first two message bytes.
+    a0 = _mm_xor_si128(crc16_load_be_clmul(buffer), _mm_set_epi64x((long long)((uint64_t)crc << 48), 0));
+    a1 = crc16_load_be_clmul(buffer + 16);
+    a2 = crc16_load_be_clmul(buffer + 32);
+    a3 = crc16_load_be_clmul(buffer + 48);
+    buffer += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        a0 = _mm_xor_si128(crc16_fold_clmul(a0, crc16_fold_consts[3]), crc16_load_be_clmul(buffer));
+        a1 = _mm_xor_si128(crc16_fold_clmul(a1, crc16_fold_consts[3]), crc16_load_be_clmul(buffer + 16));
+        a2 = _mm_xor_si128(crc16_fold_clmul(a2, crc16_fold_consts[3]), crc16_load_be_clmul(buffer + 32));
+        a3 = _mm_xor_si128(crc16_fold_clmul(a3, crc16_fold_consts[3]), crc16_load_be_clmul(buffer + 48));
+        buffer += 64;
+        len -= 64;
+    }
+
+    a0 = _mm_xor_si128(_mm_xor_si128(crc16_fold_clmul(a0, crc16_fold_consts[2]), crc16_fold_clmul(a1, crc16_fold_consts[1])),
+                       _mm_xor_si128(crc16_fold_clmul(a2, crc16_fold_consts[0]), a3));
+
+    while (len >= 16) {
+        a0 = _mm_xor_si128(crc16_fold_clmul(a0, crc16_fold_consts[0]), crc16_load_be_clmul(buffer));
+        buffer += 16;
+        len -= 16;
+    }
+
+    _mm_storeu_si128((__m128i *)folded, _mm_shuffle_epi8(a0, bswap));
+    crc = crc16_update_slice8(0, folded, sizeof(folded));
+    return crc16_update_slice8(crc, buffer, len);
+}
+#endif
+
+#if defined(CRC16_HAVE_PMULL)
+CRC16_PMULL_TARGET
+static inline uint64x2_t crc16_load_be_pmull(const uint8_t * buffer) {
+    uint64x2_t v = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(buffer)));
+    return vextq_u64(v, v, 1);
+}
+
+// Returns a value congruent to a * x^N mod P, using k = crc16_fold_consts for N.
+CRC16_PMULL_TARGET
+static inline uint64x2_t crc16_fold_pmull(uint64x2_t a, const uint64_t * k) {
+    return veorq_u64(vreinterpretq_u64_p128(vmull_p64((poly64_t)vgetq_lane_u64(a, 1), (poly64_t)k[0])),
+                     vreinterpretq_u64_p128(vmull_p64((poly64_t)vgetq_lane_u64(a, 0), (poly64_t)k[1])));
+}
+
+CRC16_PMULL_TARGET
+static uint16_t crc16_update_pmull(uint16_t crc, const uint8_t * buffer, uint32_t len) {
+    uint64x2_t a0, a1, a2, a3;
+    uint8_t folded[16];
+
+    if (len < CRC16_FOLD_MIN_LEN) {
+        return crc16_update_slice8(crc, buffer, len);
+    }
+
+    // The incoming CRC is XORed into the first two message bytes.
+    a0 = veorq_u64(crc16_load_be_pmull(buffer), vcombine_u64(vcreate_u64(0), vcreate_u64((uint64_t)crc << 48)));
+    a1 = crc16_load_be_pmull(buffer + 16);
+    a2 = crc16_load_be_pmull(buffer + 32);
+    a3 = crc16_load_be_pmull(buffer + 48);
+    buffer += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        a0 = veorq_u64(crc16_fold_pmull(a0, crc16_fold_consts[3]), crc16_load_be_pmull(buffer));
+        a1 = veorq_u64(crc16_fold_pmull(a1, crc16_fold_consts[3]), crc16_load_be_pmull(buffer + 16));
+        a2 = veorq_u64(crc16_fold_pmull(a2, crc16_fold_consts[3]), crc16_load_be_pmull(buffer + 32));
+        a3 = veorq_u64(crc16_fold_pmull(a3, crc16_fold_consts[3]), crc16_load_be_pmull(buffer + 48));
+        buffer += 64;
+        len -= 64;
+    }
+
+    a0 = veorq_u64(veorq_u64(crc16_fold_pmull(a0, crc16_fold_consts[2]), crc16_fold_pmull(a1, crc16_fold_consts[1])),
+                   veorq_u64(crc16_fold_pmull(a2, crc16_fold_consts[0]), a3));
+
+    while (len >= 16) {
+        a0 = veorq_u64(crc16_fold_pmull(a0, crc16_fold_consts[0]), crc16_load_be_pmull(buffer));
+        buffer += 16;
+        len -= 16;
+    }
+
+    vst1q_u8(folded, vrev64q_u8(vreinterpretq_u8_u64(vextq_u64(a0, a0, 1))));
+    crc = crc16_update_slice8(0, folded, sizeof(folded));
+    return crc16_update_slice8(crc, buffer, len);
+}
+#endif
+
+static int crc16_cpu_has_clmul(void) {
+#if defined(CRC16_HAVE_CLMUL)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+#elif defined(CRC16_HAVE_PMULL) && defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+#elif defined(CRC16_HAVE_PMULL) && defined(__APPLE__)
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+// Checks an implementation against the bytewise one, on various lengths, alignments and initial values.
+static int crc16_self_test(crc16_update_fn update) {
+    uint8_t buffer[1024 + 16];
+    uint32_t seed = 0x12345678;
+    uint32_t i, offset, len;
+
+    for (i = 0; i < sizeof(buffer); i++) {
+        seed = seed * 1103515245 + 12345;
+        buffer[i] = (uint8_t)(seed >> 24);
+    }
+    for (offset = 0; offset < 16; offset += 5) {
+        for (len = 0; len <= 1024; len += (len < 300 ? 1 : 61)) {
+            uint16_t init = (len & 1) ? 0x1D0F : 0x0000;
+            if (update(init, buffer + offset, len) != crc16_update_bytewise(init, buffer + offset, len)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+void crc16_init(void) {
+    uint32_t i, k;
+
+    if (crc16_initialized) {
+        return;
+    }
+
+    for (i = 0; i < 256; i++) {
+        crc16_slice_tables[0][i] = ccitt_crc16_table[i];
+    }
+    for (k = 1; k < 8; k++) {
+        for (i = 0; i < 256; i++) {
+            uint16_t prev = crc16_slice_tables[k - 1][i];
+            crc16_slice_tables[k][i] = (uint16_t)((prev << 8) ^ ccitt_crc16_table[prev >> 8]);
+        }
+    }
+    for (i = 0; i < 4; i++) {
+        crc16_fold_consts[i][0] = crc16_xpow_mod(128 * (i + 1) + 64);
+        crc16_fold_consts[i][1] = crc16_xpow_mod(128 * (i + 1));
+    }
+
+    if (crc16_self_test(crc16_update_slice8)) {
+        crc16_update_impl = crc16_update_slice8;
+        crc16_impl_name = "slice8";
+    }
+    else {
+        hpcalcs_error("%s: slice8 implementation failed self-test", __FUNCTION__);
+    }
+
+    if (crc16_cpu_has_clmul()) {
+#if defined(CRC16_HAVE_CLMUL)
+        crc16_update_fn candidate = crc16_update_clmul;
+        const char * name = "clmul";
+#elif defined(CRC16_HAVE_PMULL)
+        crc16_update_fn candidate = crc16_update_pmull;
+        const char * name = "pmull";
+#else
+        crc16_update_fn candidate = NULL;
+        const char * name = NULL;
+#endif
+        if (candidate != NULL) {
+            if (crc16_self_test(candidate)) {
+                crc16_update_impl = candidate;
+                crc16_impl_name = name;
+            }
+            else {
+                hpcalcs_error("%s: %s implementation failed self-test", __FUNCTION__, name);
+            }
+        }
+    }
+
+    hpcalcs_info("%s: using %s implementation", __FUNCTION__, crc16_impl_name);
+    crc16_initialized = 1;
+}
+
+uint16_t crc16_update(uint16_t crc, const uint8_t * buffer, uint32_t len) {
+    // Before crc16_init() has run, only the bytewise implementation, which needs no setup, can be used.
+    if (crc16_update_impl != NULL) {
+        return (crc16_update_impl)(crc, buffer, len);
+    }
+    return crc16_update_bytewise(crc, buffer, len);
+}
+
+uint16_t crc16_block(const uint8_t * buffer, uint32_t len) {
+    return crc16_update(0, buffer, len);
+}
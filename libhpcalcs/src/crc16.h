@@ -0,0 +1,36 @@
+/*
+ * libhpcalcs: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file crc16.h Calcs: CRC16-CCITT (polynomial 0x1021, initial value 0, non-reflected), as used by the Prime protocol.
+ */
+
+#ifndef __HPLIBS_CRC16_H__
+#define __HPLIBS_CRC16_H__
+
+#include <stdint.h>
+
+//! Builds the lookup tables and selects the fastest implementation supported by the CPU. Called by hpcalcs_init().
+void crc16_init(void);
+//! Continues computing the CRC \a crc over \a len more bytes.
+uint16_t crc16_update(uint16_t crc, const uint8_t * buffer, uint32_t len);
+//! Computes the CRC of a whole block.
+uint16_t crc16_block(const uint8_t * buffer, uint32_t len);
+
+#endif
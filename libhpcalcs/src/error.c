@@ -95,6 +95,12 @@ HPEXPORT int HPCALL hpcables_error_get(int number, char **message) {
                 case ERR_CABLE_PROBE_FAILED:
                     *message = strdup(_("Cable probing failed"));
                     break;
+                case ERR_CABLE_CAPTURE_IO:
+                    *message = strdup(_("Error accessing capture file"));
+                    break;
+                case ERR_CABLE_CAPTURE_FORMAT:
+                    *message = strdup(_("Invalid capture file"));
+                    break;
                 default:
                     *message = strdup(_("<Unknown error code>"));
                     break;
@@ -139,6 +145,9 @@ HPEXPORT int HPCALL hpcalcs_error_get(int number, char **message) {
                 case ERR_CALC_PROBE_FAILED:
                     *message = strdup(_("Calc probing failed"));
                     break;
+                case ERR_CALC_CANCELLED:
+                    *message = strdup(_("Request cancelled"));
+                    break;
                 default:
                     *message = strdup(_("<Unknown error code>"));
                     break;
@@ -162,6 +171,21 @@ HPEXPORT int HPCALL hpopers_error_get(int number, char **message) {
     if (message != NULL) {
         if (number >= ERR_OPER_FIRST && number <= ERR_OPER_LAST) {
             switch (number) {
+                case ERR_OPER_CANCELLED:
+                    *message = strdup(_("Operation cancelled"));
+                    break;
+                case ERR_OPER_IMAGE_FORMAT:
+                    *message = strdup(_("Unhandled image format"));
+                    break;
+                case ERR_OPER_WRITE_ERROR:
+                    *message = strdup(_("Error writing output file"));
+                    break;
+                case ERR_OPER_RECORDING_IO:
+                    *message = strdup(_("Error reading or writing recording file"));
+                    break;
+                case ERR_OPER_RECORDING_FORMAT:
+                    *message = strdup(_("Malformed recording file"));
+                    break;
                 default:
                     *message = strdup(_("<Unknown error code>"));
                     break;
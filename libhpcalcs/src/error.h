@@ -52,6 +52,8 @@ typedef enum {
     ERR_CABLE_READ_ERROR,
     ERR_CABLE_INVALID_FNCTS,
     ERR_CABLE_PROBE_FAILED,
+    ERR_CABLE_CAPTURE_IO,
+    ERR_CABLE_CAPTURE_FORMAT,
     ERR_CABLE_LAST = 383,
 
     ERR_CALC_FIRST = 384,
@@ -62,9 +64,15 @@ typedef enum {
     ERR_CALC_PACKET_FORMAT,
     ERR_CALC_SPLIT_TIMESTAMP,
     ERR_CALC_PROBE_FAILED,
+    ERR_CALC_CANCELLED,
     ERR_CALC_LAST = 511,
 
     ERR_OPER_FIRST = 512,
+    ERR_OPER_CANCELLED = 512,
+    ERR_OPER_IMAGE_FORMAT,
+    ERR_OPER_WRITE_ERROR,
+    ERR_OPER_RECORDING_IO,
+    ERR_OPER_RECORDING_FORMAT,
     ERR_OPER_LAST = 639
 } hplibs_error;
 
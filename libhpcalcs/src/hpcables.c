@@ -29,11 +29,16 @@
 # include <config.h>
 #endif
 
+#include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <hidapi.h>
 
 #include <hpcables.h>
+#include "busy.h"
+#include "cable_capture.h"
+#include "cable_faults.h"
 #include "internal.h"
 #include "logging.h"
 #include "error.h"
@@ -42,15 +47,28 @@
 
 extern const cable_fncts cable_nul_fncts;
 extern const cable_fncts cable_prime_hid_fncts;
+extern const cable_fncts cable_prime_sim_fncts;
+extern const cable_fncts cable_replay_fncts;
+extern const cable_fncts cable_prime_hidraw_fncts;
 
 const cable_fncts * hpcables_all_cables[CABLE_MAX] = {
     &cable_nul_fncts,
-    &cable_prime_hid_fncts
+    &cable_prime_hid_fncts,
+    &cable_prime_sim_fncts,
+    &cable_replay_fncts,
+    &cable_prime_hidraw_fncts
 };
 
 static const uint32_t supported_cables =
 	  (1U << CABLE_NUL)
 	| (1U << CABLE_PRIME_HID)
+	| (1U << CABLE_PRIME_SIM)
+#ifndef _WIN32
+	| (1U << CABLE_REPLAY)
+#endif
+#ifdef __linux__
+	| (1U << CABLE_PRIME_HIDRAW)
+#endif
 ;
 
 hplibs_malloc_funcs hpcables_alloc_funcs = {
@@ -162,7 +180,16 @@ HPEXPORT cable_handle * HPCALL hpcables_handle_new(cable_model model) {
             handle->model = model;
             handle->handle = NULL;
             handle->fncts = hpcables_all_cables[model];
-            hpcables_info("%s: handle allocation for model %d succeeded", __FUNCTION__, model);
+            handle->busy_timeout = BUSY_TIMEOUT_INFINITE;
+            handle->busy_gate = busy_gate_new(&hpcables_alloc_funcs);
+            if (handle->busy_gate != NULL) {
+                hpcables_info("%s: handle allocation for model %d succeeded", __FUNCTION__, model);
+            }
+            else {
+                (hpcables_alloc_funcs.free)(handle);
+                handle = NULL;
+                hpcables_error("%s: handle allocation for model %d failed", __FUNCTION__, model);
+            }
         }
         else {
             hpcables_error("%s: handle allocation for model %d failed", __FUNCTION__, model );
@@ -178,8 +205,26 @@ HPEXPORT cable_handle * HPCALL hpcables_handle_new(cable_model model) {
 HPEXPORT int HPCALL hpcables_handle_del(cable_handle * handle) {
     int res;
     if (handle != NULL) {
+        // Unwind the wrappers still in front of the cable functions, outermost first.
+        for (;;) {
+            if (hpcables_capture_active(handle)) {
+                hpcables_capture_stop(handle);
+            }
+            else if (hpcables_faults_active(handle)) {
+                hpcables_faults_stop(handle);
+            }
+            else {
+                break;
+            }
+        }
         (hpcables_alloc_funcs.free)(handle->handle);
         handle->handle = NULL;
+        (hpcables_alloc_funcs.free)(handle->device_path);
+        handle->device_path = NULL;
+        (hpcables_alloc_funcs.free)(handle->device_serial);
+        handle->device_serial = NULL;
+        busy_gate_del(handle->busy_gate, &hpcables_alloc_funcs);
+        handle->busy_gate = NULL;
 
         (hpcables_alloc_funcs.free)(handle);
         res = ERR_SUCCESS;
@@ -201,6 +246,9 @@ HPEXPORT int HPCALL hpcables_handle_display(cable_handle * handle) {
         hpcables_info("\tread_timeout: %d", handle->read_timeout);
         hpcables_info("\topen: %d", handle->open);
         hpcables_info("\tbusy: %d", handle->busy);
+        hpcables_info("\tread_thread: %d", handle->read_thread);
+        hpcables_info("\tdevice_path: %s", handle->device_path != NULL ? handle->device_path : "(none)");
+        hpcables_info("\tdevice_serial: %s", handle->device_serial != NULL ? handle->device_serial : "(none)");
         res = ERR_SUCCESS;
     }
     else {
@@ -224,15 +272,18 @@ HPEXPORT cable_model HPCALL hpcables_get_model(cable_handle * handle) {
 }
 
 #define DO_BASIC_HANDLE_CHECKS() \
+    DO_BASIC_HANDLE_CHECKS2() \
     if (!handle->open) { \
         res = ERR_CABLE_NOT_OPEN; \
         hpcalcs_error("%s: cable not open", __FUNCTION__); \
+        RELEASE_HANDLE() \
         break; \
-    } \
-    DO_BASIC_HANDLE_CHECKS2()
+    }
 
+// The handle is acquired first, so that the other checks see the state left by the previous caller, e.g. a closed cable.
+// Once acquired, the handle is released before leaving the do { } while (0) block.
 #define DO_BASIC_HANDLE_CHECKS2() \
-    if (handle->busy) { \
+    if (busy_acquire(&handle->busy, handle->busy_gate, &handle->busy_timeout)) { \
         res = ERR_CABLE_BUSY; \
         hpcalcs_error("%s: cable busy", __FUNCTION__); \
         break; \
@@ -240,9 +291,13 @@ HPEXPORT cable_model HPCALL hpcables_get_model(cable_handle * handle) {
     if (handle->fncts == NULL) { \
         res = ERR_CABLE_INVALID_FNCTS; \
         hpcalcs_error("%s: fncts is NULL", __FUNCTION__); \
+        RELEASE_HANDLE() \
         break; \
     }
 
+#define RELEASE_HANDLE() \
+    busy_release(&handle->busy, handle->busy_gate);
+
 HPEXPORT int HPCALL hpcables_options_get_read_timeout(cable_handle * handle) {
     int timeout = 0;
     if (handle != NULL) {
@@ -264,7 +319,6 @@ HPEXPORT int HPCALL hpcables_options_set_read_timeout(cable_handle * handle, int
 
             set_read_timeout = handle->fncts->set_read_timeout;
             if (set_read_timeout != NULL) {
-                handle->busy = 1;
                 res = (*set_read_timeout)(handle, read_timeout);
                 if (res == ERR_SUCCESS) {
                     hpcables_info("%s: set_read_timeout succeeded", __FUNCTION__);
@@ -272,12 +326,12 @@ HPEXPORT int HPCALL hpcables_options_set_read_timeout(cable_handle * handle, int
                 else {
                     hpcables_error("%s: set_read_timeout failed", __FUNCTION__);
                 }
-                handle->busy = 0;
             }
             else {
                 res = ERR_CABLE_INVALID_FNCTS;
                 hpcables_error("%s: fncts->set_read_timeout is NULL", __FUNCTION__);
             }
+            RELEASE_HANDLE()
         } while (0);
     }
     else {
@@ -287,6 +341,143 @@ HPEXPORT int HPCALL hpcables_options_set_read_timeout(cable_handle * handle, int
     return res;
 }
 
+HPEXPORT int HPCALL hpcables_options_get_read_thread(cable_handle * handle) {
+    int enabled = 0;
+    if (handle != NULL) {
+        enabled = handle->read_thread;
+    }
+    else {
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return enabled;
+}
+
+HPEXPORT int HPCALL hpcables_options_set_read_thread(cable_handle * handle, int enabled) {
+    int res;
+    if (handle != NULL) {
+        if (!handle->open) {
+            handle->read_thread = (enabled != 0);
+            res = ERR_SUCCESS;
+            hpcables_info("%s: reader thread %s", __FUNCTION__, enabled ? "enabled" : "disabled");
+        }
+        else {
+            res = ERR_CABLE_OPEN;
+            hpcables_error("%s: cable already open", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+// Replaces the string option pointed to by option with a copy of value.
+static int set_string_option(cable_handle * handle, char ** option, const char * value) {
+    int res;
+    if (!handle->open) {
+        char * copy = NULL;
+        if (value != NULL) {
+            size_t len = strlen(value) + 1;
+            copy = (char *)(hpcables_alloc_funcs.malloc)(len);
+            if (copy == NULL) {
+                return ERR_MALLOC;
+            }
+            memcpy(copy, value, len);
+        }
+        (hpcables_alloc_funcs.free)(*option);
+        *option = copy;
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_CABLE_OPEN;
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_options_get_busy_timeout(cable_handle * handle) {
+    int timeout = 0;
+    if (handle != NULL) {
+        timeout = __atomic_load_n(&handle->busy_timeout, __ATOMIC_RELAXED);
+    }
+    else {
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return timeout;
+}
+
+HPEXPORT int HPCALL hpcables_options_set_busy_timeout(cable_handle * handle, int timeout) {
+    int res;
+    if (handle != NULL) {
+        __atomic_store_n(&handle->busy_timeout, timeout, __ATOMIC_RELAXED);
+        res = ERR_SUCCESS;
+        hpcables_info("%s: busy timeout %d ms", __FUNCTION__, timeout);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT const char * HPCALL hpcables_options_get_device_path(cable_handle * handle) {
+    const char * path = NULL;
+    if (handle != NULL) {
+        path = handle->device_path;
+    }
+    else {
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return path;
+}
+
+HPEXPORT int HPCALL hpcables_options_set_device_path(cable_handle * handle, const char * path) {
+    int res;
+    if (handle != NULL) {
+        res = set_string_option(handle, &handle->device_path, path);
+        if (res == ERR_SUCCESS) {
+            hpcables_info("%s: device path set to %s", __FUNCTION__, path != NULL ? path : "(none)");
+        }
+        else {
+            hpcables_error("%s: couldn't set device path", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT const char * HPCALL hpcables_options_get_device_serial(cable_handle * handle) {
+    const char * serial = NULL;
+    if (handle != NULL) {
+        serial = handle->device_serial;
+    }
+    else {
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return serial;
+}
+
+HPEXPORT int HPCALL hpcables_options_set_device_serial(cable_handle * handle, const char * serial) {
+    int res;
+    if (handle != NULL) {
+        res = set_string_option(handle, &handle->device_serial, serial);
+        if (res == ERR_SUCCESS) {
+            hpcables_info("%s: device serial set to %s", __FUNCTION__, serial != NULL ? serial : "(none)");
+        }
+        else {
+            hpcables_error("%s: couldn't set device serial", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
 HPEXPORT int HPCALL hpcables_cable_probe(cable_handle * handle) {
     int res;
     if (handle != NULL) {
@@ -297,7 +488,6 @@ HPEXPORT int HPCALL hpcables_cable_probe(cable_handle * handle) {
 
             probe = handle->fncts->probe;
             if (probe != NULL) {
-                handle->busy = 1;
                 res = (*probe)(handle);
                 if (res == ERR_SUCCESS) {
                     handle->open = 0;
@@ -306,12 +496,12 @@ HPEXPORT int HPCALL hpcables_cable_probe(cable_handle * handle) {
                 else {
                     hpcables_error("%s: probe failed", __FUNCTION__);
                 }
-                handle->busy = 0;
             }
             else {
                 res = ERR_CABLE_INVALID_FNCTS;
                 hpcables_error("%s: fncts->probe is NULL", __FUNCTION__);
             }
+            RELEASE_HANDLE()
         } while (0);
     }
     else {
@@ -321,22 +511,81 @@ HPEXPORT int HPCALL hpcables_cable_probe(cable_handle * handle) {
     return res;
 }
 
+HPEXPORT int HPCALL hpcables_cable_enumerate(cable_handle * handle, cable_device_info ** devices, uint32_t * count) {
+    int res;
+    if (handle != NULL) {
+        do {
+            int (*enumerate) (cable_handle *, cable_device_info **, uint32_t *);
+
+            if (devices == NULL || count == NULL) {
+                res = ERR_INVALID_PARAMETER;
+                hpcables_error("%s: an argument is NULL", __FUNCTION__);
+                break;
+            }
+            *devices = NULL;
+            *count = 0;
+
+            DO_BASIC_HANDLE_CHECKS2()
+
+            enumerate = handle->fncts->enumerate;
+            if (enumerate != NULL) {
+                res = (*enumerate)(handle, devices, count);
+                if (res == ERR_SUCCESS) {
+                    hpcables_info("%s: enumerate succeeded, %" PRIu32 " devices", __FUNCTION__, *count);
+                }
+                else {
+                    hpcables_error("%s: enumerate failed", __FUNCTION__);
+                }
+            }
+            else {
+                // Nothing to choose from, e.g. the null cable.
+                res = ERR_SUCCESS;
+                hpcables_info("%s: cable has no devices to enumerate", __FUNCTION__);
+            }
+            RELEASE_HANDLE()
+        } while (0);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_enumerate_free(cable_device_info * devices, uint32_t count) {
+    int res;
+    if (devices != NULL || count == 0) {
+        uint32_t i;
+        for (i = 0; i < count; i++) {
+            (hpcables_alloc_funcs.free)(devices[i].path);
+            (hpcables_alloc_funcs.free)(devices[i].serial_number);
+        }
+        (hpcables_alloc_funcs.free)(devices);
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcables_error("%s: devices is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
 HPEXPORT int HPCALL hpcables_cable_open(cable_handle * handle) {
     int res;
     if (handle != NULL) {
         do {
             int (*open) (cable_handle *);
 
+            DO_BASIC_HANDLE_CHECKS2()
             if (handle->open) {
                 res = ERR_CABLE_OPEN;
                 hpcables_error("%s: cable already open", __FUNCTION__);
+                RELEASE_HANDLE()
                 break;
             }
-            DO_BASIC_HANDLE_CHECKS2()
 
             open = handle->fncts->open;
             if (open != NULL) {
-                handle->busy = 1;
                 res = (*open)(handle);
                 if (res == ERR_SUCCESS) {
                     handle->open = 1;
@@ -345,12 +594,12 @@ HPEXPORT int HPCALL hpcables_cable_open(cable_handle * handle) {
                 else {
                     hpcables_error("%s: open failed", __FUNCTION__);
                 }
-                handle->busy = 0;
             }
             else {
                 res = ERR_CABLE_INVALID_FNCTS;
                 hpcables_error("%s: fncts->open is NULL", __FUNCTION__);
             }
+            RELEASE_HANDLE()
         } while (0);
     }
     else {
@@ -370,7 +619,6 @@ HPEXPORT int HPCALL hpcables_cable_close(cable_handle * handle) {
 
             close = handle->fncts->close;
             if (close != NULL) {
-                handle->busy = 1;
                 res = (*close)(handle);
                 if (res == ERR_SUCCESS) {
                     handle->open = 0;
@@ -379,12 +627,12 @@ HPEXPORT int HPCALL hpcables_cable_close(cable_handle * handle) {
                 else {
                     hpcables_error("%s: close failed", __FUNCTION__);
                 }
-                handle->busy = 0;
             }
             else {
                 res = ERR_CABLE_INVALID_FNCTS;
                 hpcables_error("%s: fncts->close is NULL", __FUNCTION__);
             }
+            RELEASE_HANDLE()
         } while (0);
     }
     else {
@@ -404,7 +652,6 @@ HPEXPORT int HPCALL hpcables_cable_send(cable_handle * handle, uint8_t * data, u
 
             send = handle->fncts->send;
             if (send != NULL) {
-                handle->busy = 1;
                 res = (*send)(handle, data, len);
                 if (res == ERR_SUCCESS) {
                     //hpcables_info("%s: send succeeded", __FUNCTION__);
@@ -412,12 +659,64 @@ HPEXPORT int HPCALL hpcables_cable_send(cable_handle * handle, uint8_t * data, u
                 else {
                     hpcables_warning("%s: send failed", __FUNCTION__);
                 }
-                handle->busy = 0;
             }
             else {
                 res = ERR_CABLE_INVALID_FNCTS;
                 hpcables_error("%s: fncts->send is NULL", __FUNCTION__);
             }
+            RELEASE_HANDLE()
+        } while (0);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_cable_send_many(cable_handle * handle, cable_report * reports, uint32_t count) {
+    int res;
+    if (handle != NULL) {
+        do {
+            int (*send_many) (cable_handle *, cable_report *, uint32_t);
+            int (*send) (cable_handle *, uint8_t *, uint32_t);
+
+            if (reports == NULL && count != 0) {
+                res = ERR_INVALID_PARAMETER;
+                hpcables_error("%s: reports is NULL", __FUNCTION__);
+                break;
+            }
+
+            DO_BASIC_HANDLE_CHECKS()
+
+            send_many = handle->fncts->send_many;
+            send = handle->fncts->send;
+            if (send_many != NULL) {
+                res = (*send_many)(handle, reports, count);
+                if (res == ERR_SUCCESS) {
+                    //hpcables_info("%s: send_many succeeded", __FUNCTION__);
+                }
+                else {
+                    hpcables_warning("%s: send_many failed", __FUNCTION__);
+                }
+            }
+            else if (send != NULL) {
+                // The cable doesn't batch: send the reports one by one, still within a single busy section.
+                uint32_t i;
+                res = ERR_SUCCESS;
+                for (i = 0; i < count; i++) {
+                    res = (*send)(handle, reports[i].data, reports[i].size);
+                    if (res != ERR_SUCCESS) {
+                        hpcables_warning("%s: send of report %" PRIu32 " failed", __FUNCTION__, i);
+                        break;
+                    }
+                }
+            }
+            else {
+                res = ERR_CABLE_INVALID_FNCTS;
+                hpcables_error("%s: fncts->send_many and fncts->send are NULL", __FUNCTION__);
+            }
+            RELEASE_HANDLE()
         } while (0);
     }
     else {
@@ -427,17 +726,16 @@ HPEXPORT int HPCALL hpcables_cable_send(cable_handle * handle, uint8_t * data, u
     return res;
 }
 
-HPEXPORT int HPCALL hpcables_cable_recv(cable_handle * handle, uint8_t ** data, uint32_t * len) {
+HPEXPORT int HPCALL hpcables_cable_recv(cable_handle * handle, uint8_t * data, uint32_t * len) {
     int res;
     if (handle != NULL) {
         do {
-            int (*recv) (cable_handle *, uint8_t **, uint32_t *);
+            int (*recv) (cable_handle *, uint8_t *, uint32_t *);
 
             DO_BASIC_HANDLE_CHECKS()
 
             recv = handle->fncts->recv;
             if (recv != NULL) {
-                handle->busy = 1;
                 res = (*recv)(handle, data, len);
                 if (res == ERR_SUCCESS) {
                     //hpcables_info("%s: recv succeeded", __FUNCTION__);
@@ -445,12 +743,59 @@ HPEXPORT int HPCALL hpcables_cable_recv(cable_handle * handle, uint8_t ** data,
                 else {
                     hpcables_warning("%s: recv failed", __FUNCTION__);
                 }
-                handle->busy = 0;
             }
             else {
                 res = ERR_CABLE_INVALID_FNCTS;
                 hpcables_error("%s: fncts->recv is NULL", __FUNCTION__);
             }
+            RELEASE_HANDLE()
+        } while (0);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_cable_recv_nowait(cable_handle * handle, uint8_t * data, uint32_t * len) {
+    int res;
+    if (handle != NULL) {
+        do {
+            int (*set_read_timeout) (cable_handle *, int);
+            int (*recv) (cable_handle *, uint8_t *, uint32_t *);
+            int read_timeout;
+
+            DO_BASIC_HANDLE_CHECKS()
+
+            set_read_timeout = handle->fncts->set_read_timeout;
+            recv = handle->fncts->recv;
+            if (set_read_timeout != NULL && recv != NULL) {
+                read_timeout = handle->read_timeout;
+                res = (*set_read_timeout)(handle, 0);
+                if (res == ERR_SUCCESS) {
+                    int res2;
+                    res = (*recv)(handle, data, len);
+                    if (res != ERR_SUCCESS) {
+                        hpcables_warning("%s: recv failed", __FUNCTION__);
+                    }
+                    res2 = (*set_read_timeout)(handle, read_timeout);
+                    if (res2 != ERR_SUCCESS) {
+                        hpcables_error("%s: couldn't restore the read timeout", __FUNCTION__);
+                        if (res == ERR_SUCCESS) {
+                            res = res2;
+                        }
+                    }
+                }
+                else {
+                    hpcables_error("%s: set_read_timeout failed", __FUNCTION__);
+                }
+            }
+            else {
+                res = ERR_CABLE_INVALID_FNCTS;
+                hpcables_error("%s: fncts->set_read_timeout or fncts->recv is NULL", __FUNCTION__);
+            }
+            RELEASE_HANDLE()
         } while (0);
     }
     else {
@@ -460,6 +805,45 @@ HPEXPORT int HPCALL hpcables_cable_recv(cable_handle * handle, uint8_t ** data,
     return res;
 }
 
+HPEXPORT int HPCALL hpcables_cable_get_fd(cable_handle * handle, int * out_fd) {
+    int res;
+    if (handle != NULL) {
+        if (out_fd != NULL) {
+            do {
+                int (*get_fd) (cable_handle *, int *);
+
+                DO_BASIC_HANDLE_CHECKS()
+
+                get_fd = handle->fncts->get_fd;
+                if (get_fd != NULL) {
+                    res = (*get_fd)(handle, out_fd);
+                    if (res == ERR_SUCCESS) {
+                        hpcables_info("%s: get_fd succeeded", __FUNCTION__);
+                    }
+                    else {
+                        hpcables_error("%s: get_fd failed", __FUNCTION__);
+                    }
+                }
+                else {
+                    res = ERR_CABLE_INVALID_FNCTS;
+                    hpcables_error("%s: fncts->get_fd is NULL, the cable can't be polled", __FUNCTION__);
+                }
+                RELEASE_HANDLE()
+            } while (0);
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpcables_error("%s: out_fd is NULL", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+#undef RELEASE_HANDLE
 #undef DO_BASIC_HANDLE_CHECKS2
 #undef DO_BASIC_HANDLE_CHECKS
 
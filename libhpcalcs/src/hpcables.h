@@ -38,6 +38,21 @@ typedef struct _cable_fncts cable_fncts;
 //! Opaque type for internal _cable_handle.
 typedef struct _cable_handle cable_handle;
 
+//! Structure describing one framed report, as part of a batch sent by \a hpcables_cable_send_many.
+typedef struct {
+    uint8_t * data;
+    uint32_t size;
+} cable_report;
+
+//! Structure describing one device found by \a hpcables_cable_enumerate.
+typedef struct {
+    cable_model model;
+    uint16_t vendor_id;
+    uint16_t product_id;
+    char * path; ///< Platform-specific device path, usable with \a hpcables_options_set_device_path.
+    char * serial_number; ///< Serial number (non-ASCII characters replaced by '?'), usable with \a hpcables_options_set_device_serial; may be empty.
+} cable_device_info;
+
 //! Internal structure containing information about the cable, and function pointers.
 struct _cable_fncts {
     cable_model model;
@@ -48,7 +63,10 @@ struct _cable_fncts {
     int (*close) (cable_handle * handle);
     int (*set_read_timeout) (cable_handle * handle, int read_timeout);
     int (*send) (cable_handle * handle, uint8_t * data, uint32_t len);
-    int (*recv) (cable_handle * handle, uint8_t ** data, uint32_t * len);
+    int (*recv) (cable_handle * handle, uint8_t * data, uint32_t * len); ///< Receives into a caller-owned buffer; \a len holds the buffer size on input, and the amount of data received on output.
+    int (*send_many) (cable_handle * handle, cable_report * reports, uint32_t count); ///< Sends a batch of reports in one call. Optional: if NULL, \a send is called for each report.
+    int (*enumerate) (cable_handle * handle, cable_device_info ** devices, uint32_t * count); ///< Lists the attached devices. Optional: if NULL, the cable has no devices to choose from.
+    int (*get_fd) (cable_handle * handle, int * out_fd); ///< Retrieves a file descriptor which polls readable while data can be received. Optional: if NULL, the cable can't be polled.
 };
 
 //! Internal structure containing state about the cable, returned and passed around by the user.
@@ -58,7 +76,12 @@ struct _cable_handle {
     const cable_fncts * fncts;
     int read_timeout;
     int open; // Should be made explicitly atomic with GCC >= 4.7 or Clang, but int is atomic on most ISAs anyway.
-    int busy; // Should be made explicitly atomic with GCC >= 4.7 or Clang, but int is atomic on most ISAs anyway.
+    int busy; ///< Nonzero while a caller uses the handle; written atomically by the library only, concurrent callers wait in line.
+    int read_thread; ///< Nonzero if the cable should receive through a dedicated reader thread; taken into account when opening the cable.
+    char * device_path; ///< If non-NULL, path of the device to be opened, as returned by \a hpcables_cable_enumerate.
+    char * device_serial; ///< If non-NULL (and device_path is NULL), serial number of the device to be opened.
+    int busy_timeout; ///< Longest wait (in ms) of a caller for the handle to be free, negative for no limit, see \a hpcables_options_set_busy_timeout.
+    void * busy_gate; ///< Lock of the handle and callers waiting for it to be free, served in arrival order; allocated with the handle.
 };
 
 
@@ -172,6 +195,63 @@ HPEXPORT int HPCALL hpcables_options_get_read_timeout(cable_handle * handle);
  * \return 0 if the operation succeeded, nonzero otherwise.
  */
 HPEXPORT int HPCALL hpcables_options_set_read_timeout(cable_handle * handle, int timeout);
+/**
+ * \brief Gets whether the given cable handle receives data through a dedicated reader thread.
+ * \param handle the cable handle
+ * \return nonzero if the reader thread is enabled, 0 otherwise or if error.
+ */
+HPEXPORT int HPCALL hpcables_options_get_read_thread(cable_handle * handle);
+/**
+ * \brief Enables or disables the dedicated reader thread for the given cable handle.
+ * When enabled, cables which support it keep draining the device into a bounded ring of reports while the cable is open,
+ * and receiving data merely pops reports from the ring. Cables which don't support it ignore this option.
+ * \param handle the cable handle, which must not be open.
+ * \param enabled nonzero to enable the reader thread.
+ * \return 0 if the operation succeeded, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_options_set_read_thread(cable_handle * handle, int enabled);
+/**
+ * \brief Gets the path of the device which the given cable handle opens.
+ * \param handle the cable handle
+ * \return the device path, NULL if none was set (the first device found is opened) or if error.
+ */
+HPEXPORT const char * HPCALL hpcables_options_get_device_path(cable_handle * handle);
+/**
+ * \brief Selects the device opened by the given cable handle, by path.
+ * \param handle the cable handle, which must not be open.
+ * \param path a device path from \a hpcables_cable_enumerate, copied by the library; NULL for opening the first device found.
+ * \return 0 if the operation succeeded, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_options_set_device_path(cable_handle * handle, const char * path);
+/**
+ * \brief Gets the serial number of the device which the given cable handle opens.
+ * \param handle the cable handle
+ * \return the serial number, NULL if none was set or if error.
+ */
+HPEXPORT const char * HPCALL hpcables_options_get_device_serial(cable_handle * handle);
+/**
+ * \brief Selects the device opened by the given cable handle, by serial number. A device path, if set, takes precedence.
+ * \param handle the cable handle, which must not be open.
+ * \param serial a serial number from \a hpcables_cable_enumerate, copied by the library; NULL for opening the first device found.
+ * \return 0 if the operation succeeded, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_options_set_device_serial(cable_handle * handle, const char * serial);
+/**
+ * \brief Gets the longest wait (in ms) of a caller for the given cable handle to be free.
+ * \param handle the cable handle
+ * \return the current timeout, negative for no limit, 0 if error.
+ */
+HPEXPORT int HPCALL hpcables_options_get_busy_timeout(cable_handle * handle);
+/**
+ * \brief Sets the longest wait (in ms) of a caller for the given cable handle to be free.
+ * Concurrent callers of the functions using the cable are served one at a time, in the order in which they arrived;
+ * those still waiting after the timeout fail with a "cable busy" error. Callers wait for as long as it takes by default.
+ * \param handle the cable handle
+ * \param timeout the new timeout: 0 fails at once if the cable is in use, a negative value waits forever.
+ * \return 0 if the operation succeeded, nonzero otherwise.
+ * \note A callback which uses the cable it is called for always fails at once, rather than waiting for itself.
+ */
+HPEXPORT int HPCALL hpcables_options_set_busy_timeout(cable_handle * handle, int timeout);
 
 /**
  * \brief Probes the given cable.
@@ -179,6 +259,21 @@ HPEXPORT int HPCALL hpcables_options_set_read_timeout(cable_handle * handle, int
  * \return 0 if the operation succeeded, nonzero otherwise.
  **/
 HPEXPORT int HPCALL hpcables_cable_probe(cable_handle * handle);
+/**
+ * \brief Lists the devices attached to the given cable type, e.g. every Prime on the bus for the Prime HID cable.
+ * \param handle the cable handle, which does not need to be open.
+ * \param devices storage area for the array of devices. Use \a hpcables_enumerate_free to free the allocated memory.
+ * \param count storage area for the number of devices.
+ * \return 0 if the operation succeeded, nonzero otherwise.
+ **/
+HPEXPORT int HPCALL hpcables_cable_enumerate(cable_handle * handle, cable_device_info ** devices, uint32_t * count);
+/**
+ * \brief Frees the result of enumeration, created by \a hpcables_cable_enumerate.
+ * \param devices the array of devices.
+ * \param count the number of devices.
+ * \return 0 if the operation succeeded, nonzero otherwise.
+ **/
+HPEXPORT int HPCALL hpcables_enumerate_free(cable_device_info * devices, uint32_t count);
 /**
  * \brief Opens the given cable.
  * \param handle the handle to be opened.
@@ -200,13 +295,39 @@ HPEXPORT int HPCALL hpcables_cable_close(cable_handle * handle);
  **/
 HPEXPORT int HPCALL hpcables_cable_send(cable_handle * handle, uint8_t * data, uint32_t len);
 /**
- * \brief Receives data through the given cable.
+ * \brief Sends a batch of already framed reports through the given cable, in order.
+ * \param handle the cable handle.
+ * \param reports the reports to be sent.
+ * \param count the number of reports.
+ * \return 0 if the operation succeeded, nonzero otherwise (the reports after the failed one are not sent).
+ **/
+HPEXPORT int HPCALL hpcables_cable_send_many(cable_handle * handle, cable_report * reports, uint32_t count);
+/**
+ * \brief Receives data through the given cable, into a caller-owned buffer.
  * \param handle the cable handle.
  * \param data storage area for the data to be received.
- * \param len storage area for the length of the received data.
+ * \param len on input, the size of the storage area; on output, the length of the received data.
  * \return 0 if the operation succeeded, nonzero otherwise.
  **/
-HPEXPORT int HPCALL hpcables_cable_recv(cable_handle * handle, uint8_t ** data, uint32_t * len);
+HPEXPORT int HPCALL hpcables_cable_recv(cable_handle * handle, uint8_t * data, uint32_t * len);
+/**
+ * \brief Receives data through the given cable without waiting: the read timeout is set to 0 for the call, then restored.
+ * \param handle the cable handle.
+ * \param data storage area for the data to be received.
+ * \param len on input, the size of the storage area; on output, the length of the received data, 0 if none was available.
+ * \return 0 if the operation succeeded, nonzero otherwise.
+ * \note The cable is held throughout, so that concurrent calls to \a hpcables_options_set_read_timeout are applied before or after it.
+ **/
+HPEXPORT int HPCALL hpcables_cable_recv_nowait(cable_handle * handle, uint8_t * data, uint32_t * len);
+/**
+ * \brief Retrieves a file descriptor which polls readable (e.g. with poll(), select() or epoll) while data can be received through the given cable,
+ * so that the cable can be serviced from an event loop: set the read timeout to 0, then receive once the descriptor is readable.
+ * \param handle the cable handle.
+ * \param out_fd storage area for the file descriptor, owned by the cable and valid until it is closed. It must only be polled, not read from.
+ * \return 0 if the operation succeeded, nonzero otherwise, e.g. if the cable can't be polled.
+ * \note Supported by the CABLE_PRIME_HIDRAW cable, and the CABLE_PRIME_SIM cable on POSIX systems.
+ **/
+HPEXPORT int HPCALL hpcables_cable_get_fd(cable_handle * handle, int * out_fd);
 
 /**
  * \brief Detects usable cables and builds an array of uint8_t booleans corresponding to the items of enum cable_model.
@@ -38,6 +38,8 @@
 #include "logging.h"
 #include "error.h"
 #include "gettext.h"
+#include "crc16.h"
+#include "busy.h"
 
 extern const calc_fncts calc_none_fncts;
 extern const calc_fncts calc_prime_fncts;
@@ -98,6 +100,7 @@ HPEXPORT int HPCALL hpcalcs_init(hpcalcs_config * config) {
                 hpcalcs_alloc_funcs = *alloc_funcs;
             }
             hpcalcs_info(_("hpcalcs library version %s"), hpcalcs_version_get());
+            crc16_init();
 
             hpcalcs_info(_("%s: init succeeded"), __FUNCTION__);
             hpcalcs_instance_count++;
@@ -119,6 +122,9 @@ HPEXPORT int HPCALL hpcalcs_exit(void) {
     }
     else {
         hpcalcs_instance_count--;
+        if (!hpcalcs_instance_count) {
+            hpcalcs_async_exit();
+        }
 
         hpcalcs_info(_("%s: exit succeeded"), __FUNCTION__);
         res = ERR_SUCCESS;
@@ -145,7 +151,16 @@ HPEXPORT calc_handle * HPCALL hpcalcs_handle_new(calc_model model) {
         if (handle != NULL) {
             handle->model = model;
             handle->fncts = hpcalcs_all_calcs[model];
-            hpcalcs_info("%s: calc handle allocation succeeded", __FUNCTION__);
+            handle->busy_timeout = BUSY_TIMEOUT_INFINITE;
+            handle->busy_gate = busy_gate_new(&hpcalcs_alloc_funcs);
+            if (handle->busy_gate != NULL) {
+                hpcalcs_info("%s: calc handle allocation succeeded", __FUNCTION__);
+            }
+            else {
+                (hpcalcs_alloc_funcs.free)(handle);
+                handle = NULL;
+                hpcalcs_error("%s: calc handle allocation failed", __FUNCTION__);
+            }
         }
         else {
             hpcalcs_error("%s: calc handle allocation failed", __FUNCTION__);
@@ -160,6 +175,7 @@ HPEXPORT calc_handle * HPCALL hpcalcs_handle_new(calc_model model) {
 HPEXPORT int HPCALL hpcalcs_handle_del(calc_handle * handle) {
     int res;
     if (handle != NULL) {
+        hpcalcs_async_cancel(handle);
         if (handle->attached) {
             res = hpcalcs_cable_detach(handle);
         }
@@ -167,8 +183,12 @@ HPEXPORT int HPCALL hpcalcs_handle_del(calc_handle * handle) {
             res = ERR_SUCCESS;
         }
 
+        (hpcalcs_alloc_funcs.free)(handle->async);
+        handle->async = NULL;
         (hpcalcs_alloc_funcs.free)(handle->handle);
         handle->handle = NULL;
+        busy_gate_del(handle->busy_gate, &hpcalcs_alloc_funcs);
+        handle->busy_gate = NULL;
 
         (hpcalcs_alloc_funcs.free)(handle);
         hpcalcs_info("%s: calc handle deletion succeeded", __FUNCTION__);
@@ -189,6 +209,12 @@ HPEXPORT int HPCALL hpcalcs_cable_attach(calc_handle * handle, cable_handle * ca
             handle->attached = 1;
             handle->open = 1;
             hpcalcs_info("%s: cable open and attach succeeded", __FUNCTION__);
+            // A calculator which doesn't answer isn't an error here: it may be plugged in later, and will then be talked to in the old protocol.
+            if (handle->negotiate_protocol && handle->fncts != NULL && handle->fncts->negotiate_protocol != NULL) {
+                if (hpcalcs_calc_negotiate_protocol(handle) != ERR_SUCCESS) {
+                    hpcalcs_warning("%s: protocol negotiation failed", __FUNCTION__);
+                }
+            }
         }
         else {
             hpcalcs_error("%s: cable open failed", __FUNCTION__);
@@ -204,15 +230,27 @@ HPEXPORT int HPCALL hpcalcs_cable_attach(calc_handle * handle, cable_handle * ca
 HPEXPORT int HPCALL hpcalcs_cable_detach(calc_handle * handle) {
     int res;
     if (handle != NULL) {
-        res = hpcables_cable_close(handle->cable);
-        if (res == ERR_SUCCESS) {
-            handle->open = 0;
-            handle->attached = 0;
-            handle->cable = NULL;
-            hpcalcs_info("%s: cable close and detach succeeded", __FUNCTION__);
+        // Asynchronous operations and the keepalive consumer use the cable.
+        hpcalcs_async_cancel(handle);
+        // Let the callers in line before us finish; those behind us will find the cable detached.
+        if (!busy_acquire(&handle->busy, handle->busy_gate, &handle->busy_timeout)) {
+            prime_keepalive_stop(handle);
+            res = hpcables_cable_close(handle->cable);
+            if (res == ERR_SUCCESS) {
+                handle->open = 0;
+                handle->attached = 0;
+                handle->cable = NULL;
+                handle->protocol_version = 0;
+                hpcalcs_info("%s: cable close and detach succeeded", __FUNCTION__);
+            }
+            else {
+                hpcalcs_error("%s: cable close and detach failed", __FUNCTION__);
+            }
+            busy_release(&handle->busy, handle->busy_gate);
         }
         else {
-            hpcalcs_error("%s: cable close and detach failed", __FUNCTION__);
+            res = ERR_CALC_BUSY;
+            hpcalcs_error("%s: calc busy", __FUNCTION__);
         }
     }
     else {
@@ -242,6 +280,9 @@ HPEXPORT int HPCALL hpcalcs_handle_display(calc_handle * handle) {
         hpcalcs_info("\tattached: %d", handle->attached);
         hpcalcs_info("\topen: %d", handle->open);
         hpcalcs_info("\tbusy: %d", handle->busy);
+        hpcalcs_info("\tbackup_resync: %d", handle->backup_resync);
+        hpcalcs_info("\tnegotiate_protocol: %d", handle->negotiate_protocol);
+        hpcalcs_info("\tprotocol_version: %d", handle->protocol_version);
         res = ERR_SUCCESS;
     }
     else {
@@ -264,29 +305,112 @@ HPEXPORT calc_model HPCALL hpcalcs_get_model(calc_handle * handle) {
     return model;
 }
 
+HPEXPORT int HPCALL hpcalcs_options_get_backup_resync(calc_handle * handle) {
+    int enabled = 0;
+    if (handle != NULL) {
+        enabled = handle->backup_resync;
+    }
+    else {
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return enabled;
+}
+
+HPEXPORT int HPCALL hpcalcs_options_set_backup_resync(calc_handle * handle, int enabled) {
+    int res;
+    if (handle != NULL) {
+        handle->backup_resync = (enabled != 0);
+        res = ERR_SUCCESS;
+        hpcalcs_info("%s: loss-tolerant backup %s", __FUNCTION__, enabled ? "enabled" : "disabled");
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_options_get_negotiate_protocol(calc_handle * handle) {
+    int enabled = 0;
+    if (handle != NULL) {
+        enabled = handle->negotiate_protocol;
+    }
+    else {
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return enabled;
+}
+
+HPEXPORT int HPCALL hpcalcs_options_set_negotiate_protocol(calc_handle * handle, int enabled) {
+    int res;
+    if (handle != NULL) {
+        handle->negotiate_protocol = (enabled != 0);
+        res = ERR_SUCCESS;
+        hpcalcs_info("%s: protocol negotiation %s", __FUNCTION__, enabled ? "enabled" : "disabled");
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_options_get_busy_timeout(calc_handle * handle) {
+    int timeout = 0;
+    if (handle != NULL) {
+        timeout = __atomic_load_n(&handle->busy_timeout, __ATOMIC_RELAXED);
+    }
+    else {
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return timeout;
+}
+
+HPEXPORT int HPCALL hpcalcs_options_set_busy_timeout(calc_handle * handle, int timeout) {
+    int res;
+    if (handle != NULL) {
+        __atomic_store_n(&handle->busy_timeout, timeout, __ATOMIC_RELAXED);
+        res = ERR_SUCCESS;
+        hpcalcs_info("%s: busy timeout %d ms", __FUNCTION__, timeout);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
 
+// The handle is acquired first, so that the other checks see the state left by the previous caller, e.g. a detached cable.
+// Once acquired, the handle is released before leaving the do { } while (0) block.
 #define DO_BASIC_HANDLE_CHECKS() \
+    if (busy_acquire(&handle->busy, handle->busy_gate, &handle->busy_timeout)) { \
+        res = ERR_CALC_BUSY; \
+        hpcalcs_error("%s: calc busy", __FUNCTION__); \
+        break; \
+    } \
     if (!handle->attached) { \
         res = ERR_CALC_NO_CABLE; \
         hpcalcs_error("%s: no cable attached", __FUNCTION__); \
+        RELEASE_HANDLE() \
         break; \
     } \
     if (!handle->open) { \
         res = ERR_CALC_CABLE_NOT_OPEN; \
         hpcalcs_error("%s: cable not open", __FUNCTION__); \
-        break; \
-    } \
-    if (handle->busy) { \
-        res = ERR_CALC_BUSY; \
-        hpcalcs_error("%s: cable busy", __FUNCTION__); \
+        RELEASE_HANDLE() \
         break; \
     } \
     if (handle->fncts == NULL) { \
         res = ERR_CALC_INVALID_FNCTS; \
         hpcalcs_error("%s: fncts is NULL", __FUNCTION__); \
+        RELEASE_HANDLE() \
         break; \
     }
 
+#define RELEASE_HANDLE() \
+    busy_release(&handle->busy, handle->busy_gate);
+
 HPEXPORT int HPCALL hpcalcs_calc_check_ready(calc_handle * handle, uint8_t ** out_data, uint32_t * out_size) {
     int res;
     if (handle != NULL) {
@@ -297,7 +421,6 @@ HPEXPORT int HPCALL hpcalcs_calc_check_ready(calc_handle * handle, uint8_t ** ou
 
             check_ready = handle->fncts->check_ready;
             if (check_ready != NULL) {
-                handle->busy = 1;
                 res = (*check_ready)(handle, out_data, out_size);
                 if (res == ERR_SUCCESS) {
                     hpcalcs_info("%s: check_ready succeeded", __FUNCTION__);
@@ -305,12 +428,44 @@ HPEXPORT int HPCALL hpcalcs_calc_check_ready(calc_handle * handle, uint8_t ** ou
                 else {
                     hpcalcs_error("%s: check_ready failed", __FUNCTION__);
                 }
-                handle->busy = 0;
             }
             else {
                 res = ERR_CALC_INVALID_FNCTS;
                 hpcalcs_error("%s: fncts->check_ready is NULL", __FUNCTION__);
             }
+            RELEASE_HANDLE()
+        } while (0);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_calc_negotiate_protocol(calc_handle * handle) {
+    int res;
+    if (handle != NULL) {
+        do {
+            int (*negotiate_protocol) (calc_handle *);
+
+            DO_BASIC_HANDLE_CHECKS()
+
+            negotiate_protocol = handle->fncts->negotiate_protocol;
+            if (negotiate_protocol != NULL) {
+                res = (*negotiate_protocol)(handle);
+                if (res == 0) {
+                    hpcalcs_info("%s: negotiate_protocol succeeded, protocol version %d", __FUNCTION__, handle->protocol_version);
+                }
+                else {
+                    hpcalcs_error("%s: negotiate_protocol failed", __FUNCTION__);
+                }
+            }
+            else {
+                res = ERR_CALC_INVALID_FNCTS;
+                hpcalcs_error("%s: fncts->negotiate_protocol is NULL", __FUNCTION__);
+            }
+            RELEASE_HANDLE()
         } while (0);
     }
     else {
@@ -330,7 +485,6 @@ HPEXPORT int HPCALL hpcalcs_calc_get_infos(calc_handle * handle, calc_infos * in
 
             get_infos = handle->fncts->get_infos;
             if (get_infos != NULL) {
-                handle->busy = 1;
                 res = (*get_infos)(handle, infos);
                 if (res == 0) {
                     hpcalcs_info("%s: get_infos succeeded", __FUNCTION__);
@@ -338,12 +492,12 @@ HPEXPORT int HPCALL hpcalcs_calc_get_infos(calc_handle * handle, calc_infos * in
                 else {
                     hpcalcs_error("%s: get_infos failed", __FUNCTION__);
                 }
-                handle->busy = 0;
             }
             else {
                 res = ERR_CALC_INVALID_FNCTS;
                 hpcalcs_error("%s: fncts->get_infos is NULL", __FUNCTION__);
             }
+            RELEASE_HANDLE()
         } while (0);
     }
     else {
@@ -363,7 +517,6 @@ HPEXPORT int HPCALL hpcalcs_calc_set_date_time(calc_handle * handle, time_t time
 
             set_date_time = handle->fncts->set_date_time;
             if (set_date_time != NULL) {
-                handle->busy = 1;
                 res = (*set_date_time)(handle, timestamp);
                 if (res == 0) {
                     hpcalcs_info("%s: set_date_time succeeded", __FUNCTION__);
@@ -371,12 +524,12 @@ HPEXPORT int HPCALL hpcalcs_calc_set_date_time(calc_handle * handle, time_t time
                 else {
                     hpcalcs_error("%s: set_date_time failed", __FUNCTION__);
                 }
-                handle->busy = 0;
             }
             else {
                 res = ERR_CALC_INVALID_FNCTS;
                 hpcalcs_error("%s: fncts->set_date_time is NULL", __FUNCTION__);
             }
+            RELEASE_HANDLE()
         } while (0);
     }
     else {
@@ -386,31 +539,30 @@ HPEXPORT int HPCALL hpcalcs_calc_set_date_time(calc_handle * handle, time_t time
     return res;
 }
 
-HPEXPORT int HPCALL hpcalcs_calc_recv_screen(calc_handle * handle, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size) {
+HPEXPORT int HPCALL hpcalcs_calc_recv_screen_payload(calc_handle * handle, calc_screenshot_format format, calc_payload * out_payload) {
     int res;
     // TODO: some checking on format, but for now, it would hamper documentation efforts.
     if (handle != NULL) {
         do {
-            int (*recv_screen) (calc_handle *, calc_screenshot_format, uint8_t **, uint32_t *);
+            int (*recv_screen) (calc_handle *, calc_screenshot_format, calc_payload *);
 
             DO_BASIC_HANDLE_CHECKS()
 
             recv_screen = handle->fncts->recv_screen;
             if (recv_screen != NULL) {
-                handle->busy = 1;
-                res = (*recv_screen)(handle, format, out_data, out_size);
+                res = (*recv_screen)(handle, format, out_payload);
                 if (res == 0) {
                     hpcalcs_info("%s: recv_screen succeeded", __FUNCTION__);
                 }
                 else {
                     hpcalcs_error("%s: recv_screen failed", __FUNCTION__);
                 }
-                handle->busy = 0;
             }
             else {
                 res = ERR_CALC_INVALID_FNCTS;
-                hpcalcs_error("%s: fncts->get_infos is NULL", __FUNCTION__);
+                hpcalcs_error("%s: fncts->recv_screen is NULL", __FUNCTION__);
             }
+            RELEASE_HANDLE()
         } while (0);
     }
     else {
@@ -420,6 +572,23 @@ HPEXPORT int HPCALL hpcalcs_calc_recv_screen(calc_handle * handle, calc_screensh
     return res;
 }
 
+HPEXPORT int HPCALL hpcalcs_calc_recv_screen(calc_handle * handle, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size) {
+    calc_payload payload;
+    int res = hpcalcs_calc_recv_screen_payload(handle, format, &payload);
+    if (res == ERR_SUCCESS) {
+        if (out_data != NULL && out_size != NULL) {
+            // Legacy interface: the image is expected at the beginning of the memory block.
+            memmove(payload.block, CALC_PAYLOAD_DATA(&payload), payload.size);
+            *out_data = payload.block;
+            *out_size = payload.size;
+        }
+        else {
+            hpcalcs_payload_release(&payload);
+        }
+    }
+    return res;
+}
+
 HPEXPORT int HPCALL hpcalcs_calc_send_file(calc_handle * handle, files_var_entry * file) {
     int res;
     if (handle != NULL) {
@@ -430,7 +599,6 @@ HPEXPORT int HPCALL hpcalcs_calc_send_file(calc_handle * handle, files_var_entry
 
             send_file = handle->fncts->send_file;
             if (send_file != NULL) {
-                handle->busy = 1;
                 res = (*send_file)(handle, file);
                 if (res == 0) {
                     hpcalcs_info("%s: send_file succeeded", __FUNCTION__);
@@ -438,12 +606,48 @@ HPEXPORT int HPCALL hpcalcs_calc_send_file(calc_handle * handle, files_var_entry
                 else {
                     hpcalcs_error("%s: send_file failed", __FUNCTION__);
                 }
-                handle->busy = 0;
             }
             else {
                 res = ERR_CALC_INVALID_FNCTS;
                 hpcalcs_error("%s: fncts->send_file is NULL", __FUNCTION__);
             }
+            RELEASE_HANDLE()
+        } while (0);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_calc_encode_file(calc_handle * handle, files_var_entry * file, calc_encoded_file ** out_encoded) {
+    int res;
+    if (handle != NULL) {
+        do {
+            int (*encode_file) (calc_handle *, files_var_entry *, calc_encoded_file **);
+
+            // No data is exchanged with the calculator, so the cable doesn't need to be attached, and the handle may be busy.
+            if (handle->fncts == NULL) {
+                res = ERR_CALC_INVALID_FNCTS;
+                hpcalcs_error("%s: fncts is NULL", __FUNCTION__);
+                break;
+            }
+
+            encode_file = handle->fncts->encode_file;
+            if (encode_file != NULL) {
+                res = (*encode_file)(handle, file, out_encoded);
+                if (res == 0) {
+                    hpcalcs_info("%s: encode_file succeeded", __FUNCTION__);
+                }
+                else {
+                    hpcalcs_error("%s: encode_file failed", __FUNCTION__);
+                }
+            }
+            else {
+                res = ERR_CALC_INVALID_FNCTS;
+                hpcalcs_error("%s: fncts->encode_file is NULL", __FUNCTION__);
+            }
         } while (0);
     }
     else {
@@ -453,6 +657,77 @@ HPEXPORT int HPCALL hpcalcs_calc_send_file(calc_handle * handle, files_var_entry
     return res;
 }
 
+HPEXPORT int HPCALL hpcalcs_calc_send_encoded_file(calc_handle * handle, calc_encoded_file * encoded) {
+    int res;
+    if (handle != NULL) {
+        do {
+            int (*send_encoded_file) (calc_handle *, calc_encoded_file *);
+
+            if (encoded == NULL || encoded->model != handle->model) {
+                res = ERR_INVALID_MODEL;
+                hpcalcs_error("%s: encoded file is NULL or was encoded for another model", __FUNCTION__);
+                break;
+            }
+
+            DO_BASIC_HANDLE_CHECKS()
+
+            send_encoded_file = handle->fncts->send_encoded_file;
+            if (send_encoded_file != NULL) {
+                res = (*send_encoded_file)(handle, encoded);
+                if (res == 0) {
+                    hpcalcs_info("%s: send_encoded_file succeeded", __FUNCTION__);
+                }
+                else {
+                    hpcalcs_error("%s: send_encoded_file failed", __FUNCTION__);
+                }
+            }
+            else {
+                res = ERR_CALC_INVALID_FNCTS;
+                hpcalcs_error("%s: fncts->send_encoded_file is NULL", __FUNCTION__);
+            }
+            RELEASE_HANDLE()
+        } while (0);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT calc_encoded_file * HPCALL hpcalcs_encoded_file_ref(calc_encoded_file * encoded) {
+    if (encoded != NULL) {
+        __atomic_add_fetch(&encoded->refcount, 1, __ATOMIC_RELAXED);
+    }
+    else {
+        hpcalcs_error("%s: encoded is NULL", __FUNCTION__);
+    }
+    return encoded;
+}
+
+HPEXPORT void HPCALL hpcalcs_encoded_file_unref(calc_encoded_file * encoded) {
+    if (encoded != NULL) {
+        if (__atomic_sub_fetch(&encoded->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+            (hpcalcs_alloc_funcs.free)(encoded->reports);
+            (hpcalcs_alloc_funcs.free)(encoded->frames);
+            (hpcalcs_alloc_funcs.free)(encoded);
+        }
+    }
+    else {
+        hpcalcs_error("%s: encoded is NULL", __FUNCTION__);
+    }
+}
+
+HPEXPORT void HPCALL hpcalcs_payload_release(calc_payload * payload) {
+    if (payload != NULL) {
+        (hpcalcs_alloc_funcs.free)(payload->block);
+        memset(payload, 0, sizeof(*payload));
+    }
+    else {
+        hpcalcs_error("%s: payload is NULL", __FUNCTION__);
+    }
+}
+
 HPEXPORT int HPCALL hpcalcs_calc_recv_file(calc_handle * handle, files_var_entry * name, files_var_entry ** out_file) {
     int res;
     if (handle != NULL) {
@@ -463,7 +738,6 @@ HPEXPORT int HPCALL hpcalcs_calc_recv_file(calc_handle * handle, files_var_entry
 
             recv_file = handle->fncts->recv_file;
             if (recv_file != NULL) {
-                handle->busy = 1;
                 res = (*recv_file)(handle, name, out_file);
                 if (res == 0) {
                     hpcalcs_info("%s: recv_file succeeded", __FUNCTION__);
@@ -471,12 +745,12 @@ HPEXPORT int HPCALL hpcalcs_calc_recv_file(calc_handle * handle, files_var_entry
                 else {
                     hpcalcs_error("%s: recv_file failed", __FUNCTION__);
                 }
-                handle->busy = 0;
             }
             else {
                 res = ERR_CALC_INVALID_FNCTS;
                 hpcalcs_error("%s: fncts->recv_file is NULL", __FUNCTION__);
             }
+            RELEASE_HANDLE()
         } while (0);
     }
     else {
@@ -496,7 +770,6 @@ HPEXPORT int HPCALL hpcalcs_calc_recv_backup(calc_handle * handle, files_var_ent
 
             recv_backup = handle->fncts->recv_backup;
             if (recv_backup != NULL) {
-                handle->busy = 1;
                 res = (*recv_backup)(handle, out_vars);
                 if (res == 0) {
                     hpcalcs_info("%s: recv_backup succeeded", __FUNCTION__);
@@ -504,12 +777,12 @@ HPEXPORT int HPCALL hpcalcs_calc_recv_backup(calc_handle * handle, files_var_ent
                 else {
                     hpcalcs_error("%s: recv_backup failed", __FUNCTION__);
                 }
-                handle->busy = 0;
             }
             else {
                 res = ERR_CALC_INVALID_FNCTS;
                 hpcalcs_error("%s: fncts->recv_backup is NULL", __FUNCTION__);
             }
+            RELEASE_HANDLE()
         } while (0);
     }
     else {
@@ -529,7 +802,6 @@ HPEXPORT int HPCALL hpcalcs_calc_send_key(calc_handle * handle, uint32_t code) {
 
             send_key = handle->fncts->send_key;
             if (send_key != NULL) {
-                handle->busy = 1;
                 res = (*send_key)(handle, code);
                 if (res == 0) {
                     hpcalcs_info("%s: send_key succeeded", __FUNCTION__);
@@ -537,12 +809,12 @@ HPEXPORT int HPCALL hpcalcs_calc_send_key(calc_handle * handle, uint32_t code) {
                 else {
                     hpcalcs_error("%s: send_key failed", __FUNCTION__);
                 }
-                handle->busy = 0;
             }
             else {
                 res = ERR_CALC_INVALID_FNCTS;
                 hpcalcs_error("%s: fncts->send_key is NULL", __FUNCTION__);
             }
+            RELEASE_HANDLE()
         } while (0);
     }
     else {
@@ -562,7 +834,6 @@ HPEXPORT int HPCALL hpcalcs_calc_send_keys(calc_handle * handle, const uint8_t *
 
             send_keys = handle->fncts->send_keys;
             if (send_keys != NULL) {
-                handle->busy = 1;
                 res = (*send_keys)(handle, data, size);
                 if (res == 0) {
                     hpcalcs_info("%s: send_keys succeeded", __FUNCTION__);
@@ -570,12 +841,12 @@ HPEXPORT int HPCALL hpcalcs_calc_send_keys(calc_handle * handle, const uint8_t *
                 else {
                     hpcalcs_error("%s: send_keys failed", __FUNCTION__);
                 }
-                handle->busy = 0;
             }
             else {
                 res = ERR_CALC_INVALID_FNCTS;
                 hpcalcs_error("%s: fncts->send_keys is NULL", __FUNCTION__);
             }
+            RELEASE_HANDLE()
         } while (0);
     }
     else {
@@ -595,7 +866,6 @@ HPEXPORT int HPCALL hpcalcs_calc_send_chat(calc_handle * handle, const uint16_t
 
             send_chat = handle->fncts->send_chat;
             if (send_chat != NULL) {
-                handle->busy = 1;
                 res = (*send_chat)(handle, data, size);
                 if (res == 0) {
                     hpcalcs_info("%s: send_chat succeeded", __FUNCTION__);
@@ -603,12 +873,12 @@ HPEXPORT int HPCALL hpcalcs_calc_send_chat(calc_handle * handle, const uint16_t
                 else {
                     hpcalcs_error("%s: send_chat failed", __FUNCTION__);
                 }
-                handle->busy = 0;
             }
             else {
                 res = ERR_CALC_INVALID_FNCTS;
                 hpcalcs_error("%s: fncts->send_chat is NULL", __FUNCTION__);
             }
+            RELEASE_HANDLE()
         } while (0);
     }
     else {
@@ -618,30 +888,142 @@ HPEXPORT int HPCALL hpcalcs_calc_send_chat(calc_handle * handle, const uint16_t
     return res;
 }
 
-HPEXPORT int HPCALL hpcalcs_calc_recv_chat(calc_handle * handle, uint16_t ** data, uint32_t *size) {
+HPEXPORT int HPCALL hpcalcs_calc_recv_chat_payload(calc_handle * handle, calc_payload * out_payload) {
     int res;
     if (handle != NULL) {
         do {
-            int (*recv_chat) (calc_handle *, uint16_t **, uint32_t *);
+            int (*recv_chat) (calc_handle *, calc_payload *);
 
             DO_BASIC_HANDLE_CHECKS()
 
             recv_chat = handle->fncts->recv_chat;
             if (recv_chat != NULL) {
-                handle->busy = 1;
-                res = (*recv_chat)(handle, data, size);
+                res = (*recv_chat)(handle, out_payload);
                 if (res == 0) {
                     hpcalcs_info("%s: recv_chat succeeded", __FUNCTION__);
                 }
                 else {
                     hpcalcs_error("%s: recv_chat failed", __FUNCTION__);
                 }
-                handle->busy = 0;
             }
             else {
                 res = ERR_CALC_INVALID_FNCTS;
                 hpcalcs_error("%s: fncts->recv_chat is NULL", __FUNCTION__);
             }
+            RELEASE_HANDLE()
+        } while (0);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_calc_recv_chat(calc_handle * handle, uint16_t ** data, uint32_t *size) {
+    calc_payload payload;
+    int res = hpcalcs_calc_recv_chat_payload(handle, &payload);
+    if (res == ERR_SUCCESS) {
+        if (data != NULL && size != NULL) {
+            // Legacy interface: the chat data is expected at the beginning of the memory block.
+            memmove(payload.block, CALC_PAYLOAD_DATA(&payload), payload.size);
+            *data = (uint16_t *)payload.block;
+            *size = payload.size;
+        }
+        else {
+            hpcalcs_payload_release(&payload);
+        }
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_calc_recv_screen_stream(calc_handle * handle, calc_screenshot_format format, calc_recv_callback callback, void * user_data) {
+    int res;
+    if (handle != NULL) {
+        do {
+            int (*recv_screen_stream) (calc_handle *, calc_screenshot_format, calc_recv_callback, void *);
+
+            DO_BASIC_HANDLE_CHECKS()
+
+            recv_screen_stream = handle->fncts->recv_screen_stream;
+            if (recv_screen_stream != NULL) {
+                res = (*recv_screen_stream)(handle, format, callback, user_data);
+                if (res == 0) {
+                    hpcalcs_info("%s: recv_screen_stream succeeded", __FUNCTION__);
+                }
+                else {
+                    hpcalcs_error("%s: recv_screen_stream failed", __FUNCTION__);
+                }
+            }
+            else {
+                res = ERR_CALC_INVALID_FNCTS;
+                hpcalcs_error("%s: fncts->recv_screen_stream is NULL", __FUNCTION__);
+            }
+            RELEASE_HANDLE()
+        } while (0);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_calc_recv_file_stream(calc_handle * handle, files_var_entry * request, calc_recv_callback callback, void * user_data) {
+    int res;
+    if (handle != NULL) {
+        do {
+            int (*recv_file_stream) (calc_handle *, files_var_entry *, calc_recv_callback, void *);
+
+            DO_BASIC_HANDLE_CHECKS()
+
+            recv_file_stream = handle->fncts->recv_file_stream;
+            if (recv_file_stream != NULL) {
+                res = (*recv_file_stream)(handle, request, callback, user_data);
+                if (res == 0) {
+                    hpcalcs_info("%s: recv_file_stream succeeded", __FUNCTION__);
+                }
+                else {
+                    hpcalcs_error("%s: recv_file_stream failed", __FUNCTION__);
+                }
+            }
+            else {
+                res = ERR_CALC_INVALID_FNCTS;
+                hpcalcs_error("%s: fncts->recv_file_stream is NULL", __FUNCTION__);
+            }
+            RELEASE_HANDLE()
+        } while (0);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcalcs_calc_recv_backup_stream(calc_handle * handle, calc_recv_callback callback, void * user_data) {
+    int res;
+    if (handle != NULL) {
+        do {
+            int (*recv_backup_stream) (calc_handle *, calc_recv_callback, void *);
+
+            DO_BASIC_HANDLE_CHECKS()
+
+            recv_backup_stream = handle->fncts->recv_backup_stream;
+            if (recv_backup_stream != NULL) {
+                res = (*recv_backup_stream)(handle, callback, user_data);
+                if (res == 0) {
+                    hpcalcs_info("%s: recv_backup_stream succeeded", __FUNCTION__);
+                }
+                else {
+                    hpcalcs_error("%s: recv_backup_stream failed", __FUNCTION__);
+                }
+            }
+            else {
+                res = ERR_CALC_INVALID_FNCTS;
+                hpcalcs_error("%s: fncts->recv_backup_stream is NULL", __FUNCTION__);
+            }
+            RELEASE_HANDLE()
         } while (0);
     }
     else {
@@ -651,12 +1033,13 @@ HPEXPORT int HPCALL hpcalcs_calc_recv_chat(calc_handle * handle, uint16_t ** dat
     return res;
 }
 
+#undef RELEASE_HANDLE
 #undef DO_BASIC_HANDLE_CHECKS
 
 HPEXPORT int HPCALL hpcalcs_probe_calc(cable_model cable, calc_model * out_calc) {
     int res;
     if (out_calc != NULL) {
-        if (cable == CABLE_PRIME_HID) {
+        if (cable == CABLE_PRIME_HID || cable == CABLE_PRIME_SIM || cable == CABLE_REPLAY) {
             res = ERR_SUCCESS;
             *out_calc = CALC_PRIME;
             hpcalcs_info("%s: calc probe succeeded", __FUNCTION__);
@@ -54,6 +54,12 @@ typedef enum {
     CALC_FNCT_SEND_KEYS = 8,
     CALC_FNCT_SEND_CHAT = 9,
     CALC_FNCT_RECV_CHAT = 10,
+    CALC_FNCT_ENCODE_FILE = 11,
+    CALC_FNCT_SEND_ENCODED_FILE = 12,
+    CALC_FNCT_RECV_SCREEN_STREAM = 13,
+    CALC_FNCT_RECV_FILE_STREAM = 14,
+    CALC_FNCT_RECV_BACKUP_STREAM = 15,
+    CALC_FNCT_NEGOTIATE_PROTOCOL = 16,
     CALC_FNCT_LAST ///< Keep this one last
 } calc_fncts_idx;
 
@@ -70,12 +76,19 @@ typedef enum {
     CALC_OPS_SEND_KEY = (1 << CALC_FNCT_SEND_KEY),
     CALC_OPS_SEND_KEYS = (1 << CALC_FNCT_SEND_KEYS),
     CALC_OPS_SEND_CHAT = (1 << CALC_FNCT_SEND_CHAT),
-    CALC_OPS_RECV_CHAT = (1 << CALC_FNCT_RECV_CHAT)
+    CALC_OPS_RECV_CHAT = (1 << CALC_FNCT_RECV_CHAT),
+    CALC_OPS_ENCODE_FILE = (1 << CALC_FNCT_ENCODE_FILE),
+    CALC_OPS_SEND_ENCODED_FILE = (1 << CALC_FNCT_SEND_ENCODED_FILE),
+    CALC_OPS_RECV_SCREEN_STREAM = (1 << CALC_FNCT_RECV_SCREEN_STREAM),
+    CALC_OPS_RECV_FILE_STREAM = (1 << CALC_FNCT_RECV_FILE_STREAM),
+    CALC_OPS_RECV_BACKUP_STREAM = (1 << CALC_FNCT_RECV_BACKUP_STREAM),
+    CALC_OPS_NEGOTIATE_PROTOCOL = (1 << CALC_FNCT_NEGOTIATE_PROTOCOL)
 } calc_features_operations;
 
 //! Screenshot formats supported by the calculators, list is known to be incomplete.
 typedef enum {
     // 5 is triggered periodically by the official connectivity kit. It returns something with a PNG header, but much smaller.
+    CALC_SCREENSHOT_FORMAT_PRIME_POLL = 5, ///< Not a full screenshot, hence outside of FIRST .. LAST; cheap to poll for detecting screen changes.
     CALC_SCREENSHOT_FORMAT_FIRST = 8,
     CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16 = 8,
     CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x4 = 9,
@@ -90,6 +103,78 @@ typedef struct {
     uint8_t * data;
 } calc_infos;
 
+//! Structure describing a payload received from the calculator, left in place within the memory block of the reply: the header preceding it is skipped, not moved.
+typedef struct {
+    uint8_t * block; ///< Memory block holding the reply, allocated with the memory allocator given to libhpcalcs; see \a hpcalcs_payload_release.
+    uint32_t offset; ///< Offset of the payload within block.
+    uint32_t size; ///< Size of the payload.
+} calc_payload;
+
+//! Pointer to the first byte of a \a calc_payload.
+#define CALC_PAYLOAD_DATA(payload) ((payload)->block + (payload)->offset)
+
+//! Structure describing the payload being delivered by a streaming receive, see \a calc_recv_callback.
+typedef struct {
+    uint8_t cmd; ///< Command of the reply.
+    uint8_t type; ///< Type of the file, for file replies.
+    uint8_t complete; ///< Set on the last call for a payload, which carries no data; crc is then final.
+    uint8_t invalid; ///< Set on the last call if the computed CRC doesn't match the embedded one.
+    uint32_t index; ///< Index of the payload within the operation, i.e. the file number within a backup.
+    uint32_t size; ///< Size of the whole payload, as announced by the calculator.
+    uint32_t offset; ///< Offset of the data within the payload.
+    uint16_t crc; ///< CRC computed so far over the part of the reply covered by the embedded CRC.
+    uint16_t embedded_crc; ///< CRC embedded in the reply.
+    char16_t name[FILES_VARNAME_MAXLEN+1]; ///< Name of the file, for file replies.
+} calc_recv_chunk;
+
+//! Callback receiving the payload of a streaming receive, slice by slice, as raw packets arrive.
+//! Returning nonzero aborts the operation, which then fails with that value.
+typedef int (*calc_recv_callback)(const calc_recv_chunk * chunk, const uint8_t * data, uint32_t size, void * user_data);
+
+//! Structure containing a file encoded and framed once for a calculator model, ready to be sent to any number of calculators of that model, concurrently.
+//! It is immutable once created, and reference-counted: see \a hpcalcs_encoded_file_ref and \a hpcalcs_encoded_file_unref.
+typedef struct {
+    calc_model model; ///< Calculator model the file was encoded for.
+    uint32_t refcount; ///< Reference count, accessed atomically.
+    int protocol_version; ///< Protocol version the reports were framed for.
+    uint32_t size; ///< Size of the encoded file, before framing.
+    uint32_t count; ///< Number of reports.
+    cable_report * reports; ///< Framed reports, ready to be sent.
+    uint8_t * frames; ///< Storage area for the framed reports.
+} calc_encoded_file;
+
+//! Opaque type for an asynchronous request, see \a hpcalcs_async_submit.
+typedef struct _calc_request calc_request;
+//! Opaque type for a completion queue, from which completed asynchronous requests are polled.
+typedef struct _calc_completion_queue calc_completion_queue;
+
+//! Callback invoked from a worker thread (from \a hpcalcs_async_pump for a pumped calculator) when an asynchronous request has completed, or was cancelled.
+//! The next request queued on the same calculator waits for it to return.
+typedef void (*calc_async_callback)(calc_request * request, void * user_data);
+
+//! Structure describing an asynchronous operation. It is copied upon submission; the data it points to must stay valid until the request completes.
+typedef struct {
+    calc_fncts_idx op; ///< Operation: CALC_FNCT_CHECK_READY, GET_INFOS, SET_DATE_TIME, RECV_SCREEN, SEND_FILE, RECV_FILE, RECV_BACKUP, SEND_KEY, SEND_KEYS, SEND_CHAT, RECV_CHAT or SEND_ENCODED_FILE.
+    time_t timestamp; ///< CALC_FNCT_SET_DATE_TIME: date and time to be set.
+    calc_screenshot_format format; ///< CALC_FNCT_RECV_SCREEN: screenshot format.
+    files_var_entry * file; ///< CALC_FNCT_SEND_FILE: file to be sent. CALC_FNCT_RECV_FILE: file to be received.
+    calc_encoded_file * encoded; ///< CALC_FNCT_SEND_ENCODED_FILE: encoded file to be sent. The request holds a reference to it.
+    uint32_t code; ///< CALC_FNCT_SEND_KEY: key code.
+    const void * data; ///< CALC_FNCT_SEND_KEYS: key codes. CALC_FNCT_SEND_CHAT: UTF-16LE chat data.
+    uint32_t size; ///< CALC_FNCT_SEND_KEYS, CALC_FNCT_SEND_CHAT: size of the data, as passed to the synchronous function.
+} calc_async_op;
+
+//! Structure containing the outcome of an asynchronous operation. The request frees what it holds when deleted; set a field to NULL to keep it.
+typedef struct {
+    int res; ///< 0 upon success, error code otherwise.
+    uint8_t * data; ///< CALC_FNCT_CHECK_READY: information contained in the reply.
+    uint32_t size; ///< CALC_FNCT_CHECK_READY: size of the information.
+    calc_infos infos; ///< CALC_FNCT_GET_INFOS: information contained in the reply.
+    calc_payload payload; ///< CALC_FNCT_RECV_SCREEN, CALC_FNCT_RECV_CHAT: received screenshot or chat data, see \a CALC_PAYLOAD_DATA; keep it by setting payload.block to NULL.
+    files_var_entry * file; ///< CALC_FNCT_RECV_FILE: received file.
+    files_var_entry ** vars; ///< CALC_FNCT_RECV_BACKUP: received files.
+} calc_async_result;
+
 //! Internal structure containing information about the calculator, and function pointers.
 struct _calc_fncts {
     calc_model model;
@@ -99,14 +184,23 @@ struct _calc_fncts {
     int (*check_ready) (calc_handle * handle, uint8_t ** out_data, uint32_t * out_size);
     int (*get_infos) (calc_handle * handle, calc_infos * infos);
     int (*set_date_time) (calc_handle * handle, time_t timestamp);
-    int (*recv_screen) (calc_handle * handle, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size);
+    int (*recv_screen) (calc_handle * handle, calc_screenshot_format format, calc_payload * out_payload);
     int (*send_file) (calc_handle * handle, files_var_entry * file);
     int (*recv_file) (calc_handle * handle, files_var_entry * request, files_var_entry ** out_file);
     int (*recv_backup) (calc_handle * handle, files_var_entry *** out_vars);
     int (*send_key) (calc_handle * handle, uint32_t code);
     int (*send_keys) (calc_handle * handle, const uint8_t * data, uint32_t size);
     int (*send_chat) (calc_handle * handle, const uint16_t * data, uint32_t size);
-    int (*recv_chat) (calc_handle * handle, uint16_t ** out_data, uint32_t * out_size);
+    int (*recv_chat) (calc_handle * handle, calc_payload * out_payload);
+    int (*encode_file) (calc_handle * handle, files_var_entry * file, calc_encoded_file ** out_encoded);
+    int (*send_encoded_file) (calc_handle * handle, calc_encoded_file * encoded);
+    int (*recv_screen_stream) (calc_handle * handle, calc_screenshot_format format, calc_recv_callback callback, void * user_data);
+    int (*recv_file_stream) (calc_handle * handle, files_var_entry * request, calc_recv_callback callback, void * user_data);
+    int (*recv_backup_stream) (calc_handle * handle, calc_recv_callback callback, void * user_data);
+    int (*negotiate_protocol) (calc_handle * handle);
+    int (*pump_start) (calc_handle * handle, const calc_async_op * op); ///< Sends the command of an asynchronous operation, without waiting for the reply. Optional: if NULL, the calculator can't be pumped.
+    int (*pump_step) (calc_handle * handle, const calc_async_op * op, calc_async_result * result, int * out_done); ///< Takes in the reply received so far without waiting, and completes the operation once the reply is whole.
+    int (*pump_abort) (calc_handle * handle); ///< Drops the reply of an operation which won't be stepped any longer.
 };
 
 //! Internal structure containing state about the calculator, returned and passed around by the user.
@@ -117,8 +211,16 @@ struct _calc_handle {
     cable_handle * cable;
     int attached; // Should be made explicitly atomic with GCC >= 4.7 or Clang, but int is atomic on most ISAs anyway.
     int open; // Should be made explicitly atomic with GCC >= 4.7 or Clang, but int is atomic on most ISAs anyway.
-    int busy; // Should be made explicitly atomic with GCC >= 4.7 or Clang, but int is atomic on most ISAs anyway.
+    int busy; ///< Nonzero while a caller uses the handle; written atomically by the library only, concurrent callers wait in line.
     int protocol_version;
+    int backup_resync; ///< Nonzero if backups are received through the loss-tolerant path, which resynchronizes on file headers.
+    int negotiate_protocol; ///< Nonzero if the newest protocol supported by the calculator is negotiated when a cable is attached.
+    uint64_t keepalives; ///< Keepalive reports received and discarded since the handle was created; updated atomically.
+    void * keepalive; ///< Consumer of keepalive reports, running while the new protocol is in use, see \a prime_keepalive_start.
+    void * async; ///< Queue of asynchronous requests, allocated upon the first submission, see \a hpcalcs_async_submit.
+    int busy_timeout; ///< Longest wait (in ms) of a caller for the handle to be free, negative for no limit, see \a hpcalcs_options_set_busy_timeout.
+    void * busy_gate; ///< Lock of the handle and callers waiting for it to be free, served in arrival order; allocated with the handle.
+    void * pump; ///< Reports of the reply to a pumped operation, read as they arrive, see \a prime_pump_start.
 };
 
 
@@ -147,8 +249,32 @@ typedef struct
     uint32_t size;
     uint8_t * data;
     uint8_t cmd;
+    // CRC computed by prime_recv_data during reassembly, when crc_requested is set.
+    // It covers data[crc_begin .. size - crc_tail), with the 2-byte embedded CRC field at crc_field counted as zeros.
+    uint8_t crc_requested;
+    uint8_t crc_computed; // Set by prime_recv_data when crc holds the CRC of a successfully reassembled packet.
+    uint16_t crc;
+    uint32_t crc_begin;
+    uint32_t crc_tail;
+    uint32_t crc_field;
 } prime_vtl_pkt;
 
+//! Consumer of the data reassembled by \a prime_recv_data_stream, called once per raw packet.
+//! \a pkt->size is the offset of the data within the virtual packet, and \a pkt->crc already covers the data.
+typedef int (*prime_recv_consumer)(prime_vtl_pkt * pkt, uint32_t expected_size, const uint8_t * data, uint32_t size, void * user_data);
+
+//! Structure tracking a reply of the Prime report by report, following the rules of \a prime_recv_data, see \a prime_reply_scan.
+typedef struct
+{
+    uint8_t cmd; ///< Command of the reply, set before the first report.
+    uint8_t expected; ///< Packet ID of the next report.
+    int protocol_version; ///< Packet numbering followed by the reply.
+    uint32_t count; ///< Reports of the reply accepted so far.
+    uint32_t expected_size; ///< Size announced by the first report, 0 if unknown.
+    uint32_t size; ///< Data received so far.
+    int complete; ///< Nonzero once the last report of the reply was scanned.
+} prime_reply_progress;
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -230,6 +356,51 @@ HPEXPORT int HPCALL hpcalcs_handle_display(calc_handle * handle);
  */
 HPEXPORT calc_model HPCALL hpcalcs_get_model(calc_handle * handle);
 
+/**
+ * \brief Gets whether backups are received through the loss-tolerant path.
+ * \param handle the calc handle
+ * \return nonzero if the loss-tolerant path is enabled, 0 otherwise or if error.
+ */
+HPEXPORT int HPCALL hpcalcs_options_get_backup_resync(calc_handle * handle);
+/**
+ * \brief Enables or disables the loss-tolerant path for receiving backups.
+ * When enabled, the whole backup is streamed in, then split on the file headers it contains, validated by their CRC:
+ * intact files are recovered even if reports were lost, duplicated or truncated elsewhere, damaged files are marked invalid.
+ * \param handle the calc handle
+ * \param enabled nonzero to enable the loss-tolerant path.
+ * \return 0 if the operation succeeded, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_options_set_backup_resync(calc_handle * handle, int enabled);
+/**
+ * \brief Gets whether the protocol is negotiated when a cable is attached.
+ * \param handle the calc handle
+ * \return nonzero if the protocol is negotiated, 0 otherwise or if error.
+ */
+HPEXPORT int HPCALL hpcalcs_options_get_negotiate_protocol(calc_handle * handle);
+/**
+ * \brief Enables or disables the negotiation of the protocol when a cable is attached, see \a hpcalcs_calc_negotiate_protocol. Disabled by default.
+ * \param handle the calc handle
+ * \param enabled nonzero to negotiate the protocol upon \a hpcalcs_cable_attach.
+ * \return 0 if the operation succeeded, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_options_set_negotiate_protocol(calc_handle * handle, int enabled);
+/**
+ * \brief Gets the longest wait (in ms) of a caller for the given calc handle to be free.
+ * \param handle the calc handle
+ * \return the current timeout, negative for no limit, 0 if error.
+ */
+HPEXPORT int HPCALL hpcalcs_options_get_busy_timeout(calc_handle * handle);
+/**
+ * \brief Sets the longest wait (in ms) of a caller for the given calc handle to be free.
+ * Concurrent callers of the functions talking to the calculator are served one at a time, in the order in which they arrived;
+ * those still waiting after the timeout fail with a "calc busy" error. Callers wait for as long as it takes by default.
+ * \param handle the calc handle
+ * \param timeout the new timeout: 0 fails at once if the calculator is in use, a negative value waits forever.
+ * \return 0 if the operation succeeded, nonzero otherwise.
+ * \note A callback which talks to the calculator it is called for always fails at once, rather than waiting for itself.
+ */
+HPEXPORT int HPCALL hpcalcs_options_set_busy_timeout(calc_handle * handle, int timeout);
+
 /**
  * \brief Opens and attaches the given cable for use with the given calculator.
  * \param handle the calculator handle.
@@ -258,6 +429,15 @@ HPEXPORT cable_handle * HPCALL hpcalcs_cable_get(calc_handle * handle);
  * \return 0 upon success, nonzero otherwise.
  */
 HPEXPORT int HPCALL hpcalcs_calc_check_ready(calc_handle * handle, uint8_t ** out_data, uint32_t * out_size);
+/**
+ * \brief Switches to the newest protocol supported by the calculator, for the lifetime of the cable attachment.
+ * For the Prime, that's the new protocol (version 1) if the firmware answers in it, which also starts the background consumer
+ * of the keepalive reports the calculator then sends periodically; otherwise, the calculator is brought back to the old protocol.
+ * \param handle the calculator handle.
+ * \return 0 upon success, even if the calculator only supports the old protocol, nonzero otherwise.
+ * \note \a hpcalcs_cable_attach calls this function when enabled by \a hpcalcs_options_set_negotiate_protocol.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_negotiate_protocol(calc_handle * handle);
 /**
  * \brief Retrieves some information, such as firmware version, from the calculator.
  * \param handle the calculator handle.
@@ -279,8 +459,17 @@ HPEXPORT int HPCALL hpcalcs_calc_set_date_time(calc_handle * handle, time_t time
  * \param out_data storage area for screenshot contained in the calculator's reply.
  * \param out_size storage area for size of the screenshot contained in the calculator's reply.
  * \return 0 upon success, nonzero otherwise.
+ * \note The screenshot is moved to the beginning of its memory block; \a hpcalcs_calc_recv_screen_payload avoids that pass over the image.
  */
 HPEXPORT int HPCALL hpcalcs_calc_recv_screen(calc_handle * handle, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size);
+/**
+ * \brief Retrieves a screenshot from the calculator, as a view into the memory block of the reply.
+ * \param handle the calculator handle.
+ * \param format the desired screenshot format.
+ * \param out_payload storage area for the screenshot, to be released with \a hpcalcs_payload_release.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_recv_screen_payload(calc_handle * handle, calc_screenshot_format format, calc_payload * out_payload);
 /**
  * \brief Sends a file to the calculator.
  * \param handle the calculator handle.
@@ -288,6 +477,33 @@ HPEXPORT int HPCALL hpcalcs_calc_recv_screen(calc_handle * handle, calc_screensh
  * \return 0 upon success, nonzero otherwise.
  */
 HPEXPORT int HPCALL hpcalcs_calc_send_file(calc_handle * handle, files_var_entry * file);
+/**
+ * \brief Encodes and frames a file once, for sending it to many calculators of the same model with \a hpcalcs_calc_send_encoded_file.
+ * \param handle the calculator handle, which determines the calculator model; no data is exchanged with the calculator.
+ * \param file information about the file to be sent.
+ * \param out_encoded storage area for the encoded file, with a reference count of 1.
+ * \return 0 upon success, nonzero otherwise.
+ * \note The encoded file must be released with \a hpcalcs_encoded_file_unref when no longer needed.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_encode_file(calc_handle * handle, files_var_entry * file, calc_encoded_file ** out_encoded);
+/**
+ * \brief Sends a file encoded by \a hpcalcs_calc_encode_file to the calculator.
+ * \param handle the calculator handle.
+ * \param encoded the encoded file, which is not modified: several threads may send it to different calculators concurrently.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_send_encoded_file(calc_handle * handle, calc_encoded_file * encoded);
+/**
+ * \brief Takes a reference to an encoded file.
+ * \param encoded the encoded file.
+ * \return \a encoded.
+ */
+HPEXPORT calc_encoded_file * HPCALL hpcalcs_encoded_file_ref(calc_encoded_file * encoded);
+/**
+ * \brief Releases a reference to an encoded file, and frees it when the last reference is released.
+ * \param encoded the encoded file.
+ */
+HPEXPORT void HPCALL hpcalcs_encoded_file_unref(calc_encoded_file * encoded);
 /**
  * \brief Receives a file from the calculator.
  * \param handle the calculator handle.
@@ -332,8 +548,146 @@ HPEXPORT int HPCALL hpcalcs_calc_send_chat(calc_handle * handle, const uint16_t
  * \param out_data storage area for the chat data contained in the calculator's reply.
  * \param out_size storage area for size of the chat data contained in the calculator's reply.
  * \return 0 upon success, nonzero otherwise.
+ * \note The chat data is moved to the beginning of its memory block; \a hpcalcs_calc_recv_chat_payload avoids that.
  */
 HPEXPORT int HPCALL hpcalcs_calc_recv_chat(calc_handle * handle, uint16_t ** out_data, uint32_t * out_size);
+/**
+ * \brief Receives chat data from the calculator, as a view into the memory block of the reply.
+ * \param handle the calculator handle.
+ * \param out_payload storage area for the UTF-16LE chat data, to be released with \a hpcalcs_payload_release.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_recv_chat_payload(calc_handle * handle, calc_payload * out_payload);
+/**
+ * \brief Releases the memory block of a payload, and clears it.
+ * \param payload the payload, may hold no memory block.
+ */
+HPEXPORT void HPCALL hpcalcs_payload_release(calc_payload * payload);
+/**
+ * \brief Queues an operation on the calculator, and returns at once. Operations queued on the same calculator run one at a time, in order,
+ * on a pool of worker threads shared by all calculators (or from \a hpcalcs_async_pump, see \a hpcalcs_async_set_pumped);
+ * their completion is notified through \a callback, \a queue, or both.
+ * \param handle the calculator handle.
+ * \param op the operation and its arguments, copied.
+ * \param callback called from a worker thread upon completion, may be NULL.
+ * \param queue completion queue to which the request is added upon completion, after the callback returns; may be NULL.
+ * \param user_data passed to the callback, see also \a hpcalcs_request_get_user_data.
+ * \return the request, NULL upon failure. It must be deleted with \a hpcalcs_request_del, e.g. from the callback, or once polled from the queue.
+ * \note The synchronous functions fail with ERR_CALC_BUSY while an operation of the calculator is running.
+ */
+HPEXPORT calc_request * HPCALL hpcalcs_async_submit(calc_handle * handle, const calc_async_op * op, calc_async_callback callback, calc_completion_queue * queue, void * user_data);
+/**
+ * \brief Cancels the operations queued on the calculator, and waits for the running one, if any.
+ * Cancelled requests complete with ERR_CALC_CANCELLED, and are notified as usual.
+ * \param handle the calculator handle.
+ * \return 0 upon success, nonzero otherwise.
+ * \note \a hpcalcs_cable_detach and \a hpcalcs_handle_del call this function. Must not be called from a completion callback of the same calculator.
+ */
+HPEXPORT int HPCALL hpcalcs_async_cancel(calc_handle * handle);
+/**
+ * \brief Sets the number of worker threads running asynchronous operations; by default, 4. The pool only grows.
+ * \param count the number of worker threads.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_async_set_workers(uint32_t count);
+/**
+ * \brief Waits until a request has completed.
+ * \param request the request.
+ * \return the result of the operation.
+ * \note Must not be called from a completion callback of the same calculator.
+ */
+HPEXPORT int HPCALL hpcalcs_request_wait(calc_request * request);
+/**
+ * \brief Retrieves the outcome of a completed request.
+ * \param request the request.
+ * \return the outcome, which may be modified to keep the data it holds; NULL if the request hasn't completed yet.
+ */
+HPEXPORT calc_async_result * HPCALL hpcalcs_request_get_result(calc_request * request);
+/**
+ * \brief Retrieves the calculator handle a request was submitted to.
+ * \param request the request.
+ * \return the calculator handle, NULL upon failure.
+ */
+HPEXPORT calc_handle * HPCALL hpcalcs_request_get_handle(calc_request * request);
+/**
+ * \brief Retrieves the user data a request was submitted with.
+ * \param request the request.
+ * \return the user data.
+ */
+HPEXPORT void * HPCALL hpcalcs_request_get_user_data(calc_request * request);
+/**
+ * \brief Deletes a request, along with the data its outcome still holds.
+ * A request which hasn't started yet is cancelled without being notified; a running one is waited for.
+ * \param request the request.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_request_del(calc_request * request);
+/**
+ * \brief Creates a completion queue.
+ * \return the completion queue, NULL upon failure.
+ */
+HPEXPORT calc_completion_queue * HPCALL hpcalcs_completion_queue_new(void);
+/**
+ * \brief Deletes a completion queue, along with the requests left in it.
+ * \param queue the completion queue, to which no pending request may be bound.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_completion_queue_del(calc_completion_queue * queue);
+/**
+ * \brief Removes the oldest completed request from a completion queue.
+ * \param queue the completion queue.
+ * \param timeout_ms longest time to wait for a request if the queue is empty; 0 to return at once.
+ * \return the request, NULL if none completed in time.
+ */
+HPEXPORT calc_request * HPCALL hpcalcs_completion_queue_poll(calc_completion_queue * queue, uint32_t timeout_ms);
+/**
+ * \brief Sets whether the asynchronous operations of the calculator are driven by \a hpcalcs_async_pump, from the caller's event loop, instead of the worker threads.
+ * \param handle the calculator handle, with no operation queued.
+ * \param pumped nonzero for driving the operations with \a hpcalcs_async_pump.
+ * \return 0 upon success, nonzero otherwise.
+ * \note Pumped calculators don't support CALC_FNCT_RECV_BACKUP, whose reply is made of many packets; use the synchronous functions instead.
+ * On a CABLE_PRIME_HIDRAW cable, they don't support CALC_FNCT_SEND_FILE and CALC_FNCT_SEND_ENCODED_FILE either, see \a hpcalcs_async_pump.
+ */
+HPEXPORT int HPCALL hpcalcs_async_set_pumped(calc_handle * handle, int pumped);
+/**
+ * \brief Advances the operations queued on a pumped calculator as far as possible without waiting: takes in the reply data received so far,
+ * completes the operation once its reply is whole, and sends the command of the next one. To be called when the file descriptor of the cable
+ * (see \a hpcables_cable_get_fd) polls readable, and after submitting operations. The read timeout of the cable should be set to 0.
+ * \param handle the calculator handle.
+ * \param out_completed storage area for the number of operations completed by the call, may be NULL.
+ * \return 0 upon success, nonzero otherwise, e.g. ERR_CALC_BUSY if the calculator is in use.
+ * \note Completion callbacks are called from this function. Synchronous functions must not be called on the calculator while an operation is in flight.
+ * \note Only replies are taken in without waiting: commands are sent whole by the call which starts their operation. For a file, this call
+ * blocks for the whole transfer, which is why file sends are refused on a CABLE_PRIME_HIDRAW cable.
+ */
+HPEXPORT int HPCALL hpcalcs_async_pump(calc_handle * handle, uint32_t * out_completed);
+/**
+ * \brief Receives a screenshot from the calculator, handing the image data to a callback as it arrives instead of buffering it.
+ * \param handle the calculator handle.
+ * \param format the screenshot format.
+ * \param callback the function receiving the image data, then a last call with chunk->complete set.
+ * \param user_data passed to \a callback.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_recv_screen_stream(calc_handle * handle, calc_screenshot_format format, calc_recv_callback callback, void * user_data);
+/**
+ * \brief Receives a file from the calculator, handing its data to a callback as it arrives instead of buffering it.
+ * \param handle the calculator handle.
+ * \param request information about the file to be received.
+ * \param callback the function receiving the file data, then a last call with chunk->complete set; it isn't called if the calculator sent no file.
+ * \param user_data passed to \a callback.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_recv_file_stream(calc_handle * handle, files_var_entry * request, calc_recv_callback callback, void * user_data);
+/**
+ * \brief Receives a backup from the calculator, handing the data of each file to a callback as it arrives instead of buffering it.
+ * \param handle the calculator handle.
+ * \param callback the function receiving the file data, then a last call with chunk->complete set, for each file in turn.
+ * \param user_data passed to \a callback.
+ * \return 0 upon success, nonzero otherwise.
+ * \note The loss-tolerant mode set by \a hpcalcs_options_set_backup_resync doesn't apply to streamed backups.
+ */
+HPEXPORT int HPCALL hpcalcs_calc_recv_backup_stream(calc_handle * handle, calc_recv_callback callback, void * user_data);
 
 
 /**
@@ -343,6 +697,14 @@ HPEXPORT int HPCALL hpcalcs_calc_recv_chat(calc_handle * handle, uint16_t ** out
  * \return 0 upon success, nonzero otherwise.
  */
 HPEXPORT int HPCALL prime_send(calc_handle * handle, prime_raw_hid_pkt * pkt);
+/**
+ * \brief Sends a batch of framed raw packets to the Prime calculator using given calculator handle.
+ * \param handle the calculator handle.
+ * \param reports the framed raw packets.
+ * \param count the number of raw packets.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL prime_send_many(calc_handle * handle, cable_report * reports, uint32_t count);
 /**
  * \brief Receives a raw packet from the Prime calculator using given calculator handle, and store the result to given packet.
  * \param handle the calculator handle.
@@ -350,6 +712,44 @@ HPEXPORT int HPCALL prime_send(calc_handle * handle, prime_raw_hid_pkt * pkt);
  * \return 0 upon success, nonzero otherwise.
  */
 HPEXPORT int HPCALL prime_recv(calc_handle * handle, prime_raw_hid_pkt * pkt);
+/**
+ * \brief Starts the background consumer of the keepalive reports sent by the Prime in the new protocol mode.
+ * Once the cable has been idle for a poll interval, a thread reads and discards the keepalive reports, so that they don't pile up ahead of the next reply.
+ * Other reports it reads are handed to the next \a prime_recv calls, in order. Accesses to the cable are serialized with \a prime_send, \a prime_send_many and \a prime_recv.
+ * \param handle the calculator handle, attached to a cable.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL prime_keepalive_start(calc_handle * handle);
+/**
+ * \brief Stops the background consumer of keepalive reports, if it is running.
+ * \param handle the calculator handle.
+ * \return 0 upon success, nonzero otherwise.
+ * \note \a hpcalcs_cable_detach calls this function.
+ */
+HPEXPORT int HPCALL prime_keepalive_stop(calc_handle * handle);
+/**
+ * \brief Prepares the reception of a reply without waiting: \a prime_pump_recv reads its reports as they arrive, then \a prime_recv hands them
+ * to the usual reassembly functions once the reply is whole, until \a prime_pump_stop is called.
+ * \param handle the calculator handle.
+ * \param cmd the command of the reply.
+ * \return 0 upon success, nonzero otherwise.
+ * \note The command itself has been sent beforehand, with the usual blocking functions, however large it is.
+ */
+HPEXPORT int HPCALL prime_pump_start(calc_handle * handle, uint8_t cmd);
+/**
+ * \brief Reads the reports of the reply available so far, without waiting, and sets them aside.
+ * \param handle the calculator handle, on which \a prime_pump_start was called.
+ * \param protocol_version the mode in which the reply is received, usually that of the handle; 1 while the calculator may still send keepalives.
+ * \param out_complete storage area for whether the reply is whole.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL prime_pump_recv(calc_handle * handle, int protocol_version, int * out_complete);
+/**
+ * \brief Drops the reports set aside by \a prime_pump_recv, and makes \a prime_recv read from the cable again.
+ * \param handle the calculator handle.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL prime_pump_stop(calc_handle * handle);
 
 /**
  * \brief Probes the given cable model to find out what calculator is connected to it.
@@ -395,6 +795,55 @@ HPEXPORT int HPCALL prime_send_new_protocol_init(calc_handle * handle);
  * \return 0 upon success, nonzero otherwise.
  */
 HPEXPORT int HPCALL prime_send_data(calc_handle * handle, prime_vtl_pkt * pkt);
+/**
+ * \brief Sends the virtual packet made of \a head followed by \a body to the Prime calculator, without assembling it in memory.
+ * \param handle the calculator handle.
+ * \param head the first part of the virtual packet, typically a header.
+ * \param head_size the size of \a head.
+ * \param body the second part of the virtual packet, e.g. the memory mapping of a file.
+ * \param body_size the size of \a body.
+ * \return 0 upon success, nonzero otherwise.
+ * \note The raw packets are framed from both parts in batches of bounded size.
+ */
+HPEXPORT int HPCALL prime_send_data_parts(calc_handle * handle, const uint8_t * head, uint32_t head_size, const uint8_t * body, uint32_t body_size);
+/**
+ * \brief Returns the packet ID of the first raw packet of a virtual packet.
+ * \param protocol_version the protocol version.
+ * \return 0x00 for the old protocol, 0x01 for the new protocol.
+ */
+HPEXPORT uint8_t HPCALL prime_pkt_id_first(int protocol_version);
+/**
+ * \brief Returns the packet ID of the raw packet following the one with the given ID, within a virtual packet.
+ * \param protocol_version the protocol version.
+ * \param pkt_id the packet ID of the current raw packet.
+ * \return the next packet ID: the old protocol wraps from 0xFE to 0x00, the new protocol from 0xFD to 0x02.
+ */
+HPEXPORT uint8_t HPCALL prime_pkt_id_next(int protocol_version, uint8_t pkt_id);
+/**
+ * \brief Frames the given virtual packet into raw packets for the given protocol version, without sending them.
+ * \param pkt the virtual packet.
+ * \param protocol_version the protocol version, which determines the raw packet IDs.
+ * \param out_reports storage area for the framed raw packets.
+ * \param out_frames storage area for the memory block backing the framed raw packets.
+ * \param out_count storage area for the number of raw packets.
+ * \return 0 upon success, nonzero otherwise.
+ * \note Both \a out_reports and \a out_frames are allocated with the memory allocator given to libhpcalcs.
+ */
+HPEXPORT int HPCALL prime_frame_data(prime_vtl_pkt * pkt, int protocol_version, cable_report ** out_reports, uint8_t ** out_frames, uint32_t * out_count);
+/**
+ * \brief Frames the virtual packet made of \a head followed by \a body into raw packets for the given protocol version, without sending them.
+ * \param head the first part of the virtual packet.
+ * \param head_size the size of \a head.
+ * \param body the second part of the virtual packet.
+ * \param body_size the size of \a body.
+ * \param protocol_version the protocol version, which determines the raw packet IDs.
+ * \param out_reports storage area for the framed raw packets.
+ * \param out_frames storage area for the memory block backing the framed raw packets.
+ * \param out_count storage area for the number of raw packets.
+ * \return 0 upon success, nonzero otherwise.
+ * \note Both \a out_reports and \a out_frames are allocated with the memory allocator given to libhpcalcs.
+ */
+HPEXPORT int HPCALL prime_frame_data_parts(const uint8_t * head, uint32_t head_size, const uint8_t * body, uint32_t body_size, int protocol_version, cable_report ** out_reports, uint8_t ** out_frames, uint32_t * out_count);
 /**
  * \brief Receives a virtual packet from the Prime calculator using given calculator handle, and store the result to given packet.
  * \param handle the calculator handle.
@@ -402,6 +851,25 @@ HPEXPORT int HPCALL prime_send_data(calc_handle * handle, prime_vtl_pkt * pkt);
  * \return 0 upon success, nonzero otherwise.
  */
 HPEXPORT int HPCALL prime_recv_data(calc_handle * handle, prime_vtl_pkt * pkt);
+/**
+ * \brief Receives a virtual packet from the Prime calculator using given calculator handle, handing its data to a consumer as raw packets arrive, without reassembling it.
+ * \param handle the calculator handle.
+ * \param pkt the virtual packet, whose data stays NULL; its size and CRC are updated as the data goes through.
+ * \param consumer the function receiving the data; a nonzero return value aborts the reception, and is returned.
+ * \param user_data passed to \a consumer.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL prime_recv_data_stream(calc_handle * handle, prime_vtl_pkt * pkt, prime_recv_consumer consumer, void * user_data);
+/**
+ * \brief Tracks a reply report by report, so that it can be received without waiting: the reply is whole once \a prime_recv_data would stop reading.
+ * \param handle the calculator handle.
+ * \param protocol_version the mode in which the reply is received, see \a prime_pump_recv.
+ * \param progress the progress of the reply, zeroed except for its cmd field before the first report.
+ * \param pkt the next report.
+ * \param out_keep storage area for whether the report belongs to the reply; keepalive reports, for instance, don't.
+ * \return 0 upon success, nonzero if the report is out of sequence or malformed.
+ */
+HPEXPORT int HPCALL prime_reply_scan(calc_handle * handle, int protocol_version, prime_reply_progress * progress, prime_raw_hid_pkt * pkt, int * out_keep);
 /**
  * \brief Returns the packet size corresponding to command \a cmd, possibly corrected by the contents of \a data.
  * \param cmd the command.
@@ -410,6 +878,13 @@ HPEXPORT int HPCALL prime_recv_data(calc_handle * handle, prime_vtl_pkt * pkt);
  * \return 0 upon success, nonzero otherwise.
  */
 HPEXPORT int HPCALL prime_data_size(uint8_t cmd, uint8_t * data, uint32_t * out_size);
+/**
+ * \brief Computes the CRC16-CCITT used by the Prime protocol over the given data, using the fastest implementation available.
+ * \param data the data.
+ * \param size the size of the data.
+ * \return the CRC.
+ */
+HPEXPORT uint16_t HPCALL prime_crc16_block(const uint8_t * data, uint32_t size);
 
 
 /**
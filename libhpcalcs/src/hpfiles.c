@@ -37,6 +37,14 @@
 #include <inttypes.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #include <hpfiles.h>
 #include "internal.h"
 #include "logging.h"
@@ -232,7 +240,7 @@ HPEXPORT files_var_entry * HPCALL hpfiles_ve_create_from_file(FILE * file, const
         if (!fseek(file, 0, SEEK_END)) {
             long size = ftell(file);
             if (size != -1) {
-                if (!fseek(file, 0, SEEK_END)) {
+                if (!fseek(file, 0, SEEK_SET)) {
                     // No calculator has 4 GB memory, let alone handle 4 GB variables, so let's (potentially) truncate long to uint32_t.
                     ve = hpfiles_ve_create_with_size((uint32_t)size);
                     if (ve != NULL) {
@@ -268,9 +276,87 @@ HPEXPORT files_var_entry * HPCALL hpfiles_ve_create_from_file(FILE * file, const
     return ve;
 }
 
+HPEXPORT files_var_entry * HPCALL hpfiles_ve_create_from_fd(int fd, const char16_t * filename) {
+    files_var_entry * ve = NULL;
+    if (fd >= 0) {
+#ifndef _WIN32
+        struct stat st;
+        if (!fstat(fd, &st) && S_ISREG(st.st_mode)) {
+            // No calculator has 4 GB memory, let alone handle 4 GB variables.
+            if ((uint64_t)st.st_size <= UINT32_MAX) {
+                if (st.st_size != 0) {
+                    // Private and writable, so that the data behaves like a copy for the code which modifies entries in place.
+                    void * map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+                    if (map != MAP_FAILED) {
+                        ve = hpfiles_ve_create();
+                        if (ve != NULL) {
+                            // The data is typically read once, front to back, by the CRC pass then the framing.
+                            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+                            ve->data = (uint8_t *)map;
+                            ve->size = (uint32_t)st.st_size;
+                            ve->mapped = 1;
+                        }
+                        else {
+                            munmap(map, (size_t)st.st_size);
+                        }
+                    }
+                    else {
+                        hpfiles_error("%s: couldn't map file", __FUNCTION__);
+                    }
+                }
+                else {
+                    ve = hpfiles_ve_create_with_size(0);
+                }
+            }
+            else {
+                hpfiles_error("%s: file is too large", __FUNCTION__);
+            }
+        }
+        else {
+            hpfiles_error("%s: not a regular file", __FUNCTION__);
+        }
+#else
+        long size = _lseek(fd, 0, SEEK_END);
+        if (size != -1 && _lseek(fd, 0, SEEK_SET) != -1) {
+            ve = hpfiles_ve_create_with_size((uint32_t)size);
+            if (ve != NULL) {
+                if (_read(fd, ve->data, (unsigned int)size) != (int)size) {
+                    hpfiles_error("%s: couldn't read from file", __FUNCTION__);
+                    hpfiles_ve_delete(ve);
+                    ve = NULL;
+                }
+            }
+        }
+        else {
+            hpfiles_error("%s: couldn't obtain file size", __FUNCTION__);
+        }
+#endif
+        if (ve != NULL && filename != NULL) {
+            char16_strncpy(ve->name, filename, FILES_VARNAME_MAXLEN);
+        }
+    }
+    else {
+        hpfiles_error("%s: fd is invalid", __FUNCTION__);
+    }
+
+    if (ve == NULL) {
+        hpfiles_error("%s: failed to create ve", __FUNCTION__);
+    }
+
+    return ve;
+}
+
 HPEXPORT void HPCALL hpfiles_ve_delete(files_var_entry * ve) {
     if (ve != NULL) {
-        (hpfiles_alloc_funcs.free)(ve->data);
+#ifndef _WIN32
+        if (ve->mapped) {
+            munmap(ve->data, ve->size);
+        }
+        else
+#endif
+        {
+            (hpfiles_alloc_funcs.free)(ve->data);
+        }
         (hpfiles_alloc_funcs.free)(ve);
     }
     else {
@@ -286,6 +372,7 @@ HPEXPORT void *hpfiles_ve_alloc_data(uint32_t size) {
 HPEXPORT files_var_entry * HPCALL hpfiles_ve_copy(files_var_entry * dst, files_var_entry * src) {
     if (src != NULL && dst != NULL) {
         memcpy(dst, src, sizeof(files_var_entry));
+        dst->mapped = 0;
         if (src->data != NULL) {
             dst->data = (uint8_t *)(hpfiles_alloc_funcs.malloc)(src->size);
             if (dst->data != NULL) {
@@ -311,6 +398,7 @@ HPEXPORT files_var_entry * HPCALL hpfiles_ve_dup(files_var_entry * src) {
         dst = (hpfiles_alloc_funcs.malloc)(sizeof(files_var_entry));
         if (dst != NULL) {
             memcpy(dst, src, sizeof(files_var_entry));
+            dst->mapped = 0;
             if (src->data != NULL) {
                 dst->data = (uint8_t *)(hpfiles_alloc_funcs.malloc)(src->size);
                 if (dst->data != NULL) {
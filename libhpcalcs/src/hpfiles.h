@@ -58,6 +58,7 @@ typedef struct
     uint8_t type;
     uint8_t model;
     uint8_t invalid; ///< Set to nonzero by e.g. hpcalcs_calc_recv_file() if a packet loss was detected.
+    uint8_t mapped; ///< Set by hpfiles_ve_create_from_fd() when data is a private memory mapping of size bytes, unmapped by hpfiles_ve_delete().
     uint32_t size;
     uint8_t* data;
 } files_var_entry;
@@ -161,6 +162,14 @@ HPEXPORT files_var_entry * HPCALL hpfiles_ve_create_with_data_and_name(uint8_t *
  * \return Pointer to files_var_entry, NULL if failed.
  */
 HPEXPORT files_var_entry * HPCALL hpfiles_ve_create_from_file(FILE * file, const char16_t * filename);
+/**
+ * \brief Creates a files_var_entry structure whose data is a memory mapping of the given file, instead of a copy read into memory.
+ * \param fd the file descriptor of a regular file, open for reading; it can be closed once the entry is created.
+ * \param filename the UTF-16LE name of the file on the calculator side, can be NULL if you want to set it later.
+ * \return Pointer to files_var_entry, NULL if failed.
+ * \note The mapping is private: changes to the data don't reach the file. Where memory mappings aren't supported, the file is read into memory.
+ */
+HPEXPORT files_var_entry * HPCALL hpfiles_ve_create_from_fd(int fd, const char16_t * filename);
 /**
  * \brief Destroys the given files_var_entry instance (embedded data + the entry itself).
  * \param entry the entry
@@ -36,6 +36,9 @@
 typedef enum {
     CABLE_NUL = 0,
     CABLE_PRIME_HID,
+    CABLE_PRIME_SIM,
+    CABLE_REPLAY,
+    CABLE_PRIME_HIDRAW,
     CABLE_MAX
 } cable_model;
 
@@ -42,6 +42,7 @@
 #include "logging.h"
 #include "error.h"
 #include "gettext.h"
+#include "pixels.h"
 
 hplibs_malloc_funcs hpopers_alloc_funcs = {
     .malloc = malloc,
@@ -89,6 +90,7 @@ HPEXPORT int HPCALL hpopers_init(hpopers_config * config) {
                 hpopers_alloc_funcs = *alloc_funcs;
             }
             hpopers_info(_("hpopers library version %s"), hpopers_version_get());
+            pixels_init();
 
             hpopers_info(_("%s: init succeeded"), __FUNCTION__);
             hpopers_instance_count++;
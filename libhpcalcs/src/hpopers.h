@@ -49,6 +49,188 @@ typedef struct {
 #define HPOPERS_CONFIG_VERSION (1)
 
 
+//! Opaque type for a fleet of calculators, driven concurrently by a pool of worker threads.
+typedef struct _opers_fleet opers_fleet;
+
+//! Types of jobs which can be queued on a fleet.
+typedef enum {
+    FLEET_JOB_SEND_FILE = 0,
+    FLEET_JOB_RECV_BACKUP,
+    FLEET_JOB_RECV_SCREEN,
+    FLEET_JOB_SET_DATE_TIME,
+    FLEET_JOB_SEND_ENCODED_FILE,
+    FLEET_JOB_CALL
+} fleet_job_type;
+
+//! Structure describing a job queued on a fleet. It is copied upon submission.
+typedef struct {
+    fleet_job_type type; ///< Type of the job.
+    files_var_entry * file; ///< FLEET_JOB_SEND_FILE: file to be sent. Not owned by the fleet, must stay valid until the job completes; may be shared by several jobs.
+    calc_screenshot_format format; ///< FLEET_JOB_RECV_SCREEN: screenshot format.
+    time_t timestamp; ///< FLEET_JOB_SET_DATE_TIME: date and time to be set.
+    calc_encoded_file * encoded; ///< FLEET_JOB_SEND_ENCODED_FILE: encoded file to be sent. The fleet holds a reference until the job completes.
+    int (*call)(calc_handle * calc, uint32_t calc_index, void * user_data); ///< FLEET_JOB_CALL: function run by the worker with the calculator, passed \a user_data; its return value is the result of the job. Not called if the job is cancelled.
+    void * user_data; ///< Opaque pointer for the caller's use.
+} fleet_job;
+
+//! Structure containing the outcome of a job, passed to the completion callback.
+typedef struct {
+    int res; ///< 0 upon success, error code otherwise.
+    files_var_entry ** vars; ///< FLEET_JOB_RECV_BACKUP: received files.
+    calc_payload screen; ///< FLEET_JOB_RECV_SCREEN: received screenshot, see \a CALC_PAYLOAD_DATA.
+} fleet_job_result;
+
+//! Structure containing the callbacks invoked by a fleet. They are called from worker threads, all of them may be NULL.
+typedef struct {
+    void (*job_started)(opers_fleet * fleet, uint32_t calc_index, const fleet_job * job, void * user_data); ///< A job is about to run on the given calculator.
+    void (*job_completed)(opers_fleet * fleet, uint32_t calc_index, const fleet_job * job, fleet_job_result * result, void * user_data); ///< A job has completed or was cancelled. To keep \a result->vars or \a result->screen, set \a result->vars or \a result->screen.block to NULL; otherwise, the fleet frees them upon return.
+    void (*progress)(opers_fleet * fleet, uint32_t jobs_done, uint32_t jobs_total, void * user_data); ///< Called after each completed job.
+    void * user_data; ///< Passed to the callbacks.
+} fleet_callbacks;
+
+//! Opaque type for a screencast, polling one calculator for screen changes from a thread of its own.
+typedef struct _opers_screencast opers_screencast;
+
+//! Structure describing a frame delivered by a screencast.
+typedef struct {
+    uint32_t sequence; ///< Number of the frame, from 0.
+    calc_screenshot_format format; ///< Format of the frame, chosen by the adaptation to the budgets.
+    uint64_t timestamp_us; ///< Time at which the change was detected, on the CLOCK_MONOTONIC clock, in microseconds.
+    uint32_t latency_us; ///< Time taken by fetching the frame once the change was detected.
+    uint32_t polls; ///< Number of polls since the previous frame, the one which detected the change included.
+    const uint8_t * data; ///< Raw screenshot, as returned by \a hpcalcs_calc_recv_screen. Only valid during the callback.
+    uint32_t size; ///< Size of the raw screenshot.
+} screencast_frame;
+
+//! Structure containing the parameters of a screencast. Budgets set to 0 are unlimited.
+typedef struct {
+    calc_screenshot_format format; ///< Best format for frames. The adaptation steps down from it to lower resolutions, then to 4 bits per pixel.
+    uint32_t max_fps; ///< Maximum number of polls per second; 0 selects 10.
+    uint32_t latency_budget_us; ///< Longest acceptable time for fetching a frame; the format steps down while the average exceeds it.
+    uint32_t bandwidth_budget; ///< Bytes per second which polls and frames may use on average; polls are spaced out accordingly.
+    int (*frame)(opers_screencast * cast, const screencast_frame * frame, void * user_data); ///< Called from the screencast thread for each frame; returning nonzero ends the screencast.
+    void * user_data; ///< Passed to the callback.
+} screencast_config;
+
+//! Structure containing statistics of a screencast.
+typedef struct {
+    uint32_t polls; ///< Polls for screen changes.
+    uint32_t frames; ///< Frames delivered.
+    uint32_t format_changes; ///< Steps of the adaptation between formats.
+    calc_screenshot_format format; ///< Format of the next frame.
+    uint32_t interval_us; ///< Current interval between polls.
+    uint64_t bytes; ///< Bytes of polls and frames received.
+    int running; ///< Nonzero until the screencast ends.
+    int res; ///< Error which ended the screencast, 0 if none.
+} screencast_stats;
+
+//! Opaque type for a screenshot recorder, capturing the screen of one calculator on a schedule from a thread of its own.
+typedef struct _opers_recorder opers_recorder;
+
+//! Structure containing the parameters of a recorder. All memory is allocated when the recorder is created.
+typedef struct {
+    calc_screenshot_format format; ///< Format of the captured screenshots.
+    uint32_t interval_ms; ///< Interval between captures; 0 selects 1000.
+    uint32_t ring_size; ///< Bytes of memory for screenshots. The oldest ones are evicted to make room for new ones.
+    uint32_t max_frames; ///< Maximum number of distinct screenshots in memory; 0 selects ring_size / 4096, at least 16.
+    uint32_t max_age_ms; ///< Screenshots last captured longer ago are evicted, even with room left; 0 for no limit.
+    const char * spill_path; ///< If not NULL, file to which evicted screenshots are appended, created if needed; see \a hpopers_recorder_read.
+} recorder_config;
+
+//! Structure describing a screenshot held by a recorder, along with the captures identical to it which followed.
+typedef struct {
+    uint64_t first_us; ///< Wall-clock time of the first capture, in microseconds since the Epoch.
+    uint64_t last_us; ///< Wall-clock time of the last identical capture.
+    uint32_t captures; ///< Number of identical captures.
+    calc_screenshot_format format; ///< Screenshot format.
+    const uint8_t * data; ///< Raw screenshot, as returned by \a hpcalcs_calc_recv_screen. Only valid during the callback.
+    uint32_t size; ///< Size of the raw screenshot.
+} recorder_frame;
+
+//! Callback invoked for each screenshot by \a hpopers_recorder_foreach and \a hpopers_recorder_read; returning nonzero stops the iteration.
+typedef int (*recorder_callback)(const recorder_frame * frame, void * user_data);
+
+//! Structure containing statistics of a recorder.
+typedef struct {
+    uint32_t captures; ///< Successful captures.
+    uint32_t duplicates; ///< Captures identical to the previous one, stored as a repeat.
+    uint32_t errors; ///< Failed captures.
+    uint32_t dropped; ///< Screenshots larger than the whole ring, not stored.
+    uint32_t evicted; ///< Screenshots evicted from memory.
+    uint32_t spilled; ///< Screenshots appended to the spill file.
+    uint64_t spill_bytes; ///< Bytes appended to the spill file.
+    uint32_t frames; ///< Screenshots currently in memory.
+    uint32_t bytes; ///< Bytes of screenshots currently in memory.
+    int spill_res; ///< Last error on the spill file, 0 if none.
+} recorder_stats;
+
+// A spill file is a recorder_spill_header followed by records, each being a recorder_spill_record followed by
+// the screenshot, padded with zeros to a multiple of 8 bytes. Fields are in the byte order of the host which wrote the file.
+// Records are only ever appended, so that the screenshots of successive recording sessions can follow each other.
+// A screenshot captured again after a flush is written again when evicted: the later record, with the same first_us, supersedes the earlier one.
+
+//! Magic number at the beginning of spill files.
+#define RECORDER_SPILL_MAGIC "HPLPREC\x1A"
+//! Latest revision of the spill file format.
+#define RECORDER_SPILL_VERSION (1)
+
+//! Header of a spill file, 16 bytes.
+typedef struct {
+    uint8_t magic[8]; ///< RECORDER_SPILL_MAGIC.
+    uint32_t version; ///< RECORDER_SPILL_VERSION.
+    uint32_t reserved; ///< Zero.
+} recorder_spill_header;
+
+//! Header of a spill record, 32 bytes.
+typedef struct {
+    uint64_t first_us; ///< See \a recorder_frame.
+    uint64_t last_us; ///< See \a recorder_frame.
+    uint32_t captures; ///< See \a recorder_frame.
+    uint32_t format; ///< See \a recorder_frame.
+    uint32_t size; ///< Size of the screenshot following the header.
+    uint32_t reserved; ///< Zero.
+} recorder_spill_record;
+
+//! Opaque type for a screen wall, refreshing a mosaic of the screens of all calculators of a fleet from a thread of its own.
+typedef struct _opers_wall opers_wall;
+
+//! Structure describing a mosaic delivered by a screen wall.
+typedef struct {
+    uint32_t sequence; ///< Number of the refresh, from 0.
+    uint64_t timestamp_us; ///< Start of the refresh, on the CLOCK_MONOTONIC clock, in microseconds.
+    uint32_t duration_us; ///< Time taken by capturing and decoding all screens.
+    const uint8_t * pixels; ///< R8G8B8 mosaic, rows of \a stride bytes. Only valid during the callback.
+    uint32_t width; ///< Width of the mosaic, in pixels.
+    uint32_t height; ///< Height of the mosaic, in pixels.
+    uint32_t stride; ///< Bytes per row of the mosaic.
+    uint32_t columns; ///< Tiles per row: the screen of calculator i is the tile in column i % columns of row i / columns.
+    uint32_t tile_width; ///< Width of a tile, in pixels.
+    uint32_t tile_height; ///< Height of a tile, in pixels.
+    const int * results; ///< Outcome of the capture of each calculator, 0 upon success. Failed tiles keep their previous contents, black at first.
+    uint32_t count; ///< Number of calculators.
+    uint32_t failed; ///< Number of failed captures.
+} wall_mosaic;
+
+//! Structure containing the parameters of a screen wall.
+typedef struct {
+    calc_screenshot_format format; ///< Format of the captured screenshots: 160x120 tiles for the 160x120 formats, which are the cheapest to capture, 320x240 tiles otherwise.
+    uint32_t columns; ///< Tiles per row; 0 selects a mosaic about as many tiles wide as high.
+    uint32_t fps; ///< Target number of refreshes per second; 0 selects 1. A refresh taking longer delays the next one.
+    int (*mosaic)(opers_wall * wall, const wall_mosaic * mosaic, void * user_data); ///< Called from the wall thread after each refresh; returning nonzero stops the refreshes.
+    void * user_data; ///< Passed to the callback.
+} wall_config;
+
+//! Structure containing statistics of a screen wall.
+typedef struct {
+    uint32_t refreshes; ///< Completed refreshes.
+    uint32_t late; ///< Refreshes which took longer than the period, delaying the next one.
+    uint32_t failed; ///< Failed captures, over all refreshes.
+    uint32_t last_duration_us; ///< Duration of the last refresh.
+    uint32_t max_duration_us; ///< Duration of the longest refresh.
+    int running; ///< Nonzero until the refreshes stop.
+} wall_stats;
+
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -96,6 +278,156 @@ HPEXPORT void HPCALL hpopers_log_set_callback(void (*log_callback)(const char *f
 HPEXPORT hplibs_logging_level HPCALL hpopers_log_set_level(hplibs_logging_level log_level);
 
 
+/**
+ * \brief Creates a fleet of calculators, and starts its worker threads.
+ * \param calcs array of attached calculator handles, the fleet takes ownership of them upon success.
+ * \param count number of calculator handles.
+ * \param worker_count number of worker threads; 0 means one per calculator. Capped to \a count, since each calculator runs at most one job at a time.
+ * \param callbacks callbacks invoked when jobs start and complete, copied; may be NULL.
+ * \return the fleet, NULL upon failure.
+ * \note The fleet must be freed with \a hpopers_fleet_del when no longer needed.
+ */
+HPEXPORT opers_fleet * HPCALL hpopers_fleet_new(calc_handle ** calcs, uint32_t count, uint32_t worker_count, const fleet_callbacks * callbacks);
+/**
+ * \brief Cancels the queued jobs of a fleet, waits for the running ones, stops the worker threads, and deletes the fleet along with its calculator and cable handles.
+ * \param fleet the fleet.
+ * \return 0 upon success, nonzero otherwise.
+ * \note Cancelled jobs are reported to the completion callback with ERR_OPER_CANCELLED. Must not be called from a fleet callback.
+ */
+HPEXPORT int HPCALL hpopers_fleet_del(opers_fleet * fleet);
+/**
+ * \brief Queues a job on one calculator of the fleet. Jobs queued on the same calculator run in order.
+ * \param fleet the fleet.
+ * \param calc_index index of the calculator, in the array passed to \a hpopers_fleet_new.
+ * \param job the job, copied.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpopers_fleet_submit(opers_fleet * fleet, uint32_t calc_index, const fleet_job * job);
+/**
+ * \brief Queues a job on every calculator of the fleet.
+ * \param fleet the fleet.
+ * \param job the job, copied once per calculator.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpopers_fleet_submit_all(opers_fleet * fleet, const fleet_job * job);
+/**
+ * \brief Queues the sending of a file on every calculator of the fleet. The file is encoded once per calculator model, and the resulting reports are shared by all jobs.
+ * \param fleet the fleet.
+ * \param file the file to be sent, only used during this call.
+ * \param user_data passed back to the callbacks through \a fleet_job.user_data.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpopers_fleet_broadcast_file(opers_fleet * fleet, files_var_entry * file, void * user_data);
+/**
+ * \brief Waits until all jobs queued on the fleet have completed.
+ * \param fleet the fleet.
+ * \return 0 upon success, nonzero otherwise.
+ * \note Must not be called from a fleet callback.
+ */
+HPEXPORT int HPCALL hpopers_fleet_wait(opers_fleet * fleet);
+/**
+ * \brief Retrieves a calculator handle owned by the fleet.
+ * \param fleet the fleet.
+ * \param calc_index index of the calculator.
+ * \return the calculator handle, NULL upon failure.
+ * \note The handle must not be used directly while jobs are queued on it.
+ */
+HPEXPORT calc_handle * HPCALL hpopers_fleet_get_calc(opers_fleet * fleet, uint32_t calc_index);
+/**
+ * \brief Retrieves the number of calculators of a fleet.
+ * \param fleet the fleet.
+ * \return the number of calculators, 0 upon failure.
+ */
+HPEXPORT uint32_t HPCALL hpopers_fleet_get_count(opers_fleet * fleet);
+
+/**
+ * \brief Starts a screencast: a thread polls the calculator with the cheap CALC_SCREENSHOT_FORMAT_PRIME_POLL screenshots, and fetches a frame only when the screen changed.
+ * \param calc the calculator handle, which must stay attached to its cable, and must not be used otherwise until the screencast is stopped.
+ * \param config parameters of the screencast, copied.
+ * \return the screencast, NULL upon failure.
+ */
+HPEXPORT opers_screencast * HPCALL hpopers_screencast_start(calc_handle * calc, const screencast_config * config);
+/**
+ * \brief Stops a screencast, waits for its thread, and deletes it. The calculator handle is left to the caller.
+ * \param cast the screencast.
+ * \return 0 if the screencast had not failed, the error which ended it otherwise.
+ */
+HPEXPORT int HPCALL hpopers_screencast_stop(opers_screencast * cast);
+/**
+ * \brief Retrieves the statistics of a screencast.
+ * \param cast the screencast.
+ * \param out_stats storage area for the statistics.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpopers_screencast_get_stats(opers_screencast * cast, screencast_stats * out_stats);
+/**
+ * \brief Creates a screenshot recorder, and starts its capture thread.
+ * Screenshots identical to the previous one only update its last capture time, the others are copied into a ring preallocated
+ * according to \a config, so that memory use stays flat however long the recording runs.
+ * \param calc the calculator handle, which must stay attached to its cable, and must not be used otherwise until the recorder is deleted.
+ * \param config parameters of the recorder, copied.
+ * \return the recorder, NULL upon failure.
+ */
+HPEXPORT opers_recorder * HPCALL hpopers_recorder_new(calc_handle * calc, const recorder_config * config);
+/**
+ * \brief Stops a recorder, appends the screenshots it still holds to its spill file, if any, and deletes it. The calculator handle is left to the caller.
+ * \param recorder the recorder.
+ * \return 0 upon success, the last error on the spill file otherwise.
+ */
+HPEXPORT int HPCALL hpopers_recorder_del(opers_recorder * recorder);
+/**
+ * \brief Appends the screenshots held in memory which aren't in the spill file yet, e.g. before the recording is inspected; they stay in memory.
+ * \param recorder the recorder.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpopers_recorder_flush(opers_recorder * recorder);
+/**
+ * \brief Iterates over the screenshots held in memory, oldest first. Captures wait while the callback runs.
+ * \param recorder the recorder.
+ * \param callback the callback, which must not call other recorder functions.
+ * \param user_data passed to the callback.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpopers_recorder_foreach(opers_recorder * recorder, recorder_callback callback, void * user_data);
+/**
+ * \brief Retrieves the statistics of a recorder.
+ * \param recorder the recorder.
+ * \param out_stats storage area for the statistics.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpopers_recorder_get_stats(opers_recorder * recorder, recorder_stats * out_stats);
+/**
+ * \brief Iterates over the screenshots of a spill file, oldest first.
+ * \param path the spill file.
+ * \param callback the callback.
+ * \param user_data passed to the callback.
+ * \return 0 upon success, ERR_OPER_RECORDING_FORMAT if the file is not a spill file or is truncated, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpopers_recorder_read(const char * path, recorder_callback callback, void * user_data);
+/**
+ * \brief Starts a screen wall: for each refresh, a thread queues a capture on every calculator of the fleet, so that the workers
+ * capture the screens in parallel and decode each of them into its tile of the mosaic, then delivers the mosaic.
+ * \param fleet the fleet, whose workers run the captures as FLEET_JOB_CALL jobs, reported to its callbacks like other jobs.
+ * \param config parameters of the screen wall, copied.
+ * \return the screen wall, NULL upon failure.
+ * \note The screen wall must be stopped before the fleet is deleted. Jobs queued by others on the same calculators delay the refreshes.
+ */
+HPEXPORT opers_wall * HPCALL hpopers_wall_start(opers_fleet * fleet, const wall_config * config);
+/**
+ * \brief Stops a screen wall, waits for the refresh in progress, if any, and deletes the screen wall. The fleet is left to the caller.
+ * \param wall the screen wall.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpopers_wall_stop(opers_wall * wall);
+/**
+ * \brief Retrieves the statistics of a screen wall.
+ * \param wall the screen wall.
+ * \param out_stats storage area for the statistics.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpopers_wall_get_stats(opers_wall * wall, wall_stats * out_stats);
+
+
 // Tentative APIs, may change in the near future.
 
 /**
@@ -114,7 +446,7 @@ HPEXPORT int HPCALL hpopers_oper_recv_screen_verbatim_to_file(calc_handle * hand
  * \param out_data storage area for converted R8G8B8 screenshot.
  * \param out_size storage area for size of the R8G8B8 screenshot contained in the calculator's reply.
  * \return 0 upon success, nonzero otherwise.
- * \note This shall be a wrapper over \a hpcalcs_calc_recv_screen and \a hpopers_oper_convert_raw_screen_to_png_r8g8b8.
+ * \note This is a wrapper over \a hpcalcs_calc_recv_screen_payload and \a hpopers_oper_convert_raw_screen_to_png_r8g8b8.
  */
 HPEXPORT int HPCALL hpopers_oper_recv_screen_png_r8g8b8(calc_handle * handle, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size);
 /**
@@ -123,17 +455,18 @@ HPEXPORT int HPCALL hpopers_oper_recv_screen_png_r8g8b8(calc_handle * handle, ca
  * \param format the desired screenshot format.
  * \param out_file struct FILE pointer for storing the output.
  * \return 0 upon success, nonzero otherwise.
- * \note This shall be a wrapper over \a hpopers_oper_recv_screen_png_r8g8b8 .
+ * \note This is a wrapper over \a hpopers_oper_recv_screen_png_r8g8b8 .
  */
 HPEXPORT int HPCALL hpopers_oper_recv_screen_png_r8g8b8_to_file(calc_handle * handle, calc_screenshot_format format, FILE * out_file);
 /**
  * \brief Converts a raw screenshot (output by e.g. \a hpcalcs_calc_recv_screen) to a more usual PNG R8G8B8 format.
+ * The X1R5G5B5 pixels of the 16-bit formats and the grey levels of the 4-bit formats are converted with the SIMD instructions of the CPU, if any.
  * \param in_data storage area for raw screenshot.
  * \param in_size storage area for size of the raw screenshot.
  * \param format the desired screenshot format.
- * \param out_data storage area for R8G8B8 screenshot.
+ * \param out_data storage area for R8G8B8 screenshot, allocated with the memory allocator given to libhpopers.
  * \param out_size storage area for size of the R8G8B8 screenshot.
- * \return 0 upon success, nonzero otherwise.
+ * \return 0 upon success, ERR_OPER_IMAGE_FORMAT if the screenshot isn't a PNG image, nonzero otherwise.
  */
 HPEXPORT int HPCALL hpopers_oper_convert_raw_screen_to_png_r8g8b8(uint8_t * in_data, uint32_t in_size, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size);
 /**
@@ -29,4 +29,7 @@ extern hplibs_malloc_funcs hpcables_alloc_funcs;
 extern hplibs_malloc_funcs hpcalcs_alloc_funcs;
 extern hplibs_malloc_funcs hpopers_alloc_funcs;
 
+// Stops the worker threads of the asynchronous operations of libhpcalcs, called by the last hpcalcs_exit().
+void hpcalcs_async_exit(void);
+
 #endif
@@ -0,0 +1,393 @@
+/*
+ * libhpcables: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file link_capture.c Cables: traffic capture wrapper, in front of the cable functions of any cable.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <hplibs.h>
+#include <hpcalcs.h>
+#include "busy.h"
+#include "cable_capture.h"
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+
+// The mapping grows by doubling, from CAPTURE_MIN_MAP_SIZE up to steps of CAPTURE_MAX_MAP_STEP.
+#define CAPTURE_MIN_MAP_SIZE (1024 * 1024)
+#define CAPTURE_MAX_MAP_STEP (64 * 1024 * 1024)
+
+#define CAPTURE_ALIGN(size) (((size) + 7) & ~(uint64_t)7)
+
+#ifndef _WIN32
+
+// State of a capture. The wrapping cable functions come first, so that the state can be found from handle->fncts.
+typedef struct {
+    cable_fncts fncts;
+    const cable_fncts * inner;
+    int fd;
+    uint8_t * map;
+    uint64_t map_size;
+    uint64_t offset;
+    struct timespec start;
+} cable_capture;
+
+static int capture_send(cable_handle * handle, uint8_t * data, uint32_t len);
+static int capture_recv(cable_handle * handle, uint8_t * data, uint32_t * len);
+static int capture_send_many(cable_handle * handle, cable_report * reports, uint32_t count);
+static int capture_close(cable_handle * handle);
+
+static uint64_t capture_now(const cable_capture * capture) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec - capture->start.tv_sec) * 1000000000 + (uint64_t)ts.tv_nsec - (uint64_t)capture->start.tv_nsec;
+}
+
+static int capture_map(cable_capture * capture, uint64_t size) {
+    uint8_t * map;
+    if (ftruncate(capture->fd, (off_t)size) != 0) {
+        return ERR_CABLE_CAPTURE_IO;
+    }
+    map = (uint8_t *)mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, capture->fd, 0);
+    if (map == MAP_FAILED) {
+        return ERR_CABLE_CAPTURE_IO;
+    }
+    if (capture->map != NULL) {
+        munmap(capture->map, (size_t)capture->map_size);
+    }
+    capture->map = map;
+    capture->map_size = size;
+    return ERR_SUCCESS;
+}
+
+// Slow path: grows the mapping so that it can hold \a needed more bytes.
+static int capture_grow(cable_capture * capture, uint64_t needed) {
+    uint64_t size = capture->map_size;
+    while (size < capture->offset + needed) {
+        size += size < CAPTURE_MAX_MAP_STEP ? size : CAPTURE_MAX_MAP_STEP;
+    }
+    return capture_map(capture, size);
+}
+
+static void capture_record(cable_capture * capture, uint8_t direction, uint8_t flags, uint64_t timestamp, uint64_t duration, int result, const uint8_t * data, uint32_t size) {
+    uint64_t total = sizeof(cable_capture_record_header) + CAPTURE_ALIGN((uint64_t)size);
+    cable_capture_record_header * record;
+    uint8_t * payload;
+
+    if (capture->map == NULL) {
+        // A previous failure to grow the mapping ended the capture.
+        return;
+    }
+    if (capture->offset + total > capture->map_size) {
+        if (capture_grow(capture, total) != ERR_SUCCESS) {
+            hpcables_error("%s: couldn't grow the capture file, capture stopped", __FUNCTION__);
+            munmap(capture->map, (size_t)capture->map_size);
+            capture->map = NULL;
+            return;
+        }
+    }
+    record = (cable_capture_record_header *)(capture->map + capture->offset);
+    record->timestamp_ns = timestamp;
+    record->duration_ns = duration > UINT32_MAX ? UINT32_MAX : (uint32_t)duration;
+    record->size = size;
+    record->result = result;
+    record->direction = direction;
+    record->flags = flags | (result != ERR_SUCCESS ? CABLE_CAPTURE_FLAG_ERROR : 0);
+    record->reserved = 0;
+    payload = (uint8_t *)(record + 1);
+    if (size != 0) {
+        memcpy(payload, data, size);
+    }
+    // The mapping beyond the end of the file contents is zero-filled, no padding to write.
+    capture->offset += total;
+    __atomic_store_n(&((cable_capture_header *)capture->map)->end_offset, capture->offset, __ATOMIC_RELEASE);
+}
+
+static int capture_send(cable_handle * handle, uint8_t * data, uint32_t len) {
+    cable_capture * capture = (cable_capture *)handle->fncts;
+    uint64_t start = capture_now(capture);
+    int res = (*capture->inner->send)(handle, data, len);
+    capture_record(capture, PACKET_DIRECTION_SEND, 0, start, capture_now(capture) - start, res, data, len);
+    return res;
+}
+
+static int capture_recv(cable_handle * handle, uint8_t * data, uint32_t * len) {
+    cable_capture * capture = (cable_capture *)handle->fncts;
+    uint64_t start = capture_now(capture);
+    int res = (*capture->inner->recv)(handle, data, len);
+    // Empty reads are timeouts, which callers poll through: only failures are worth recording.
+    if (*len != 0 || res != ERR_SUCCESS) {
+        capture_record(capture, PACKET_DIRECTION_RECV, 0, start, capture_now(capture) - start, res, data, res == ERR_SUCCESS ? *len : 0);
+    }
+    return res;
+}
+
+static int capture_send_many(cable_handle * handle, cable_report * reports, uint32_t count) {
+    cable_capture * capture = (cable_capture *)handle->fncts;
+    uint64_t start = capture_now(capture);
+    uint64_t duration;
+    uint32_t i;
+    int res = ERR_SUCCESS;
+    if (capture->inner->send_many != NULL) {
+        res = (*capture->inner->send_many)(handle, reports, count);
+    }
+    else {
+        for (i = 0; i < count && res == ERR_SUCCESS; i++) {
+            res = (*capture->inner->send)(handle, reports[i].data, reports[i].size);
+        }
+    }
+    duration = capture_now(capture) - start;
+    for (i = 0; i < count; i++) {
+        capture_record(capture, PACKET_DIRECTION_SEND, CABLE_CAPTURE_FLAG_BATCH, start, duration, res, reports[i].data, reports[i].size);
+    }
+    return res;
+}
+
+static int capture_finish(cable_capture * capture) {
+    int res = ERR_SUCCESS;
+    if (capture->map != NULL) {
+        if (msync(capture->map, (size_t)capture->map_size, MS_SYNC) != 0) {
+            res = ERR_CABLE_CAPTURE_IO;
+        }
+        munmap(capture->map, (size_t)capture->map_size);
+    }
+    if (ftruncate(capture->fd, (off_t)capture->offset) != 0 || close(capture->fd) != 0) {
+        res = ERR_CABLE_CAPTURE_IO;
+    }
+    if (res != ERR_SUCCESS) {
+        hpcables_error("%s: couldn't finalize the capture file", __FUNCTION__);
+    }
+    else {
+        hpcables_info("%s: captured %" PRIu64 " bytes", __FUNCTION__, capture->offset);
+    }
+    (hpcables_alloc_funcs.free)(capture);
+    return res;
+}
+
+static int capture_close(cable_handle * handle) {
+    cable_capture * capture = (cable_capture *)handle->fncts;
+    int res;
+    handle->fncts = capture->inner;
+    res = (*capture->inner->close)(handle);
+    capture_finish(capture);
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_capture_active(cable_handle * handle) {
+    return handle != NULL && handle->fncts != NULL && handle->fncts->close == &capture_close;
+}
+
+HPEXPORT int HPCALL hpcables_capture_start(cable_handle * handle, const char * path) {
+    int res;
+    if (handle != NULL) {
+        if (path != NULL) {
+            if (!busy_acquire(&handle->busy, handle->busy_gate, &handle->busy_timeout)) {
+                if (handle->open && handle->fncts != NULL && handle->fncts->send != NULL && handle->fncts->recv != NULL) {
+                    if (!hpcables_capture_active(handle)) {
+                        cable_capture * capture = (cable_capture *)(hpcables_alloc_funcs.calloc)(1, sizeof(*capture));
+                        if (capture != NULL) {
+                            capture->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+                            if (capture->fd >= 0 && capture_map(capture, CAPTURE_MIN_MAP_SIZE) == ERR_SUCCESS) {
+                                cable_capture_header * header = (cable_capture_header *)capture->map;
+                                struct timespec now;
+                                clock_gettime(CLOCK_REALTIME, &now);
+                                clock_gettime(CLOCK_MONOTONIC, &capture->start);
+                                memcpy(header->magic, CABLE_CAPTURE_MAGIC, sizeof(header->magic));
+                                header->version = CABLE_CAPTURE_VERSION;
+                                header->cable_model = handle->model;
+                                header->start_time_ns = (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+                                header->end_offset = sizeof(*header);
+                                capture->offset = sizeof(*header);
+                                capture->inner = handle->fncts;
+                                capture->fncts = *handle->fncts;
+                                capture->fncts.send = &capture_send;
+                                capture->fncts.recv = &capture_recv;
+                                capture->fncts.send_many = &capture_send_many;
+                                capture->fncts.close = &capture_close;
+                                handle->fncts = &capture->fncts;
+                                res = ERR_SUCCESS;
+                                hpcables_info("%s: capturing to %s", __FUNCTION__, path);
+                            }
+                            else {
+                                if (capture->fd >= 0) {
+                                    close(capture->fd);
+                                }
+                                (hpcables_alloc_funcs.free)(capture);
+                                res = ERR_CABLE_CAPTURE_IO;
+                                hpcables_error("%s: couldn't create capture file %s", __FUNCTION__, path);
+                            }
+                        }
+                        else {
+                            res = ERR_MALLOC;
+                            hpcables_error("%s: couldn't allocate capture state", __FUNCTION__);
+                        }
+                    }
+                    else {
+                        res = ERR_CABLE_BUSY;
+                        hpcables_error("%s: capture already active", __FUNCTION__);
+                    }
+                }
+                else {
+                    res = handle->open ? ERR_CABLE_INVALID_FNCTS : ERR_CABLE_NOT_OPEN;
+                    hpcables_error("%s: cable not open, or without send/recv functions", __FUNCTION__);
+                }
+                busy_release(&handle->busy, handle->busy_gate);
+            }
+            else {
+                res = ERR_CABLE_BUSY;
+                hpcables_error("%s: cable busy", __FUNCTION__);
+            }
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpcables_error("%s: path is NULL", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_capture_stop(cable_handle * handle) {
+    int res;
+    if (handle != NULL) {
+        if (!busy_acquire(&handle->busy, handle->busy_gate, &handle->busy_timeout)) {
+            if (hpcables_capture_active(handle)) {
+                cable_capture * capture = (cable_capture *)handle->fncts;
+                handle->fncts = capture->inner;
+                busy_release(&handle->busy, handle->busy_gate);
+                res = capture_finish(capture);
+            }
+            else {
+                busy_release(&handle->busy, handle->busy_gate);
+                res = ERR_INVALID_PARAMETER;
+                hpcables_error("%s: no active capture", __FUNCTION__);
+            }
+        }
+        else {
+            res = ERR_CABLE_BUSY;
+            hpcables_error("%s: cable busy", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_capture_read(const char * path, cable_capture_header * out_header, cable_capture_callback callback, void * user_data) {
+    int res;
+    if (path != NULL) {
+        int fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && (uint64_t)st.st_size >= sizeof(cable_capture_header)) {
+            const uint8_t * map = (const uint8_t *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (map != MAP_FAILED) {
+                const cable_capture_header * header = (const cable_capture_header *)map;
+                uint64_t end = __atomic_load_n(&header->end_offset, __ATOMIC_ACQUIRE);
+                if (   !memcmp(header->magic, CABLE_CAPTURE_MAGIC, sizeof(header->magic))
+                    && header->version == CABLE_CAPTURE_VERSION
+                    && end >= sizeof(*header) && end <= (uint64_t)st.st_size) {
+                    uint64_t offset = sizeof(*header);
+                    res = ERR_SUCCESS;
+                    if (out_header != NULL) {
+                        *out_header = *header;
+                    }
+                    while (offset + sizeof(cable_capture_record_header) <= end) {
+                        const cable_capture_record_header * record = (const cable_capture_record_header *)(map + offset);
+                        uint64_t total = sizeof(*record) + CAPTURE_ALIGN((uint64_t)record->size);
+                        if (offset + total > end) {
+                            res = ERR_CABLE_CAPTURE_FORMAT;
+                            hpcables_error("%s: truncated record at offset %" PRIu64, __FUNCTION__, offset);
+                            break;
+                        }
+                        if (callback != NULL && (*callback)(record, (const uint8_t *)(record + 1), user_data)) {
+                            break;
+                        }
+                        offset += total;
+                    }
+                }
+                else {
+                    res = ERR_CABLE_CAPTURE_FORMAT;
+                    hpcables_error("%s: %s is not a capture file", __FUNCTION__, path);
+                }
+                munmap((void *)map, (size_t)st.st_size);
+            }
+            else {
+                res = ERR_CABLE_CAPTURE_IO;
+                hpcables_error("%s: couldn't map %s", __FUNCTION__, path);
+            }
+        }
+        else {
+            res = fd >= 0 ? ERR_CABLE_CAPTURE_FORMAT : ERR_CABLE_CAPTURE_IO;
+            hpcables_error("%s: couldn't read %s", __FUNCTION__, path);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcables_error("%s: path is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+#else
+
+// Memory-mapped capture files are only implemented for POSIX systems so far.
+
+HPEXPORT int HPCALL hpcables_capture_active(cable_handle * handle) {
+    return 0;
+}
+
+HPEXPORT int HPCALL hpcables_capture_start(cable_handle * handle, const char * path) {
+    hpcables_error("%s: not supported on this platform", __FUNCTION__);
+    return ERR_CABLE_CAPTURE_IO;
+}
+
+HPEXPORT int HPCALL hpcables_capture_stop(cable_handle * handle) {
+    hpcables_error("%s: not supported on this platform", __FUNCTION__);
+    return ERR_CABLE_CAPTURE_IO;
+}
+
+HPEXPORT int HPCALL hpcables_capture_read(const char * path, cable_capture_header * out_header, cable_capture_callback callback, void * user_data) {
+    hpcables_error("%s: not supported on this platform", __FUNCTION__);
+    return ERR_CABLE_CAPTURE_IO;
+}
+
+#endif
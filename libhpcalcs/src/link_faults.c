@@ -0,0 +1,260 @@
+/*
+ * libhpcables: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file link_faults.c Cables: fault injection wrapper, in front of the cable functions of any cable.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#include <hplibs.h>
+#include <hpcalcs.h>
+#include "busy.h"
+#include "cable_faults.h"
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+
+// State of the wrapper. The wrapping cable functions come first, so that the state can be found from handle->fncts.
+typedef struct {
+    cable_fncts fncts;
+    const cable_fncts * inner;
+    cable_faults_config config;
+    cable_faults_stats stats;
+    uint64_t rng;
+    uint8_t pending[PRIME_RAW_HID_DATA_SIZE]; // Report to be delivered again.
+    uint32_t pending_size;
+} cable_faults;
+
+static int faults_close(cable_handle * handle);
+
+// xorshift64*: fast, and good enough to spread faults.
+static uint32_t faults_random(cable_faults * faults) {
+    uint64_t x = faults->rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    faults->rng = x;
+    return (uint32_t)((x * UINT64_C(2685821657736338717)) >> 32);
+}
+
+static int faults_roll(cable_faults * faults, uint32_t rate) {
+    return rate != 0 && faults_random(faults) % CABLE_FAULTS_RATE_ONE < rate;
+}
+
+static int faults_send(cable_handle * handle, uint8_t * data, uint32_t len) {
+    cable_faults * faults = (cable_faults *)handle->fncts;
+    faults->stats.reports_sent++;
+    if (faults_roll(faults, faults->config.send_drop_rate)) {
+        faults->stats.send_dropped++;
+        return ERR_SUCCESS;
+    }
+    return (*faults->inner->send)(handle, data, len);
+}
+
+static int faults_send_many(cable_handle * handle, cable_report * reports, uint32_t count) {
+    cable_faults * faults = (cable_faults *)handle->fncts;
+    int res = ERR_SUCCESS;
+    uint32_t i;
+    if (faults->config.send_drop_rate == 0 && faults->inner->send_many != NULL) {
+        faults->stats.reports_sent += count;
+        res = (*faults->inner->send_many)(handle, reports, count);
+    }
+    else {
+        for (i = 0; i < count && res == ERR_SUCCESS; i++) {
+            res = faults_send(handle, reports[i].data, reports[i].size);
+        }
+    }
+    return res;
+}
+
+static int faults_recv(cable_handle * handle, uint8_t * data, uint32_t * len) {
+    cable_faults * faults = (cable_faults *)handle->fncts;
+    uint32_t capacity = *len;
+    int res;
+
+    if (faults->pending_size != 0) {
+        uint32_t size = faults->pending_size < capacity ? faults->pending_size : capacity;
+        memcpy(data, faults->pending, size);
+        *len = size;
+        faults->pending_size = 0;
+        return ERR_SUCCESS;
+    }
+    if (capacity != 0 && faults_roll(faults, faults->config.spurious_rate)) {
+        memset(data, 0, capacity);
+        data[0] = (faults_random(faults) & 1) ? 0xFF : 0xFE;
+        *len = capacity < PRIME_RAW_HID_DATA_SIZE ? capacity : PRIME_RAW_HID_DATA_SIZE;
+        faults->stats.spurious++;
+        return ERR_SUCCESS;
+    }
+
+    for (;;) {
+        *len = capacity;
+        res = (*faults->inner->recv)(handle, data, len);
+        if (res != ERR_SUCCESS || *len == 0) {
+            return res;
+        }
+        faults->stats.reports_received++;
+        if (!faults_roll(faults, faults->config.drop_rate)) {
+            break;
+        }
+        // The report is lost: the computer gets the next one, or a timeout.
+        faults->stats.dropped++;
+    }
+
+    if (faults_roll(faults, faults->config.delay_rate)) {
+        struct timespec ts;
+        ts.tv_sec = faults->config.delay_us / 1000000;
+        ts.tv_nsec = (long)(faults->config.delay_us % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+        faults->stats.delayed++;
+    }
+    if (faults_roll(faults, faults->config.duplicate_rate)) {
+        faults->pending_size = *len < sizeof(faults->pending) ? *len : sizeof(faults->pending);
+        memcpy(faults->pending, data, faults->pending_size);
+        faults->stats.duplicated++;
+    }
+    if (*len > 1 && faults_roll(faults, faults->config.short_read_rate)) {
+        *len = 1 + faults_random(faults) % (*len - 1);
+        faults->stats.shortened++;
+    }
+    return res;
+}
+
+static int faults_close(cable_handle * handle) {
+    cable_faults * faults = (cable_faults *)handle->fncts;
+    int res;
+    handle->fncts = faults->inner;
+    res = (*faults->inner->close)(handle);
+    (hpcables_alloc_funcs.free)(faults);
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_faults_active(cable_handle * handle) {
+    return handle != NULL && handle->fncts != NULL && handle->fncts->close == &faults_close;
+}
+
+HPEXPORT int HPCALL hpcables_faults_start(cable_handle * handle, const cable_faults_config * config) {
+    int res;
+    if (handle != NULL) {
+        if (config != NULL) {
+            if (!busy_acquire(&handle->busy, handle->busy_gate, &handle->busy_timeout)) {
+                if (handle->open && handle->fncts != NULL && handle->fncts->send != NULL && handle->fncts->recv != NULL) {
+                    cable_faults * faults = (cable_faults *)(hpcables_alloc_funcs.calloc)(1, sizeof(*faults));
+                    if (faults != NULL) {
+                        faults->config = *config;
+                        // xorshift must not be seeded with 0.
+                        faults->rng = config->seed != 0 ? config->seed : UINT64_C(0x9E3779B97F4A7C15);
+                        faults->inner = handle->fncts;
+                        faults->fncts = *handle->fncts;
+                        faults->fncts.send = &faults_send;
+                        faults->fncts.recv = &faults_recv;
+                        faults->fncts.send_many = &faults_send_many;
+                        faults->fncts.close = &faults_close;
+                        handle->fncts = &faults->fncts;
+                        res = ERR_SUCCESS;
+                        hpcables_info("%s: injecting faults, seed %" PRIu64, __FUNCTION__, config->seed);
+                    }
+                    else {
+                        res = ERR_MALLOC;
+                        hpcables_error("%s: couldn't allocate fault injection state", __FUNCTION__);
+                    }
+                }
+                else {
+                    res = handle->open ? ERR_CABLE_INVALID_FNCTS : ERR_CABLE_NOT_OPEN;
+                    hpcables_error("%s: cable not open, or without send/recv functions", __FUNCTION__);
+                }
+                busy_release(&handle->busy, handle->busy_gate);
+            }
+            else {
+                res = ERR_CABLE_BUSY;
+                hpcables_error("%s: cable busy", __FUNCTION__);
+            }
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpcables_error("%s: config is NULL", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_faults_stop(cable_handle * handle) {
+    int res;
+    if (handle != NULL) {
+        if (!busy_acquire(&handle->busy, handle->busy_gate, &handle->busy_timeout)) {
+            if (hpcables_faults_active(handle)) {
+                cable_faults * faults = (cable_faults *)handle->fncts;
+                handle->fncts = faults->inner;
+                busy_release(&handle->busy, handle->busy_gate);
+                (hpcables_alloc_funcs.free)(faults);
+                res = ERR_SUCCESS;
+            }
+            else {
+                busy_release(&handle->busy, handle->busy_gate);
+                res = ERR_INVALID_PARAMETER;
+                hpcables_error("%s: fault injection isn't the outermost wrapper", __FUNCTION__);
+            }
+        }
+        else {
+            res = ERR_CABLE_BUSY;
+            hpcables_error("%s: cable busy", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_faults_get_stats(cable_handle * handle, cable_faults_stats * out_stats) {
+    int res;
+    if (handle != NULL) {
+        if (out_stats != NULL) {
+            if (hpcables_faults_active(handle)) {
+                *out_stats = ((cable_faults *)handle->fncts)->stats;
+                res = ERR_SUCCESS;
+            }
+            else {
+                res = ERR_INVALID_PARAMETER;
+                hpcables_error("%s: fault injection isn't the outermost wrapper", __FUNCTION__);
+            }
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpcables_error("%s: out_stats is NULL", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
@@ -42,7 +42,6 @@ static int cable_nul_open(cable_handle * handle) {
     handle->fncts = NULL;
     handle->read_timeout = 0;
     handle->open = 0;
-    handle->busy = 0;
     return 0;
 }
 
@@ -60,7 +59,13 @@ static int cable_nul_send(cable_handle * handle, uint8_t * data, uint32_t len) {
     return 0;
 }
 
-static int cable_nul_recv(cable_handle * handle, uint8_t ** data, uint32_t * len) {
+static int cable_nul_recv(cable_handle * handle, uint8_t * data, uint32_t * len) {
+    // Nothing ever comes in: an empty report, as after a read timeout.
+    *len = 0;
+    return 0;
+}
+
+static int cable_nul_send_many(cable_handle * handle, cable_report * reports, uint32_t count) {
     return 0;
 }
 
@@ -74,5 +79,8 @@ const cable_fncts cable_nul_fncts =
     &cable_nul_close,
     &cable_nul_set_read_timeout,
     &cable_nul_send,
-    &cable_nul_recv
+    &cable_nul_recv,
+    &cable_nul_send_many,
+    NULL,
+    NULL
 };
@@ -29,17 +29,187 @@
 # include <config.h>
 #endif
 
+#include <errno.h>
 #include <inttypes.h>
+#include <string.h>
+#include <wchar.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <hidapi.h>
 
 #include <hplibs.h>
 #include <hpcalcs.h>
+#include "internal.h"
 #include "logging.h"
 #include "error.h"
+#include "utils.h"
+
+// Number of reports buffered by the reader thread, must be a power of 2. 256 reports are 16 KB, i.e. about a quarter of a second of traffic.
+#define PRIME_HID_RING_SIZE (256)
+// Timeout of the reads performed by the reader thread, i.e. how quickly it notices that it should stop, in ms.
+#define PRIME_HID_READER_POLL_MS (100)
+
+typedef struct {
+    uint32_t size;
+    uint8_t data[PRIME_RAW_HID_DATA_SIZE];
+} prime_hid_report;
+
+// State of an open Prime HID cable, pointed to by cable_handle.handle.
+typedef struct {
+    hid_device * device;
+    // Optional reader thread, feeding a single-producer / single-consumer ring of reports.
+    // head is only written by the reader thread, tail only by the consumer. The mutex and condition variables are only used for sleeping on an empty or full ring.
+    prime_hid_report * ring;
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    uint32_t head;
+    uint32_t tail;
+    int consumer_waiting;
+    int producer_waiting;
+    int stop;
+    int reader_error;
+} prime_hid_state;
 
 extern const cable_fncts cable_prime_hid_fncts;
 
+// Wakes up the other side of the ring, if it is sleeping. Pairs with the waiting flag being set before the ring is checked again.
+static void prime_hid_wake(prime_hid_state * state, int * waiting, pthread_cond_t * cond) {
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&state->lock);
+        pthread_cond_signal(cond);
+        pthread_mutex_unlock(&state->lock);
+    }
+}
+
+static void * prime_hid_reader(void * arg) {
+    prime_hid_state * state = (prime_hid_state *)arg;
+    for (;;) {
+        uint32_t head = state->head;
+        prime_hid_report * report;
+        int res;
+
+        if (__atomic_load_n(&state->stop, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+        if (head - __atomic_load_n(&state->tail, __ATOMIC_ACQUIRE) == PRIME_HID_RING_SIZE) {
+            // Ring full: stop draining the device until the consumer catches up.
+            pthread_mutex_lock(&state->lock);
+            __atomic_store_n(&state->producer_waiting, 1, __ATOMIC_SEQ_CST);
+            while (   head - __atomic_load_n(&state->tail, __ATOMIC_SEQ_CST) == PRIME_HID_RING_SIZE
+                   && !__atomic_load_n(&state->stop, __ATOMIC_SEQ_CST)) {
+                pthread_cond_wait(&state->not_full, &state->lock);
+            }
+            __atomic_store_n(&state->producer_waiting, 0, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&state->lock);
+            continue;
+        }
+
+        report = &state->ring[head & (PRIME_HID_RING_SIZE - 1)];
+        res = hid_read_timeout(state->device, report->data, sizeof(report->data), PRIME_HID_READER_POLL_MS);
+        if (res > 0) {
+            report->size = (uint32_t)res;
+            __atomic_store_n(&state->head, head + 1, __ATOMIC_SEQ_CST);
+            prime_hid_wake(state, &state->consumer_waiting, &state->not_empty);
+        }
+        else if (res < 0) {
+            // Reported by the consumer once it has drained the ring.
+            __atomic_store_n(&state->reader_error, 1, __ATOMIC_SEQ_CST);
+            prime_hid_wake(state, &state->consumer_waiting, &state->not_empty);
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int prime_hid_reader_start(prime_hid_state * state) {
+    int res = ERR_MALLOC;
+    state->ring = (prime_hid_report *)(hpcables_alloc_funcs.malloc)(PRIME_HID_RING_SIZE * sizeof(*state->ring));
+    if (state->ring != NULL) {
+        pthread_mutex_init(&state->lock, NULL);
+        cond_init_monotonic(&state->not_empty);
+        pthread_cond_init(&state->not_full, NULL);
+        state->head = 0;
+        state->tail = 0;
+        state->consumer_waiting = 0;
+        state->producer_waiting = 0;
+        state->stop = 0;
+        state->reader_error = 0;
+        if (pthread_create(&state->reader, NULL, prime_hid_reader, state) == 0) {
+            res = ERR_SUCCESS;
+        }
+        else {
+            pthread_cond_destroy(&state->not_full);
+            pthread_cond_destroy(&state->not_empty);
+            pthread_mutex_destroy(&state->lock);
+            (hpcables_alloc_funcs.free)(state->ring);
+            state->ring = NULL;
+        }
+    }
+    return res;
+}
+
+static void prime_hid_reader_stop(prime_hid_state * state) {
+    if (state->ring != NULL) {
+        __atomic_store_n(&state->stop, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_lock(&state->lock);
+        pthread_cond_broadcast(&state->not_full);
+        pthread_mutex_unlock(&state->lock);
+        pthread_join(state->reader, NULL);
+        pthread_cond_destroy(&state->not_full);
+        pthread_cond_destroy(&state->not_empty);
+        pthread_mutex_destroy(&state->lock);
+        (hpcables_alloc_funcs.free)(state->ring);
+        state->ring = NULL;
+    }
+}
+
+// Pops a report from the ring, waiting at most read_timeout ms (forever if negative) for one. Like hid_read_timeout, a timeout yields an empty report.
+static int prime_hid_ring_pop(prime_hid_state * state, int read_timeout, uint8_t * data, uint32_t * len) {
+    int res = ERR_SUCCESS;
+    uint32_t tail = state->tail;
+
+    if (__atomic_load_n(&state->head, __ATOMIC_ACQUIRE) == tail) {
+        struct timespec deadline;
+        if (read_timeout >= 0) {
+            cond_deadline(&deadline, monotonic_now_ns() + (uint64_t)read_timeout * 1000000);
+        }
+        pthread_mutex_lock(&state->lock);
+        __atomic_store_n(&state->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+        while (   __atomic_load_n(&state->head, __ATOMIC_SEQ_CST) == tail
+               && !__atomic_load_n(&state->reader_error, __ATOMIC_SEQ_CST)) {
+            if (read_timeout >= 0) {
+                if (pthread_cond_timedwait(&state->not_empty, &state->lock, &deadline) == ETIMEDOUT) {
+                    break;
+                }
+            }
+            else {
+                pthread_cond_wait(&state->not_empty, &state->lock);
+            }
+        }
+        __atomic_store_n(&state->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&state->lock);
+    }
+
+    if (__atomic_load_n(&state->head, __ATOMIC_ACQUIRE) != tail) {
+        prime_hid_report * report = &state->ring[tail & (PRIME_HID_RING_SIZE - 1)];
+        uint32_t size = report->size < *len ? report->size : *len;
+        memcpy(data, report->data, size);
+        *len = size;
+        __atomic_store_n(&state->tail, tail + 1, __ATOMIC_SEQ_CST);
+        prime_hid_wake(state, &state->producer_waiting, &state->not_full);
+    }
+    else if (__atomic_load_n(&state->reader_error, __ATOMIC_SEQ_CST)) {
+        res = ERR_CABLE_READ_ERROR;
+    }
+    else {
+        *len = 0;
+    }
+    return res;
+}
+
 static int cable_prime_hid_probe(cable_handle * handle) {
     int res;
     // In fact, we're not using handle here, but let's nevertheless flag misuse of the API.
@@ -71,34 +241,192 @@ static int cable_prime_hid_probe(cable_handle * handle) {
     return res;
 }
 
+// Maps a character of a string returned by hidapi to the character reported by the enumeration: non-ASCII characters become '?'.
+static char prime_hid_narrow(wchar_t c) {
+    return (c > 0 && c < 0x80) ? (char)c : '?';
+}
+
+// Copies a string returned by hidapi into memory allocated with the library's allocator. Non-ASCII characters become '?'.
+static char * prime_hid_strdup(const wchar_t * wstr, const char * str) {
+    size_t i, len = 0;
+    char * copy;
+    if (wstr != NULL) {
+        len = wcslen(wstr);
+    }
+    else if (str != NULL) {
+        len = strlen(str);
+    }
+    copy = (char *)(hpcables_alloc_funcs.malloc)(len + 1);
+    if (copy != NULL) {
+        for (i = 0; i < len; i++) {
+            if (wstr != NULL) {
+                copy[i] = prime_hid_narrow(wstr[i]);
+            }
+            else {
+                copy[i] = str[i];
+            }
+        }
+        copy[len] = 0;
+    }
+    return copy;
+}
+
+// Appends the Primes with the given PID to the array.
+static int prime_hid_enumerate_pid(unsigned short pid, cable_device_info ** devices, uint32_t * count) {
+    int res = ERR_SUCCESS;
+    struct hid_device_info * infos = hid_enumerate(USB_VID_HP, pid);
+    struct hid_device_info * info;
+    uint32_t found = 0;
+
+    for (info = infos; info != NULL; info = info->next) {
+        found++;
+    }
+    if (found != 0) {
+        cable_device_info * array = (cable_device_info *)(hpcables_alloc_funcs.realloc)(*devices, (*count + found) * sizeof(**devices));
+        if (array != NULL) {
+            *devices = array;
+            for (info = infos; info != NULL; info = info->next) {
+                cable_device_info * device = &array[*count];
+                device->model = CABLE_PRIME_HID;
+                device->vendor_id = info->vendor_id;
+                device->product_id = info->product_id;
+                device->path = prime_hid_strdup(NULL, info->path);
+                device->serial_number = prime_hid_strdup(info->serial_number, NULL);
+                (*count)++;
+                if (device->path == NULL || device->serial_number == NULL) {
+                    res = ERR_MALLOC;
+                    break;
+                }
+            }
+        }
+        else {
+            res = ERR_MALLOC;
+        }
+    }
+    hid_free_enumeration(infos);
+    return res;
+}
+
+static int cable_prime_hid_enumerate(cable_handle * handle, cable_device_info ** devices, uint32_t * count) {
+    int res;
+    // As for probing, we're not using handle here.
+    if (handle != NULL && devices != NULL && count != NULL) {
+        res = prime_hid_enumerate_pid(USB_PID_PRIME1, devices, count);
+        if (res == ERR_SUCCESS) {
+            res = prime_hid_enumerate_pid(USB_PID_PRIME2, devices, count);
+        }
+        if (res != ERR_SUCCESS) {
+            hpcables_enumerate_free(*devices, *count);
+            *devices = NULL;
+            *count = 0;
+            hpcables_error("%s: couldn't allocate memory for device list", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcables_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+// Tells whether the serial number of a device, as returned by hidapi, is the one reported for it by the enumeration.
+static int prime_hid_serial_matches(const wchar_t * wstr, const char * serial) {
+    size_t i;
+    if (wstr == NULL) {
+        return 0;
+    }
+    for (i = 0; wstr[i] != 0 && serial[i] != 0; i++) {
+        if (prime_hid_narrow(wstr[i]) != serial[i]) {
+            return 0;
+        }
+    }
+    return wstr[i] == 0 && serial[i] == 0;
+}
+
+// Opens the Prime with the given PID whose serial number is the given one, as reported by the enumeration.
+static hid_device * prime_hid_open_serial(unsigned short pid, const char * serial) {
+    hid_device * device_handle = NULL;
+    struct hid_device_info * infos = hid_enumerate(USB_VID_HP, pid);
+    struct hid_device_info * info;
+
+    for (info = infos; info != NULL && device_handle == NULL; info = info->next) {
+        if (prime_hid_serial_matches(info->serial_number, serial)) {
+            device_handle = hid_open_path(info->path);
+        }
+    }
+    hid_free_enumeration(infos);
+    return device_handle;
+}
+
+// Opens the device selected by the handle's options, or the first Prime found.
+static hid_device * prime_hid_open_device(cable_handle * handle, unsigned int * pid) {
+    hid_device * device_handle = NULL;
+    if (handle->device_path != NULL) {
+        device_handle = hid_open_path(handle->device_path);
+        *pid = 0;
+    }
+    else if (handle->device_serial != NULL) {
+        // Matched the way hpcables_cable_enumerate reports serial numbers, so that any of them can be opened again.
+        device_handle = prime_hid_open_serial(USB_PID_PRIME1, handle->device_serial);
+        *pid = USB_PID_PRIME1;
+        if (device_handle == NULL) {
+            device_handle = prime_hid_open_serial(USB_PID_PRIME2, handle->device_serial);
+            *pid = USB_PID_PRIME2;
+        }
+    }
+    else {
+        device_handle = hid_open(USB_VID_HP, USB_PID_PRIME1, NULL);
+        *pid = USB_PID_PRIME1;
+        if (device_handle == NULL) {
+            device_handle = hid_open(USB_VID_HP, USB_PID_PRIME2, NULL);
+            *pid = USB_PID_PRIME2;
+        }
+    }
+    return device_handle;
+}
+
 static int cable_prime_hid_open(cable_handle * handle) {
     int res;
     if (handle != NULL) {
-        hid_device * device_handle = hid_open(USB_VID_HP, USB_PID_PRIME1, NULL);
-        unsigned int pid = USB_PID_PRIME1;
+        prime_hid_state * state;
+        unsigned int pid;
+        hid_device * device_handle = prime_hid_open_device(handle, &pid);
         if (device_handle) {
-device_handle_ok:
-            handle->model = CABLE_PRIME_HID;
-            handle->handle = (void *)device_handle;
-            handle->fncts = &cable_prime_hid_fncts;
-            // Especially screenshots can take a while before beginning to send data.
-            handle->read_timeout = 8000;
-            handle->open = 1;
-            handle->busy = 0;
-            res = ERR_SUCCESS;
-            hpcables_info("%s: cable open succeeded, PID=%04X", __FUNCTION__, pid);
-        }
-        else {
-            device_handle = hid_open(USB_VID_HP, USB_PID_PRIME2, NULL);
-            pid = USB_PID_PRIME2;
-            if (device_handle) {
-                goto device_handle_ok;
+            state = (prime_hid_state *)(hpcables_alloc_funcs.calloc)(1, sizeof(*state));
+            if (state != NULL) {
+                state->device = device_handle;
+                if (handle->read_thread) {
+                    if (prime_hid_reader_start(state) == ERR_SUCCESS) {
+                        hpcables_info("%s: reader thread started", __FUNCTION__);
+                    }
+                    else {
+                        hpcables_warning("%s: couldn't start reader thread, reading synchronously", __FUNCTION__);
+                    }
+                }
+                handle->model = CABLE_PRIME_HID;
+                handle->handle = (void *)state;
+                handle->fncts = &cable_prime_hid_fncts;
+                // Especially screenshots can take a while before beginning to send data.
+                handle->read_timeout = 8000;
+                handle->open = 1;
+                res = ERR_SUCCESS;
+                if (handle->device_path != NULL) {
+                    hpcables_info("%s: cable open succeeded, path=%s", __FUNCTION__, handle->device_path);
+                }
+                else {
+                    hpcables_info("%s: cable open succeeded, PID=%04X", __FUNCTION__, pid);
+                }
             }
             else {
-                res = ERR_CABLE_NOT_OPEN;
-                hpcables_error("%s: cable open failed", __FUNCTION__);
+                hid_close(device_handle);
+                res = ERR_MALLOC;
+                hpcables_error("%s: couldn't allocate cable state", __FUNCTION__);
             }
         }
+        else {
+            res = ERR_CABLE_NOT_OPEN;
+            hpcables_error("%s: cable open failed", __FUNCTION__);
+        }
     }
     else {
         res = ERR_INVALID_HANDLE;
@@ -110,10 +438,12 @@ device_handle_ok:
 static int cable_prime_hid_close(cable_handle * handle) {
     int res;
     if (handle != NULL) {
-        hid_device * device_handle = (hid_device *)handle->handle;
-        if (device_handle != NULL) {
+        prime_hid_state * state = (prime_hid_state *)handle->handle;
+        if (state != NULL) {
             if (handle->open) {
-                hid_close(device_handle);
+                prime_hid_reader_stop(state);
+                hid_close(state->device);
+                (hpcables_alloc_funcs.free)(state);
                 handle->model = CABLE_NUL;
                 handle->handle = NULL;
                 handle->fncts = NULL;
@@ -152,11 +482,13 @@ static int cable_prime_hid_set_read_timeout(cable_handle * handle, int read_time
 }
 
 
+
 static int cable_prime_hid_send(cable_handle * handle, uint8_t * data, uint32_t len) {
     int res;
     if (handle != NULL && data != NULL) {
-        hid_device * device_handle = (hid_device *)handle->handle;
-        if (device_handle != NULL) {
+        prime_hid_state * state = (prime_hid_state *)handle->handle;
+        if (state != NULL) {
+            hid_device * device_handle = state->device;
             uint32_t bytes_written = 0;
             while (bytes_written < len) {
                 if (handle->open) {
@@ -191,22 +523,71 @@ static int cable_prime_hid_send(cable_handle * handle, uint8_t * data, uint32_t
     return res;
 }
 
-static int cable_prime_hid_recv(cable_handle * handle, uint8_t ** data, uint32_t * len) {
+static int cable_prime_hid_recv(cable_handle * handle, uint8_t * data, uint32_t * len) {
     int res;
-    // Use pre-allocated area pointed to by data.
-    if (handle != NULL && data != NULL && *data != NULL && len != NULL) {
-        hid_device * device_handle = (hid_device *)handle->handle;
-        if (device_handle != NULL) {
+    // Read straight into the caller-owned area pointed to by data.
+    if (handle != NULL && data != NULL && len != NULL) {
+        prime_hid_state * state = (prime_hid_state *)handle->handle;
+        if (state != NULL) {
             if (handle->open) {
-                res = hid_read_timeout(device_handle, *data, PRIME_RAW_HID_DATA_SIZE, handle->read_timeout);
-                if (res >= 0) {
-                    *len = res;
-                    res = ERR_SUCCESS;
-                    hpcables_info("%s: read %" PRIu32 "bytes", __FUNCTION__, *len);
+                if (state->ring != NULL) {
+                    // The reader thread has been draining the device in the background.
+                    res = prime_hid_ring_pop(state, handle->read_timeout, data, len);
+                    if (res == ERR_SUCCESS) {
+                        hpcables_info("%s: read %" PRIu32 "bytes", __FUNCTION__, *len);
+                    }
+                    else {
+                        hpcables_error("%s: read failed", __FUNCTION__);
+                    }
                 }
                 else {
-                    res = ERR_CABLE_READ_ERROR;
-                    hpcables_error("%s: read failed", __FUNCTION__);
+                    res = hid_read_timeout(state->device, data, *len < PRIME_RAW_HID_DATA_SIZE ? *len : PRIME_RAW_HID_DATA_SIZE, handle->read_timeout);
+                    if (res >= 0) {
+                        *len = res;
+                        res = ERR_SUCCESS;
+                        hpcables_info("%s: read %" PRIu32 "bytes", __FUNCTION__, *len);
+                    }
+                    else {
+                        res = ERR_CABLE_READ_ERROR;
+                        hpcables_error("%s: read failed", __FUNCTION__);
+                    }
+                }
+            }
+            else {
+                res = ERR_CABLE_NOT_OPEN;
+                hpcables_error("%s: cable was not open", __FUNCTION__);
+            }
+        }
+        else {
+            res = ERR_INVALID_HANDLE;
+            hpcables_error("%s: device_handle is NULL", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcables_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+static int cable_prime_hid_send_many(cable_handle * handle, cable_report * reports, uint32_t count) {
+    int res;
+    if (handle != NULL && reports != NULL) {
+        prime_hid_state * state = (prime_hid_state *)handle->handle;
+        if (state != NULL) {
+            if (handle->open) {
+                uint32_t i;
+                res = ERR_SUCCESS;
+                for (i = 0; i < count; i++) {
+                    // hid_write sends a whole report (or fails), there's no partial write to resume.
+                    if (hid_write(state->device, reports[i].data, reports[i].size) < 0) {
+                        res = ERR_CABLE_WRITE_ERROR;
+                        hpcables_error("%s: write of report %" PRIu32 "/%" PRIu32 " failed %ls", __FUNCTION__, i, count, hid_error(state->device));
+                        break;
+                    }
+                }
+                if (res == ERR_SUCCESS) {
+                    hpcables_info("%s: wrote %" PRIu32 " reports", __FUNCTION__, count);
                 }
             }
             else {
@@ -236,5 +617,8 @@ const cable_fncts cable_prime_hid_fncts =
     &cable_prime_hid_close,
     &cable_prime_hid_set_read_timeout,
     &cable_prime_hid_send,
-    &cable_prime_hid_recv
+    &cable_prime_hid_recv,
+    &cable_prime_hid_send_many,
+    &cable_prime_hid_enumerate,
+    NULL
 };
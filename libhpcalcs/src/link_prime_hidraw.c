@@ -0,0 +1,499 @@
+/*
+ * libhpcables: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file link_prime_hidraw.c Cables: Prime cable talking to the Linux hidraw driver directly, whose device can be polled from an event loop.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <dirent.h>
+#endif
+
+#include <hplibs.h>
+#include <hpcalcs.h>
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+
+#ifdef __linux__
+
+// The hidraw nodes are listed there; the uevent file of their HID device holds the USB IDs and the serial number.
+#define PRIME_HIDRAW_SYSFS "/sys/class/hidraw"
+// Longest wait (in ms) for the device to take a report; the read timeout, often 0 for event loops, isn't fit for writes.
+#define PRIME_HIDRAW_WRITE_TIMEOUT_MS (2000)
+
+// State of an open Prime hidraw cable, pointed to by cable_handle.handle.
+// The device is opened in non-blocking mode: waiting for data is left to poll(), called either by recv or by the caller's event loop.
+typedef struct {
+    int fd;
+} prime_hidraw_state;
+
+// Identity of a hidraw node, read from sysfs without opening the device.
+typedef struct {
+    unsigned int vendor_id;
+    unsigned int product_id;
+    char serial[128];
+} prime_hidraw_ids;
+
+extern const cable_fncts cable_prime_hidraw_fncts;
+
+// Copies a string into memory allocated with the library's allocator.
+static char * prime_hidraw_strdup(const char * str) {
+    size_t len = strlen(str);
+    char * copy = (char *)(hpcables_alloc_funcs.malloc)(len + 1);
+    if (copy != NULL) {
+        memcpy(copy, str, len + 1);
+    }
+    return copy;
+}
+
+// Reads the identity of a hidraw node from lines such as "HID_ID=0003:000003F0:00000441" and "HID_UNIQ=<serial>".
+// Returns nonzero if the node is a Prime.
+static int prime_hidraw_identify(const char * name, prime_hidraw_ids * ids) {
+    char path[256];
+    char line[256];
+    unsigned int bus;
+    FILE * f;
+
+    memset(ids, 0, sizeof(*ids));
+    snprintf(path, sizeof(path), PRIME_HIDRAW_SYSFS "/%s/device/uevent", name);
+    f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (!strncmp(line, "HID_ID=", 7)) {
+            if (sscanf(line + 7, "%x:%x:%x", &bus, &ids->vendor_id, &ids->product_id) != 3) {
+                ids->vendor_id = ids->product_id = 0;
+            }
+        }
+        else if (!strncmp(line, "HID_UNIQ=", 9)) {
+            size_t i;
+            // As with the HID cable, non-ASCII characters become '?'.
+            for (i = 0; line[9 + i] != 0 && i + 1 < sizeof(ids->serial); i++) {
+                ids->serial[i] = ((unsigned char)line[9 + i] < 0x80) ? line[9 + i] : '?';
+            }
+            ids->serial[i] = 0;
+        }
+    }
+    fclose(f);
+    return ids->vendor_id == USB_VID_HP && (ids->product_id == USB_PID_PRIME1 || ids->product_id == USB_PID_PRIME2);
+}
+
+// Lists the Primes attached through hidraw. If devices is NULL, they are only counted.
+static int prime_hidraw_list(cable_device_info ** devices, uint32_t * count) {
+    int res = ERR_SUCCESS;
+    DIR * dir = opendir(PRIME_HIDRAW_SYSFS);
+    if (dir != NULL) {
+        struct dirent * entry;
+        while ((entry = readdir(dir)) != NULL) {
+            prime_hidraw_ids ids;
+            if (entry->d_name[0] == '.' || !prime_hidraw_identify(entry->d_name, &ids)) {
+                continue;
+            }
+            if (devices != NULL) {
+                char path[300];
+                cable_device_info * device;
+                cable_device_info * array = (cable_device_info *)(hpcables_alloc_funcs.realloc)(*devices, (*count + 1) * sizeof(**devices));
+                if (array == NULL) {
+                    res = ERR_MALLOC;
+                    break;
+                }
+                *devices = array;
+                device = &array[*count];
+                snprintf(path, sizeof(path), "/dev/%s", entry->d_name);
+                device->model = CABLE_PRIME_HIDRAW;
+                device->vendor_id = (uint16_t)ids.vendor_id;
+                device->product_id = (uint16_t)ids.product_id;
+                device->path = prime_hidraw_strdup(path);
+                device->serial_number = prime_hidraw_strdup(ids.serial);
+                (*count)++;
+                if (device->path == NULL || device->serial_number == NULL) {
+                    res = ERR_MALLOC;
+                    break;
+                }
+            }
+            else {
+                (*count)++;
+            }
+        }
+        closedir(dir);
+    }
+    return res;
+}
+
+// Opens the device selected by the handle's options, or the first Prime found. Returns -1 upon failure.
+static int prime_hidraw_open_device(cable_handle * handle) {
+    int fd = -1;
+    if (handle->device_path != NULL) {
+        fd = open(handle->device_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    }
+    else {
+        DIR * dir = opendir(PRIME_HIDRAW_SYSFS);
+        if (dir != NULL) {
+            struct dirent * entry;
+            while (fd < 0 && (entry = readdir(dir)) != NULL) {
+                prime_hidraw_ids ids;
+                char path[300];
+                if (entry->d_name[0] == '.' || !prime_hidraw_identify(entry->d_name, &ids)) {
+                    continue;
+                }
+                if (handle->device_serial != NULL && strcmp(handle->device_serial, ids.serial)) {
+                    continue;
+                }
+                snprintf(path, sizeof(path), "/dev/%s", entry->d_name);
+                fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+                if (fd < 0) {
+                    hpcables_warning("%s: cannot open %s: %s", __FUNCTION__, path, strerror(errno));
+                }
+            }
+            closedir(dir);
+        }
+    }
+    return fd;
+}
+
+// Writes a whole report. As with hidapi, the first byte is the report ID, 0x00 for the Prime.
+static int prime_hidraw_write(prime_hidraw_state * state, const uint8_t * data, uint32_t len) {
+    for (;;) {
+        ssize_t written = write(state->fd, data, len);
+        if (written >= 0) {
+            // hidraw sends a whole report (or fails), there's no partial write to resume.
+            return ERR_SUCCESS;
+        }
+        if (errno == EAGAIN) {
+            struct pollfd pfd;
+            int ready;
+            pfd.fd = state->fd;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            ready = poll(&pfd, 1, PRIME_HIDRAW_WRITE_TIMEOUT_MS);
+            if (ready == 0) {
+                hpcables_error("%s: write timed out", __FUNCTION__);
+                return ERR_CABLE_WRITE_ERROR;
+            }
+            else if (ready < 0 && errno != EINTR) {
+                hpcables_error("%s: poll failed: %s", __FUNCTION__, strerror(errno));
+                return ERR_CABLE_WRITE_ERROR;
+            }
+        }
+        else if (errno != EINTR) {
+            hpcables_error("%s: write failed: %s", __FUNCTION__, strerror(errno));
+            return ERR_CABLE_WRITE_ERROR;
+        }
+    }
+}
+
+static int cable_prime_hidraw_probe(cable_handle * handle) {
+    int res;
+    // As with the HID cable, handle isn't used here.
+    if (handle != NULL) {
+        uint32_t count = 0;
+        prime_hidraw_list(NULL, &count);
+        if (count != 0) {
+            res = ERR_SUCCESS;
+            hpcables_info("%s: cable probe succeeded, %" PRIu32 " devices", __FUNCTION__, count);
+        }
+        else {
+            res = ERR_CABLE_PROBE_FAILED;
+            hpcables_error("%s: cable probe failed", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+static int cable_prime_hidraw_enumerate(cable_handle * handle, cable_device_info ** devices, uint32_t * count) {
+    int res;
+    if (handle != NULL && devices != NULL && count != NULL) {
+        res = prime_hidraw_list(devices, count);
+        if (res != ERR_SUCCESS) {
+            hpcables_enumerate_free(*devices, *count);
+            *devices = NULL;
+            *count = 0;
+            hpcables_error("%s: couldn't allocate memory for device list", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcables_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+static int cable_prime_hidraw_open(cable_handle * handle) {
+    int res;
+    if (handle != NULL) {
+        int fd = prime_hidraw_open_device(handle);
+        if (fd >= 0) {
+            prime_hidraw_state * state = (prime_hidraw_state *)(hpcables_alloc_funcs.calloc)(1, sizeof(*state));
+            if (state != NULL) {
+                state->fd = fd;
+                handle->model = CABLE_PRIME_HIDRAW;
+                handle->handle = (void *)state;
+                handle->fncts = &cable_prime_hidraw_fncts;
+                // Same default as the HID cable; event loops set it to 0 and wait for the descriptor instead.
+                handle->read_timeout = 8000;
+                handle->open = 1;
+                res = ERR_SUCCESS;
+                hpcables_info("%s: cable open succeeded, fd=%d", __FUNCTION__, fd);
+            }
+            else {
+                close(fd);
+                res = ERR_MALLOC;
+                hpcables_error("%s: couldn't allocate cable state", __FUNCTION__);
+            }
+        }
+        else {
+            res = ERR_CABLE_NOT_OPEN;
+            hpcables_error("%s: cable open failed", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+static int cable_prime_hidraw_close(cable_handle * handle) {
+    int res;
+    if (handle != NULL) {
+        prime_hidraw_state * state = (prime_hidraw_state *)handle->handle;
+        if (state != NULL && handle->open) {
+            close(state->fd);
+            (hpcables_alloc_funcs.free)(state);
+            handle->model = CABLE_NUL;
+            handle->handle = NULL;
+            handle->fncts = NULL;
+            handle->open = 0;
+            res = ERR_SUCCESS;
+            hpcables_info("%s: cable close succeeded", __FUNCTION__);
+        }
+        else {
+            res = ERR_CABLE_NOT_OPEN;
+            hpcables_error("%s: cable was not open", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+static int cable_prime_hidraw_set_read_timeout(cable_handle * handle, int read_timeout) {
+    int res;
+    if (handle != NULL) {
+        res = ERR_SUCCESS;
+        handle->read_timeout = read_timeout;
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+static int cable_prime_hidraw_send(cable_handle * handle, uint8_t * data, uint32_t len) {
+    int res;
+    if (handle != NULL && data != NULL) {
+        prime_hidraw_state * state = (prime_hidraw_state *)handle->handle;
+        if (state != NULL && handle->open) {
+            res = prime_hidraw_write(state, data, len);
+            if (res == ERR_SUCCESS) {
+                hpcables_info("%s: wrote %" PRIu32 " bytes", __FUNCTION__, len);
+            }
+        }
+        else {
+            res = ERR_CABLE_NOT_OPEN;
+            hpcables_error("%s: cable was not open", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcables_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+static int cable_prime_hidraw_recv(cable_handle * handle, uint8_t * data, uint32_t * len) {
+    int res;
+    if (handle != NULL && data != NULL && len != NULL) {
+        prime_hidraw_state * state = (prime_hidraw_state *)handle->handle;
+        if (state != NULL && handle->open) {
+            struct pollfd pfd;
+            int ready;
+            pfd.fd = state->fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            // Like hid_read_timeout: wait forever if the timeout is negative, not at all if it is 0.
+            do {
+                ready = poll(&pfd, 1, handle->read_timeout);
+            } while (ready < 0 && errno == EINTR);
+            if (ready > 0) {
+                ssize_t got = read(state->fd, data, *len < PRIME_RAW_HID_DATA_SIZE ? *len : PRIME_RAW_HID_DATA_SIZE);
+                if (got >= 0) {
+                    *len = (uint32_t)got;
+                    res = ERR_SUCCESS;
+                    hpcables_info("%s: read %" PRIu32 " bytes", __FUNCTION__, *len);
+                }
+                else if (errno == EAGAIN || errno == EINTR) {
+                    *len = 0;
+                    res = ERR_SUCCESS;
+                }
+                else {
+                    res = ERR_CABLE_READ_ERROR;
+                    hpcables_error("%s: read failed: %s", __FUNCTION__, strerror(errno));
+                }
+            }
+            else if (ready == 0) {
+                // Like a read timeout of hidapi, yields an empty report.
+                *len = 0;
+                res = ERR_SUCCESS;
+            }
+            else {
+                res = ERR_CABLE_READ_ERROR;
+                hpcables_error("%s: poll failed: %s", __FUNCTION__, strerror(errno));
+            }
+        }
+        else {
+            res = ERR_CABLE_NOT_OPEN;
+            hpcables_error("%s: cable was not open", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcables_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+static int cable_prime_hidraw_send_many(cable_handle * handle, cable_report * reports, uint32_t count) {
+    int res;
+    if (handle != NULL && reports != NULL) {
+        prime_hidraw_state * state = (prime_hidraw_state *)handle->handle;
+        if (state != NULL && handle->open) {
+            uint32_t i;
+            res = ERR_SUCCESS;
+            for (i = 0; i < count; i++) {
+                res = prime_hidraw_write(state, reports[i].data, reports[i].size);
+                if (res != ERR_SUCCESS) {
+                    hpcables_error("%s: write of report %" PRIu32 "/%" PRIu32 " failed", __FUNCTION__, i, count);
+                    break;
+                }
+            }
+            if (res == ERR_SUCCESS) {
+                hpcables_info("%s: wrote %" PRIu32 " reports", __FUNCTION__, count);
+            }
+        }
+        else {
+            res = ERR_CABLE_NOT_OPEN;
+            hpcables_error("%s: cable was not open", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcables_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+static int cable_prime_hidraw_get_fd(cable_handle * handle, int * out_fd) {
+    int res;
+    if (handle != NULL && out_fd != NULL) {
+        prime_hidraw_state * state = (prime_hidraw_state *)handle->handle;
+        if (state != NULL && handle->open) {
+            *out_fd = state->fd;
+            res = ERR_SUCCESS;
+        }
+        else {
+            res = ERR_CABLE_NOT_OPEN;
+            hpcables_error("%s: cable was not open", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcables_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+const cable_fncts cable_prime_hidraw_fncts =
+{
+    CABLE_PRIME_HIDRAW,
+    "Prime hidraw cable",
+    "Prime cable using the Linux hidraw driver, pollable from an event loop",
+    &cable_prime_hidraw_probe,
+    &cable_prime_hidraw_open,
+    &cable_prime_hidraw_close,
+    &cable_prime_hidraw_set_read_timeout,
+    &cable_prime_hidraw_send,
+    &cable_prime_hidraw_recv,
+    &cable_prime_hidraw_send_many,
+    &cable_prime_hidraw_enumerate,
+    &cable_prime_hidraw_get_fd
+};
+
+#else
+
+// hidraw is specific to Linux; elsewhere, the HID cable is the way to talk to a Prime.
+
+static int cable_prime_hidraw_probe(cable_handle * handle) {
+    return ERR_CABLE_PROBE_FAILED;
+}
+
+static int cable_prime_hidraw_open(cable_handle * handle) {
+    hpcables_error("%s: not supported on this platform", __FUNCTION__);
+    return ERR_CABLE_NOT_OPEN;
+}
+
+const cable_fncts cable_prime_hidraw_fncts =
+{
+    CABLE_PRIME_HIDRAW,
+    "Prime hidraw cable",
+    "Prime cable using the Linux hidraw driver, pollable from an event loop",
+    &cable_prime_hidraw_probe,
+    &cable_prime_hidraw_open,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+#endif
@@ -0,0 +1,1030 @@
+/*
+ * libhpcables: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file link_prime_sim.c Cables: simulated Prime, for exercising and benchmarking the protocol stack without a calculator.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <hplibs.h>
+#include <hpcalcs.h>
+#include "prime_cmd.h"
+#include "prime_sim.h"
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+#include "utils.h"
+#include "crc16.h"
+
+// Image returned for screenshots until hpcables_prime_sim_set_screen is called: 320x240, 16 bits per pixel.
+#define PRIME_SIM_SCREEN_SIZE (320 * 240 * 2)
+// Screenshot formats for which an image can be set separately, from PRIME_SIM_SCREEN_FORMAT_FIRST on.
+#define PRIME_SIM_SCREEN_FORMAT_FIRST (8)
+#define PRIME_SIM_SCREEN_FORMATS (4)
+// Keepalive reports the simulated calculator queues up at most while the computer isn't reading.
+#define PRIME_SIM_KEEPALIVE_BACKLOG (64)
+
+// State of an open simulated Prime cable, pointed to by cable_handle.handle.
+// The lock makes it possible to use the cable from one thread, e.g. a keepalive consumer, while another one calls hpcables_prime_sim_*.
+typedef struct {
+    pthread_mutex_t lock;
+    // Timing.
+    uint32_t latency_us;
+    uint32_t bytes_per_second;
+    int wait;
+    // Computer -> calculator: virtual packet being reassembled.
+    uint8_t * in;
+    uint32_t in_size;
+    uint32_t in_capacity;
+    uint32_t in_expected;
+    uint8_t next_pkt_id;
+    int protocol_version;
+    // New protocol support.
+    int max_protocol_version;
+    uint32_t keepalive_us;
+    uint64_t keepalive_last_ns;
+    uint32_t keepalive_pending;
+    // Calculator -> computer: queued reports, PRIME_RAW_HID_DATA_SIZE bytes each.
+    uint8_t * out;
+    uint32_t out_count;
+    uint32_t out_pos;
+    uint32_t out_capacity;
+    // Pipe returned by cable_prime_sim_get_fd, created upon the first call. It holds a byte while reports are queued.
+    int notify[2];
+    int notify_open;
+    int notify_armed;
+    // Simulated calculator.
+    files_var_entry ** vars;
+    uint32_t var_count;
+    uint8_t * screen;
+    uint32_t screen_size;
+    uint8_t * format_screens[PRIME_SIM_SCREEN_FORMATS];
+    uint32_t format_screen_sizes[PRIME_SIM_SCREEN_FORMATS];
+    uint32_t screen_generation;
+    uint8_t * infos;
+    uint32_t infos_size;
+    uint8_t date_time[6];
+    int date_time_set;
+    prime_sim_stats stats;
+} prime_sim_state;
+
+extern const cable_fncts cable_prime_sim_fncts;
+
+static void prime_sim_account(prime_sim_state * state, uint32_t size) {
+    uint64_t us = state->latency_us;
+    if (state->bytes_per_second != 0) {
+        us += ((uint64_t)size * 1000000 + state->bytes_per_second - 1) / state->bytes_per_second;
+    }
+    state->stats.simulated_us += us;
+    if (state->wait && us != 0) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)(us / 1000000);
+        ts.tv_nsec = (long)(us % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+    }
+}
+
+static uint64_t prime_sim_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Returns the number of keepalive reports the calculator has sent in the new protocol mode, and which the computer hasn't read yet.
+static uint32_t prime_sim_keepalives(prime_sim_state * state) {
+    if (state->protocol_version > 0 && state->keepalive_us != 0) {
+        uint64_t now = prime_sim_now_ns();
+        uint64_t interval = (uint64_t)state->keepalive_us * 1000;
+        uint64_t due = (now - state->keepalive_last_ns) / interval;
+        if (due != 0) {
+            state->keepalive_last_ns += due * interval;
+            if (due > PRIME_SIM_KEEPALIVE_BACKLOG - state->keepalive_pending) {
+                due = PRIME_SIM_KEEPALIVE_BACKLOG - state->keepalive_pending;
+            }
+            state->keepalive_pending += (uint32_t)due;
+        }
+    }
+    return state->keepalive_pending;
+}
+
+// Keeps the pipe returned by cable_prime_sim_get_fd readable exactly while reports are queued. Called with the lock held.
+// The keepalive reports of the new protocol mode are generated upon reading, so they don't make the pipe readable.
+static void prime_sim_notify(prime_sim_state * state) {
+#ifndef _WIN32
+    int pending = state->out_pos < state->out_count;
+    if (state->notify_open && pending != state->notify_armed) {
+        uint8_t byte = 0;
+        if (pending) {
+            if (write(state->notify[1], &byte, 1) == 1) {
+                state->notify_armed = 1;
+            }
+        }
+        else if (read(state->notify[0], &byte, 1) == 1) {
+            state->notify_armed = 0;
+        }
+    }
+#endif
+}
+
+static int prime_sim_reserve_reports(prime_sim_state * state, uint32_t count) {
+    if (state->out_count + count > state->out_capacity) {
+        uint32_t new_capacity = state->out_capacity != 0 ? state->out_capacity : 64;
+        uint8_t * new_out;
+        while (new_capacity < state->out_count + count) {
+            new_capacity *= 2;
+        }
+        new_out = (uint8_t *)(hpcables_alloc_funcs.realloc)(state->out, (size_t)new_capacity * PRIME_RAW_HID_DATA_SIZE);
+        if (new_out == NULL) {
+            return ERR_MALLOC;
+        }
+        state->out = new_out;
+        state->out_capacity = new_capacity;
+    }
+    return ERR_SUCCESS;
+}
+
+// Queues a virtual packet for the computer, split into reports the way the calculator does: leading sequence number, then 63 bytes of data,
+// the last report being padded with zeros. Sequence numbers go from 0x00 to 0xFE in the old protocol, from 0x01, then 0x02 to 0xFD in the new one.
+static int prime_sim_queue_data(prime_sim_state * state, const uint8_t * data, uint32_t size) {
+    uint32_t count = (size + PRIME_RAW_HID_DATA_SIZE - 2) / (PRIME_RAW_HID_DATA_SIZE - 1);
+    // While in the new protocol mode, the calculator precedes its replies with a 0xFE keepalive packet, after those not read yet.
+    uint32_t extra = state->protocol_version > 0 ? 1 + prime_sim_keepalives(state) : 0;
+    int res = prime_sim_reserve_reports(state, count + extra);
+    if (res == ERR_SUCCESS) {
+        uint8_t * report = state->out + (size_t)state->out_count * PRIME_RAW_HID_DATA_SIZE;
+        uint8_t seq = state->protocol_version > 0 ? 0x01 : 0x00;
+        uint32_t i;
+        for (i = 0; i < extra; i++) {
+            memset(report, 0, PRIME_RAW_HID_DATA_SIZE);
+            report[0] = 0xFE;
+            report += PRIME_RAW_HID_DATA_SIZE;
+        }
+        state->keepalive_pending = 0;
+        state->stats.keepalives += extra;
+        for (i = 0; i < count; i++) {
+            uint32_t offset = i * (PRIME_RAW_HID_DATA_SIZE - 1);
+            uint32_t chunk = size - offset < PRIME_RAW_HID_DATA_SIZE - 1 ? size - offset : PRIME_RAW_HID_DATA_SIZE - 1;
+            memset(report, 0, PRIME_RAW_HID_DATA_SIZE);
+            report[0] = seq;
+            memcpy(report + 1, data + offset, chunk);
+            report += PRIME_RAW_HID_DATA_SIZE;
+            seq++;
+            if (state->protocol_version > 0 ? seq == 0xFE : seq == 0xFF) {
+                seq = state->protocol_version > 0 ? 0x02 : 0x00;
+            }
+        }
+        state->out_count += count + extra;
+    }
+    return res;
+}
+
+// Queues a reply made of a command byte, 0x01, a big-endian size, then the given header and body.
+static int prime_sim_queue_reply(prime_sim_state * state, uint8_t cmd, const uint8_t * header, uint32_t header_size, const uint8_t * body, uint32_t body_size) {
+    int res;
+    uint32_t size = header_size + body_size;
+    uint8_t * data = (uint8_t *)(hpcables_alloc_funcs.malloc)(size + 6);
+    if (data != NULL) {
+        data[0] = cmd;
+        data[1] = 0x01;
+        data[2] = (uint8_t)((size >> 24) & 0xFF);
+        data[3] = (uint8_t)((size >> 16) & 0xFF);
+        data[4] = (uint8_t)((size >>  8) & 0xFF);
+        data[5] = (uint8_t)((size      ) & 0xFF);
+        if (header_size != 0) {
+            memcpy(data + 6, header, header_size);
+        }
+        if (body_size != 0) {
+            memcpy(data + 6 + header_size, body, body_size);
+        }
+        // Files carry a little-endian CRC at offset 8, covering all but the last 6 bytes.
+        if (cmd == CMD_PRIME_RECV_FILE) {
+            uint16_t crc;
+            data[8] = 0x00;
+            data[9] = 0x00;
+            crc = crc16_block(data, size);
+            data[8] = crc & 0xFF;
+            data[9] = (crc >> 8) & 0xFF;
+        }
+        // Screenshots carry a big-endian CRC at offset 6, covering everything after the first 6 bytes.
+        else if (cmd == CMD_PRIME_RECV_SCREEN) {
+            uint16_t crc;
+            data[6] = 0x00;
+            data[7] = 0x00;
+            crc = crc16_block(data + 6, size);
+            data[6] = (crc >> 8) & 0xFF;
+            data[7] = crc & 0xFF;
+        }
+        res = prime_sim_queue_data(state, data, size + 6);
+        (hpcables_alloc_funcs.free)(data);
+    }
+    else {
+        res = ERR_MALLOC;
+    }
+    return res;
+}
+
+static int prime_sim_queue_var(prime_sim_state * state, files_var_entry * entry) {
+    uint8_t header[4];
+    uint32_t namelen = char16_strlen(entry->name) * 2;
+    int res;
+    uint8_t * body = (uint8_t *)(hpcables_alloc_funcs.malloc)(namelen + entry->size + 1);
+    if (body != NULL) {
+        header[0] = entry->type;
+        header[1] = (uint8_t)namelen;
+        header[2] = 0x00; // CRC16, filled in by prime_sim_queue_reply.
+        header[3] = 0x00;
+        memcpy(body, entry->name, namelen);
+        if (entry->size != 0) {
+            memcpy(body + namelen, entry->data, entry->size);
+        }
+        res = prime_sim_queue_reply(state, CMD_PRIME_RECV_FILE, header, sizeof(header), body, namelen + entry->size);
+        (hpcables_alloc_funcs.free)(body);
+    }
+    else {
+        res = ERR_MALLOC;
+    }
+    return res;
+}
+
+// Short packet which terminates a backup, and answers requests for unknown files.
+static int prime_sim_queue_end_of_files(prime_sim_state * state) {
+    return prime_sim_queue_reply(state, CMD_PRIME_RECV_BACKUP, NULL, 0, NULL, 0);
+}
+
+static files_var_entry ** prime_sim_find_var(prime_sim_state * state, const uint8_t * name, uint32_t namelen) {
+    uint32_t i;
+    for (i = 0; i < state->var_count; i++) {
+        files_var_entry * entry = state->vars[i];
+        if (char16_strlen(entry->name) * 2 == namelen && !memcmp(entry->name, name, namelen)) {
+            return &state->vars[i];
+        }
+    }
+    return NULL;
+}
+
+static int prime_sim_store_var(prime_sim_state * state, files_var_entry * entry) {
+    files_var_entry ** slot = prime_sim_find_var(state, (const uint8_t *)entry->name, char16_strlen(entry->name) * 2);
+    if (slot != NULL) {
+        hpfiles_ve_delete(*slot);
+        *slot = entry;
+    }
+    else {
+        files_var_entry ** vars = (files_var_entry **)(hpcables_alloc_funcs.realloc)(state->vars, (state->var_count + 1) * sizeof(*vars));
+        if (vars == NULL) {
+            return ERR_MALLOC;
+        }
+        state->vars = vars;
+        state->vars[state->var_count++] = entry;
+    }
+    return ERR_SUCCESS;
+}
+
+// File sent by calc_prime_s_send_file: 4-byte sequence, little-endian size, then CMD_PRIME_RECV_FILE, 0x03, big-endian size,
+// type, name length, little-endian CRC of everything after the first 8 bytes, name and data.
+static void prime_sim_recv_file(prime_sim_state * state, const uint8_t * data, uint32_t size) {
+    if (size >= 18 && data[8] == CMD_PRIME_RECV_FILE && (uint32_t)data[15] + 18 <= size) {
+        uint8_t namelen = data[15];
+        uint16_t embedded_crc = (uint16_t)(data[16] | (data[17] << 8));
+        uint16_t computed_crc;
+        uint8_t * copy = (uint8_t *)(hpcables_alloc_funcs.malloc)(size - 8);
+        if (copy != NULL) {
+            memcpy(copy, data + 8, size - 8);
+            copy[8] = 0x00;
+            copy[9] = 0x00;
+            computed_crc = crc16_block(copy, size - 8);
+            (hpcables_alloc_funcs.free)(copy);
+            if (computed_crc == embedded_crc) {
+                files_var_entry * entry = hpfiles_ve_create_with_data((uint8_t *)data + 18 + namelen, size - 18 - namelen);
+                if (entry != NULL) {
+                    entry->type = data[14];
+                    memset(entry->name, 0, sizeof(entry->name));
+                    memcpy(entry->name, data + 18, namelen);
+                    if (prime_sim_store_var(state, entry) != ERR_SUCCESS) {
+                        hpfiles_ve_delete(entry);
+                        hpcables_error("%s: couldn't store file", __FUNCTION__);
+                    }
+                }
+            }
+            else {
+                state->stats.crc_errors++;
+                hpcables_warning("%s: CRC mismatch, embedded=%04X computed=%04X", __FUNCTION__, embedded_crc, computed_crc);
+            }
+        }
+    }
+    else {
+        state->stats.unknown_commands++;
+        hpcables_warning("%s: malformed file packet", __FUNCTION__);
+    }
+}
+
+// Acts upon a complete virtual packet from the computer.
+static int prime_sim_process(prime_sim_state * state, const uint8_t * data, uint32_t size) {
+    int res = ERR_SUCCESS;
+    state->stats.commands++;
+    if (size >= 9 && data[0] == 0x01) {
+        prime_sim_recv_file(state, data, size);
+        return res;
+    }
+    switch (data[0]) {
+        case CMD_PRIME_CHECK_READY: {
+            static const uint8_t ready = CMD_PRIME_CHECK_READY;
+            res = prime_sim_queue_data(state, &ready, 1);
+            break;
+        }
+        case CMD_PRIME_GET_INFOS:
+            res = prime_sim_queue_reply(state, CMD_PRIME_GET_INFOS, NULL, 0, state->infos, state->infos_size);
+            break;
+        case CMD_PRIME_SET_DATE_TIME:
+            if (size >= 16) {
+                memcpy(state->date_time, data + 10, sizeof(state->date_time));
+                state->date_time_set = 1;
+            }
+            break;
+        case CMD_PRIME_RECV_SCREEN: {
+            // CRC, format, then a 0xFFFFFFFF marker.
+            uint8_t header[7] = { 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF };
+            uint8_t format = size >= 2 ? data[1] : 0;
+            uint32_t index = (uint32_t)format - PRIME_SIM_SCREEN_FORMAT_FIRST;
+            header[2] = format;
+            if (index < PRIME_SIM_SCREEN_FORMATS) {
+                if (state->format_screens[index] != NULL) {
+                    res = prime_sim_queue_reply(state, CMD_PRIME_RECV_SCREEN, header, sizeof(header), state->format_screens[index], state->format_screen_sizes[index]);
+                }
+                else {
+                    res = prime_sim_queue_reply(state, CMD_PRIME_RECV_SCREEN, header, sizeof(header), state->screen, state->screen_size);
+                }
+            }
+            else {
+                // Other formats, e.g. the one polled by the connectivity kit: a PNG signature, then the number of changes of the screen.
+                uint8_t poll[12] = { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A };
+                poll[8] = (uint8_t)(state->screen_generation >> 24);
+                poll[9] = (uint8_t)(state->screen_generation >> 16);
+                poll[10] = (uint8_t)(state->screen_generation >> 8);
+                poll[11] = (uint8_t)(state->screen_generation);
+                res = prime_sim_queue_reply(state, CMD_PRIME_RECV_SCREEN, header, sizeof(header), poll, sizeof(poll));
+            }
+            break;
+        }
+        case CMD_PRIME_REQ_FILE:
+            if (size >= 10 && (uint32_t)data[7] + 10 <= size) {
+                files_var_entry ** slot = prime_sim_find_var(state, data + 10, data[7]);
+                res = slot != NULL ? prime_sim_queue_var(state, *slot) : prime_sim_queue_end_of_files(state);
+            }
+            break;
+        case CMD_PRIME_RECV_BACKUP: {
+            uint32_t i;
+            for (i = 0; i < state->var_count && res == ERR_SUCCESS; i++) {
+                res = prime_sim_queue_var(state, state->vars[i]);
+            }
+            if (res == ERR_SUCCESS) {
+                res = prime_sim_queue_end_of_files(state);
+            }
+            break;
+        }
+        case CMD_PRIME_SEND_KEY:
+            if (size >= 6) {
+                state->stats.keys += size - 6;
+            }
+            break;
+        case CMD_PRIME_SEND_CHAT:
+            state->stats.chats++;
+            break;
+        default:
+            state->stats.unknown_commands++;
+            hpcables_warning("%s: unknown command %02X", __FUNCTION__, data[0]);
+            break;
+    }
+    return res;
+}
+
+// Determines the size of a virtual packet from its first report, see the calc_prime_s_* functions.
+static uint32_t prime_sim_expected_size(const uint8_t * data, uint32_t size) {
+    if (size >= 8 && data[0] == 0x01) {
+        return ((((uint32_t)data[4]) | ((uint32_t)data[5] << 8) | ((uint32_t)data[6] << 16) | ((uint32_t)data[7] << 24))) + 8;
+    }
+    if (size >= 6 && data[1] == 0x01
+        && (data[0] == CMD_PRIME_SET_DATE_TIME || data[0] == CMD_PRIME_REQ_FILE || data[0] == CMD_PRIME_SEND_KEY || data[0] == CMD_PRIME_SEND_CHAT)) {
+        return ((((uint32_t)data[2] << 24) | ((uint32_t)data[3] << 16) | ((uint32_t)data[4] << 8) | ((uint32_t)data[5]))) + 6;
+    }
+    // Single-report command.
+    return size;
+}
+
+// Consumes one report written by the computer: report ID, packet ID, then data.
+static int prime_sim_feed(prime_sim_state * state, const uint8_t * report, uint32_t len) {
+    int res = ERR_SUCCESS;
+    const uint8_t * data;
+    uint32_t size;
+    uint8_t pkt_id;
+
+    state->stats.reports_in++;
+    state->stats.bytes_in += len;
+    prime_sim_account(state, len);
+    if (len < 3) {
+        return res;
+    }
+    pkt_id = report[1];
+    data = report + 2;
+    size = len - 2;
+
+    if (state->in_expected == 0) {
+        // Switch to the new protocol, see prime_send_new_protocol_init.
+        if (pkt_id == 0xFF && data[0] == CMD_PRIME_SEND_KEY) {
+            if (state->max_protocol_version > 0 && state->protocol_version == 0) {
+                state->protocol_version = 1;
+                state->keepalive_last_ns = prime_sim_now_ns();
+                state->keepalive_pending = 0;
+            }
+            return res;
+        }
+        if (pkt_id == 0x00) {
+            // Commands sent using the old protocol drop the calculator out of the new protocol mode.
+            state->protocol_version = 0;
+        }
+        else if (pkt_id != 0x01 || state->protocol_version == 0) {
+            state->stats.sequence_errors++;
+        }
+        state->in_expected = prime_sim_expected_size(data, size);
+        state->in_size = 0;
+        if (state->in_expected > state->in_capacity) {
+            uint8_t * in = (uint8_t *)(hpcables_alloc_funcs.realloc)(state->in, state->in_expected);
+            if (in == NULL) {
+                state->in_expected = 0;
+                return ERR_MALLOC;
+            }
+            state->in = in;
+            state->in_capacity = state->in_expected;
+        }
+    }
+    else if (pkt_id != state->next_pkt_id) {
+        state->stats.sequence_errors++;
+    }
+
+    state->next_pkt_id = (uint8_t)(pkt_id + 1);
+    if (state->protocol_version > 0) {
+        if (state->next_pkt_id == 0xFE) {
+            state->next_pkt_id = 0x02;
+        }
+    }
+    else if (state->next_pkt_id == 0xFF) {
+        state->next_pkt_id = 0x00;
+    }
+
+    if (size > state->in_expected - state->in_size) {
+        size = state->in_expected - state->in_size;
+    }
+    memcpy(state->in + state->in_size, data, size);
+    state->in_size += size;
+    if (state->in_size == state->in_expected) {
+        state->in_expected = 0;
+        res = prime_sim_process(state, state->in, state->in_size);
+    }
+    return res;
+}
+
+static void prime_sim_free(prime_sim_state * state) {
+    uint32_t i;
+    for (i = 0; i < state->var_count; i++) {
+        hpfiles_ve_delete(state->vars[i]);
+    }
+    (hpcables_alloc_funcs.free)(state->vars);
+    (hpcables_alloc_funcs.free)(state->screen);
+    for (i = 0; i < PRIME_SIM_SCREEN_FORMATS; i++) {
+        (hpcables_alloc_funcs.free)(state->format_screens[i]);
+    }
+    (hpcables_alloc_funcs.free)(state->infos);
+    (hpcables_alloc_funcs.free)(state->out);
+    (hpcables_alloc_funcs.free)(state->in);
+#ifndef _WIN32
+    if (state->notify_open) {
+        close(state->notify[0]);
+        close(state->notify[1]);
+    }
+#endif
+    pthread_mutex_destroy(&state->lock);
+    (hpcables_alloc_funcs.free)(state);
+}
+
+static int cable_prime_sim_probe(cable_handle * handle) {
+    return 0;
+}
+
+static int cable_prime_sim_open(cable_handle * handle) {
+    int res;
+    if (handle != NULL) {
+        prime_sim_state * state = (prime_sim_state *)(hpcables_alloc_funcs.calloc)(1, sizeof(*state));
+        if (state != NULL) {
+            static const char model_name[] = "HP Prime (simulated)";
+            uint32_t i;
+            pthread_mutex_init(&state->lock, NULL);
+            state->max_protocol_version = 1;
+            state->screen_size = PRIME_SIM_SCREEN_SIZE;
+            state->screen = (uint8_t *)(hpcables_alloc_funcs.malloc)(state->screen_size);
+            state->infos_size = sizeof(model_name) * 2;
+            state->infos = (uint8_t *)(hpcables_alloc_funcs.calloc)(state->infos_size, 1);
+            if (state->screen != NULL && state->infos != NULL) {
+                // Deterministic gradient, so that screenshots compress like real ones and can be checked byte by byte.
+                for (i = 0; i < state->screen_size; i++) {
+                    state->screen[i] = (uint8_t)((i / 2) % 320 + (i / 640));
+                }
+                for (i = 0; i < sizeof(model_name); i++) {
+                    state->infos[2 * i] = (uint8_t)model_name[i];
+                }
+                handle->model = CABLE_PRIME_SIM;
+                handle->handle = (void *)state;
+                handle->fncts = &cable_prime_sim_fncts;
+                handle->read_timeout = 0;
+                handle->open = 1;
+                res = ERR_SUCCESS;
+                hpcables_info("%s: cable open succeeded", __FUNCTION__);
+            }
+            else {
+                prime_sim_free(state);
+                res = ERR_MALLOC;
+                hpcables_error("%s: couldn't allocate cable state", __FUNCTION__);
+            }
+        }
+        else {
+            res = ERR_MALLOC;
+            hpcables_error("%s: couldn't allocate cable state", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+static int cable_prime_sim_close(cable_handle * handle) {
+    int res;
+    if (handle != NULL) {
+        prime_sim_state * state = (prime_sim_state *)handle->handle;
+        if (state != NULL && handle->open) {
+            prime_sim_free(state);
+            handle->handle = NULL;
+            handle->open = 0;
+            res = ERR_SUCCESS;
+            hpcables_info("%s: cable close succeeded", __FUNCTION__);
+        }
+        else {
+            res = ERR_CABLE_NOT_OPEN;
+            hpcables_error("%s: cable was not open", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+static int cable_prime_sim_set_read_timeout(cable_handle * handle, int read_timeout) {
+    int res;
+    if (handle != NULL) {
+        res = ERR_SUCCESS;
+        handle->read_timeout = read_timeout;
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+static int cable_prime_sim_send(cable_handle * handle, uint8_t * data, uint32_t len) {
+    int res;
+    if (handle != NULL && data != NULL) {
+        prime_sim_state * state = (prime_sim_state *)handle->handle;
+        if (state != NULL) {
+            pthread_mutex_lock(&state->lock);
+            res = prime_sim_feed(state, data, len);
+            prime_sim_notify(state);
+            pthread_mutex_unlock(&state->lock);
+        }
+        else {
+            res = ERR_CABLE_NOT_OPEN;
+            hpcables_error("%s: cable was not open", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcables_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+static int cable_prime_sim_recv(cable_handle * handle, uint8_t * data, uint32_t * len) {
+    int res;
+    if (handle != NULL && data != NULL && len != NULL) {
+        prime_sim_state * state = (prime_sim_state *)handle->handle;
+        if (state != NULL) {
+            pthread_mutex_lock(&state->lock);
+            if (state->out_pos < state->out_count) {
+                uint32_t size = *len < PRIME_RAW_HID_DATA_SIZE ? *len : PRIME_RAW_HID_DATA_SIZE;
+                memcpy(data, state->out + (size_t)state->out_pos * PRIME_RAW_HID_DATA_SIZE, size);
+                *len = size;
+                state->out_pos++;
+                if (state->out_pos == state->out_count) {
+                    state->out_pos = 0;
+                    state->out_count = 0;
+                }
+                state->stats.reports_out++;
+                state->stats.bytes_out += size;
+                prime_sim_account(state, size);
+            }
+            else if (prime_sim_keepalives(state) != 0) {
+                // Nothing else to send in the new protocol mode.
+                uint32_t size = *len < PRIME_RAW_HID_DATA_SIZE ? *len : PRIME_RAW_HID_DATA_SIZE;
+                memset(data, 0, size);
+                data[0] = 0xFE;
+                *len = size;
+                state->keepalive_pending--;
+                state->stats.keepalives++;
+                state->stats.reports_out++;
+                state->stats.bytes_out += size;
+                prime_sim_account(state, size);
+            }
+            else {
+                // Nothing to send: behave like a read timeout, without waiting.
+                *len = 0;
+            }
+            prime_sim_notify(state);
+            pthread_mutex_unlock(&state->lock);
+            res = ERR_SUCCESS;
+        }
+        else {
+            res = ERR_CABLE_NOT_OPEN;
+            hpcables_error("%s: cable was not open", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcables_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+static int cable_prime_sim_send_many(cable_handle * handle, cable_report * reports, uint32_t count) {
+    int res;
+    if (handle != NULL && reports != NULL) {
+        prime_sim_state * state = (prime_sim_state *)handle->handle;
+        if (state != NULL) {
+            uint32_t i;
+            res = ERR_SUCCESS;
+            pthread_mutex_lock(&state->lock);
+            for (i = 0; i < count && res == ERR_SUCCESS; i++) {
+                res = prime_sim_feed(state, reports[i].data, reports[i].size);
+            }
+            prime_sim_notify(state);
+            pthread_mutex_unlock(&state->lock);
+        }
+        else {
+            res = ERR_CABLE_NOT_OPEN;
+            hpcables_error("%s: cable was not open", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcables_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+static int cable_prime_sim_get_fd(cable_handle * handle, int * out_fd) {
+    int res;
+    if (handle != NULL && out_fd != NULL) {
+        prime_sim_state * state = (prime_sim_state *)handle->handle;
+        if (state != NULL) {
+#ifndef _WIN32
+            pthread_mutex_lock(&state->lock);
+            res = ERR_SUCCESS;
+            if (!state->notify_open) {
+                if (pipe(state->notify) == 0) {
+                    fcntl(state->notify[0], F_SETFD, FD_CLOEXEC);
+                    fcntl(state->notify[1], F_SETFD, FD_CLOEXEC);
+                    state->notify_open = 1;
+                    prime_sim_notify(state);
+                }
+                else {
+                    res = ERR_MALLOC;
+                    hpcables_error("%s: cannot create pipe", __FUNCTION__);
+                }
+            }
+            if (res == ERR_SUCCESS) {
+                *out_fd = state->notify[0];
+            }
+            pthread_mutex_unlock(&state->lock);
+#else
+            res = ERR_CABLE_INVALID_FNCTS;
+            hpcables_error("%s: not supported on this platform", __FUNCTION__);
+#endif
+        }
+        else {
+            res = ERR_CABLE_NOT_OPEN;
+            hpcables_error("%s: cable was not open", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcables_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+const cable_fncts cable_prime_sim_fncts =
+{
+    CABLE_PRIME_SIM,
+    "Simulated Prime",
+    "In-process simulated HP Prime, for tests and benchmarks",
+    &cable_prime_sim_probe,
+    &cable_prime_sim_open,
+    &cable_prime_sim_close,
+    &cable_prime_sim_set_read_timeout,
+    &cable_prime_sim_send,
+    &cable_prime_sim_recv,
+    &cable_prime_sim_send_many,
+    NULL,
+    &cable_prime_sim_get_fd
+};
+
+
+// Returns the state of an open simulated Prime cable, or NULL with an error code.
+static prime_sim_state * prime_sim_get_state(cable_handle * handle, int * res, const char * function) {
+    if (handle == NULL) {
+        *res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", function);
+    }
+    else if (handle->model != CABLE_PRIME_SIM) {
+        *res = ERR_INVALID_MODEL;
+        hpcables_error("%s: not a simulated Prime cable", function);
+    }
+    else if (!handle->open || handle->handle == NULL) {
+        *res = ERR_CABLE_NOT_OPEN;
+        hpcables_error("%s: cable not open", function);
+    }
+    else {
+        *res = ERR_SUCCESS;
+        return (prime_sim_state *)handle->handle;
+    }
+    return NULL;
+}
+
+// Replaces *dst with a copy of data.
+static int prime_sim_set_blob(uint8_t ** dst, uint32_t * dst_size, const uint8_t * data, uint32_t size) {
+    uint8_t * copy = NULL;
+    if (size != 0) {
+        if (data == NULL) {
+            return ERR_INVALID_PARAMETER;
+        }
+        copy = (uint8_t *)(hpcables_alloc_funcs.malloc)(size);
+        if (copy == NULL) {
+            return ERR_MALLOC;
+        }
+        memcpy(copy, data, size);
+    }
+    (hpcables_alloc_funcs.free)(*dst);
+    *dst = copy;
+    *dst_size = size;
+    return ERR_SUCCESS;
+}
+
+HPEXPORT int HPCALL hpcables_prime_sim_set_timing(cable_handle * handle, uint32_t latency_us, uint32_t bytes_per_second, int wait) {
+    int res;
+    prime_sim_state * state = prime_sim_get_state(handle, &res, __FUNCTION__);
+    if (state != NULL) {
+        pthread_mutex_lock(&state->lock);
+        state->latency_us = latency_us;
+        state->bytes_per_second = bytes_per_second;
+        state->wait = wait;
+        pthread_mutex_unlock(&state->lock);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_prime_sim_set_protocol(cable_handle * handle, int max_version, uint32_t keepalive_us) {
+    int res;
+    prime_sim_state * state = prime_sim_get_state(handle, &res, __FUNCTION__);
+    if (state != NULL) {
+        pthread_mutex_lock(&state->lock);
+        state->max_protocol_version = max_version > 0 ? 1 : 0;
+        state->keepalive_us = keepalive_us;
+        state->keepalive_last_ns = prime_sim_now_ns();
+        state->keepalive_pending = 0;
+        pthread_mutex_unlock(&state->lock);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_prime_sim_add_var(cable_handle * handle, files_var_entry * entry) {
+    int res;
+    prime_sim_state * state = prime_sim_get_state(handle, &res, __FUNCTION__);
+    if (state != NULL) {
+        pthread_mutex_lock(&state->lock);
+        if (entry != NULL) {
+            files_var_entry * copy = hpfiles_ve_dup(entry);
+            if (copy != NULL) {
+                res = prime_sim_store_var(state, copy);
+                if (res != ERR_SUCCESS) {
+                    hpfiles_ve_delete(copy);
+                }
+            }
+            else {
+                res = ERR_MALLOC;
+            }
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpcables_error("%s: entry is NULL", __FUNCTION__);
+        }
+        pthread_mutex_unlock(&state->lock);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_prime_sim_get_vars(cable_handle * handle, files_var_entry *** out_vars) {
+    int res;
+    prime_sim_state * state = prime_sim_get_state(handle, &res, __FUNCTION__);
+    if (state != NULL) {
+        pthread_mutex_lock(&state->lock);
+        if (out_vars != NULL) {
+            files_var_entry ** vars = hpfiles_ve_create_array(state->var_count);
+            if (vars != NULL) {
+                uint32_t i;
+                for (i = 0; i < state->var_count; i++) {
+                    vars[i] = hpfiles_ve_dup(state->vars[i]);
+                    if (vars[i] == NULL) {
+                        res = ERR_MALLOC;
+                        break;
+                    }
+                }
+                if (res == ERR_SUCCESS) {
+                    *out_vars = vars;
+                }
+                else {
+                    hpfiles_ve_delete_array(vars);
+                }
+            }
+            else {
+                res = ERR_MALLOC;
+            }
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpcables_error("%s: out_vars is NULL", __FUNCTION__);
+        }
+        pthread_mutex_unlock(&state->lock);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_prime_sim_set_screen(cable_handle * handle, const uint8_t * data, uint32_t size) {
+    int res;
+    prime_sim_state * state = prime_sim_get_state(handle, &res, __FUNCTION__);
+    if (state != NULL) {
+        pthread_mutex_lock(&state->lock);
+        res = prime_sim_set_blob(&state->screen, &state->screen_size, data, size);
+        if (res == ERR_SUCCESS) {
+            uint32_t i;
+            for (i = 0; i < PRIME_SIM_SCREEN_FORMATS; i++) {
+                (hpcables_alloc_funcs.free)(state->format_screens[i]);
+                state->format_screens[i] = NULL;
+                state->format_screen_sizes[i] = 0;
+            }
+            state->screen_generation++;
+        }
+        pthread_mutex_unlock(&state->lock);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_prime_sim_set_screen_format(cable_handle * handle, uint8_t format, const uint8_t * data, uint32_t size) {
+    int res;
+    prime_sim_state * state = prime_sim_get_state(handle, &res, __FUNCTION__);
+    if (state != NULL) {
+        uint32_t index = (uint32_t)format - PRIME_SIM_SCREEN_FORMAT_FIRST;
+        if (index < PRIME_SIM_SCREEN_FORMATS && data != NULL && size != 0) {
+            pthread_mutex_lock(&state->lock);
+            res = prime_sim_set_blob(&state->format_screens[index], &state->format_screen_sizes[index], data, size);
+            if (res == ERR_SUCCESS) {
+                state->screen_generation++;
+            }
+            pthread_mutex_unlock(&state->lock);
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpcables_error("%s: bad format, or no image", __FUNCTION__);
+        }
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_prime_sim_set_infos(cable_handle * handle, const uint8_t * data, uint32_t size) {
+    int res;
+    prime_sim_state * state = prime_sim_get_state(handle, &res, __FUNCTION__);
+    if (state != NULL) {
+        pthread_mutex_lock(&state->lock);
+        res = prime_sim_set_blob(&state->infos, &state->infos_size, data, size);
+        pthread_mutex_unlock(&state->lock);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_prime_sim_queue_chat(cable_handle * handle, const uint16_t * data, uint32_t size) {
+    int res;
+    prime_sim_state * state = prime_sim_get_state(handle, &res, __FUNCTION__);
+    if (state != NULL) {
+        pthread_mutex_lock(&state->lock);
+        if (data != NULL || size == 0) {
+            res = prime_sim_queue_reply(state, CMD_PRIME_RECV_CHAT, NULL, 0, (const uint8_t *)data, size);
+            prime_sim_notify(state);
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpcables_error("%s: data is NULL", __FUNCTION__);
+        }
+        pthread_mutex_unlock(&state->lock);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_prime_sim_get_date_time(cable_handle * handle, struct tm * out_tm) {
+    int res;
+    prime_sim_state * state = prime_sim_get_state(handle, &res, __FUNCTION__);
+    if (state != NULL) {
+        pthread_mutex_lock(&state->lock);
+        if (out_tm != NULL && state->date_time_set) {
+            memset(out_tm, 0, sizeof(*out_tm));
+            out_tm->tm_year = state->date_time[0] + (2000 - 1900);
+            out_tm->tm_mon = state->date_time[1] - 1;
+            out_tm->tm_mday = state->date_time[2];
+            out_tm->tm_hour = state->date_time[3];
+            out_tm->tm_min = state->date_time[4];
+            out_tm->tm_sec = state->date_time[5];
+            out_tm->tm_isdst = -1;
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpcables_error("%s: out_tm is NULL, or date and time were never set", __FUNCTION__);
+        }
+        pthread_mutex_unlock(&state->lock);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_prime_sim_get_stats(cable_handle * handle, prime_sim_stats * out_stats) {
+    int res;
+    prime_sim_state * state = prime_sim_get_state(handle, &res, __FUNCTION__);
+    if (state != NULL) {
+        pthread_mutex_lock(&state->lock);
+        if (out_stats != NULL) {
+            *out_stats = state->stats;
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpcables_error("%s: out_stats is NULL", __FUNCTION__);
+        }
+        pthread_mutex_unlock(&state->lock);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_prime_sim_reset_stats(cable_handle * handle) {
+    int res;
+    prime_sim_state * state = prime_sim_get_state(handle, &res, __FUNCTION__);
+    if (state != NULL) {
+        pthread_mutex_lock(&state->lock);
+        memset(&state->stats, 0, sizeof(state->stats));
+        pthread_mutex_unlock(&state->lock);
+    }
+    return res;
+}
@@ -0,0 +1,408 @@
+/*
+ * libhpcables: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file link_replay.c Cables: replay of a capture file written by the traffic capture wrapper.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <hplibs.h>
+#include <hpcalcs.h>
+#include "cable_capture.h"
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+
+#define REPLAY_RECORD_SIZE(record) (sizeof(cable_capture_record_header) + (((uint64_t)(record)->size + 7) & ~(uint64_t)7))
+
+#ifndef _WIN32
+
+// State of an open replay cable, pointed to by cable_handle.handle.
+// Sent and received reports are matched against the capture through two independent cursors.
+typedef struct {
+    int fd;
+    const uint8_t * map;
+    uint64_t map_size;
+    uint64_t end;
+    uint64_t send_offset;
+    uint64_t recv_offset;
+    uint64_t sends_done; ///< Records passed by the send cursor.
+    uint64_t sends_before_recv; ///< Send records passed by the recv cursor: the recorded report at recv_offset was received after as many sends.
+    uint64_t first_timestamp;
+    struct timespec start;
+    int started;
+    int realtime;
+    cable_replay_stats stats;
+} replay_state;
+
+extern const cable_fncts cable_replay_fncts;
+
+// Returns the next record of the given direction at or after *offset, or NULL at the end of the capture.
+static const cable_capture_record_header * replay_next(const replay_state * state, uint64_t * offset, uint8_t direction, uint64_t * skipped_sends) {
+    while (*offset + sizeof(cable_capture_record_header) <= state->end) {
+        const cable_capture_record_header * record = (const cable_capture_record_header *)(state->map + *offset);
+        if (*offset + REPLAY_RECORD_SIZE(record) > state->end) {
+            break;
+        }
+        if (record->direction == direction) {
+            return record;
+        }
+        if (skipped_sends != NULL && record->direction == PACKET_DIRECTION_SEND) {
+            (*skipped_sends)++;
+        }
+        *offset += REPLAY_RECORD_SIZE(record);
+    }
+    return NULL;
+}
+
+// At recorded timing, waits until the operation of the record would have completed, relative to the first operation.
+static void replay_pace(replay_state * state, const cable_capture_record_header * record) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!state->started) {
+        state->start = now;
+        state->started = 1;
+    }
+    if (state->realtime) {
+        uint64_t target = record->timestamp_ns + record->duration_ns - state->first_timestamp;
+        uint64_t elapsed = (uint64_t)(now.tv_sec - state->start.tv_sec) * 1000000000 + (uint64_t)now.tv_nsec - (uint64_t)state->start.tv_nsec;
+        if (target > elapsed) {
+            struct timespec ts;
+            ts.tv_sec = (time_t)((target - elapsed) / 1000000000);
+            ts.tv_nsec = (long)((target - elapsed) % 1000000000);
+            nanosleep(&ts, NULL);
+        }
+    }
+}
+
+static void replay_rewind(replay_state * state) {
+    state->send_offset = sizeof(cable_capture_header);
+    state->recv_offset = sizeof(cable_capture_header);
+    state->sends_done = 0;
+    state->sends_before_recv = 0;
+    state->started = 0;
+}
+
+static int cable_replay_probe(cable_handle * handle) {
+    return 0;
+}
+
+static int cable_replay_open(cable_handle * handle) {
+    int res;
+    if (handle != NULL) {
+        if (handle->device_path != NULL) {
+            replay_state * state = (replay_state *)(hpcables_alloc_funcs.calloc)(1, sizeof(*state));
+            if (state != NULL) {
+                struct stat st;
+                res = ERR_CABLE_CAPTURE_IO;
+                state->fd = open(handle->device_path, O_RDONLY);
+                if (state->fd >= 0 && fstat(state->fd, &st) == 0) {
+                    state->map_size = (uint64_t)st.st_size;
+                    if (state->map_size >= sizeof(cable_capture_header)) {
+                        state->map = (const uint8_t *)mmap(NULL, (size_t)state->map_size, PROT_READ, MAP_PRIVATE, state->fd, 0);
+                        if (state->map != MAP_FAILED) {
+                            const cable_capture_header * header = (const cable_capture_header *)state->map;
+                            if (   !memcmp(header->magic, CABLE_CAPTURE_MAGIC, sizeof(header->magic))
+                                && header->version == CABLE_CAPTURE_VERSION
+                                && header->end_offset >= sizeof(*header) && header->end_offset <= state->map_size) {
+                                res = ERR_SUCCESS;
+                            }
+                            else {
+                                munmap((void *)state->map, (size_t)state->map_size);
+                                res = ERR_CABLE_CAPTURE_FORMAT;
+                            }
+                        }
+                    }
+                    else {
+                        res = ERR_CABLE_CAPTURE_FORMAT;
+                    }
+                }
+                if (res == ERR_SUCCESS) {
+                    uint64_t offset = sizeof(cable_capture_header);
+                    state->end = ((const cable_capture_header *)state->map)->end_offset;
+                    if (offset + sizeof(cable_capture_record_header) <= state->end) {
+                        state->first_timestamp = ((const cable_capture_record_header *)(state->map + offset))->timestamp_ns;
+                    }
+                    replay_rewind(state);
+                    handle->model = CABLE_REPLAY;
+                    handle->handle = (void *)state;
+                    handle->fncts = &cable_replay_fncts;
+                    handle->read_timeout = 0;
+                    handle->open = 1;
+                    hpcables_info("%s: replaying %s", __FUNCTION__, handle->device_path);
+                }
+                else {
+                    if (state->fd >= 0) {
+                        close(state->fd);
+                    }
+                    (hpcables_alloc_funcs.free)(state);
+                    hpcables_error("%s: couldn't load capture file %s", __FUNCTION__, handle->device_path);
+                }
+            }
+            else {
+                res = ERR_MALLOC;
+                hpcables_error("%s: couldn't allocate cable state", __FUNCTION__);
+            }
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpcables_error("%s: no capture file, set it with hpcables_options_set_device_path", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+static int cable_replay_close(cable_handle * handle) {
+    int res;
+    if (handle != NULL) {
+        replay_state * state = (replay_state *)handle->handle;
+        if (state != NULL && handle->open) {
+            munmap((void *)state->map, (size_t)state->map_size);
+            close(state->fd);
+            (hpcables_alloc_funcs.free)(state);
+            handle->handle = NULL;
+            handle->open = 0;
+            res = ERR_SUCCESS;
+            hpcables_info("%s: cable close succeeded", __FUNCTION__);
+        }
+        else {
+            res = ERR_CABLE_NOT_OPEN;
+            hpcables_error("%s: cable was not open", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+static int cable_replay_set_read_timeout(cable_handle * handle, int read_timeout) {
+    int res;
+    if (handle != NULL) {
+        res = ERR_SUCCESS;
+        handle->read_timeout = read_timeout;
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+static int cable_replay_send(cable_handle * handle, uint8_t * data, uint32_t len) {
+    int res;
+    if (handle != NULL && data != NULL) {
+        replay_state * state = (replay_state *)handle->handle;
+        if (state != NULL) {
+            const cable_capture_record_header * record = replay_next(state, &state->send_offset, PACKET_DIRECTION_SEND, NULL);
+            state->stats.reports_sent++;
+            res = ERR_SUCCESS;
+            if (record != NULL) {
+                if (record->size != len || memcmp(record + 1, data, len)) {
+                    state->stats.mismatches++;
+                    hpcables_warning("%s: report %" PRIu64 " differs from the capture", __FUNCTION__, state->sends_done);
+                }
+                replay_pace(state, record);
+                res = record->result;
+                state->send_offset += REPLAY_RECORD_SIZE(record);
+                state->sends_done++;
+            }
+            else {
+                state->stats.mismatches++;
+                hpcables_warning("%s: report sent past the end of the capture", __FUNCTION__);
+            }
+        }
+        else {
+            res = ERR_CABLE_NOT_OPEN;
+            hpcables_error("%s: cable was not open", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcables_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+static int cable_replay_recv(cable_handle * handle, uint8_t * data, uint32_t * len) {
+    int res;
+    if (handle != NULL && data != NULL && len != NULL) {
+        replay_state * state = (replay_state *)handle->handle;
+        if (state != NULL) {
+            const cable_capture_record_header * record = replay_next(state, &state->recv_offset, PACKET_DIRECTION_RECV, &state->sends_before_recv);
+            res = ERR_SUCCESS;
+            // A reply can't be served before the computer sent what it answers: behave like a read timeout meanwhile.
+            if (record != NULL && state->sends_before_recv <= state->sends_done) {
+                uint32_t size = record->size < *len ? record->size : *len;
+                replay_pace(state, record);
+                memcpy(data, record + 1, size);
+                *len = size;
+                res = record->result;
+                state->recv_offset += REPLAY_RECORD_SIZE(record);
+                state->stats.reports_received++;
+            }
+            else {
+                *len = 0;
+                state->stats.stalls++;
+            }
+        }
+        else {
+            res = ERR_CABLE_NOT_OPEN;
+            hpcables_error("%s: cable was not open", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcables_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+const cable_fncts cable_replay_fncts =
+{
+    CABLE_REPLAY,
+    "Replay",
+    "Replay of a capture file",
+    &cable_replay_probe,
+    &cable_replay_open,
+    &cable_replay_close,
+    &cable_replay_set_read_timeout,
+    &cable_replay_send,
+    &cable_replay_recv,
+    NULL,
+    NULL,
+    NULL
+};
+
+
+// Returns the state of an open replay cable, or NULL with an error code.
+static replay_state * replay_get_state(cable_handle * handle, int * res, const char * function) {
+    if (handle == NULL) {
+        *res = ERR_INVALID_HANDLE;
+        hpcables_error("%s: handle is NULL", function);
+    }
+    else if (handle->model != CABLE_REPLAY) {
+        *res = ERR_INVALID_MODEL;
+        hpcables_error("%s: not a replay cable", function);
+    }
+    else if (!handle->open || handle->handle == NULL) {
+        *res = ERR_CABLE_NOT_OPEN;
+        hpcables_error("%s: cable not open", function);
+    }
+    else {
+        *res = ERR_SUCCESS;
+        return (replay_state *)handle->handle;
+    }
+    return NULL;
+}
+
+HPEXPORT int HPCALL hpcables_replay_set_realtime(cable_handle * handle, int realtime) {
+    int res;
+    replay_state * state = replay_get_state(handle, &res, __FUNCTION__);
+    if (state != NULL) {
+        state->realtime = realtime;
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_replay_rewind(cable_handle * handle) {
+    int res;
+    replay_state * state = replay_get_state(handle, &res, __FUNCTION__);
+    if (state != NULL) {
+        replay_rewind(state);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpcables_replay_get_stats(cable_handle * handle, cable_replay_stats * out_stats) {
+    int res;
+    replay_state * state = replay_get_state(handle, &res, __FUNCTION__);
+    if (state != NULL) {
+        if (out_stats != NULL) {
+            *out_stats = state->stats;
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpcables_error("%s: out_stats is NULL", __FUNCTION__);
+        }
+    }
+    return res;
+}
+
+#else
+
+// Capture files are only supported on POSIX systems so far, see link_capture.c.
+
+static int cable_replay_probe(cable_handle * handle) {
+    return ERR_CABLE_PROBE_FAILED;
+}
+
+static int cable_replay_open(cable_handle * handle) {
+    hpcables_error("%s: not supported on this platform", __FUNCTION__);
+    return ERR_CABLE_CAPTURE_IO;
+}
+
+const cable_fncts cable_replay_fncts =
+{
+    CABLE_REPLAY,
+    "Replay",
+    "Replay of a capture file",
+    &cable_replay_probe,
+    &cable_replay_open,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+HPEXPORT int HPCALL hpcables_replay_set_realtime(cable_handle * handle, int realtime) {
+    return ERR_CABLE_NOT_OPEN;
+}
+
+HPEXPORT int HPCALL hpcables_replay_rewind(cable_handle * handle) {
+    return ERR_CABLE_NOT_OPEN;
+}
+
+HPEXPORT int HPCALL hpcables_replay_get_stats(cable_handle * handle, cable_replay_stats * out_stats) {
+    return ERR_CABLE_NOT_OPEN;
+}
+
+#endif
@@ -0,0 +1,591 @@
+/*
+ * libhpopers: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file opers_fleet.c Higher-level operations: fleet of calculators driven by a work-stealing pool of worker threads.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <hpopers.h>
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+
+// Scheduling model:
+// * each calculator has a FIFO of queued jobs, and is "scheduled" while it sits in a worker deque or runs a job,
+//   which guarantees at most one in-flight job per calculator;
+// * each worker owns a deque of ready calculators: it pops the most recent one, idle workers steal the oldest one;
+// * after running a job, a worker keeps the calculator in its own deque if more jobs are queued on it.
+
+typedef struct _fleet_job_node {
+    fleet_job job;
+    struct _fleet_job_node * next;
+} fleet_job_node;
+
+typedef struct {
+    calc_handle * calc;
+    pthread_mutex_t lock;
+    fleet_job_node * head;
+    fleet_job_node * tail;
+    int scheduled;
+} fleet_device;
+
+typedef struct {
+    opers_fleet * fleet;
+    uint32_t index;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    uint32_t * items; // Ring of calculator indices, as large as the fleet: a calculator is in at most one deque.
+    uint32_t top;
+    uint32_t count;
+} fleet_worker;
+
+struct _opers_fleet {
+    fleet_device * devices;
+    uint32_t device_count;
+    fleet_worker * workers;
+    uint32_t worker_count;
+    fleet_callbacks callbacks;
+    pthread_mutex_t lock;
+    pthread_cond_t work_available;
+    pthread_cond_t all_done;
+    uint32_t ready; // Number of calculators sitting in deques, accessed atomically.
+    uint32_t next_worker; // Round-robin distribution of calculators scheduled by submitters.
+    uint32_t jobs_total;
+    uint32_t jobs_done;
+    uint32_t jobs_pending;
+    int stop;
+};
+
+static void fleet_push(opers_fleet * fleet, uint32_t worker_index, uint32_t device_index) {
+    fleet_worker * worker = &fleet->workers[worker_index];
+
+    pthread_mutex_lock(&worker->lock);
+    worker->items[(worker->top + worker->count) % fleet->device_count] = device_index;
+    worker->count++;
+    pthread_mutex_unlock(&worker->lock);
+
+    __atomic_add_fetch(&fleet->ready, 1, __ATOMIC_SEQ_CST);
+    // Sleeping workers check the counter with the fleet lock held, so taking it here prevents lost wakeups.
+    pthread_mutex_lock(&fleet->lock);
+    pthread_cond_signal(&fleet->work_available);
+    pthread_mutex_unlock(&fleet->lock);
+}
+
+// Own deque: most recently pushed calculator first. Other deques: oldest calculator first.
+static int fleet_take(opers_fleet * fleet, fleet_worker * self, uint32_t * device_index) {
+    uint32_t i;
+    for (i = 0; i < fleet->worker_count; i++) {
+        fleet_worker * worker = &fleet->workers[(self->index + i) % fleet->worker_count];
+        int found = 0;
+
+        pthread_mutex_lock(&worker->lock);
+        if (worker->count != 0) {
+            if (worker == self) {
+                *device_index = worker->items[(worker->top + worker->count - 1) % fleet->device_count];
+            }
+            else {
+                *device_index = worker->items[worker->top];
+                worker->top = (worker->top + 1) % fleet->device_count;
+            }
+            worker->count--;
+            found = 1;
+        }
+        pthread_mutex_unlock(&worker->lock);
+
+        if (found) {
+            __atomic_sub_fetch(&fleet->ready, 1, __ATOMIC_SEQ_CST);
+            if (worker != self) {
+                hpopers_debug("%s: worker %" PRIu32 " stole calc %" PRIu32 " from worker %" PRIu32, __FUNCTION__, self->index, *device_index, worker->index);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void fleet_execute(calc_handle * calc, uint32_t device_index, const fleet_job * job, fleet_job_result * result) {
+    memset(result, 0, sizeof(*result));
+    switch (job->type) {
+        case FLEET_JOB_SEND_FILE:
+            result->res = hpcalcs_calc_send_file(calc, job->file);
+            break;
+        case FLEET_JOB_RECV_BACKUP:
+            result->res = hpcalcs_calc_recv_backup(calc, &result->vars);
+            break;
+        case FLEET_JOB_RECV_SCREEN:
+            result->res = hpcalcs_calc_recv_screen_payload(calc, job->format, &result->screen);
+            break;
+        case FLEET_JOB_SET_DATE_TIME:
+            result->res = hpcalcs_calc_set_date_time(calc, job->timestamp);
+            break;
+        case FLEET_JOB_SEND_ENCODED_FILE:
+            result->res = hpcalcs_calc_send_encoded_file(calc, job->encoded);
+            break;
+        case FLEET_JOB_CALL:
+            if (job->call != NULL) {
+                result->res = (*job->call)(calc, device_index, job->user_data);
+            }
+            else {
+                result->res = ERR_INVALID_PARAMETER;
+                hpopers_error("%s: call is NULL", __FUNCTION__);
+            }
+            break;
+        default:
+            result->res = ERR_INVALID_PARAMETER;
+            hpopers_error("%s: unknown job type %d", __FUNCTION__, job->type);
+            break;
+    }
+}
+
+// Reports a completed or cancelled job, then releases whatever the callback did not take ownership of.
+static void fleet_complete(opers_fleet * fleet, uint32_t device_index, fleet_job_node * node, fleet_job_result * result) {
+    uint32_t jobs_done;
+    uint32_t jobs_total;
+
+    if (fleet->callbacks.job_completed != NULL) {
+        (*fleet->callbacks.job_completed)(fleet, device_index, &node->job, result, fleet->callbacks.user_data);
+    }
+    if (result->vars != NULL) {
+        hpfiles_ve_delete_array(result->vars);
+    }
+    if (result->screen.block != NULL) {
+        hpcalcs_payload_release(&result->screen);
+    }
+    if (node->job.type == FLEET_JOB_SEND_ENCODED_FILE && node->job.encoded != NULL) {
+        hpcalcs_encoded_file_unref(node->job.encoded);
+    }
+    (hpopers_alloc_funcs.free)(node);
+
+    pthread_mutex_lock(&fleet->lock);
+    jobs_done = ++fleet->jobs_done;
+    jobs_total = fleet->jobs_total;
+    pthread_mutex_unlock(&fleet->lock);
+
+    if (fleet->callbacks.progress != NULL) {
+        (*fleet->callbacks.progress)(fleet, jobs_done, jobs_total, fleet->callbacks.user_data);
+    }
+
+    // Only now, so that hpopers_fleet_wait returns after the last callback.
+    pthread_mutex_lock(&fleet->lock);
+    if (--fleet->jobs_pending == 0) {
+        pthread_cond_broadcast(&fleet->all_done);
+    }
+    pthread_mutex_unlock(&fleet->lock);
+}
+
+static void fleet_run_one(opers_fleet * fleet, fleet_worker * self, uint32_t device_index) {
+    fleet_device * device = &fleet->devices[device_index];
+    fleet_job_node * node;
+    int requeue = 0;
+
+    pthread_mutex_lock(&device->lock);
+    node = device->head;
+    if (node != NULL) {
+        device->head = node->next;
+        if (device->head == NULL) {
+            device->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&device->lock);
+
+    if (node != NULL) {
+        fleet_job_result result;
+        if (fleet->callbacks.job_started != NULL) {
+            (*fleet->callbacks.job_started)(fleet, device_index, &node->job, fleet->callbacks.user_data);
+        }
+        fleet_execute(device->calc, device_index, &node->job, &result);
+        fleet_complete(fleet, device_index, node, &result);
+    }
+
+    pthread_mutex_lock(&device->lock);
+    if (device->head != NULL) {
+        requeue = 1;
+    }
+    else {
+        device->scheduled = 0;
+    }
+    pthread_mutex_unlock(&device->lock);
+
+    if (requeue) {
+        fleet_push(fleet, self->index, device_index);
+    }
+}
+
+static void * fleet_worker_main(void * arg) {
+    fleet_worker * self = (fleet_worker *)arg;
+    opers_fleet * fleet = self->fleet;
+
+    for (;;) {
+        uint32_t device_index;
+        int stop;
+
+        if (fleet_take(fleet, self, &device_index)) {
+            fleet_run_one(fleet, self, device_index);
+            continue;
+        }
+
+        pthread_mutex_lock(&fleet->lock);
+        while (!fleet->stop && __atomic_load_n(&fleet->ready, __ATOMIC_SEQ_CST) == 0) {
+            pthread_cond_wait(&fleet->work_available, &fleet->lock);
+        }
+        stop = fleet->stop;
+        pthread_mutex_unlock(&fleet->lock);
+        if (stop) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void fleet_stop_workers(opers_fleet * fleet, uint32_t started_workers) {
+    uint32_t i;
+
+    pthread_mutex_lock(&fleet->lock);
+    fleet->stop = 1;
+    pthread_cond_broadcast(&fleet->work_available);
+    pthread_mutex_unlock(&fleet->lock);
+
+    for (i = 0; i < started_workers; i++) {
+        pthread_join(fleet->workers[i].thread, NULL);
+    }
+}
+
+static void fleet_free(opers_fleet * fleet) {
+    uint32_t i;
+
+    for (i = 0; i < fleet->worker_count; i++) {
+        pthread_mutex_destroy(&fleet->workers[i].lock);
+        (hpopers_alloc_funcs.free)(fleet->workers[i].items);
+    }
+    for (i = 0; i < fleet->device_count; i++) {
+        pthread_mutex_destroy(&fleet->devices[i].lock);
+    }
+    pthread_cond_destroy(&fleet->all_done);
+    pthread_cond_destroy(&fleet->work_available);
+    pthread_mutex_destroy(&fleet->lock);
+    (hpopers_alloc_funcs.free)(fleet->workers);
+    (hpopers_alloc_funcs.free)(fleet->devices);
+    (hpopers_alloc_funcs.free)(fleet);
+}
+
+HPEXPORT opers_fleet * HPCALL hpopers_fleet_new(calc_handle ** calcs, uint32_t count, uint32_t worker_count, const fleet_callbacks * callbacks) {
+    opers_fleet * fleet = NULL;
+    if (calcs != NULL && count != 0) {
+        uint32_t i;
+
+        if (worker_count == 0 || worker_count > count) {
+            worker_count = count;
+        }
+        for (i = 0; i < count; i++) {
+            if (calcs[i] == NULL) {
+                hpopers_error("%s: calcs[%" PRIu32 "] is NULL", __FUNCTION__, i);
+                return NULL;
+            }
+        }
+
+        fleet = (opers_fleet *)(hpopers_alloc_funcs.calloc)(1, sizeof(*fleet));
+        if (fleet != NULL) {
+            fleet->devices = (fleet_device *)(hpopers_alloc_funcs.calloc)(count, sizeof(*fleet->devices));
+            fleet->workers = (fleet_worker *)(hpopers_alloc_funcs.calloc)(worker_count, sizeof(*fleet->workers));
+            if (fleet->devices != NULL && fleet->workers != NULL) {
+                uint32_t started = 0;
+
+                fleet->device_count = count;
+                fleet->worker_count = worker_count;
+                if (callbacks != NULL) {
+                    fleet->callbacks = *callbacks;
+                }
+                pthread_mutex_init(&fleet->lock, NULL);
+                pthread_cond_init(&fleet->work_available, NULL);
+                pthread_cond_init(&fleet->all_done, NULL);
+                for (i = 0; i < count; i++) {
+                    fleet->devices[i].calc = calcs[i];
+                    pthread_mutex_init(&fleet->devices[i].lock, NULL);
+                }
+                // All the locks are set up before anything can fail, so that fleet_free can destroy them all.
+                for (i = 0; i < worker_count; i++) {
+                    fleet->workers[i].fleet = fleet;
+                    fleet->workers[i].index = i;
+                    pthread_mutex_init(&fleet->workers[i].lock, NULL);
+                }
+                for (i = 0; i < worker_count; i++) {
+                    fleet->workers[i].items = (uint32_t *)(hpopers_alloc_funcs.malloc)(count * sizeof(uint32_t));
+                    if (fleet->workers[i].items == NULL) {
+                        break;
+                    }
+                }
+                if (i == worker_count) {
+                    for (; started < worker_count; started++) {
+                        if (pthread_create(&fleet->workers[started].thread, NULL, fleet_worker_main, &fleet->workers[started]) != 0) {
+                            hpopers_error("%s: cannot start worker thread", __FUNCTION__);
+                            break;
+                        }
+                    }
+                }
+                else {
+                    hpopers_error("%s: couldn't allocate memory for worker deques", __FUNCTION__);
+                }
+                if (started == worker_count) {
+                    hpopers_info("%s: fleet of %" PRIu32 " calcs with %" PRIu32 " workers", __FUNCTION__, count, worker_count);
+                }
+                else {
+                    fleet_stop_workers(fleet, started);
+                    fleet_free(fleet);
+                    fleet = NULL;
+                }
+            }
+            else {
+                hpopers_error("%s: couldn't allocate memory for fleet", __FUNCTION__);
+                (hpopers_alloc_funcs.free)(fleet->workers);
+                (hpopers_alloc_funcs.free)(fleet->devices);
+                (hpopers_alloc_funcs.free)(fleet);
+                fleet = NULL;
+            }
+        }
+        else {
+            hpopers_error("%s: couldn't allocate memory for fleet", __FUNCTION__);
+        }
+    }
+    else {
+        hpopers_error("%s: calcs is NULL or count is 0", __FUNCTION__);
+    }
+    return fleet;
+}
+
+HPEXPORT int HPCALL hpopers_fleet_del(opers_fleet * fleet) {
+    int res;
+    if (fleet != NULL) {
+        uint32_t i;
+
+        // Cancel queued jobs; those already running complete normally.
+        for (i = 0; i < fleet->device_count; i++) {
+            fleet_device * device = &fleet->devices[i];
+            fleet_job_node * node;
+
+            pthread_mutex_lock(&device->lock);
+            node = device->head;
+            device->head = NULL;
+            device->tail = NULL;
+            pthread_mutex_unlock(&device->lock);
+
+            while (node != NULL) {
+                fleet_job_node * next = node->next;
+                fleet_job_result result;
+                memset(&result, 0, sizeof(result));
+                result.res = ERR_OPER_CANCELLED;
+                fleet_complete(fleet, i, node, &result);
+                node = next;
+            }
+        }
+        hpopers_fleet_wait(fleet);
+        fleet_stop_workers(fleet, fleet->worker_count);
+
+        res = ERR_SUCCESS;
+        for (i = 0; i < fleet->device_count; i++) {
+            calc_handle * calc = fleet->devices[i].calc;
+            cable_handle * cable = hpcalcs_cable_get(calc);
+            int res2 = hpcalcs_handle_del(calc);
+            if (cable != NULL) {
+                hpcables_handle_del(cable);
+            }
+            if (res2 != ERR_SUCCESS) {
+                res = res2;
+            }
+        }
+        fleet_free(fleet);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpopers_error("%s: fleet is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_fleet_submit(opers_fleet * fleet, uint32_t calc_index, const fleet_job * job) {
+    int res;
+    if (fleet != NULL) {
+        if (calc_index < fleet->device_count && job != NULL) {
+            fleet_job_node * node = (fleet_job_node *)(hpopers_alloc_funcs.malloc)(sizeof(*node));
+            if (node != NULL) {
+                fleet_device * device = &fleet->devices[calc_index];
+                int schedule;
+
+                node->job = *job;
+                node->next = NULL;
+                if (job->type == FLEET_JOB_SEND_ENCODED_FILE && job->encoded != NULL) {
+                    hpcalcs_encoded_file_ref(job->encoded);
+                }
+
+                // Account for the job before it becomes visible to workers, so that hpopers_fleet_wait cannot miss it.
+                pthread_mutex_lock(&fleet->lock);
+                fleet->jobs_total++;
+                fleet->jobs_pending++;
+                pthread_mutex_unlock(&fleet->lock);
+
+                pthread_mutex_lock(&device->lock);
+                if (device->tail != NULL) {
+                    device->tail->next = node;
+                }
+                else {
+                    device->head = node;
+                }
+                device->tail = node;
+                schedule = !device->scheduled;
+                device->scheduled = 1;
+                pthread_mutex_unlock(&device->lock);
+
+                if (schedule) {
+                    fleet_push(fleet, __atomic_fetch_add(&fleet->next_worker, 1, __ATOMIC_RELAXED) % fleet->worker_count, calc_index);
+                }
+                res = ERR_SUCCESS;
+            }
+            else {
+                res = ERR_MALLOC;
+                hpopers_error("%s: couldn't allocate memory for job", __FUNCTION__);
+            }
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpopers_error("%s: invalid calc index or job is NULL", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpopers_error("%s: fleet is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_fleet_submit_all(opers_fleet * fleet, const fleet_job * job) {
+    int res;
+    if (fleet != NULL) {
+        uint32_t i;
+        res = ERR_SUCCESS;
+        for (i = 0; i < fleet->device_count && res == ERR_SUCCESS; i++) {
+            res = hpopers_fleet_submit(fleet, i, job);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpopers_error("%s: fleet is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_fleet_broadcast_file(opers_fleet * fleet, files_var_entry * file, void * user_data) {
+    int res;
+    if (fleet != NULL) {
+        if (file != NULL) {
+            calc_encoded_file * encoded[CALC_MAX];
+            uint32_t i;
+
+            memset(encoded, 0, sizeof(encoded));
+            res = ERR_SUCCESS;
+            for (i = 0; i < fleet->device_count && res == ERR_SUCCESS; i++) {
+                calc_handle * calc = fleet->devices[i].calc;
+                calc_model model = hpcalcs_get_model(calc);
+                fleet_job job;
+
+                if (model >= CALC_MAX) {
+                    res = ERR_INVALID_MODEL;
+                    hpopers_error("%s: invalid model for calc %" PRIu32, __FUNCTION__, i);
+                    break;
+                }
+                if (encoded[model] == NULL) {
+                    res = hpcalcs_calc_encode_file(calc, file, &encoded[model]);
+                    if (res != ERR_SUCCESS) {
+                        encoded[model] = NULL;
+                        break;
+                    }
+                }
+                memset(&job, 0, sizeof(job));
+                job.type = FLEET_JOB_SEND_ENCODED_FILE;
+                job.encoded = encoded[model];
+                job.user_data = user_data;
+                res = hpopers_fleet_submit(fleet, i, &job);
+            }
+            for (i = 0; i < CALC_MAX; i++) {
+                if (encoded[i] != NULL) {
+                    hpcalcs_encoded_file_unref(encoded[i]);
+                }
+            }
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpopers_error("%s: file is NULL", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpopers_error("%s: fleet is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_fleet_wait(opers_fleet * fleet) {
+    int res;
+    if (fleet != NULL) {
+        pthread_mutex_lock(&fleet->lock);
+        while (fleet->jobs_pending != 0) {
+            pthread_cond_wait(&fleet->all_done, &fleet->lock);
+        }
+        pthread_mutex_unlock(&fleet->lock);
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpopers_error("%s: fleet is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT calc_handle * HPCALL hpopers_fleet_get_calc(opers_fleet * fleet, uint32_t calc_index) {
+    calc_handle * res = NULL;
+    if (fleet != NULL) {
+        if (calc_index < fleet->device_count) {
+            res = fleet->devices[calc_index].calc;
+        }
+        else {
+            hpopers_error("%s: invalid calc index", __FUNCTION__);
+        }
+    }
+    else {
+        hpopers_error("%s: fleet is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT uint32_t HPCALL hpopers_fleet_get_count(opers_fleet * fleet) {
+    uint32_t res = 0;
+    if (fleet != NULL) {
+        res = fleet->device_count;
+    }
+    else {
+        hpopers_error("%s: fleet is NULL", __FUNCTION__);
+    }
+    return res;
+}
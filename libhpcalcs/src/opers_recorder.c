@@ -0,0 +1,538 @@
+/*
+ * libhpopers: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file opers_recorder.c Higher-level operations: screenshot flight recorder, keeping the latest screenshots in a fixed-size ring and spilling older ones to disk.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <hpopers.h>
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+#include "utils.h"
+
+// Memory model:
+// * screenshots are stored contiguously in a ring of bytes: a screenshot which doesn't fit before the end of the ring
+//   wraps around to its beginning, the oldest screenshots are evicted until it fits;
+// * entries describing the screenshots are kept in a ring of max_frames slots, in capture order;
+// * evicted screenshots are appended to the spill file, unless an earlier flush already did.
+
+#define RECORDER_DEFAULT_INTERVAL_MS (1000)
+#define RECORDER_MIN_FRAMES (16)
+#define RECORDER_ALIGN(size) (((size) + 7) & ~(uint64_t)7)
+
+typedef struct {
+    uint32_t offset;
+    uint32_t size;
+    uint64_t hash;
+    uint64_t first_us;
+    uint64_t last_us;
+    uint32_t captures;
+    calc_screenshot_format format;
+    int spilled;
+} recorder_entry;
+
+struct _opers_recorder {
+    calc_handle * calc;
+    recorder_config config;
+    FILE * spill;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    int stop;
+    // Protected by lock.
+    uint8_t * ring;
+    recorder_entry * entries;
+    uint32_t first;
+    uint32_t count;
+    recorder_stats stats;
+};
+
+static uint64_t recorder_now_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// FNV-1a, as for screencasts; identical screenshots are also compared byte by byte before being merged.
+static uint64_t recorder_hash(const uint8_t * data, uint32_t size) {
+    uint64_t hash = UINT64_C(0xCBF29CE484222325);
+    while (size--) {
+        hash ^= *data++;
+        hash *= UINT64_C(0x100000001B3);
+    }
+    return hash;
+}
+
+static recorder_entry * recorder_entry_at(opers_recorder * recorder, uint32_t index) {
+    return &recorder->entries[(recorder->first + index) % recorder->config.max_frames];
+}
+
+// Appends a screenshot to the spill file, unless it is already there. Errors are recorded in the statistics, the screenshot is then lost.
+static void recorder_spill_entry(opers_recorder * recorder, recorder_entry * entry) {
+    if (recorder->spill != NULL && !entry->spilled) {
+        static const uint8_t padding[8] = { 0 };
+        recorder_spill_record record;
+        uint32_t pad = (uint32_t)(RECORDER_ALIGN((uint64_t)entry->size) - entry->size);
+
+        memset(&record, 0, sizeof(record));
+        record.first_us = entry->first_us;
+        record.last_us = entry->last_us;
+        record.captures = entry->captures;
+        record.format = (uint32_t)entry->format;
+        record.size = entry->size;
+        if (   fwrite(&record, sizeof(record), 1, recorder->spill) == 1
+            && fwrite(recorder->ring + entry->offset, 1, entry->size, recorder->spill) == entry->size
+            && fwrite(padding, 1, pad, recorder->spill) == pad) {
+            recorder->stats.spilled++;
+            recorder->stats.spill_bytes += sizeof(record) + entry->size + pad;
+        }
+        else {
+            if (recorder->stats.spill_res == ERR_SUCCESS) {
+                hpopers_error("%s: couldn't write to spill file", __FUNCTION__);
+            }
+            recorder->stats.spill_res = ERR_OPER_RECORDING_IO;
+        }
+        entry->spilled = 1;
+    }
+}
+
+static void recorder_evict(opers_recorder * recorder) {
+    recorder_entry * entry = recorder_entry_at(recorder, 0);
+    recorder_spill_entry(recorder, entry);
+    recorder->stats.bytes -= entry->size;
+    recorder->first = (recorder->first + 1) % recorder->config.max_frames;
+    recorder->count--;
+    recorder->stats.frames = recorder->count;
+    recorder->stats.evicted++;
+}
+
+// Returns the offset at which size bytes fit contiguously, evicting the oldest screenshots as needed. size must not exceed ring_size.
+static uint32_t recorder_place(opers_recorder * recorder, uint32_t size) {
+    for (;;) {
+        recorder_entry * oldest;
+        recorder_entry * newest;
+        uint32_t head, tail;
+
+        if (recorder->count == 0) {
+            return 0;
+        }
+        oldest = recorder_entry_at(recorder, 0);
+        newest = recorder_entry_at(recorder, recorder->count - 1);
+        head = oldest->offset;
+        tail = newest->offset + newest->size;
+        if (newest->offset >= head) {
+            // Not wrapped: free space after the tail, and before the head.
+            if (recorder->config.ring_size - tail >= size) {
+                return tail;
+            }
+            if (head >= size) {
+                return 0;
+            }
+        }
+        else if (head - tail >= size) {
+            // Wrapped: free space between the tail and the head.
+            return tail;
+        }
+        recorder_evict(recorder);
+    }
+}
+
+static void recorder_store(opers_recorder * recorder, const uint8_t * data, uint32_t size, uint64_t now_us) {
+    uint64_t hash = recorder_hash(data, size);
+
+    pthread_mutex_lock(&recorder->lock);
+    if (recorder->config.max_age_ms != 0) {
+        uint64_t max_age_us = (uint64_t)recorder->config.max_age_ms * 1000;
+        while (recorder->count != 0 && recorder_entry_at(recorder, 0)->last_us + max_age_us < now_us) {
+            recorder_evict(recorder);
+        }
+    }
+
+    recorder->stats.captures++;
+    if (recorder->count != 0) {
+        recorder_entry * newest = recorder_entry_at(recorder, recorder->count - 1);
+        if (   newest->hash == hash && newest->size == size && newest->format == recorder->config.format
+            && !memcmp(recorder->ring + newest->offset, data, size)) {
+            newest->last_us = now_us;
+            newest->captures++;
+            recorder->stats.duplicates++;
+            // If a flush already appended it, append it again, with the repeat, upon eviction or the next flush.
+            newest->spilled = 0;
+            pthread_mutex_unlock(&recorder->lock);
+            return;
+        }
+    }
+
+    if (size <= recorder->config.ring_size) {
+        recorder_entry * entry;
+        uint32_t offset;
+
+        if (recorder->count == recorder->config.max_frames) {
+            recorder_evict(recorder);
+        }
+        offset = recorder_place(recorder, size);
+        memcpy(recorder->ring + offset, data, size);
+        entry = recorder_entry_at(recorder, recorder->count);
+        entry->offset = offset;
+        entry->size = size;
+        entry->hash = hash;
+        entry->first_us = now_us;
+        entry->last_us = now_us;
+        entry->captures = 1;
+        entry->format = recorder->config.format;
+        entry->spilled = 0;
+        recorder->count++;
+        recorder->stats.frames = recorder->count;
+        recorder->stats.bytes += size;
+    }
+    else {
+        recorder->stats.dropped++;
+        hpopers_warning("%s: screenshot of %" PRIu32 " bytes larger than the ring", __FUNCTION__, size);
+    }
+    pthread_mutex_unlock(&recorder->lock);
+}
+
+static void * recorder_main(void * arg) {
+    opers_recorder * recorder = (opers_recorder *)arg;
+    uint64_t interval_ns = (uint64_t)recorder->config.interval_ms * 1000000;
+    uint64_t next_ns = recorder_now_ns(CLOCK_MONOTONIC);
+
+    for (;;) {
+        calc_payload payload;
+        struct timespec deadline;
+        uint64_t now_ns;
+        int stop;
+        int res = hpcalcs_calc_recv_screen_payload(recorder->calc, recorder->config.format, &payload);
+
+        if (res == ERR_SUCCESS) {
+            recorder_store(recorder, CALC_PAYLOAD_DATA(&payload), payload.size, recorder_now_ns(CLOCK_REALTIME) / 1000);
+            hpcalcs_payload_release(&payload);
+        }
+        else {
+            // Keep going: the calculator may come back, e.g. after its cable was reconnected.
+            pthread_mutex_lock(&recorder->lock);
+            recorder->stats.errors++;
+            pthread_mutex_unlock(&recorder->lock);
+        }
+
+        // Fixed rate, without catching up on captures missed while a capture took longer than the interval.
+        next_ns += interval_ns;
+        now_ns = recorder_now_ns(CLOCK_MONOTONIC);
+        if (next_ns < now_ns) {
+            next_ns = now_ns;
+        }
+        cond_deadline(&deadline, next_ns);
+
+        pthread_mutex_lock(&recorder->lock);
+        while (!recorder->stop) {
+            if (pthread_cond_timedwait(&recorder->wakeup, &recorder->lock, &deadline) != 0) {
+                break;
+            }
+        }
+        stop = recorder->stop;
+        pthread_mutex_unlock(&recorder->lock);
+        if (stop) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Opens the spill file for appending, writing the file header if the file is new.
+static FILE * recorder_open_spill(const char * path) {
+    FILE * spill = fopen(path, "ab");
+    if (spill != NULL) {
+        if (fseek(spill, 0, SEEK_END) == 0) {
+            long size = ftell(spill);
+            if (size == 0) {
+                recorder_spill_header header;
+                memset(&header, 0, sizeof(header));
+                memcpy(header.magic, RECORDER_SPILL_MAGIC, sizeof(header.magic));
+                header.version = RECORDER_SPILL_VERSION;
+                if (fwrite(&header, sizeof(header), 1, spill) == 1 && fflush(spill) == 0) {
+                    return spill;
+                }
+            }
+            else if (size > 0) {
+                // Appending to an earlier recording: check that it is one.
+                FILE * check = fopen(path, "rb");
+                if (check != NULL) {
+                    recorder_spill_header header;
+                    int valid = fread(&header, sizeof(header), 1, check) == 1
+                                && !memcmp(header.magic, RECORDER_SPILL_MAGIC, sizeof(header.magic))
+                                && header.version == RECORDER_SPILL_VERSION;
+                    fclose(check);
+                    if (valid) {
+                        return spill;
+                    }
+                }
+            }
+        }
+        fclose(spill);
+    }
+    return NULL;
+}
+
+HPEXPORT opers_recorder * HPCALL hpopers_recorder_new(calc_handle * calc, const recorder_config * config) {
+    opers_recorder * recorder = NULL;
+    if (calc != NULL && config != NULL) {
+        if (config->format >= CALC_SCREENSHOT_FORMAT_FIRST && config->format < CALC_SCREENSHOT_FORMAT_LAST && config->ring_size != 0) {
+            recorder = (opers_recorder *)(hpopers_alloc_funcs.calloc)(1, sizeof(*recorder));
+            if (recorder != NULL) {
+                recorder->calc = calc;
+                recorder->config = *config;
+                recorder->config.spill_path = NULL;
+                if (recorder->config.interval_ms == 0) {
+                    recorder->config.interval_ms = RECORDER_DEFAULT_INTERVAL_MS;
+                }
+                if (recorder->config.max_frames == 0) {
+                    recorder->config.max_frames = config->ring_size / 4096;
+                    if (recorder->config.max_frames < RECORDER_MIN_FRAMES) {
+                        recorder->config.max_frames = RECORDER_MIN_FRAMES;
+                    }
+                }
+                recorder->ring = (uint8_t *)(hpopers_alloc_funcs.malloc)(recorder->config.ring_size);
+                recorder->entries = (recorder_entry *)(hpopers_alloc_funcs.calloc)(recorder->config.max_frames, sizeof(*recorder->entries));
+                if (recorder->ring != NULL && recorder->entries != NULL) {
+                    if (config->spill_path != NULL) {
+                        recorder->spill = recorder_open_spill(config->spill_path);
+                    }
+                    if (config->spill_path == NULL || recorder->spill != NULL) {
+                        pthread_mutex_init(&recorder->lock, NULL);
+                        cond_init_monotonic(&recorder->wakeup);
+                        if (pthread_create(&recorder->thread, NULL, recorder_main, recorder) == 0) {
+                            hpopers_info("%s: recording every %" PRIu32 " ms into %" PRIu32 " bytes, at most %" PRIu32 " screenshots", __FUNCTION__,
+                                         recorder->config.interval_ms, recorder->config.ring_size, recorder->config.max_frames);
+                            return recorder;
+                        }
+                        hpopers_error("%s: cannot start recorder thread", __FUNCTION__);
+                        pthread_cond_destroy(&recorder->wakeup);
+                        pthread_mutex_destroy(&recorder->lock);
+                    }
+                    else {
+                        hpopers_error("%s: couldn't open spill file %s", __FUNCTION__, config->spill_path);
+                    }
+                }
+                else {
+                    hpopers_error("%s: couldn't allocate memory for recorder", __FUNCTION__);
+                }
+                if (recorder->spill != NULL) {
+                    fclose(recorder->spill);
+                }
+                (hpopers_alloc_funcs.free)(recorder->entries);
+                (hpopers_alloc_funcs.free)(recorder->ring);
+                (hpopers_alloc_funcs.free)(recorder);
+                recorder = NULL;
+            }
+            else {
+                hpopers_error("%s: couldn't allocate memory for recorder", __FUNCTION__);
+            }
+        }
+        else {
+            hpopers_error("%s: bad screenshot format %d, or empty ring", __FUNCTION__, config->format);
+        }
+    }
+    else {
+        hpopers_error("%s: calc or config is NULL", __FUNCTION__);
+    }
+    return recorder;
+}
+
+HPEXPORT int HPCALL hpopers_recorder_flush(opers_recorder * recorder) {
+    int res;
+    if (recorder != NULL) {
+        uint32_t i;
+        pthread_mutex_lock(&recorder->lock);
+        if (recorder->spill != NULL) {
+            for (i = 0; i < recorder->count; i++) {
+                recorder_spill_entry(recorder, recorder_entry_at(recorder, i));
+            }
+            if (fflush(recorder->spill) != 0) {
+                recorder->stats.spill_res = ERR_OPER_RECORDING_IO;
+            }
+        }
+        res = recorder->stats.spill_res;
+        pthread_mutex_unlock(&recorder->lock);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpopers_error("%s: recorder is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_recorder_del(opers_recorder * recorder) {
+    int res;
+    if (recorder != NULL) {
+        pthread_mutex_lock(&recorder->lock);
+        recorder->stop = 1;
+        pthread_cond_signal(&recorder->wakeup);
+        pthread_mutex_unlock(&recorder->lock);
+        pthread_join(recorder->thread, NULL);
+
+        res = hpopers_recorder_flush(recorder);
+        if (recorder->spill != NULL && fclose(recorder->spill) != 0 && res == ERR_SUCCESS) {
+            res = ERR_OPER_RECORDING_IO;
+        }
+        hpopers_info("%s: %" PRIu32 " captures, %" PRIu32 " duplicates, %" PRIu32 " spilled", __FUNCTION__,
+                     recorder->stats.captures, recorder->stats.duplicates, recorder->stats.spilled);
+        pthread_cond_destroy(&recorder->wakeup);
+        pthread_mutex_destroy(&recorder->lock);
+        (hpopers_alloc_funcs.free)(recorder->entries);
+        (hpopers_alloc_funcs.free)(recorder->ring);
+        (hpopers_alloc_funcs.free)(recorder);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpopers_error("%s: recorder is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_recorder_foreach(opers_recorder * recorder, recorder_callback callback, void * user_data) {
+    int res;
+    if (recorder != NULL) {
+        if (callback != NULL) {
+            uint32_t i;
+            pthread_mutex_lock(&recorder->lock);
+            for (i = 0; i < recorder->count; i++) {
+                recorder_entry * entry = recorder_entry_at(recorder, i);
+                recorder_frame frame;
+                frame.first_us = entry->first_us;
+                frame.last_us = entry->last_us;
+                frame.captures = entry->captures;
+                frame.format = entry->format;
+                frame.data = recorder->ring + entry->offset;
+                frame.size = entry->size;
+                if ((*callback)(&frame, user_data)) {
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&recorder->lock);
+            res = ERR_SUCCESS;
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpopers_error("%s: callback is NULL", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpopers_error("%s: recorder is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_recorder_get_stats(opers_recorder * recorder, recorder_stats * out_stats) {
+    int res;
+    if (recorder != NULL) {
+        if (out_stats != NULL) {
+            pthread_mutex_lock(&recorder->lock);
+            *out_stats = recorder->stats;
+            pthread_mutex_unlock(&recorder->lock);
+            res = ERR_SUCCESS;
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpopers_error("%s: out_stats is NULL", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpopers_error("%s: recorder is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_recorder_read(const char * path, recorder_callback callback, void * user_data) {
+    int res;
+    if (path != NULL) {
+        FILE * file = fopen(path, "rb");
+        if (file != NULL) {
+            recorder_spill_header header;
+            if (   fread(&header, sizeof(header), 1, file) == 1
+                && !memcmp(header.magic, RECORDER_SPILL_MAGIC, sizeof(header.magic))
+                && header.version == RECORDER_SPILL_VERSION) {
+                uint8_t * buffer = NULL;
+                uint64_t capacity = 0;
+                recorder_spill_record record;
+
+                res = ERR_SUCCESS;
+                while (fread(&record, sizeof(record), 1, file) == 1) {
+                    uint64_t padded = RECORDER_ALIGN((uint64_t)record.size);
+                    recorder_frame frame;
+                    if (padded > capacity) {
+                        uint8_t * grown = (uint8_t *)(hpopers_alloc_funcs.realloc)(buffer, (size_t)padded);
+                        if (grown == NULL) {
+                            res = ERR_MALLOC;
+                            hpopers_error("%s: couldn't allocate memory for a screenshot of %" PRIu32 " bytes", __FUNCTION__, record.size);
+                            break;
+                        }
+                        buffer = grown;
+                        capacity = padded;
+                    }
+                    if (padded != 0 && fread(buffer, (size_t)padded, 1, file) != 1) {
+                        res = ERR_OPER_RECORDING_FORMAT;
+                        hpopers_error("%s: truncated record in %s", __FUNCTION__, path);
+                        break;
+                    }
+                    frame.first_us = record.first_us;
+                    frame.last_us = record.last_us;
+                    frame.captures = record.captures;
+                    frame.format = (calc_screenshot_format)record.format;
+                    frame.data = buffer;
+                    frame.size = record.size;
+                    if (callback != NULL && (*callback)(&frame, user_data)) {
+                        break;
+                    }
+                }
+                if (res == ERR_SUCCESS && ferror(file)) {
+                    res = ERR_OPER_RECORDING_IO;
+                    hpopers_error("%s: couldn't read %s", __FUNCTION__, path);
+                }
+                (hpopers_alloc_funcs.free)(buffer);
+            }
+            else {
+                res = ERR_OPER_RECORDING_FORMAT;
+                hpopers_error("%s: %s is not a spill file", __FUNCTION__, path);
+            }
+            fclose(file);
+        }
+        else {
+            res = ERR_OPER_RECORDING_IO;
+            hpopers_error("%s: couldn't open %s", __FUNCTION__, path);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpopers_error("%s: path is NULL", __FUNCTION__);
+    }
+    return res;
+}
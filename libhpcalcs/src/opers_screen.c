@@ -0,0 +1,343 @@
+/*
+ * libhpopers: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file opers_screen.c Higher-level operations: conversion of screenshots to conventional R8G8B8 PNG images.
+ *
+ * The Prime sends screenshots as PNG images whose samples hold its own pixel formats:
+ * - 16-bit formats: 16-bit greyscale samples, which actually are X1R5G5B5 pixels;
+ * - 4-bit formats: 4-bit greyscale samples, which are grey levels.
+ * Both are converted by the kernels of pixels.c. Any other kind of PNG image is converted through the transformations of libpng.
+ * Images are decoded from, and encoded to, memory buffers; screen_decode_r8g8b8 decodes into a region of a larger image, e.g. a tile of a screen wall.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <string.h>
+#include <setjmp.h>
+#include <png.h>
+
+#include <hpopers.h>
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+#include "pixels.h"
+
+// zlib level of the images produced: the fastest one. Screenshots are mostly flat areas, which even the fastest level compresses well.
+#define SCREEN_PNG_COMPRESSION_LEVEL (1)
+// Larger images are rejected, the screen of the Prime being 320x240.
+#define SCREEN_PNG_MAX_DIMENSION (4096)
+
+typedef enum {
+    SCREEN_PIXELS_X1R5G5B5,
+    SCREEN_PIXELS_G4,
+    SCREEN_PIXELS_LIBPNG
+} screen_pixels;
+
+// State of a conversion, outside of the functions which call setjmp, so that it is reliable after a longjmp.
+typedef struct {
+    int res;
+    // Input image.
+    const uint8_t * in_data;
+    uint32_t in_size;
+    uint32_t in_offset;
+    // Output image, allocated with hpopers_alloc_funcs.
+    uint8_t * out_data;
+    uint32_t out_size;
+    uint32_t out_capacity;
+    // Decoded image, and one converted row.
+    png_uint_32 width;
+    png_uint_32 height;
+    screen_pixels pixels;
+    uint8_t * image;
+    png_bytep * rows;
+    uint8_t * row;
+} screen_png_context;
+
+static void screen_png_error(png_structp png, png_const_charp message) {
+    hpopers_error("libpng error: %s", message);
+    longjmp(png_jmpbuf(png), 1);
+}
+
+static void screen_png_warning(png_structp png, png_const_charp message) {
+    (void)png;
+    hpopers_warning("libpng warning: %s", message);
+}
+
+static void screen_png_read(png_structp png, png_bytep data, png_size_t length) {
+    screen_png_context * ctx = (screen_png_context *)png_get_io_ptr(png);
+    if (length > ctx->in_size - ctx->in_offset) {
+        png_error(png, "truncated image");
+    }
+    memcpy(data, ctx->in_data + ctx->in_offset, length);
+    ctx->in_offset += (uint32_t)length;
+}
+
+static void screen_png_write(png_structp png, png_bytep data, png_size_t length) {
+    screen_png_context * ctx = (screen_png_context *)png_get_io_ptr(png);
+    if (length > ctx->out_capacity - ctx->out_size) {
+        uint64_t capacity = (uint64_t)ctx->out_capacity * 2;
+        uint8_t * grown;
+        if (capacity < (uint64_t)ctx->out_size + length) {
+            capacity = (uint64_t)ctx->out_size + length;
+        }
+        if (capacity > UINT32_MAX) {
+            png_error(png, "image too large");
+        }
+        grown = (uint8_t *)(hpopers_alloc_funcs.realloc)(ctx->out_data, (size_t)capacity);
+        if (grown == NULL) {
+            ctx->res = ERR_MALLOC;
+            png_error(png, "couldn't grow output buffer");
+        }
+        ctx->out_data = grown;
+        ctx->out_capacity = (uint32_t)capacity;
+    }
+    memcpy(ctx->out_data + ctx->out_size, data, length);
+    ctx->out_size += (uint32_t)length;
+}
+
+static void screen_png_flush(png_structp png) {
+    (void)png;
+}
+
+// Decodes the whole image, which copes with interlacing. The buffers of ctx are freed by the caller, whatever the outcome.
+static int screen_png_decode(screen_png_context * ctx, png_structp read, png_infop read_info) {
+    int bit_depth, color_type;
+    size_t rowbytes;
+    png_uint_32 y;
+
+    if (setjmp(png_jmpbuf(read))) {
+        return ctx->res;
+    }
+
+    png_set_read_fn(read, ctx, screen_png_read);
+    png_read_info(read, read_info);
+    png_get_IHDR(read, read_info, &ctx->width, &ctx->height, &bit_depth, &color_type, NULL, NULL, NULL);
+    if (ctx->width == 0 || ctx->height == 0 || ctx->width > SCREEN_PNG_MAX_DIMENSION || ctx->height > SCREEN_PNG_MAX_DIMENSION) {
+        png_error(read, "unexpected image dimensions");
+    }
+    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth == 16) {
+        ctx->pixels = SCREEN_PIXELS_X1R5G5B5;
+    }
+    else if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth == 4) {
+        ctx->pixels = SCREEN_PIXELS_G4;
+    }
+    else {
+        ctx->pixels = SCREEN_PIXELS_LIBPNG;
+        png_set_expand(read);
+        png_set_strip_16(read);
+        png_set_strip_alpha(read);
+        png_set_gray_to_rgb(read);
+    }
+    png_set_interlace_handling(read);
+    png_read_update_info(read, read_info);
+    rowbytes = png_get_rowbytes(read, read_info);
+    if (ctx->pixels == SCREEN_PIXELS_LIBPNG && rowbytes != (size_t)ctx->width * 3) {
+        png_error(read, "unexpected row size after transformations");
+    }
+
+    ctx->res = ERR_MALLOC;
+    ctx->image = (uint8_t *)(hpopers_alloc_funcs.malloc)(rowbytes * ctx->height);
+    ctx->rows = (png_bytep *)(hpopers_alloc_funcs.malloc)(sizeof(png_bytep) * ctx->height);
+    if (ctx->image == NULL || ctx->rows == NULL) {
+        return ctx->res;
+    }
+    ctx->res = ERR_OPER_IMAGE_FORMAT;
+    for (y = 0; y < ctx->height; y++) {
+        ctx->rows[y] = ctx->image + rowbytes * y;
+    }
+    png_read_image(read, ctx->rows);
+    png_read_end(read, NULL);
+    return ERR_SUCCESS;
+}
+
+// Converts the first width pixels of row y of the decoded image to R8G8B8.
+static void screen_png_convert_row(screen_png_context * ctx, png_uint_32 y, uint8_t * out, png_uint_32 width) {
+    if (ctx->pixels == SCREEN_PIXELS_X1R5G5B5) {
+        pixels_x1r5g5b5_to_r8g8b8(ctx->rows[y], out, width);
+    }
+    else if (ctx->pixels == SCREEN_PIXELS_G4) {
+        pixels_g4_to_r8g8b8(ctx->rows[y], out, width);
+    }
+    else {
+        memcpy(out, ctx->rows[y], (size_t)width * 3);
+    }
+}
+
+// Encodes the decoded image as R8G8B8. The buffers of ctx are freed by the caller, whatever the outcome.
+static int screen_png_encode(screen_png_context * ctx, png_structp write, png_infop write_info) {
+    png_uint_32 y;
+
+    if (setjmp(png_jmpbuf(write))) {
+        return ctx->res;
+    }
+
+    ctx->res = ERR_MALLOC;
+    ctx->row = (uint8_t *)(hpopers_alloc_funcs.malloc)((size_t)ctx->width * 3);
+    ctx->out_capacity = ctx->width * ctx->height + 1024;
+    ctx->out_data = (uint8_t *)(hpopers_alloc_funcs.malloc)(ctx->out_capacity);
+    if (ctx->row == NULL || ctx->out_data == NULL) {
+        return ctx->res;
+    }
+    ctx->res = ERR_OPER_IMAGE_FORMAT;
+
+    png_set_write_fn(write, ctx, screen_png_write, screen_png_flush);
+    png_set_IHDR(write, write_info, ctx->width, ctx->height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_set_compression_level(write, SCREEN_PNG_COMPRESSION_LEVEL);
+    png_write_info(write, write_info);
+    for (y = 0; y < ctx->height; y++) {
+        if (ctx->pixels == SCREEN_PIXELS_LIBPNG) {
+            png_write_row(write, ctx->rows[y]);
+        }
+        else {
+            screen_png_convert_row(ctx, y, ctx->row, ctx->width);
+            png_write_row(write, ctx->row);
+        }
+    }
+    png_write_end(write, write_info);
+    return ERR_SUCCESS;
+}
+
+int screen_decode_r8g8b8(const uint8_t * in_data, uint32_t in_size, uint8_t * out, uint32_t stride, uint32_t max_width, uint32_t max_height) {
+    int res;
+    png_structp read = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, screen_png_error, screen_png_warning);
+    png_infop read_info = read != NULL ? png_create_info_struct(read) : NULL;
+    if (read_info != NULL) {
+        screen_png_context ctx;
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.res = ERR_OPER_IMAGE_FORMAT;
+        ctx.in_data = in_data;
+        ctx.in_size = in_size;
+        res = screen_png_decode(&ctx, read, read_info);
+        if (res == ERR_SUCCESS) {
+            png_uint_32 width = ctx.width < max_width ? ctx.width : max_width;
+            png_uint_32 height = ctx.height < max_height ? ctx.height : max_height;
+            png_uint_32 y;
+            for (y = 0; y < height; y++) {
+                screen_png_convert_row(&ctx, y, out + (size_t)stride * y, width);
+            }
+        }
+        (hpopers_alloc_funcs.free)(ctx.rows);
+        (hpopers_alloc_funcs.free)(ctx.image);
+    }
+    else {
+        res = ERR_MALLOC;
+        hpopers_error("%s: couldn't create libpng structures", __FUNCTION__);
+    }
+    png_destroy_read_struct(read != NULL ? &read : NULL, read_info != NULL ? &read_info : NULL, NULL);
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_oper_convert_raw_screen_to_png_r8g8b8(uint8_t * in_data, uint32_t in_size, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size) {
+    int res;
+    if (in_data != NULL && out_data != NULL && out_size != NULL) {
+        if (format >= CALC_SCREENSHOT_FORMAT_FIRST && format < CALC_SCREENSHOT_FORMAT_LAST) {
+            png_structp read = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, screen_png_error, screen_png_warning);
+            png_structp write = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, screen_png_error, screen_png_warning);
+            png_infop read_info = read != NULL ? png_create_info_struct(read) : NULL;
+            png_infop write_info = write != NULL ? png_create_info_struct(write) : NULL;
+            if (read_info != NULL && write_info != NULL) {
+                screen_png_context ctx;
+                memset(&ctx, 0, sizeof(ctx));
+                ctx.res = ERR_OPER_IMAGE_FORMAT;
+                ctx.in_data = in_data;
+                ctx.in_size = in_size;
+                res = screen_png_decode(&ctx, read, read_info);
+                if (res == ERR_SUCCESS) {
+                    res = screen_png_encode(&ctx, write, write_info);
+                }
+                if (res == ERR_SUCCESS) {
+                    *out_data = ctx.out_data;
+                    *out_size = ctx.out_size;
+                    hpopers_info("%s: converted %" PRIu32 " bytes into %" PRIu32 " bytes", __FUNCTION__, in_size, ctx.out_size);
+                }
+                else {
+                    (hpopers_alloc_funcs.free)(ctx.out_data);
+                    hpopers_error("%s: conversion failed", __FUNCTION__);
+                }
+                (hpopers_alloc_funcs.free)(ctx.row);
+                (hpopers_alloc_funcs.free)(ctx.rows);
+                (hpopers_alloc_funcs.free)(ctx.image);
+            }
+            else {
+                res = ERR_MALLOC;
+                hpopers_error("%s: couldn't create libpng structures", __FUNCTION__);
+            }
+            png_destroy_read_struct(read != NULL ? &read : NULL, read_info != NULL ? &read_info : NULL, NULL);
+            png_destroy_write_struct(write != NULL ? &write : NULL, write_info != NULL ? &write_info : NULL);
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpopers_error("%s: unknown screenshot format %d", __FUNCTION__, (int)format);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpopers_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_oper_recv_screen_png_r8g8b8(calc_handle * handle, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size) {
+    int res;
+    if (handle != NULL) {
+        if (out_data != NULL && out_size != NULL) {
+            calc_payload payload;
+            res = hpcalcs_calc_recv_screen_payload(handle, format, &payload);
+            if (res == ERR_SUCCESS) {
+                // The image is decoded where it was received.
+                res = hpopers_oper_convert_raw_screen_to_png_r8g8b8(CALC_PAYLOAD_DATA(&payload), payload.size, format, out_data, out_size);
+                hpcalcs_payload_release(&payload);
+            }
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpopers_error("%s: an argument is NULL", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpopers_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_oper_recv_screen_png_r8g8b8_to_file(calc_handle * handle, calc_screenshot_format format, FILE * out_file) {
+    int res;
+    if (out_file != NULL) {
+        uint8_t * data;
+        uint32_t size;
+        res = hpopers_oper_recv_screen_png_r8g8b8(handle, format, &data, &size);
+        if (res == ERR_SUCCESS) {
+            if (fwrite(data, 1, size, out_file) != size) {
+                res = ERR_OPER_WRITE_ERROR;
+                hpopers_error("%s: couldn't write image", __FUNCTION__);
+            }
+            (hpopers_alloc_funcs.free)(data);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpopers_error("%s: out_file is NULL", __FUNCTION__);
+    }
+    return res;
+}
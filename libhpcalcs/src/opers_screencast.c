@@ -0,0 +1,355 @@
+/*
+ * libhpopers: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file opers_screencast.c Higher-level operations: screencast, fetching frames only when the screen changes, within latency and bandwidth budgets.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <hpopers.h>
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+#include "utils.h"
+
+// Adaptation model:
+// * each poll fetches a CALC_SCREENSHOT_FORMAT_PRIME_POLL screenshot, a frame is fetched only if it differs from the previous poll;
+// * the cost of a frame is the longer of its fetch time and its transfer time at the bandwidth budget, averaged over the last frames;
+// * the format steps down as soon as the average cost exceeds the latency budget, and steps up when the next better format,
+//   about SCREENCAST_FORMAT_RATIO times costlier, would fit over SCREENCAST_MIN_FRAMES frames; the ratio itself provides the hysteresis;
+// * polls are spaced by the longer of 1 / max_fps and the time the bytes of the last poll and frame take at the bandwidth budget.
+
+#define SCREENCAST_DEFAULT_FPS (10)
+// Frames fetched in a format before the adaptation may step up from it.
+#define SCREENCAST_MIN_FRAMES (4)
+// Cost ratio between a format and the next lower one: a quarter of the pixels, or a quarter of the bits per pixel.
+#define SCREENCAST_FORMAT_RATIO (4)
+
+struct _opers_screencast {
+    calc_handle * calc;
+    screencast_config config;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    int stop;
+    screencast_stats stats; // Protected by lock.
+    // Only used by the screencast thread.
+    uint64_t poll_hash;
+    uint64_t frame_hash;
+    int polled;
+    int delivered;
+    uint64_t cost_us;
+    uint32_t frames_at_format;
+};
+
+static uint64_t screencast_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// FNV-1a: polls are only compared with the previous one, so a fast non-cryptographic hash is enough.
+static uint64_t screencast_hash(const uint8_t * data, uint32_t size) {
+    uint64_t hash = UINT64_C(0xCBF29CE484222325);
+    while (size--) {
+        hash ^= *data++;
+        hash *= UINT64_C(0x100000001B3);
+    }
+    return hash;
+}
+
+// 320x240 formats step down to 160x120 with the same depth, 160x120x16 steps down to 160x120x4.
+static calc_screenshot_format screencast_lower(calc_screenshot_format format) {
+    switch (format) {
+        case CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16:
+            return CALC_SCREENSHOT_FORMAT_PRIME_PNG_160x120x16;
+        case CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x4:
+        case CALC_SCREENSHOT_FORMAT_PRIME_PNG_160x120x16:
+            return CALC_SCREENSHOT_FORMAT_PRIME_PNG_160x120x4;
+        default:
+            return format;
+    }
+}
+
+// Inverse of screencast_lower, never above the best format.
+static calc_screenshot_format screencast_higher(calc_screenshot_format format, calc_screenshot_format best) {
+    calc_screenshot_format higher = format;
+    calc_screenshot_format current = best;
+    while (current != format) {
+        calc_screenshot_format lower = screencast_lower(current);
+        if (lower == current) {
+            return format;
+        }
+        higher = current;
+        current = lower;
+    }
+    return higher;
+}
+
+static void screencast_adapt(opers_screencast * cast, uint32_t latency_us, uint32_t size) {
+    uint64_t cost = latency_us;
+    calc_screenshot_format format;
+    calc_screenshot_format next;
+
+    if (cast->config.bandwidth_budget != 0) {
+        uint64_t transfer = (uint64_t)size * 1000000 / cast->config.bandwidth_budget;
+        if (transfer > cost) {
+            cost = transfer;
+        }
+    }
+    cast->cost_us = cast->frames_at_format == 0 ? cost : (3 * cast->cost_us + cost) / 4;
+    cast->frames_at_format++;
+    if (cast->config.latency_budget_us == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&cast->lock);
+    format = cast->stats.format;
+    if (cast->cost_us > cast->config.latency_budget_us) {
+        next = screencast_lower(format);
+    }
+    else if (cast->frames_at_format >= SCREENCAST_MIN_FRAMES && cast->cost_us * SCREENCAST_FORMAT_RATIO <= cast->config.latency_budget_us) {
+        next = screencast_higher(format, cast->config.format);
+    }
+    else {
+        next = format;
+    }
+    if (next != format) {
+        cast->stats.format = next;
+        cast->stats.format_changes++;
+        cast->frames_at_format = 0;
+    }
+    pthread_mutex_unlock(&cast->lock);
+
+    if (next != format) {
+        hpopers_info("%s: format %d -> %d, average frame cost %" PRIu64 " us", __FUNCTION__, format, next, cast->cost_us);
+    }
+}
+
+// Fetches a frame in the current format, and delivers it unless it is the same as the previous one, resetting *polls.
+// Returns nonzero if the screencast must end, with *res set upon errors.
+static int screencast_fetch_frame(opers_screencast * cast, uint64_t detected_ns, uint32_t * polls, uint64_t * bytes, int * res) {
+    calc_payload payload;
+    calc_screenshot_format format;
+    uint64_t hash;
+    uint32_t latency_us;
+    uint32_t sequence;
+    int end = 0;
+
+    pthread_mutex_lock(&cast->lock);
+    format = cast->stats.format;
+    sequence = cast->stats.frames;
+    pthread_mutex_unlock(&cast->lock);
+
+    *res = hpcalcs_calc_recv_screen_payload(cast->calc, format, &payload);
+    if (*res != ERR_SUCCESS) {
+        hpopers_error("%s: couldn't fetch frame", __FUNCTION__);
+        return 1;
+    }
+    latency_us = (uint32_t)((screencast_now_ns() - detected_ns) / 1000);
+    *bytes += payload.size;
+
+    // A poll may differ while the frame doesn't, e.g. when a change was undone between two polls.
+    hash = screencast_hash(CALC_PAYLOAD_DATA(&payload), payload.size) ^ (uint64_t)format;
+    if (!cast->delivered || hash != cast->frame_hash) {
+        screencast_frame frame;
+
+        frame.sequence = sequence;
+        frame.format = format;
+        frame.timestamp_us = detected_ns / 1000;
+        frame.latency_us = latency_us;
+        frame.polls = *polls;
+        frame.data = CALC_PAYLOAD_DATA(&payload);
+        frame.size = payload.size;
+        cast->frame_hash = hash;
+        cast->delivered = 1;
+        *polls = 0;
+
+        pthread_mutex_lock(&cast->lock);
+        cast->stats.frames++;
+        pthread_mutex_unlock(&cast->lock);
+
+        if (cast->config.frame != NULL) {
+            end = (*cast->config.frame)(cast, &frame, cast->config.user_data);
+        }
+    }
+    screencast_adapt(cast, latency_us, payload.size);
+    hpcalcs_payload_release(&payload);
+    return end;
+}
+
+static void * screencast_main(void * arg) {
+    opers_screencast * cast = (opers_screencast *)arg;
+    uint64_t min_interval_ns = 1000000000 / cast->config.max_fps;
+    uint32_t polls = 0;
+    int res = ERR_SUCCESS;
+
+    for (;;) {
+        uint64_t start_ns = screencast_now_ns();
+        uint64_t interval_ns = min_interval_ns;
+        uint64_t bytes = 0;
+        calc_payload payload;
+        uint64_t hash;
+        int changed;
+        struct timespec deadline;
+        int stop;
+
+        res = hpcalcs_calc_recv_screen_payload(cast->calc, CALC_SCREENSHOT_FORMAT_PRIME_POLL, &payload);
+        if (res != ERR_SUCCESS) {
+            hpopers_error("%s: couldn't poll screen", __FUNCTION__);
+            break;
+        }
+        polls++;
+        bytes += payload.size;
+        hash = screencast_hash(CALC_PAYLOAD_DATA(&payload), payload.size);
+        hpcalcs_payload_release(&payload);
+        changed = !cast->polled || hash != cast->poll_hash;
+        cast->poll_hash = hash;
+        cast->polled = 1;
+
+        if (changed) {
+            if (screencast_fetch_frame(cast, screencast_now_ns(), &polls, &bytes, &res)) {
+                break;
+            }
+        }
+
+        if (cast->config.bandwidth_budget != 0) {
+            uint64_t transfer_ns = bytes * 1000000000 / cast->config.bandwidth_budget;
+            if (transfer_ns > interval_ns) {
+                interval_ns = transfer_ns;
+            }
+        }
+        start_ns += interval_ns;
+        cond_deadline(&deadline, start_ns);
+
+        pthread_mutex_lock(&cast->lock);
+        cast->stats.polls++;
+        cast->stats.bytes += bytes;
+        cast->stats.interval_us = (uint32_t)(interval_ns / 1000);
+        // Until the deadline, or until hpopers_screencast_stop signals.
+        while (!cast->stop) {
+            if (pthread_cond_timedwait(&cast->wakeup, &cast->lock, &deadline) != 0) {
+                break;
+            }
+        }
+        stop = cast->stop;
+        pthread_mutex_unlock(&cast->lock);
+        if (stop) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&cast->lock);
+    cast->stats.running = 0;
+    cast->stats.res = res;
+    pthread_mutex_unlock(&cast->lock);
+    return NULL;
+}
+
+HPEXPORT opers_screencast * HPCALL hpopers_screencast_start(calc_handle * calc, const screencast_config * config) {
+    opers_screencast * cast = NULL;
+    if (calc != NULL && config != NULL) {
+        if (config->format >= CALC_SCREENSHOT_FORMAT_FIRST && config->format < CALC_SCREENSHOT_FORMAT_LAST) {
+            cast = (opers_screencast *)(hpopers_alloc_funcs.calloc)(1, sizeof(*cast));
+            if (cast != NULL) {
+                cast->calc = calc;
+                cast->config = *config;
+                if (cast->config.max_fps == 0) {
+                    cast->config.max_fps = SCREENCAST_DEFAULT_FPS;
+                }
+                cast->stats.format = config->format;
+                cast->stats.running = 1;
+                pthread_mutex_init(&cast->lock, NULL);
+                // Deadlines are computed on CLOCK_MONOTONIC, so that changes of the wall clock don't stall the screencast.
+                cond_init_monotonic(&cast->wakeup);
+                if (pthread_create(&cast->thread, NULL, screencast_main, cast) == 0) {
+                    hpopers_info("%s: screencast in format %d, at most %" PRIu32 " polls/s", __FUNCTION__, config->format, cast->config.max_fps);
+                }
+                else {
+                    hpopers_error("%s: cannot start screencast thread", __FUNCTION__);
+                    pthread_cond_destroy(&cast->wakeup);
+                    pthread_mutex_destroy(&cast->lock);
+                    (hpopers_alloc_funcs.free)(cast);
+                    cast = NULL;
+                }
+            }
+            else {
+                hpopers_error("%s: couldn't allocate memory for screencast", __FUNCTION__);
+            }
+        }
+        else {
+            hpopers_error("%s: bad screenshot format %d", __FUNCTION__, config->format);
+        }
+    }
+    else {
+        hpopers_error("%s: calc or config is NULL", __FUNCTION__);
+    }
+    return cast;
+}
+
+HPEXPORT int HPCALL hpopers_screencast_stop(opers_screencast * cast) {
+    int res;
+    if (cast != NULL) {
+        pthread_mutex_lock(&cast->lock);
+        cast->stop = 1;
+        pthread_cond_signal(&cast->wakeup);
+        pthread_mutex_unlock(&cast->lock);
+        pthread_join(cast->thread, NULL);
+
+        res = cast->stats.res;
+        hpopers_info("%s: %" PRIu32 " frames for %" PRIu32 " polls, %" PRIu64 " bytes", __FUNCTION__, cast->stats.frames, cast->stats.polls, cast->stats.bytes);
+        pthread_cond_destroy(&cast->wakeup);
+        pthread_mutex_destroy(&cast->lock);
+        (hpopers_alloc_funcs.free)(cast);
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpopers_error("%s: cast is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_screencast_get_stats(opers_screencast * cast, screencast_stats * out_stats) {
+    int res;
+    if (cast != NULL) {
+        if (out_stats != NULL) {
+            pthread_mutex_lock(&cast->lock);
+            *out_stats = cast->stats;
+            pthread_mutex_unlock(&cast->lock);
+            res = ERR_SUCCESS;
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpopers_error("%s: out_stats is NULL", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpopers_error("%s: cast is NULL", __FUNCTION__);
+    }
+    return res;
+}
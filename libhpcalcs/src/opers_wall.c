@@ -0,0 +1,331 @@
+/*
+ * libhpopers: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file opers_wall.c Higher-level operations: screen wall, compositing the screens of a fleet of calculators into a mosaic.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <hpopers.h>
+#include "internal.h"
+#include "logging.h"
+#include "error.h"
+#include "utils.h"
+#include "pixels.h"
+
+// Refresh model:
+// * the wall thread queues one FLEET_JOB_CALL job per calculator, so that the fleet workers capture the screens in parallel;
+// * each job decodes its screenshot straight into its own tile of the mosaic, then counts down the captures in progress;
+// * once the count reaches zero, the wall thread delivers the mosaic, and waits for the next period.
+// The mosaic is only written by the jobs of the refresh in progress, and only read by the wall thread between refreshes.
+
+#define WALL_DEFAULT_FPS (1)
+
+struct _opers_wall {
+    opers_fleet * fleet;
+    wall_config config;
+    uint32_t count;
+    uint32_t columns;
+    uint32_t rows;
+    uint32_t tile_width;
+    uint32_t tile_height;
+    uint32_t stride;
+    uint8_t * pixels;
+    int * results;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_cond_t captured;
+    uint32_t pending; // Captures of the refresh in progress, protected by lock.
+    int stop;
+    wall_stats stats; // Protected by lock.
+};
+
+static uint64_t wall_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void wall_capture_done(opers_wall * wall, uint32_t calc_index, int res) {
+    pthread_mutex_lock(&wall->lock);
+    wall->results[calc_index] = res;
+    if (--wall->pending == 0) {
+        pthread_cond_signal(&wall->captured);
+    }
+    pthread_mutex_unlock(&wall->lock);
+}
+
+// Runs on a fleet worker.
+static int wall_capture(calc_handle * calc, uint32_t calc_index, void * user_data) {
+    opers_wall * wall = (opers_wall *)user_data;
+    calc_payload payload;
+    int res;
+
+    res = hpcalcs_calc_recv_screen_payload(calc, wall->config.format, &payload);
+    if (res == ERR_SUCCESS) {
+        uint8_t * tile = wall->pixels + (size_t)(calc_index / wall->columns) * wall->tile_height * wall->stride
+                                      + (size_t)(calc_index % wall->columns) * wall->tile_width * 3;
+        res = screen_decode_r8g8b8(CALC_PAYLOAD_DATA(&payload), payload.size, tile, wall->stride, wall->tile_width, wall->tile_height);
+        hpcalcs_payload_release(&payload);
+    }
+    if (res != ERR_SUCCESS) {
+        hpopers_warning("%s: couldn't capture screen of calc %" PRIu32, __FUNCTION__, calc_index);
+    }
+    wall_capture_done(wall, calc_index, res);
+    return res;
+}
+
+// Captures all screens, and returns once the mosaic is complete.
+static void wall_refresh(opers_wall * wall) {
+    fleet_job job;
+    uint32_t i;
+
+    memset(&job, 0, sizeof(job));
+    job.type = FLEET_JOB_CALL;
+    job.call = wall_capture;
+    job.user_data = wall;
+
+    pthread_mutex_lock(&wall->lock);
+    wall->pending = wall->count;
+    pthread_mutex_unlock(&wall->lock);
+    for (i = 0; i < wall->count; i++) {
+        int res = hpopers_fleet_submit(wall->fleet, i, &job);
+        if (res != ERR_SUCCESS) {
+            wall_capture_done(wall, i, res);
+        }
+    }
+
+    // Even when stopping: the jobs write into the mosaic.
+    pthread_mutex_lock(&wall->lock);
+    while (wall->pending != 0) {
+        pthread_cond_wait(&wall->captured, &wall->lock);
+    }
+    pthread_mutex_unlock(&wall->lock);
+}
+
+static void * wall_main(void * arg) {
+    opers_wall * wall = (opers_wall *)arg;
+    uint64_t period_ns = 1000000000 / wall->config.fps;
+    uint64_t next_ns = wall_now_ns();
+    uint32_t sequence;
+
+    for (sequence = 0; ; sequence++) {
+        uint64_t start_ns = wall_now_ns();
+        uint64_t end_ns;
+        wall_mosaic mosaic;
+        struct timespec deadline;
+        uint32_t i;
+        int late = 0;
+        int stop;
+
+        wall_refresh(wall);
+        end_ns = wall_now_ns();
+
+        mosaic.sequence = sequence;
+        mosaic.timestamp_us = start_ns / 1000;
+        mosaic.duration_us = (uint32_t)((end_ns - start_ns) / 1000);
+        mosaic.pixels = wall->pixels;
+        mosaic.width = wall->columns * wall->tile_width;
+        mosaic.height = wall->rows * wall->tile_height;
+        mosaic.stride = wall->stride;
+        mosaic.columns = wall->columns;
+        mosaic.tile_width = wall->tile_width;
+        mosaic.tile_height = wall->tile_height;
+        mosaic.results = wall->results;
+        mosaic.count = wall->count;
+        mosaic.failed = 0;
+        for (i = 0; i < wall->count; i++) {
+            if (wall->results[i] != ERR_SUCCESS) {
+                mosaic.failed++;
+            }
+        }
+
+        // Refreshes keep to the period; a late one starts the next period at its end rather than catching up.
+        next_ns += period_ns;
+        if (next_ns < end_ns) {
+            next_ns = end_ns;
+            late = 1;
+        }
+        cond_deadline(&deadline, next_ns);
+
+        pthread_mutex_lock(&wall->lock);
+        wall->stats.refreshes++;
+        wall->stats.late += late;
+        wall->stats.failed += mosaic.failed;
+        wall->stats.last_duration_us = mosaic.duration_us;
+        if (mosaic.duration_us > wall->stats.max_duration_us) {
+            wall->stats.max_duration_us = mosaic.duration_us;
+        }
+        pthread_mutex_unlock(&wall->lock);
+
+        if (wall->config.mosaic != NULL && (*wall->config.mosaic)(wall, &mosaic, wall->config.user_data)) {
+            break;
+        }
+
+        pthread_mutex_lock(&wall->lock);
+        // Until the deadline, or until hpopers_wall_stop signals.
+        while (!wall->stop) {
+            if (pthread_cond_timedwait(&wall->wakeup, &wall->lock, &deadline) != 0) {
+                break;
+            }
+        }
+        stop = wall->stop;
+        pthread_mutex_unlock(&wall->lock);
+        if (stop) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&wall->lock);
+    wall->stats.running = 0;
+    pthread_mutex_unlock(&wall->lock);
+    return NULL;
+}
+
+static void wall_free(opers_wall * wall) {
+    (hpopers_alloc_funcs.free)(wall->results);
+    (hpopers_alloc_funcs.free)(wall->pixels);
+    (hpopers_alloc_funcs.free)(wall);
+}
+
+HPEXPORT opers_wall * HPCALL hpopers_wall_start(opers_fleet * fleet, const wall_config * config) {
+    opers_wall * wall = NULL;
+    if (fleet != NULL && config != NULL) {
+        uint32_t count = hpopers_fleet_get_count(fleet);
+        if (config->format >= CALC_SCREENSHOT_FORMAT_FIRST && config->format < CALC_SCREENSHOT_FORMAT_LAST && count != 0) {
+            wall = (opers_wall *)(hpopers_alloc_funcs.calloc)(1, sizeof(*wall));
+            if (wall != NULL) {
+                wall->fleet = fleet;
+                wall->config = *config;
+                if (wall->config.fps == 0) {
+                    wall->config.fps = WALL_DEFAULT_FPS;
+                }
+                wall->count = count;
+                wall->columns = config->columns;
+                if (wall->columns == 0) {
+                    while (wall->columns * wall->columns < count) {
+                        wall->columns++;
+                    }
+                }
+                else if (wall->columns > count) {
+                    wall->columns = count;
+                }
+                wall->rows = (count + wall->columns - 1) / wall->columns;
+                if (   config->format == CALC_SCREENSHOT_FORMAT_PRIME_PNG_160x120x16
+                    || config->format == CALC_SCREENSHOT_FORMAT_PRIME_PNG_160x120x4) {
+                    wall->tile_width = 160;
+                    wall->tile_height = 120;
+                }
+                else {
+                    wall->tile_width = 320;
+                    wall->tile_height = 240;
+                }
+                wall->stride = wall->columns * wall->tile_width * 3;
+                wall->pixels = (uint8_t *)(hpopers_alloc_funcs.calloc)((size_t)wall->rows * wall->tile_height, wall->stride);
+                wall->results = (int *)(hpopers_alloc_funcs.calloc)(count, sizeof(int));
+                if (wall->pixels != NULL && wall->results != NULL) {
+                    wall->stats.running = 1;
+                    pthread_mutex_init(&wall->lock, NULL);
+                    pthread_cond_init(&wall->captured, NULL);
+                    // Deadlines are computed on CLOCK_MONOTONIC, so that changes of the wall clock don't stall the refreshes.
+                    cond_init_monotonic(&wall->wakeup);
+                    if (pthread_create(&wall->thread, NULL, wall_main, wall) == 0) {
+                        hpopers_info("%s: wall of %" PRIu32 " screens in %" PRIu32 " columns, format %d, %" PRIu32 " refreshes/s", __FUNCTION__, count, wall->columns, config->format, wall->config.fps);
+                    }
+                    else {
+                        hpopers_error("%s: cannot start wall thread", __FUNCTION__);
+                        pthread_cond_destroy(&wall->wakeup);
+                        pthread_cond_destroy(&wall->captured);
+                        pthread_mutex_destroy(&wall->lock);
+                        wall_free(wall);
+                        wall = NULL;
+                    }
+                }
+                else {
+                    hpopers_error("%s: couldn't allocate memory for mosaic", __FUNCTION__);
+                    wall_free(wall);
+                    wall = NULL;
+                }
+            }
+            else {
+                hpopers_error("%s: couldn't allocate memory for wall", __FUNCTION__);
+            }
+        }
+        else {
+            hpopers_error("%s: bad screenshot format %d or empty fleet", __FUNCTION__, config->format);
+        }
+    }
+    else {
+        hpopers_error("%s: fleet or config is NULL", __FUNCTION__);
+    }
+    return wall;
+}
+
+HPEXPORT int HPCALL hpopers_wall_stop(opers_wall * wall) {
+    int res;
+    if (wall != NULL) {
+        pthread_mutex_lock(&wall->lock);
+        wall->stop = 1;
+        pthread_cond_signal(&wall->wakeup);
+        pthread_mutex_unlock(&wall->lock);
+        pthread_join(wall->thread, NULL);
+
+        hpopers_info("%s: %" PRIu32 " refreshes, %" PRIu32 " late, %" PRIu32 " failed captures", __FUNCTION__, wall->stats.refreshes, wall->stats.late, wall->stats.failed);
+        pthread_cond_destroy(&wall->wakeup);
+        pthread_cond_destroy(&wall->captured);
+        pthread_mutex_destroy(&wall->lock);
+        wall_free(wall);
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpopers_error("%s: wall is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL hpopers_wall_get_stats(opers_wall * wall, wall_stats * out_stats) {
+    int res;
+    if (wall != NULL) {
+        if (out_stats != NULL) {
+            pthread_mutex_lock(&wall->lock);
+            *out_stats = wall->stats;
+            pthread_mutex_unlock(&wall->lock);
+            res = ERR_SUCCESS;
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpopers_error("%s: out_stats is NULL", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpopers_error("%s: wall is NULL", __FUNCTION__);
+    }
+    return res;
+}
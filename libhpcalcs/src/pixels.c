@@ -0,0 +1,340 @@
+/*
+ * libhpopers: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file pixels.c Opers: conversion of screenshot pixels to R8G8B8, with several implementations selected at runtime.
+ *
+ * - scalar: one pixel per step. Always available, used as the reference.
+ * - sse2 (x86): 8 X1R5G5B5 or 32 grey pixels per step, building R8G8B8X8 pixels and squeezing out the X bytes with 64-bit shifts.
+ * - avx2 (x86): 16 pixels per step, widening pixels to 32-bit lanes and squeezing them with a byte shuffle.
+ * - neon (ARM): 8 X1R5G5B5 or 16 grey pixels per step, interleaving the channels with structure stores.
+ *
+ * Channels are widened to 8 bits by replicating their high bits into the low ones, so that full intensity maps to 0xFF.
+ * Every implementation other than scalar is checked against scalar at initialization time, and is not used if the results differ.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <hpopers.h>
+#include "logging.h"
+#include "pixels.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define PIXELS_HAVE_X86 1
+# include <immintrin.h>
+# define PIXELS_SSE2_TARGET __attribute__((target("sse2")))
+# define PIXELS_AVX2_TARGET __attribute__((target("avx2")))
+#elif defined(__GNUC__) && (defined(__aarch64__) || defined(__ARM_NEON))
+# define PIXELS_HAVE_NEON 1
+# include <arm_neon.h>
+#endif
+
+typedef void (*pixels_convert_fn)(const uint8_t * in, uint8_t * out, uint32_t count);
+
+static pixels_convert_fn pixels_x1r5g5b5_impl;
+static pixels_convert_fn pixels_g4_impl;
+static int pixels_initialized;
+
+static void pixels_x1r5g5b5_scalar(const uint8_t * in, uint8_t * out, uint32_t count) {
+    while (count--) {
+        uint32_t v = ((uint32_t)in[0] << 8) | in[1];
+        uint32_t r = (v >> 10) & 0x1F, g = (v >> 5) & 0x1F, b = v & 0x1F;
+        out[0] = (uint8_t)((r << 3) | (r >> 2));
+        out[1] = (uint8_t)((g << 3) | (g >> 2));
+        out[2] = (uint8_t)((b << 3) | (b >> 2));
+        in += 2;
+        out += 3;
+    }
+}
+
+static void pixels_g4_scalar(const uint8_t * in, uint8_t * out, uint32_t count) {
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        uint8_t g = (uint8_t)(((i & 1) ? (in[i >> 1] & 0x0F) : (in[i >> 1] >> 4)) * 0x11);
+        out[0] = g;
+        out[1] = g;
+        out[2] = g;
+        out += 3;
+    }
+}
+
+#if defined(PIXELS_HAVE_X86)
+// Packs four R8G8B8X8 pixels into the low 12 bytes: in each 64-bit half, the second pixel is shifted down over the X byte of the first,
+// then the upper half is moved down over the two unused bytes of the lower one.
+static inline PIXELS_SSE2_TARGET __m128i pixels_pack_sse2(__m128i v) {
+    __m128i first = _mm_and_si128(v, _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF));
+    __m128i second = _mm_and_si128(_mm_srli_epi64(v, 8), _mm_set_epi32(0x0000FFFF, (int)0xFF000000, 0x0000FFFF, (int)0xFF000000));
+    __m128i halves = _mm_or_si128(first, second);
+    return _mm_or_si128(_mm_move_epi64(halves), _mm_slli_si128(_mm_srli_si128(halves, 8), 6));
+}
+
+// Stores the low 12 bytes of v.
+static inline PIXELS_SSE2_TARGET void pixels_store12_sse2(uint8_t * out, __m128i v) {
+    int32_t last = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+    _mm_storel_epi64((__m128i *)out, v);
+    memcpy(out + 8, &last, sizeof(last));
+}
+
+static inline PIXELS_SSE2_TARGET __m128i pixels_widen5_sse2(__m128i v) {
+    return _mm_or_si128(_mm_slli_epi16(v, 3), _mm_srli_epi16(v, 2));
+}
+
+static PIXELS_SSE2_TARGET void pixels_x1r5g5b5_sse2(const uint8_t * in, uint8_t * out, uint32_t count) {
+    const __m128i mask5 = _mm_set1_epi16(0x1F);
+    while (count >= 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)in);
+        __m128i r, g, b, rg;
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        r = pixels_widen5_sse2(_mm_and_si128(_mm_srli_epi16(v, 10), mask5));
+        g = pixels_widen5_sse2(_mm_and_si128(_mm_srli_epi16(v, 5), mask5));
+        b = pixels_widen5_sse2(_mm_and_si128(v, mask5));
+        rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+        pixels_store12_sse2(out, pixels_pack_sse2(_mm_unpacklo_epi16(rg, b)));
+        pixels_store12_sse2(out + 12, pixels_pack_sse2(_mm_unpackhi_epi16(rg, b)));
+        in += 16;
+        out += 24;
+        count -= 8;
+    }
+    pixels_x1r5g5b5_scalar(in, out, count);
+}
+
+// Stores 16 grey levels as R8G8B8.
+static inline PIXELS_SSE2_TARGET void pixels_grey16_sse2(uint8_t * out, __m128i grey) {
+    const __m128i low = _mm_set1_epi16(0x00FF);
+    __m128i gg_lo = _mm_unpacklo_epi8(grey, grey);
+    __m128i gg_hi = _mm_unpackhi_epi8(grey, grey);
+    pixels_store12_sse2(out, pixels_pack_sse2(_mm_unpacklo_epi16(gg_lo, _mm_and_si128(gg_lo, low))));
+    pixels_store12_sse2(out + 12, pixels_pack_sse2(_mm_unpackhi_epi16(gg_lo, _mm_and_si128(gg_lo, low))));
+    pixels_store12_sse2(out + 24, pixels_pack_sse2(_mm_unpacklo_epi16(gg_hi, _mm_and_si128(gg_hi, low))));
+    pixels_store12_sse2(out + 36, pixels_pack_sse2(_mm_unpackhi_epi16(gg_hi, _mm_and_si128(gg_hi, low))));
+}
+
+// Unpacks nibbles into grey levels, the high nibble first; the multiplication by 0x11 can't carry, as each byte is below 0x10.
+static inline PIXELS_SSE2_TARGET void pixels_unpack_g4_sse2(__m128i v, __m128i * lo, __m128i * hi) {
+    const __m128i mask4 = _mm_set1_epi8(0x0F);
+    __m128i first = _mm_and_si128(_mm_srli_epi16(v, 4), mask4);
+    __m128i second = _mm_and_si128(v, mask4);
+    *lo = _mm_unpacklo_epi8(first, second);
+    *hi = _mm_unpackhi_epi8(first, second);
+    *lo = _mm_or_si128(*lo, _mm_slli_epi16(*lo, 4));
+    *hi = _mm_or_si128(*hi, _mm_slli_epi16(*hi, 4));
+}
+
+static PIXELS_SSE2_TARGET void pixels_g4_sse2(const uint8_t * in, uint8_t * out, uint32_t count) {
+    while (count >= 32) {
+        __m128i lo, hi;
+        pixels_unpack_g4_sse2(_mm_loadu_si128((const __m128i *)in), &lo, &hi);
+        pixels_grey16_sse2(out, lo);
+        pixels_grey16_sse2(out + 48, hi);
+        in += 16;
+        out += 96;
+        count -= 32;
+    }
+    pixels_g4_scalar(in, out, count);
+}
+
+// Packs the R8G8B8X8 pixels of each 128-bit lane into its low 12 bytes, and stores the 24 bytes.
+static inline PIXELS_AVX2_TARGET void pixels_store24_avx2(uint8_t * out, __m256i v) {
+    const __m256i squeeze = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                             0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    __m256i packed = _mm256_shuffle_epi8(v, squeeze);
+    __m128i high = _mm256_extracti128_si256(packed, 1);
+    int32_t last = _mm_cvtsi128_si32(_mm_srli_si128(high, 8));
+    // The last 4 bytes of the first store are overwritten by the second one.
+    _mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(packed));
+    _mm_storel_epi64((__m128i *)(out + 12), high);
+    memcpy(out + 20, &last, sizeof(last));
+}
+
+static inline PIXELS_AVX2_TARGET __m256i pixels_x1r5g5b5_8_avx2(const uint8_t * in) {
+    const __m256i mask5 = _mm256_set1_epi32(0x1F);
+    __m128i v = _mm_loadu_si128((const __m128i *)in);
+    __m256i w, r, g, b;
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    w = _mm256_cvtepu16_epi32(v);
+    r = _mm256_and_si256(_mm256_srli_epi32(w, 10), mask5);
+    g = _mm256_and_si256(_mm256_srli_epi32(w, 5), mask5);
+    b = _mm256_and_si256(w, mask5);
+    r = _mm256_or_si256(_mm256_slli_epi32(r, 3), _mm256_srli_epi32(r, 2));
+    g = _mm256_or_si256(_mm256_slli_epi32(g, 3), _mm256_srli_epi32(g, 2));
+    b = _mm256_or_si256(_mm256_slli_epi32(b, 3), _mm256_srli_epi32(b, 2));
+    return _mm256_or_si256(r, _mm256_or_si256(_mm256_slli_epi32(g, 8), _mm256_slli_epi32(b, 16)));
+}
+
+static PIXELS_AVX2_TARGET void pixels_x1r5g5b5_avx2(const uint8_t * in, uint8_t * out, uint32_t count) {
+    while (count >= 16) {
+        pixels_store24_avx2(out, pixels_x1r5g5b5_8_avx2(in));
+        pixels_store24_avx2(out + 24, pixels_x1r5g5b5_8_avx2(in + 16));
+        in += 32;
+        out += 48;
+        count -= 16;
+    }
+    pixels_x1r5g5b5_scalar(in, out, count);
+}
+
+static PIXELS_AVX2_TARGET void pixels_g4_avx2(const uint8_t * in, uint8_t * out, uint32_t count) {
+    const __m256i replicate = _mm256_set1_epi32(0x010101);
+    while (count >= 32) {
+        __m128i lo, hi;
+        pixels_unpack_g4_sse2(_mm_loadu_si128((const __m128i *)in), &lo, &hi);
+        pixels_store24_avx2(out, _mm256_mullo_epi32(_mm256_cvtepu8_epi32(lo), replicate));
+        pixels_store24_avx2(out + 24, _mm256_mullo_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(lo, 8)), replicate));
+        pixels_store24_avx2(out + 48, _mm256_mullo_epi32(_mm256_cvtepu8_epi32(hi), replicate));
+        pixels_store24_avx2(out + 72, _mm256_mullo_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(hi, 8)), replicate));
+        in += 16;
+        out += 96;
+        count -= 32;
+    }
+    pixels_g4_scalar(in, out, count);
+}
+#endif
+
+#if defined(PIXELS_HAVE_NEON)
+static inline uint16x8_t pixels_widen5_neon(uint16x8_t v) {
+    return vorrq_u16(vshlq_n_u16(v, 3), vshrq_n_u16(v, 2));
+}
+
+static void pixels_x1r5g5b5_neon(const uint8_t * in, uint8_t * out, uint32_t count) {
+    const uint16x8_t mask5 = vdupq_n_u16(0x1F);
+    while (count >= 8) {
+        uint16x8_t v = vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8(in)));
+        uint8x8x3_t rgb;
+        rgb.val[0] = vmovn_u16(pixels_widen5_neon(vandq_u16(vshrq_n_u16(v, 10), mask5)));
+        rgb.val[1] = vmovn_u16(pixels_widen5_neon(vandq_u16(vshrq_n_u16(v, 5), mask5)));
+        rgb.val[2] = vmovn_u16(pixels_widen5_neon(vandq_u16(v, mask5)));
+        vst3_u8(out, rgb);
+        in += 16;
+        out += 24;
+        count -= 8;
+    }
+    pixels_x1r5g5b5_scalar(in, out, count);
+}
+
+static void pixels_g4_neon(const uint8_t * in, uint8_t * out, uint32_t count) {
+    while (count >= 16) {
+        uint8x8_t v = vld1_u8(in);
+        uint8x8x2_t nibbles = vzip_u8(vshr_n_u8(v, 4), vand_u8(v, vdup_n_u8(0x0F)));
+        uint8x16_t grey = vcombine_u8(nibbles.val[0], nibbles.val[1]);
+        uint8x16x3_t rgb;
+        grey = vorrq_u8(grey, vshlq_n_u8(grey, 4));
+        rgb.val[0] = grey;
+        rgb.val[1] = grey;
+        rgb.val[2] = grey;
+        vst3q_u8(out, rgb);
+        in += 8;
+        out += 48;
+        count -= 16;
+    }
+    pixels_g4_scalar(in, out, count);
+}
+#endif
+
+// Checks an implementation against the scalar one, on various pixel counts and alignments.
+static int pixels_self_test(pixels_convert_fn convert, pixels_convert_fn reference, uint32_t bits) {
+    uint8_t in[256 + 16];
+    uint8_t out[3 * 512 + 16];
+    uint8_t expected[3 * 512 + 16];
+    uint32_t seed = 0x2468ACE1;
+    uint32_t i, offset, count;
+
+    for (i = 0; i < sizeof(in); i++) {
+        seed = seed * 1103515245 + 12345;
+        in[i] = (uint8_t)(seed >> 24);
+    }
+    for (offset = 0; offset < 16; offset += 3) {
+        for (count = 0; count * bits <= 256 * 8; count += (count < 100 ? 1 : 37)) {
+            // The sentinel after the last pixel catches stores past the end.
+            memset(out, 0xA5, sizeof(out));
+            memset(expected, 0xA5, sizeof(expected));
+            convert(in + offset, out + offset, count);
+            reference(in + offset, expected + offset, count);
+            if (memcmp(out, expected, sizeof(out))) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Selects candidate if it passes the self-test.
+static int pixels_select(pixels_convert_fn * impl, pixels_convert_fn candidate, pixels_convert_fn reference, uint32_t bits, const char * name, const char * function) {
+    if (pixels_self_test(candidate, reference, bits)) {
+        *impl = candidate;
+        return 1;
+    }
+    hpopers_error("%s: %s implementation failed self-test", function, name);
+    return 0;
+}
+
+void pixels_init(void) {
+    const char * name = "scalar";
+
+    if (pixels_initialized) {
+        return;
+    }
+
+    pixels_x1r5g5b5_impl = pixels_x1r5g5b5_scalar;
+    pixels_g4_impl = pixels_g4_scalar;
+#if defined(PIXELS_HAVE_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        if (  pixels_select(&pixels_x1r5g5b5_impl, pixels_x1r5g5b5_sse2, pixels_x1r5g5b5_scalar, 16, "sse2", __FUNCTION__)
+            & pixels_select(&pixels_g4_impl, pixels_g4_sse2, pixels_g4_scalar, 4, "sse2", __FUNCTION__)) {
+            name = "sse2";
+        }
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        if (  pixels_select(&pixels_x1r5g5b5_impl, pixels_x1r5g5b5_avx2, pixels_x1r5g5b5_scalar, 16, "avx2", __FUNCTION__)
+            & pixels_select(&pixels_g4_impl, pixels_g4_avx2, pixels_g4_scalar, 4, "avx2", __FUNCTION__)) {
+            name = "avx2";
+        }
+    }
+#elif defined(PIXELS_HAVE_NEON)
+    if (  pixels_select(&pixels_x1r5g5b5_impl, pixels_x1r5g5b5_neon, pixels_x1r5g5b5_scalar, 16, "neon", __FUNCTION__)
+        & pixels_select(&pixels_g4_impl, pixels_g4_neon, pixels_g4_scalar, 4, "neon", __FUNCTION__)) {
+        name = "neon";
+    }
+#endif
+
+    hpopers_info("%s: using %s implementation", __FUNCTION__, name);
+    pixels_initialized = 1;
+}
+
+void pixels_x1r5g5b5_to_r8g8b8(const uint8_t * in, uint8_t * out, uint32_t count) {
+    // Before pixels_init() has run, only the scalar implementation can be used.
+    if (pixels_x1r5g5b5_impl != NULL) {
+        (pixels_x1r5g5b5_impl)(in, out, count);
+    }
+    else {
+        pixels_x1r5g5b5_scalar(in, out, count);
+    }
+}
+
+void pixels_g4_to_r8g8b8(const uint8_t * in, uint8_t * out, uint32_t count) {
+    if (pixels_g4_impl != NULL) {
+        (pixels_g4_impl)(in, out, count);
+    }
+    else {
+        pixels_g4_scalar(in, out, count);
+    }
+}
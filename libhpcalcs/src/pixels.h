@@ -0,0 +1,38 @@
+/*
+ * libhpopers: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file pixels.h Opers: conversion of the pixels of Prime screenshots to R8G8B8.
+ */
+
+#ifndef __HPLIBS_PIXELS_H__
+#define __HPLIBS_PIXELS_H__
+
+#include <stdint.h>
+
+//! Selects the fastest implementations supported by the CPU. Called by hpopers_init().
+void pixels_init(void);
+//! Converts \a count 16-bit big-endian X1R5G5B5 pixels, as in the 16-bit screenshot formats, to R8G8B8.
+void pixels_x1r5g5b5_to_r8g8b8(const uint8_t * in, uint8_t * out, uint32_t count);
+//! Converts \a count 4-bit grey levels, packed two per byte with the first one in the high nibble, as in the 4-bit screenshot formats, to R8G8B8.
+void pixels_g4_to_r8g8b8(const uint8_t * in, uint8_t * out, uint32_t count);
+//! Decodes a screenshot, as received from the calculator, into the R8G8B8 rows of \a out, \a stride bytes apart, clipped to \a max_width x \a max_height. Implemented in opers_screen.c.
+int screen_decode_r8g8b8(const uint8_t * in_data, uint32_t in_size, uint8_t * out, uint32_t stride, uint32_t max_width, uint32_t max_height);
+
+#endif
@@ -31,64 +31,27 @@
 
 #include <hpcalcs.h>
 #include "prime_cmd.h"
+#include "internal.h"
 #include "logging.h"
 #include "error.h"
 #include "utils.h"
+#include "crc16.h"
 
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <wchar.h>
 
-static inline uint16_t crc16_block(const uint8_t * buffer, uint32_t len) {
-    static const uint16_t ccitt_crc16_table[256] = {
-        0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
-        0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
-        0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
-        0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
-        0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
-        0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
-        0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
-        0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
-        0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
-        0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
-        0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
-        0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
-        0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
-        0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
-        0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
-        0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
-        0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
-        0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
-        0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
-        0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
-        0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
-        0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
-        0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
-        0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
-        0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
-        0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
-        0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
-        0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
-        0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
-        0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
-        0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
-        0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
-    };
-    uint16_t crc = 0;
-
-    while (len--) {
-       crc = ccitt_crc16_table[(crc >> 8) ^ *buffer++] ^ (crc << 8);
-    }
-    return crc;
-}
-
-static int read_vtl_pkt(calc_handle * handle, uint8_t cmd, prime_vtl_pkt ** pkt, int packet_contains_header) {
+// Reads a virtual packet. If crc_requested is nonzero, the CRC over data[crc_begin .. size - crc_tail), with the embedded CRC field at crc_field counted as zeros, is computed during reassembly.
+static int read_vtl_pkt_with_crc(calc_handle * handle, uint8_t cmd, prime_vtl_pkt ** pkt, int crc_requested, uint32_t crc_begin, uint32_t crc_tail, uint32_t crc_field) {
     int res;
-    (void)packet_contains_header;
     *pkt = prime_vtl_pkt_new(0);
     if (*pkt != NULL) {
         (*pkt)->cmd = cmd;
+        (*pkt)->crc_requested = (uint8_t)(crc_requested != 0);
+        (*pkt)->crc_begin = crc_begin;
+        (*pkt)->crc_tail = crc_tail;
+        (*pkt)->crc_field = crc_field;
         res = prime_recv_data(handle, *pkt);
         if (res == ERR_SUCCESS) {
             if ((*pkt)->size > 0) {
@@ -116,10 +79,153 @@ static int read_vtl_pkt(calc_handle * handle, uint8_t cmd, prime_vtl_pkt ** pkt,
     return res;
 }
 
+static int read_vtl_pkt(calc_handle * handle, uint8_t cmd, prime_vtl_pkt ** pkt, int packet_contains_header) {
+    (void)packet_contains_header;
+    return read_vtl_pkt_with_crc(handle, cmd, pkt, 0, 0, 0, 0);
+}
+
 static int write_vtl_pkt(calc_handle * handle, prime_vtl_pkt * pkt) {
     return prime_send_data(handle, pkt);
 }
 
+// Size of the part of a file header which precedes the name: cmd, 0x01, size, type, name length, CRC.
+#define PRIME_STREAM_FILE_HEADER_SIZE (10)
+// Size of the header of a screenshot: cmd, 0x01, size, CRC, format, 4 marker bytes.
+#define PRIME_STREAM_SCREEN_HEADER_SIZE (13)
+
+// State of a reply streamed to a calc_recv_callback: the header is gathered first, then the payload is handed over slice by slice.
+typedef struct {
+    calc_recv_chunk chunk;
+    calc_recv_callback callback;
+    void * user_data;
+    uint8_t format; // Expected screenshot format.
+    uint8_t header_done;
+    uint32_t invalid_count;
+    uint32_t header_size;
+    uint8_t header[PRIME_STREAM_FILE_HEADER_SIZE + 255];
+} prime_stream_parser;
+
+static int stream_parse_header(prime_stream_parser * parser, uint32_t expected_size) {
+    int res = ERR_SUCCESS;
+    uint8_t * ptr = parser->header;
+    parser->chunk.size = expected_size - parser->header_size;
+    if (parser->chunk.cmd == CMD_PRIME_RECV_SCREEN) {
+        // For whatever reason the CRC seems to be encoded the other way around compared to receiving files
+        parser->chunk.embedded_crc = (((uint16_t)(ptr[6])) << 8) | ((uint16_t)(ptr[7]));
+        if (!(ptr[8] == parser->format && ptr[9] == 0xFF && ptr[10] == 0xFF && ptr[11] == 0xFF && ptr[12] == 0xFF)) {
+            res = ERR_CALC_PACKET_FORMAT;
+            hpcalcs_warning("%s: unknown marker at beginning of image", __FUNCTION__);
+        }
+    }
+    else {
+        parser->chunk.embedded_crc = (((uint16_t)(ptr[9])) << 8) | ((uint16_t)(ptr[8]));
+        parser->chunk.type = ptr[6];
+        memset(parser->chunk.name, 0, sizeof(parser->chunk.name));
+        memcpy(parser->chunk.name, &ptr[PRIME_STREAM_FILE_HEADER_SIZE], ptr[7]);
+    }
+    return res;
+}
+
+static int stream_consume(prime_vtl_pkt * pkt, uint32_t expected_size, const uint8_t * data, uint32_t size, void * user_data) {
+    prime_stream_parser * parser = (prime_stream_parser *)user_data;
+    uint32_t offset = pkt->size;
+    int res = ERR_SUCCESS;
+
+    if (parser->chunk.cmd != CMD_PRIME_RECV_SCREEN && expected_size < 11) {
+        // Too short for a file, e.g. the F9 packet ending a backup: only keep the command for read_vtl_pkt_stream.
+        if (offset == 0) {
+            parser->header[0] = data[0];
+        }
+        return res;
+    }
+
+    // The header may straddle raw packets. For files, its size is only known once the name length has arrived.
+    while (size > 0 && !parser->header_done) {
+        uint32_t count = parser->header_size - offset < size ? parser->header_size - offset : size;
+        memcpy(parser->header + offset, data, count);
+        offset += count;
+        data += count;
+        size -= count;
+        if (offset == parser->header_size) {
+            if (parser->chunk.cmd != CMD_PRIME_RECV_SCREEN && parser->header_size == 8) {
+                parser->header_size = PRIME_STREAM_FILE_HEADER_SIZE + parser->header[7];
+            }
+            else {
+                res = stream_parse_header(parser, expected_size);
+                if (res != ERR_SUCCESS) {
+                    return res;
+                }
+                parser->header_done = 1;
+            }
+        }
+    }
+    if (size > 0) {
+        parser->chunk.offset = offset - parser->header_size;
+        parser->chunk.crc = pkt->crc;
+        res = (*parser->callback)(&parser->chunk, data, size, parser->user_data);
+    }
+    return res;
+}
+
+// Streams a file or screenshot reply to the parser's callback. *out_none is set if the reply carries no file, e.g. the F9 packet ending a backup.
+static int read_vtl_pkt_stream(calc_handle * handle, prime_stream_parser * parser, int * out_none) {
+    int res;
+    prime_vtl_pkt pkt;
+
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.cmd = parser->chunk.cmd;
+    pkt.crc_requested = 1;
+    if (parser->chunk.cmd == CMD_PRIME_RECV_SCREEN) {
+        // The CRC for *screenshots* skips the header, and includes all data.
+        pkt.crc_begin = 6;
+        pkt.crc_field = 6;
+        parser->header_size = PRIME_STREAM_SCREEN_HEADER_SIZE;
+    }
+    else {
+        // The CRC contains the initial 0x00, but not the final 6 bytes (...).
+        pkt.crc_tail = 6;
+        pkt.crc_field = 8;
+        parser->header_size = 8;
+    }
+    parser->header_done = 0;
+    parser->header[0] = 0;
+    *out_none = 0;
+
+    res = prime_recv_data_stream(handle, &pkt, &stream_consume, parser);
+    if (res == ERR_SUCCESS) {
+        if (parser->header_done) {
+            parser->chunk.complete = 1;
+            parser->chunk.offset = parser->chunk.size;
+            parser->chunk.crc = pkt.crc;
+            parser->chunk.invalid = (!pkt.crc_computed || pkt.crc != parser->chunk.embedded_crc);
+            hpcalcs_info("%s: embedded=%" PRIX16 " computed=%" PRIX16, __FUNCTION__, parser->chunk.embedded_crc, pkt.crc);
+            if (parser->chunk.invalid) {
+                hpcalcs_error("%s: CRC mismatch", __FUNCTION__);
+            }
+            res = (*parser->callback)(&parser->chunk, NULL, 0, parser->user_data);
+            if (res == ERR_SUCCESS && parser->chunk.invalid) {
+                // Keep the outcome for calc_prime_r_recv_screen_stream, which fails on CRC mismatches like calc_prime_r_recv_screen.
+                parser->invalid_count++;
+            }
+            parser->chunk.complete = 0;
+            parser->chunk.invalid = 0;
+        }
+        // An empty packet means that nothing came in before the read timeout.
+        else if (parser->chunk.cmd != CMD_PRIME_RECV_SCREEN && pkt.size > 0 && pkt.size < 11 && parser->header[0] == 0xF9) {
+            hpcalcs_info("%s: skipping F9 packet", __FUNCTION__);
+            *out_none = 1;
+        }
+        else {
+            res = ERR_CALC_PACKET_FORMAT;
+            hpcalcs_info("%s: packet is too short: %" PRIu32 "bytes", __FUNCTION__, pkt.size);
+        }
+    }
+    else {
+        hpcalcs_error("%s: failed to read packet", __FUNCTION__);
+    }
+    return res;
+}
+
 HPEXPORT int HPCALL calc_prime_s_check_ready(calc_handle * handle) {
     int res;
     if (handle != NULL) {
@@ -306,11 +412,15 @@ HPEXPORT int HPCALL calc_prime_s_recv_screen(calc_handle * handle, calc_screensh
     return res;
 }
 
-HPEXPORT int HPCALL calc_prime_r_recv_screen(calc_handle * handle, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size) {
+HPEXPORT int HPCALL calc_prime_r_recv_screen(calc_handle * handle, calc_screenshot_format format, calc_payload * out_payload) {
     int res;
+    if (out_payload != NULL) {
+        memset(out_payload, 0, sizeof(*out_payload));
+    }
     if (handle != NULL) {
         prime_vtl_pkt * pkt;
-        res = read_vtl_pkt(handle, CMD_PRIME_RECV_SCREEN, &pkt, 1);
+        // The CRC for *screenshots* skips the header, and includes all data.
+        res = read_vtl_pkt_with_crc(handle, CMD_PRIME_RECV_SCREEN, &pkt, 1, 6, 0, 6);
         if (res == ERR_SUCCESS && pkt != NULL) {
             if (pkt->size > 13) {
                 // Packet has CRC
@@ -318,10 +428,15 @@ HPEXPORT int HPCALL calc_prime_r_recv_screen(calc_handle * handle, calc_screensh
                 uint8_t * ptr = pkt->data;
                 // For whatever reason the CRC seems to be encoded the other way around compared to receiving files
                 uint16_t embedded_crc = (((uint16_t)(ptr[6])) << 8) | ((uint16_t)(ptr[7]));
-                // Reset CRC before computing
-                ptr[6] = 0x00;
-                ptr[7] = 0x00;
-                computed_crc = crc16_block(ptr + 6, pkt->size - 6); // The CRC for *screenshots* skips the header, and includes all data.
+                if (pkt->crc_computed) {
+                    computed_crc = pkt->crc;
+                }
+                else {
+                    // Reset CRC before computing
+                    ptr[6] = 0x00;
+                    ptr[7] = 0x00;
+                    computed_crc = crc16_block(ptr + 6, pkt->size - 6);
+                }
                 hpcalcs_info("%s: embedded=%" PRIX16 " computed=%" PRIX16, __FUNCTION__, embedded_crc, computed_crc);
                 if (computed_crc != embedded_crc) {
                     res = ERR_CALC_PACKET_FORMAT;
@@ -330,10 +445,11 @@ HPEXPORT int HPCALL calc_prime_r_recv_screen(calc_handle * handle, calc_screensh
 
                 // Skip marker.
                 if (pkt->data[8] == (uint8_t)format && pkt->data[9] == 0xFF && pkt->data[10] == 0xFF && pkt->data[11] == 0xFF && pkt->data[12] == 0xFF) {
-                    if (out_data != NULL && out_size != NULL) {
-                        *out_size = pkt->size - 13;
-                        memmove(pkt->data, pkt->data + 13, pkt->size - 13);
-                        *out_data = pkt->data; // Transfer ownership of the memory block to the caller.
+                    if (out_payload != NULL && res == ERR_SUCCESS) {
+                        // The image stays where it was reassembled, after the header.
+                        out_payload->block = pkt->data; // Transfer ownership of the memory block to the caller.
+                        out_payload->offset = 13;
+                        out_payload->size = pkt->size - 13;
                         pkt->data = NULL; // Detach it from virtual packet.
                     }
                     // else do nothing. res is already ERR_SUCCESS.
@@ -360,6 +476,34 @@ HPEXPORT int HPCALL calc_prime_r_recv_screen(calc_handle * handle, calc_screensh
     return res;
 }
 
+HPEXPORT int HPCALL calc_prime_r_recv_screen_stream(calc_handle * handle, calc_screenshot_format format, calc_recv_callback callback, void * user_data) {
+    int res;
+    if (handle != NULL && callback != NULL) {
+        prime_stream_parser * parser = (prime_stream_parser *)(hpcalcs_alloc_funcs.calloc)(1, sizeof(*parser));
+        if (parser != NULL) {
+            int none;
+            parser->chunk.cmd = CMD_PRIME_RECV_SCREEN;
+            parser->callback = callback;
+            parser->user_data = user_data;
+            parser->format = (uint8_t)format;
+            res = read_vtl_pkt_stream(handle, parser, &none);
+            if (res == ERR_SUCCESS && parser->invalid_count != 0) {
+                res = ERR_CALC_PACKET_FORMAT;
+            }
+            (hpcalcs_alloc_funcs.free)(parser);
+        }
+        else {
+            res = ERR_MALLOC;
+            hpcalcs_error("%s: couldn't allocate parser", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
 HPEXPORT int HPCALL calc_prime_s_enable_new_protocol(calc_handle * handle) {
     int res;
     res = prime_send_new_protocol_init(handle);
@@ -409,81 +553,184 @@ HPEXPORT int HPCALL calc_prime_r_disable_new_protocol(calc_handle * handle) {
     return res;
 }
 
-HPEXPORT int HPCALL calc_prime_s_send_file(calc_handle * handle, files_var_entry * file) {
+HPEXPORT int HPCALL calc_prime_negotiate_new_protocol(calc_handle * handle) {
     int res;
-    if (handle != NULL && file != NULL) {
-        uint32_t offset = 0;
-        uint32_t header_size = 8;
-        uint8_t namelen = (uint8_t)char16_strlen(file->name) * 2;
-        uint32_t size = namelen + file->size + 10; // Size of the data plus something
-        uint32_t other_size = namelen + file->size + 4; // Also size of the data plus something
-        prime_vtl_pkt * pkt;
-
-        // Some text editors add the UTF-16LE BOM at the beginning of the file, but the SDKV0.30 firmware version chokes on it.
-        // Therefore, skip the BOM.
-        if (   (file->type == PRIME_TYPE_PRGM || file->type == PRIME_TYPE_NOTE)
-            && (file->data[0] == 0xFF && file->data[1] == 0xFE)
-           ) {
-            offset = 2;
-            size -= 2;
-            other_size -= 2;
+    if (handle != NULL) {
+        if (handle->protocol_version == 0) {
+            uint64_t keepalives = __atomic_load_n(&handle->keepalives, __ATOMIC_RELAXED);
+            // Switch to the new protocol, and check the status in it: firmware versions which support it
+            // precede their reply with a keepalive report.
+            res = calc_prime_s_enable_new_protocol(handle);
+            if (res == ERR_SUCCESS) {
+                res = calc_prime_s_check_ready(handle);
+            }
+            if (res == ERR_SUCCESS) {
+                res = calc_prime_r_check_ready(handle, NULL, NULL);
+            }
+            if (res == ERR_SUCCESS && __atomic_load_n(&handle->keepalives, __ATOMIC_RELAXED) != keepalives) {
+                res = prime_keepalive_start(handle);
+                if (res == ERR_SUCCESS) {
+                    hpcalcs_info("%s: using the new protocol", __FUNCTION__);
+                }
+            }
+            else {
+                int disable_res;
+                if (res == ERR_SUCCESS) {
+                    hpcalcs_info("%s: the calculator doesn't seem to support the new protocol", __FUNCTION__);
+                }
+                // Bring the calculator back to the old protocol, whatever state it's in.
+                disable_res = calc_prime_s_disable_new_protocol(handle);
+                if (disable_res == ERR_SUCCESS) {
+                    disable_res = calc_prime_r_disable_new_protocol(handle);
+                }
+                if (res == ERR_SUCCESS) {
+                    res = disable_res;
+                }
+            }
+            if (res != ERR_SUCCESS) {
+                handle->protocol_version = 0;
+            }
+        }
+        else {
+            res = ERR_SUCCESS;
         }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
 
-        pkt = prime_vtl_pkt_new(size + header_size); // Add size of the header.
-        if (pkt != NULL) {
-            uint8_t * ptr;
-            uint16_t crc16;
+// Size of the header of a file sent to the calculator, excluding the name.
+#define PRIME_SEND_FILE_HEADER_SIZE (18)
 
-            pkt->cmd = CMD_PRIME_RECV_FILE;
-            ptr = pkt->data;
+// Builds the header of the virtual packet carrying a file, shared by calc_prime_s_send_file and calc_prime_frame_file.
+// The virtual packet is the header followed by file->data + *out_offset, *out_body_size bytes: the file data is never copied.
+static uint32_t build_send_file_header(files_var_entry * file, uint8_t header[PRIME_SEND_FILE_HEADER_SIZE + 255], uint32_t * out_offset, uint32_t * out_body_size) {
+    uint32_t offset = 0;
+    uint32_t header_size = 8;
+    uint8_t namelen = (uint8_t)char16_strlen(file->name) * 2;
+    uint32_t size = namelen + file->size + 10; // Size of the data plus something
+    uint32_t other_size = namelen + file->size + 4; // Also size of the data plus something
+    uint8_t * ptr;
+    uint16_t crc16;
 
-            // Command sequence. Connectivity kit increments this after each command, but the Prime seems to ignore it.
-            *ptr++ = 0x01;
-            *ptr++ = 0x00;
-            *ptr++ = 0x00;
-            *ptr++ = 0x00;  
+    // Some text editors add the UTF-16LE BOM at the beginning of the file, but the SDKV0.30 firmware version chokes on it.
+    // Therefore, skip the BOM.
+    if (   (file->type == PRIME_TYPE_PRGM || file->type == PRIME_TYPE_NOTE)
+        && file->size >= 2 && (file->data[0] == 0xFF && file->data[1] == 0xFE)
+       ) {
+        offset = 2;
+        size -= 2;
+        other_size -= 2;
+    }
 
-            *ptr++ = (uint8_t)((size      ) & 0xFF);
-            *ptr++ = (uint8_t)((size >>  8) & 0xFF);
-            *ptr++ = (uint8_t)((size >> 16) & 0xFF);
-            *ptr++ = (uint8_t)((size >> 24) & 0xFF);
+    ptr = header;
 
-            *ptr++ = CMD_PRIME_RECV_FILE;
-            
-            // ?
-            *ptr++ = 0x03;
-            
-            // Why not use different endiannesses for sizes within the same package... It's more fun that way.
-            *ptr++ = (uint8_t)((other_size >> 24) & 0xFF);
-            *ptr++ = (uint8_t)((other_size >> 16) & 0xFF);
-            *ptr++ = (uint8_t)((other_size >>  8) & 0xFF);
-            *ptr++ = (uint8_t)((other_size      ) & 0xFF);
-            
-            *ptr++ = file->type;
-            
-            *ptr++ = namelen;
+    // Command sequence. Connectivity kit increments this after each command, but the Prime seems to ignore it.
+    *ptr++ = 0x01;
+    *ptr++ = 0x00;
+    *ptr++ = 0x00;
+    *ptr++ = 0x00;  
 
-            // CRC16, set it to 0 for now.
-            *ptr++ = 0x00;
-            *ptr++ = 0x00;
+    *ptr++ = (uint8_t)((size      ) & 0xFF);
+    *ptr++ = (uint8_t)((size >>  8) & 0xFF);
+    *ptr++ = (uint8_t)((size >> 16) & 0xFF);
+    *ptr++ = (uint8_t)((size >> 24) & 0xFF);
 
-            memcpy(ptr, file->name, namelen);
-            ptr += namelen;
+    *ptr++ = CMD_PRIME_RECV_FILE;
+    
+    // ?
+    *ptr++ = 0x03;
+    
+    // Why not use different endiannesses for sizes within the same package... It's more fun that way.
+    *ptr++ = (uint8_t)((other_size >> 24) & 0xFF);
+    *ptr++ = (uint8_t)((other_size >> 16) & 0xFF);
+    *ptr++ = (uint8_t)((other_size >>  8) & 0xFF);
+    *ptr++ = (uint8_t)((other_size      ) & 0xFF);
+    
+    *ptr++ = file->type;
+    
+    *ptr++ = namelen;
 
-            memcpy(ptr, file->data + offset, file->size - offset);
-            ptr += file->size - offset;
+    // CRC16, set it to 0 for now.
+    *ptr++ = 0x00;
+    *ptr++ = 0x00;
 
-            crc16 = crc16_block(pkt->data + header_size, size); // Excluding the header
-            pkt->data[16] = crc16 & 0xFF;
-            pkt->data[17] = (crc16 >> 8) & 0xFF;
+    memcpy(ptr, file->name, namelen);
+    ptr += namelen;
 
-            res = write_vtl_pkt(handle, pkt);
+    // Excluding the header. This is the only pass over the file data before framing.
+    crc16 = crc16_block(header + header_size, (uint32_t)(ptr - header) - header_size);
+    crc16 = crc16_update(crc16, file->data + offset, file->size - offset);
+    header[16] = crc16 & 0xFF;
+    header[17] = (crc16 >> 8) & 0xFF;
 
-            prime_vtl_pkt_del(pkt);
+    *out_offset = offset;
+    *out_body_size = file->size - offset;
+    return (uint32_t)(ptr - header);
+}
+
+HPEXPORT int HPCALL calc_prime_s_send_file(calc_handle * handle, files_var_entry * file) {
+    int res;
+    if (handle != NULL && file != NULL) {
+        uint8_t header[PRIME_SEND_FILE_HEADER_SIZE + 255];
+        uint32_t offset, body_size;
+        uint32_t header_size = build_send_file_header(file, header, &offset, &body_size);
+        // The file data is framed straight into the raw packets, e.g. from a memory mapping set up by hpfiles_ve_create_from_fd.
+        res = prime_send_data_parts(handle, header, header_size, file->data + offset, body_size);
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL calc_prime_frame_file(files_var_entry * file, calc_encoded_file ** out_encoded) {
+    int res;
+    if (file != NULL && out_encoded != NULL) {
+        uint8_t header[PRIME_SEND_FILE_HEADER_SIZE + 255];
+        uint32_t offset, body_size;
+        uint32_t header_size = build_send_file_header(file, header, &offset, &body_size);
+        calc_encoded_file * encoded = (calc_encoded_file *)(hpcalcs_alloc_funcs.calloc)(1, sizeof(*encoded));
+        *out_encoded = NULL;
+        if (encoded != NULL) {
+            // Files are always sent using the new protocol, see calc_prime_send_file. Only the framed copy is made.
+            res = prime_frame_data_parts(header, header_size, file->data + offset, body_size, 1, &encoded->reports, &encoded->frames, &encoded->count);
+            if (res == ERR_SUCCESS) {
+                encoded->model = CALC_PRIME;
+                encoded->refcount = 1;
+                encoded->protocol_version = 1;
+                encoded->size = header_size + body_size;
+                *out_encoded = encoded;
+            }
+            else {
+                (hpcalcs_alloc_funcs.free)(encoded);
+            }
         }
         else {
             res = ERR_MALLOC;
-            hpcalcs_error("%s: couldn't create packet", __FUNCTION__);
+            hpcalcs_error("%s: couldn't allocate encoded file", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL calc_prime_s_send_encoded_file(calc_handle * handle, calc_encoded_file * encoded) {
+    int res;
+    if (handle != NULL && encoded != NULL) {
+        if (encoded->protocol_version == handle->protocol_version) {
+            res = prime_send_many(handle, encoded->reports, encoded->count);
+        }
+        else {
+            res = ERR_INVALID_PARAMETER;
+            hpcalcs_error("%s: file was framed for protocol version %d, not %d", __FUNCTION__, encoded->protocol_version, handle->protocol_version);
         }
     }
     else {
@@ -554,17 +801,23 @@ HPEXPORT int HPCALL calc_prime_r_recv_file(calc_handle * handle, files_var_entry
     prime_vtl_pkt * pkt;
     // TODO: if no file was received, have *out_file = NULL, but res = 0.
     if (handle != NULL) {
-        res = read_vtl_pkt(handle, CMD_PRIME_RECV_FILE, &pkt, 1);
+        // The CRC contains the initial 0x00, but not the final 6 bytes (...).
+        res = read_vtl_pkt_with_crc(handle, CMD_PRIME_RECV_FILE, &pkt, 1, 0, 6, 8);
         if (res == ERR_SUCCESS && pkt != NULL) {
             if (pkt->size >= 11) {
                 // Packet has CRC
                 uint16_t computed_crc; // 0x0000 ?
                 uint8_t * ptr = pkt->data;
                 uint16_t embedded_crc = (((uint16_t)(ptr[9])) << 8) | ((uint16_t)(ptr[8]));
-                // Reset CRC before computing
-                ptr[8] = 0x00;
-                ptr[9] = 0x00;
-                computed_crc = crc16_block(ptr, pkt->size - 6); // The CRC contains the initial 0x00, but not the final 6 bytes (...).
+                if (pkt->crc_computed) {
+                    computed_crc = pkt->crc;
+                }
+                else {
+                    // Reset CRC before computing
+                    ptr[8] = 0x00;
+                    ptr[9] = 0x00;
+                    computed_crc = crc16_block(ptr, pkt->size - 6);
+                }
                 hpcalcs_info("%s: embedded=%" PRIX16 " computed=%" PRIX16, __FUNCTION__, embedded_crc, computed_crc);
                 if (computed_crc != embedded_crc) {
                     hpcalcs_error("%s: CRC mismatch", __FUNCTION__);
@@ -601,7 +854,8 @@ HPEXPORT int HPCALL calc_prime_r_recv_file(calc_handle * handle, files_var_entry
                 }
             }
             else {
-                if (pkt->data[0] != 0xF9) {
+                // An empty packet means that nothing came in before the read timeout.
+                if (pkt->size == 0 || pkt->data[0] != 0xF9) {
                     res = ERR_CALC_PACKET_FORMAT;
                     hpcalcs_info("%s: packet is too short: %" PRIu32 "bytes", __FUNCTION__, pkt->size);
                 }
@@ -625,6 +879,30 @@ HPEXPORT int HPCALL calc_prime_r_recv_file(calc_handle * handle, files_var_entry
     return res;
 }
 
+HPEXPORT int HPCALL calc_prime_r_recv_file_stream(calc_handle * handle, calc_recv_callback callback, void * user_data) {
+    int res;
+    if (handle != NULL && callback != NULL) {
+        prime_stream_parser * parser = (prime_stream_parser *)(hpcalcs_alloc_funcs.calloc)(1, sizeof(*parser));
+        if (parser != NULL) {
+            int none;
+            parser->chunk.cmd = CMD_PRIME_RECV_FILE;
+            parser->callback = callback;
+            parser->user_data = user_data;
+            res = read_vtl_pkt_stream(handle, parser, &none);
+            (hpcalcs_alloc_funcs.free)(parser);
+        }
+        else {
+            res = ERR_MALLOC;
+            hpcalcs_error("%s: couldn't allocate parser", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
 HPEXPORT int HPCALL calc_prime_s_recv_backup(calc_handle * handle) {
     int res;
     if (handle != NULL) {
@@ -650,11 +928,232 @@ HPEXPORT int HPCALL calc_prime_s_recv_backup(calc_handle * handle) {
     return res;
 }
 
-HPEXPORT int HPCALL calc_prime_r_recv_backup(calc_handle * handle, files_var_entry *** out_vars) {
+// Number of consecutive empty reads after which a loss-tolerant backup is considered over, if its terminator was lost.
+#define PRIME_RESYNC_IDLE_READS (3)
+
+// One report of a streamed backup: where its data starts in the stream, and whether its sequence number is that of the first report of a reply.
+typedef struct {
+    uint32_t offset;
+    uint8_t first;
+} prime_resync_report;
+
+// Tells whether the data at ptr looks like the header of a file packet, or of the short packet which terminates a backup.
+static int resync_is_header(const uint8_t * ptr, uint32_t avail, uint32_t * out_total) {
+    if (avail >= 6 && (ptr[0] == CMD_PRIME_RECV_FILE || ptr[0] == CMD_PRIME_RECV_BACKUP) && ptr[1] == 0x01) {
+        uint32_t size = (((uint32_t)ptr[2]) << 24) | (((uint32_t)ptr[3]) << 16) | (((uint32_t)ptr[4]) << 8) | ((uint32_t)ptr[5]);
+        if (size <= UINT32_MAX - 6) {
+            *out_total = size + 6;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// CRC of a file packet: the bytes before the last 6, with the CRC field at offsets 8 and 9 zeroed.
+static uint16_t resync_file_crc(const uint8_t * ptr, uint32_t total) {
+    static const uint8_t zeros[2] = { 0x00, 0x00 };
+    uint32_t len = total - 6;
+    uint16_t crc = crc16_update(0, ptr, len < 8 ? len : 8);
+    if (len > 8) {
+        crc = crc16_update(crc, zeros, len < 10 ? len - 8 : 2);
+    }
+    if (len > 10) {
+        crc = crc16_update(crc, ptr + 10, len - 10);
+    }
+    return crc;
+}
+
+// Streams in every report until the backup terminator, or until the calculator stops sending.
+// Duplicated reports are dropped; lost, truncated or out-of-sequence reports are merely appended, the scan sorts them out.
+static int resync_stream(calc_handle * handle, uint8_t ** out_data, uint32_t * out_size, prime_resync_report ** out_reports, uint32_t * out_count) {
+    int res = ERR_SUCCESS;
+    prime_raw_hid_pkt raw, last;
+    uint8_t * data = NULL;
+    uint32_t size = 0, capacity = 0;
+    prime_resync_report * reports = NULL;
+    uint32_t count = 0, reports_capacity = 0;
+    uint32_t idle = 0, total;
+
+    last.size = 0;
+    while (idle < PRIME_RESYNC_IDLE_READS) {
+        res = prime_recv(handle, &raw);
+        if (res != ERR_SUCCESS) {
+            hpcalcs_warning("%s: recv failed, stopping the stream", __FUNCTION__);
+            break;
+        }
+        if (raw.size < 2) {
+            idle++;
+            continue;
+        }
+        idle = 0;
+        // In the old protocol, 0xFE is also a legitimate sequence number, but only right after 0xFD.
+        if (raw.data[0] == 0xFF || (raw.data[0] == 0xFE && (handle->protocol_version > 0 || last.size == 0 || last.data[0] != 0xFD))) {
+            continue;
+        }
+        if (raw.size == last.size && !memcmp(raw.data, last.data, raw.size)) {
+            hpcalcs_warning("%s: skipping duplicate report", __FUNCTION__);
+            continue;
+        }
+        memcpy(last.data, raw.data, raw.size);
+        last.size = raw.size;
+
+        if (count == reports_capacity) {
+            uint32_t new_capacity = reports_capacity != 0 ? reports_capacity * 2 : 256;
+            prime_resync_report * new_reports = (prime_resync_report *)(hpcalcs_alloc_funcs.realloc)(reports, new_capacity * sizeof(*reports));
+            if (new_reports == NULL) {
+                res = ERR_MALLOC;
+                break;
+            }
+            reports = new_reports;
+            reports_capacity = new_capacity;
+        }
+        if (raw.size - 1 > capacity - size) {
+            uint32_t new_capacity = capacity != 0 ? capacity * 2 : 256 * (PRIME_RAW_HID_DATA_SIZE - 1);
+            uint8_t * new_data = (uint8_t *)(hpcalcs_alloc_funcs.realloc)(data, new_capacity);
+            if (new_data == NULL) {
+                res = ERR_MALLOC;
+                break;
+            }
+            data = new_data;
+            capacity = new_capacity;
+        }
+        reports[count].offset = size;
+        // In the new protocol mode, replies may be numbered either way, see prime_pkt_id_first.
+        reports[count].first = raw.data[0] == prime_pkt_id_first(0) || (handle->protocol_version > 0 && raw.data[0] == prime_pkt_id_first(1));
+        count++;
+        memcpy(data + size, raw.data + 1, raw.size - 1);
+        size += raw.size - 1;
+
+        // A short reply is the terminator.
+        if (reports[count - 1].first && resync_is_header(raw.data + 1, raw.size - 1, &total) && total < 11) {
+            hpcalcs_info("%s: end of backup", __FUNCTION__);
+            break;
+        }
+    }
+    if (res == ERR_MALLOC) {
+        hpcalcs_error("%s: couldn't grow the stream buffers", __FUNCTION__);
+    }
+    // A failure after some data was received only cuts the backup short.
+    if (res != ERR_MALLOC && count != 0) {
+        res = ERR_SUCCESS;
+    }
+    else if (res == ERR_SUCCESS) {
+        res = ERR_CALC_PACKET_FORMAT;
+        hpcalcs_error("%s: nothing received", __FUNCTION__);
+    }
+    *out_data = data;
+    *out_size = size;
+    *out_reports = reports;
+    *out_count = count;
+    return res;
+}
+
+static files_var_entry * resync_make_entry(const uint8_t * ptr, uint32_t size, int invalid) {
+    uint8_t namelen = ptr[7];
+    files_var_entry * entry = NULL;
+    if (size >= 10 + (uint32_t)namelen) {
+        entry = hpfiles_ve_create_with_data((uint8_t *)ptr + 10 + namelen, size - 10 - namelen);
+        if (entry != NULL) {
+            entry->type = ptr[6];
+            memcpy(entry->name, ptr + 10, namelen);
+            entry->invalid = invalid;
+        }
+    }
+    return entry;
+}
+
+HPEXPORT int HPCALL calc_prime_r_recv_backup_resync(calc_handle * handle, files_var_entry *** out_vars) {
     int res;
     if (handle != NULL) {
-        // TODO: in order to be more robust against packet losses,
-        // rewrite this code to read as much as possible, then attempt to split data according to file headers.
+        uint8_t * data;
+        uint32_t size;
+        prime_resync_report * reports;
+        uint32_t report_count;
+        res = resync_stream(handle, &data, &size, &reports, &report_count);
+        if (res == ERR_SUCCESS) {
+            uint32_t count = 0, valid = 0, consumed = 0, i, j;
+            files_var_entry ** entries = hpfiles_ve_create_array(count);
+            // Packets always start at the beginning of a report: only report boundaries are candidate headers.
+            for (i = 0; i < report_count && entries != NULL; i++) {
+                uint32_t offset = reports[i].offset, avail = size - offset, total, end;
+                const uint8_t * ptr = data + offset;
+                files_var_entry * entry = NULL;
+                if (offset < consumed || !resync_is_header(ptr, avail, &total)) {
+                    continue;
+                }
+                if (total < 11) {
+                    break;
+                }
+                if (total <= avail && ptr[7] + 10U <= total && resync_file_crc(ptr, total) == (uint16_t)(ptr[8] | (ptr[9] << 8))) {
+                    entry = resync_make_entry(ptr, total, 0);
+                    end = offset + total;
+                    valid++;
+                }
+                else if (reports[i].first && avail >= 10) {
+                    // Damaged file: it extends to its announced size, or up to the next reply, whichever comes first.
+                    end = total <= avail ? offset + total : size;
+                    for (j = i + 1; j < report_count && reports[j].offset < end; j++) {
+                        uint32_t next_total;
+                        if (reports[j].first && resync_is_header(data + reports[j].offset, size - reports[j].offset, &next_total)) {
+                            end = reports[j].offset;
+                            break;
+                        }
+                    }
+                    entry = resync_make_entry(ptr, end - offset, 1);
+                    hpcalcs_warning("%s: damaged file at offset %" PRIu32, __FUNCTION__, offset);
+                }
+                else {
+                    continue;
+                }
+                consumed = end;
+                if (entry != NULL) {
+                    files_var_entry ** new_entries;
+                    entries[count++] = entry;
+                    new_entries = hpfiles_ve_resize_array(entries, count);
+                    if (new_entries != NULL) {
+                        entries = new_entries;
+                        entries[count] = NULL;
+                    }
+                    else {
+                        hpfiles_ve_delete_array(entries);
+                        entries = NULL;
+                    }
+                }
+            }
+            if (entries != NULL) {
+                hpcalcs_info("%s: recovered %" PRIu32 " intact and %" PRIu32 " damaged files", __FUNCTION__, valid, count - valid);
+                if (out_vars != NULL) {
+                    *out_vars = entries;
+                }
+                else {
+                    hpfiles_ve_delete_array(entries);
+                }
+            }
+            else {
+                res = ERR_MALLOC;
+                hpcalcs_error("%s: couldn't create entries", __FUNCTION__);
+            }
+        }
+        else {
+            hpcalcs_error("%s: failed to receive the backup", __FUNCTION__);
+        }
+        (hpcalcs_alloc_funcs.free)(reports);
+        (hpcalcs_alloc_funcs.free)(data);
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL calc_prime_r_recv_backup(calc_handle * handle, files_var_entry *** out_vars) {
+    int res;
+    if (handle != NULL && handle->backup_resync) {
+        res = calc_prime_r_recv_backup_resync(handle, out_vars);
+    }
+    else if (handle != NULL) {
+        // A single lost report abandons the rest of the backup: see calc_prime_r_recv_backup_resync for the loss-tolerant path.
         uint32_t count = 0;
         files_var_entry ** entries = hpfiles_ve_create_array(count);
         if (entries != NULL) {
@@ -703,6 +1202,42 @@ HPEXPORT int HPCALL calc_prime_r_recv_backup(calc_handle * handle, files_var_ent
     return res;
 }
 
+HPEXPORT int HPCALL calc_prime_r_recv_backup_stream(calc_handle * handle, calc_recv_callback callback, void * user_data) {
+    int res;
+    if (handle != NULL && callback != NULL) {
+        prime_stream_parser * parser = (prime_stream_parser *)(hpcalcs_alloc_funcs.calloc)(1, sizeof(*parser));
+        if (parser != NULL) {
+            int none = 0;
+            parser->chunk.cmd = CMD_PRIME_RECV_FILE;
+            parser->callback = callback;
+            parser->user_data = user_data;
+            // Files come one after the other, until the F9 packet.
+            for (;;) {
+                res = read_vtl_pkt_stream(handle, parser, &none);
+                if (res != ERR_SUCCESS) {
+                    hpcalcs_error("%s: breaking due to reception failure", __FUNCTION__);
+                    break;
+                }
+                if (none) {
+                    hpcalcs_info("%s: breaking due to empty file", __FUNCTION__);
+                    break;
+                }
+                parser->chunk.index++;
+            }
+            (hpcalcs_alloc_funcs.free)(parser);
+        }
+        else {
+            res = ERR_MALLOC;
+            hpcalcs_error("%s: couldn't allocate parser", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
 HPEXPORT int HPCALL calc_prime_s_send_key(calc_handle * handle, uint32_t code) {
     int res;
     if (handle != NULL) {
@@ -832,17 +1367,20 @@ HPEXPORT int HPCALL calc_prime_r_send_chat(calc_handle * handle) {
     return res;
 }
 
-HPEXPORT int HPCALL calc_prime_r_recv_chat(calc_handle * handle, uint16_t ** out_data, uint32_t * out_size) {
+HPEXPORT int HPCALL calc_prime_r_recv_chat(calc_handle * handle, calc_payload * out_payload) {
     int res;
+    if (out_payload != NULL) {
+        memset(out_payload, 0, sizeof(*out_payload));
+    }
     if (handle != NULL) {
         prime_vtl_pkt * pkt;
         res = read_vtl_pkt(handle, CMD_PRIME_RECV_CHAT, &pkt, 0);
         if (res == ERR_SUCCESS && pkt != NULL) {
             if (pkt->size >= 8) {
-                if (out_data != NULL && out_size != NULL) {
-                    *out_size = pkt->size - 6;
-                    memmove(pkt->data, pkt->data + 6, pkt->size - 6);
-                    *out_data = (uint16_t *)pkt->data; // Transfer ownership of the memory block to the caller.
+                if (out_payload != NULL) {
+                    out_payload->block = pkt->data; // Transfer ownership of the memory block to the caller.
+                    out_payload->offset = 6;
+                    out_payload->size = pkt->size - 6;
                     pkt->data = NULL; // Detach it from virtual packet.
                 }
             }
@@ -54,17 +54,26 @@ HPEXPORT int HPCALL calc_prime_r_enable_new_protocol(calc_handle * handle);
 HPEXPORT int HPCALL calc_prime_s_disable_new_protocol(calc_handle * handle);
 HPEXPORT int HPCALL calc_prime_r_disable_new_protocol(calc_handle * handle);
 
+HPEXPORT int HPCALL calc_prime_negotiate_new_protocol(calc_handle * handle);
+
 HPEXPORT int HPCALL calc_prime_s_recv_screen(calc_handle * handle, calc_screenshot_format format);
-HPEXPORT int HPCALL calc_prime_r_recv_screen(calc_handle * handle, calc_screenshot_format format, uint8_t ** out_data, uint32_t * out_size);
+HPEXPORT int HPCALL calc_prime_r_recv_screen(calc_handle * handle, calc_screenshot_format format, calc_payload * out_payload);
+HPEXPORT int HPCALL calc_prime_r_recv_screen_stream(calc_handle * handle, calc_screenshot_format format, calc_recv_callback callback, void * user_data);
 
 HPEXPORT int HPCALL calc_prime_s_send_file(calc_handle * handle, files_var_entry * file);
 HPEXPORT int HPCALL calc_prime_r_send_file(calc_handle * handle);
 
+HPEXPORT int HPCALL calc_prime_frame_file(files_var_entry * file, calc_encoded_file ** out_encoded);
+HPEXPORT int HPCALL calc_prime_s_send_encoded_file(calc_handle * handle, calc_encoded_file * encoded);
+
 HPEXPORT int HPCALL calc_prime_s_recv_file(calc_handle * handle, files_var_entry * file);
 HPEXPORT int HPCALL calc_prime_r_recv_file(calc_handle * handle, files_var_entry ** out_file);
+HPEXPORT int HPCALL calc_prime_r_recv_file_stream(calc_handle * handle, calc_recv_callback callback, void * user_data);
 
 HPEXPORT int HPCALL calc_prime_s_recv_backup(calc_handle * handle);
 HPEXPORT int HPCALL calc_prime_r_recv_backup(calc_handle * handle, files_var_entry *** out_vars);
+HPEXPORT int HPCALL calc_prime_r_recv_backup_resync(calc_handle * handle, files_var_entry *** out_vars);
+HPEXPORT int HPCALL calc_prime_r_recv_backup_stream(calc_handle * handle, calc_recv_callback callback, void * user_data);
 
 HPEXPORT int HPCALL calc_prime_s_send_key(calc_handle * handle, uint32_t code);
 HPEXPORT int HPCALL calc_prime_r_send_key(calc_handle * handle);
@@ -74,6 +83,6 @@ HPEXPORT int HPCALL calc_prime_r_send_keys(calc_handle * handle);
 HPEXPORT int HPCALL calc_prime_s_send_chat(calc_handle * handle, const uint16_t * data, uint32_t size);
 HPEXPORT int HPCALL calc_prime_r_send_chat(calc_handle * handle);
 
-HPEXPORT int HPCALL calc_prime_r_recv_chat(calc_handle * handle, uint16_t ** out_data, uint32_t * out_size);
+HPEXPORT int HPCALL calc_prime_r_recv_chat(calc_handle * handle, calc_payload * out_payload);
 
 #endif
@@ -39,14 +39,87 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// Reports other than keepalives which the keepalive consumer sets aside for prime_recv; it stops reading when they fill up.
+#define PRIME_KEEPALIVE_PENDING (64)
+// Interval between two polls of the keepalive consumer, in ms.
+#define PRIME_KEEPALIVE_POLL_MS (20)
+
+// State of the keepalive consumer of a calculator handle, pointed to by calc_handle.keepalive.
+typedef struct {
+    calc_handle * handle;
+    pthread_t thread;
+    // Held while the cable is in use, by the foreground around each report, by the consumer while it polls.
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stop;
+    // Cable calls made by the foreground: the consumer only polls once a whole interval went by without any.
+    uint32_t activity;
+    // Numbering of the reply in progress, as seen from the reports read so far, see keepalive_track.
+    int v1_numbering;
+    uint8_t last_id;
+    uint32_t head;
+    uint32_t count;
+    prime_raw_hid_pkt pending[PRIME_KEEPALIVE_PENDING];
+} prime_keepalive;
+
+// Reports of a reply received without waiting, pointed to by calc_handle.pump. prime_pump_recv sets them aside as they arrive;
+// once the reply is whole, prime_recv hands them out in order, so that the usual reassembly functions run unchanged.
+typedef struct {
+    prime_reply_progress progress;
+    prime_raw_hid_pkt * reports;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t pos;
+} prime_pump;
+
+static prime_keepalive * keepalive_lock(calc_handle * handle) {
+    prime_keepalive * keepalive = (prime_keepalive *)handle->keepalive;
+    if (keepalive != NULL) {
+        pthread_mutex_lock(&keepalive->lock);
+        keepalive->activity++;
+    }
+    return keepalive;
+}
+
+static void keepalive_unlock(prime_keepalive * keepalive) {
+    if (keepalive != NULL) {
+        pthread_mutex_unlock(&keepalive->lock);
+    }
+}
+
+// Follows the numbering of the reports read from the cable, called with the lock held. In the new protocol mode, replies may be numbered
+// either way (see prime_pkt_id_first); in the old numbering, 0xFE is a data packet when it follows 0xFD, and mustn't be taken for a keepalive.
+static void keepalive_track(prime_keepalive * keepalive, const prime_raw_hid_pkt * raw) {
+    if (keepalive != NULL && raw->size > 0 && raw->data[0] != 0xFF) {
+        uint8_t pkt_id = raw->data[0];
+        if (pkt_id == prime_pkt_id_first(0)) {
+            keepalive->v1_numbering = 0;
+        }
+        else if (pkt_id == prime_pkt_id_first(1) && keepalive->last_id != prime_pkt_id_first(0)) {
+            keepalive->v1_numbering = 1;
+        }
+        keepalive->last_id = pkt_id;
+    }
+}
+
+// Tells whether a 0xFE report is a keepalive, rather than the next data packet of a reply in the old numbering.
+static int keepalive_is_keepalive(prime_keepalive * keepalive, const prime_raw_hid_pkt * raw) {
+    return raw->data[0] == 0xFE && (keepalive->v1_numbering || prime_pkt_id_next(0, keepalive->last_id) != 0xFE);
+}
 
 HPEXPORT int HPCALL prime_send(calc_handle * handle, prime_raw_hid_pkt * pkt) {
     int res;
     if (handle != NULL && pkt != NULL) {
         cable_handle * cable = handle->cable;
         if (cable != NULL) {
+            prime_keepalive * keepalive;
             hexdump("OUT", pkt->data, pkt->size, 2);
+            keepalive = keepalive_lock(handle);
             res = hpcables_cable_send(cable, pkt->data, pkt->size);
+            keepalive_unlock(keepalive);
             if (res == ERR_SUCCESS) {
                 hpcalcs_info("%s: send succeeded", __FUNCTION__);
             }
@@ -66,28 +139,167 @@ HPEXPORT int HPCALL prime_send(calc_handle * handle, prime_raw_hid_pkt * pkt) {
     return res;
 }
 
+HPEXPORT int HPCALL prime_send_many(calc_handle * handle, cable_report * reports, uint32_t count) {
+    int res;
+    if (handle != NULL && (reports != NULL || count == 0)) {
+        cable_handle * cable = handle->cable;
+        if (cable != NULL) {
+            prime_keepalive * keepalive;
+            // Dumping every report would cost more than sending it.
+            if (count > 0) {
+                hexdump("OUT", reports[0].data, reports[0].size, 2);
+            }
+            keepalive = keepalive_lock(handle);
+            res = hpcables_cable_send_many(cable, reports, count);
+            keepalive_unlock(keepalive);
+            if (res == ERR_SUCCESS) {
+                hpcalcs_info("%s: send of %" PRIu32 " packets succeeded", __FUNCTION__, count);
+            }
+            else {
+                hpcalcs_error("%s: send failed", __FUNCTION__);
+            }
+        }
+        else {
+            res = ERR_CALC_NO_CABLE;
+            hpcalcs_error("%s: cable is NULL", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
 HPEXPORT int HPCALL prime_recv(calc_handle * handle, prime_raw_hid_pkt * pkt) {
     int res;
     if (handle != NULL && pkt != NULL) {
         cable_handle * cable = handle->cable;
         if (cable != NULL) {
-            uint8_t * data;
-            data = (hpcalcs_alloc_funcs.malloc)(sizeof(pkt->data));
-            if (data != NULL) {
-                res = hpcables_cable_recv(cable, &data, &pkt->size);
-                hexdump("IN", data, pkt->size, 2);
-                if (res == ERR_SUCCESS) {
-                    //hpcalcs_info("%s: recv succeeded", __FUNCTION__);
-                    memcpy(pkt->data, data, sizeof(pkt->data));
+            prime_pump * pump = (prime_pump *)handle->pump;
+            if (pump != NULL) {
+                // Read earlier by prime_pump_recv. Past the end of the reply, behave like a read timeout.
+                if (pump->pos < pump->count) {
+                    *pkt = pump->reports[pump->pos++];
+                }
+                else {
+                    pkt->size = 0;
+                }
+                res = ERR_SUCCESS;
+            }
+            else {
+                prime_keepalive * keepalive = keepalive_lock(handle);
+                if (keepalive != NULL && keepalive->count != 0) {
+                    // Read earlier by the keepalive consumer.
+                    *pkt = keepalive->pending[keepalive->head];
+                    keepalive->head = (keepalive->head + 1) % PRIME_KEEPALIVE_PENDING;
+                    keepalive->count--;
+                    res = ERR_SUCCESS;
+                }
+                else {
+                    // The report lands directly in the raw packet.
+                    pkt->size = sizeof(pkt->data);
+                    res = hpcables_cable_recv(cable, pkt->data, &pkt->size);
+                    if (res == ERR_SUCCESS) {
+                        keepalive_track(keepalive, pkt);
+                    }
+                }
+                keepalive_unlock(keepalive);
+            }
+            if (res == ERR_SUCCESS) {
+                //hpcalcs_info("%s: recv succeeded", __FUNCTION__);
+                hexdump("IN", pkt->data, pkt->size, 2);
+            }
+            else {
+                pkt->size = 0;
+                hpcalcs_warning("%s: recv failed", __FUNCTION__);
+            }
+        }
+        else {
+            res = ERR_CALC_NO_CABLE;
+            hpcalcs_error("%s: cable is NULL", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+// Reads whatever the calculator sent while the handle was idle, discarding keepalive reports. Called with the lock held.
+static void keepalive_drain(prime_keepalive * keepalive) {
+    cable_handle * cable = keepalive->handle->cable;
+    uint32_t i;
+
+    // Poll without waiting, as the foreground may be waiting for the lock.
+    for (i = 0; i < PRIME_KEEPALIVE_PENDING && keepalive->count < PRIME_KEEPALIVE_PENDING; i++) {
+        prime_raw_hid_pkt * raw = &keepalive->pending[(keepalive->head + keepalive->count) % PRIME_KEEPALIVE_PENDING];
+        raw->size = sizeof(raw->data);
+        if (hpcables_cable_recv_nowait(cable, raw->data, &raw->size) != ERR_SUCCESS || raw->size == 0) {
+            break;
+        }
+        if (keepalive_is_keepalive(keepalive, raw)) {
+            __atomic_add_fetch(&keepalive->handle->keepalives, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        // Anything else belongs to the foreground: set it aside, and leave the rest of the traffic alone until then.
+        keepalive_track(keepalive, raw);
+        keepalive->count++;
+        break;
+    }
+}
+
+static void * keepalive_thread(void * arg) {
+    prime_keepalive * keepalive = (prime_keepalive *)arg;
+    uint32_t activity;
+    pthread_mutex_lock(&keepalive->lock);
+    activity = keepalive->activity;
+    while (!keepalive->stop) {
+        struct timespec deadline;
+        cond_deadline(&deadline, monotonic_now_ns() + PRIME_KEEPALIVE_POLL_MS * 1000000ULL);
+        // The lock is released while sleeping.
+        pthread_cond_timedwait(&keepalive->wake, &keepalive->lock, &deadline);
+        if (!keepalive->stop && keepalive->activity == activity) {
+            keepalive_drain(keepalive);
+        }
+        activity = keepalive->activity;
+    }
+    pthread_mutex_unlock(&keepalive->lock);
+    return NULL;
+}
+
+HPEXPORT int HPCALL prime_keepalive_start(calc_handle * handle) {
+    int res;
+    if (handle != NULL) {
+        if (handle->keepalive != NULL) {
+            res = ERR_SUCCESS;
+        }
+        else if (handle->cable != NULL) {
+            prime_keepalive * keepalive = (prime_keepalive *)(hpcalcs_alloc_funcs.calloc)(1, sizeof(*keepalive));
+            if (keepalive != NULL) {
+                keepalive->handle = handle;
+                // Until a reply says otherwise, the numbering is the negotiated one.
+                keepalive->v1_numbering = 1;
+                keepalive->last_id = 0xFF;
+                pthread_mutex_init(&keepalive->lock, NULL);
+                cond_init_monotonic(&keepalive->wake);
+                if (pthread_create(&keepalive->thread, NULL, keepalive_thread, keepalive) == 0) {
+                    handle->keepalive = keepalive;
+                    res = ERR_SUCCESS;
+                    hpcalcs_info("%s: keepalive consumer started", __FUNCTION__);
                 }
                 else {
-                    hpcalcs_warning("%s: recv failed", __FUNCTION__);
+                    pthread_cond_destroy(&keepalive->wake);
+                    pthread_mutex_destroy(&keepalive->lock);
+                    (hpcalcs_alloc_funcs.free)(keepalive);
+                    res = ERR_MALLOC;
+                    hpcalcs_error("%s: cannot start keepalive thread", __FUNCTION__);
                 }
-                (hpcalcs_alloc_funcs.free)(data);
             }
             else {
                 res = ERR_MALLOC;
-                hpcalcs_error("%s: failed to allocate buffer", __FUNCTION__);
+                hpcalcs_error("%s: couldn't allocate keepalive consumer", __FUNCTION__);
             }
         }
         else {
@@ -95,9 +307,144 @@ HPEXPORT int HPCALL prime_recv(calc_handle * handle, prime_raw_hid_pkt * pkt) {
             hpcalcs_error("%s: cable is NULL", __FUNCTION__);
         }
     }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL prime_keepalive_stop(calc_handle * handle) {
+    int res;
+    if (handle != NULL) {
+        prime_keepalive * keepalive = (prime_keepalive *)handle->keepalive;
+        if (keepalive != NULL) {
+            pthread_mutex_lock(&keepalive->lock);
+            keepalive->stop = 1;
+            pthread_cond_signal(&keepalive->wake);
+            pthread_mutex_unlock(&keepalive->lock);
+            pthread_join(keepalive->thread, NULL);
+            handle->keepalive = NULL;
+            if (keepalive->count != 0) {
+                hpcalcs_warning("%s: dropping %" PRIu32 " unread reports", __FUNCTION__, keepalive->count);
+            }
+            pthread_cond_destroy(&keepalive->wake);
+            pthread_mutex_destroy(&keepalive->lock);
+            (hpcalcs_alloc_funcs.free)(keepalive);
+            hpcalcs_info("%s: keepalive consumer stopped", __FUNCTION__);
+        }
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL prime_pump_start(calc_handle * handle, uint8_t cmd) {
+    int res;
+    if (handle != NULL) {
+        if (handle->pump == NULL) {
+            prime_pump * pump = (prime_pump *)(hpcalcs_alloc_funcs.calloc)(1, sizeof(*pump));
+            if (pump != NULL) {
+                pump->progress.cmd = cmd;
+                handle->pump = pump;
+                res = ERR_SUCCESS;
+            }
+            else {
+                res = ERR_MALLOC;
+                hpcalcs_error("%s: couldn't allocate memory for the reply", __FUNCTION__);
+            }
+        }
+        else {
+            res = ERR_CALC_BUSY;
+            hpcalcs_error("%s: a reply is already being received", __FUNCTION__);
+        }
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL prime_pump_recv(calc_handle * handle, int protocol_version, int * out_complete) {
+    int res;
+    if (handle != NULL && out_complete != NULL) {
+        prime_pump * pump = (prime_pump *)handle->pump;
+        cable_handle * cable = handle->cable;
+        if (pump != NULL && cable != NULL) {
+            prime_keepalive * keepalive = keepalive_lock(handle);
+
+            // Don't wait: the caller polls the cable before calling again.
+            res = ERR_SUCCESS;
+            while (res == ERR_SUCCESS && !pump->progress.complete) {
+                prime_raw_hid_pkt * raw;
+                int keep;
+                if (pump->count == pump->capacity) {
+                    uint32_t new_capacity = pump->capacity != 0 ? pump->capacity * 2 : 16;
+                    prime_raw_hid_pkt * new_reports = (prime_raw_hid_pkt *)(hpcalcs_alloc_funcs.realloc)(pump->reports, new_capacity * sizeof(*new_reports));
+                    if (new_reports == NULL) {
+                        res = ERR_MALLOC;
+                        hpcalcs_error("%s: couldn't allocate memory for the reply", __FUNCTION__);
+                        break;
+                    }
+                    pump->reports = new_reports;
+                    pump->capacity = new_capacity;
+                }
+                raw = &pump->reports[pump->count];
+                if (keepalive != NULL && keepalive->count != 0) {
+                    *raw = keepalive->pending[keepalive->head];
+                    keepalive->head = (keepalive->head + 1) % PRIME_KEEPALIVE_PENDING;
+                    keepalive->count--;
+                }
+                else {
+                    raw->size = sizeof(raw->data);
+                    res = hpcables_cable_recv_nowait(cable, raw->data, &raw->size);
+                    if (res != ERR_SUCCESS || raw->size == 0) {
+                        break;
+                    }
+                    keepalive_track(keepalive, raw);
+                }
+                // Keepalive reports are dropped here, so that they are only counted once.
+                res = prime_reply_scan(handle, protocol_version, &pump->progress, raw, &keep);
+                if (res == ERR_SUCCESS && keep) {
+                    pump->count++;
+                }
+            }
+            keepalive_unlock(keepalive);
+            *out_complete = pump->progress.complete;
+            if (res != ERR_SUCCESS) {
+                hpcalcs_error("%s: recv failed", __FUNCTION__);
+            }
+        }
+        else {
+            res = pump == NULL ? ERR_INVALID_PARAMETER : ERR_CALC_NO_CABLE;
+            hpcalcs_error("%s: no reply is being received, or cable is NULL", __FUNCTION__);
+        }
+    }
     else {
         res = ERR_INVALID_PARAMETER;
         hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
     }
     return res;
 }
+
+HPEXPORT int HPCALL prime_pump_stop(calc_handle * handle) {
+    int res;
+    if (handle != NULL) {
+        prime_pump * pump = (prime_pump *)handle->pump;
+        if (pump != NULL) {
+            handle->pump = NULL;
+            (hpcalcs_alloc_funcs.free)(pump->reports);
+            (hpcalcs_alloc_funcs.free)(pump);
+        }
+        res = ERR_SUCCESS;
+    }
+    else {
+        res = ERR_INVALID_HANDLE;
+        hpcalcs_error("%s: handle is NULL", __FUNCTION__);
+    }
+    return res;
+}
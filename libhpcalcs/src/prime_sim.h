@@ -0,0 +1,145 @@
+/*
+ * libhpcables: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file prime_sim.h Cables: simulated Prime, implementing the calculator side of the protocol in-process.
+ */
+
+#ifndef __HPLIBS_PRIME_SIM_H__
+#define __HPLIBS_PRIME_SIM_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#include "hplibs.h"
+#include "hpfiles.h"
+#include "hpcables.h"
+
+//! Statistics gathered by a simulated Prime cable.
+typedef struct {
+    uint64_t reports_in; ///< Reports written by the computer.
+    uint64_t reports_out; ///< Reports read by the computer.
+    uint64_t bytes_in; ///< Bytes written by the computer, report IDs included.
+    uint64_t bytes_out; ///< Bytes read by the computer.
+    uint64_t simulated_us; ///< Transfer time modeled from the timing parameters, whether or not the cable actually waits.
+    uint32_t commands; ///< Complete commands processed by the simulated calculator.
+    uint32_t crc_errors; ///< Files received with a CRC mismatch; they are not stored.
+    uint32_t sequence_errors; ///< Reports received with an unexpected packet ID.
+    uint32_t unknown_commands; ///< Commands the simulated calculator ignored.
+    uint32_t keys; ///< Key codes received.
+    uint32_t chats; ///< Chat messages received.
+    uint32_t keepalives; ///< 0xFE keepalive reports sent in the new protocol mode.
+} prime_sim_stats;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief Sets the timing of a simulated Prime cable: each report costs \a latency_us plus its size divided by \a bytes_per_second.
+ * \param handle the cable handle, which must be open.
+ * \param latency_us per-report latency, in microseconds.
+ * \param bytes_per_second bandwidth, 0 for unlimited.
+ * \param wait whether the cable actually sleeps, or only accounts the time in \a prime_sim_stats.simulated_us.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_prime_sim_set_timing(cable_handle * handle, uint32_t latency_us, uint32_t bytes_per_second, int wait);
+/**
+ * \brief Sets the protocol support of the simulated calculator: by default, it switches to the new protocol when asked to, and sends no idle keepalives.
+ * \param handle the cable handle, which must be open.
+ * \param max_version 0 to model a firmware which ignores requests to switch to the new protocol, 1 otherwise.
+ * \param keepalive_us interval between the 0xFE keepalive reports sent while in the new protocol mode, besides those preceding replies; 0 for none.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_prime_sim_set_protocol(cable_handle * handle, int max_version, uint32_t keepalive_us);
+/**
+ * \brief Stores a variable in the simulated calculator, replacing any variable with the same name.
+ * \param handle the cable handle, which must be open.
+ * \param entry the variable, copied.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_prime_sim_add_var(cable_handle * handle, files_var_entry * entry);
+/**
+ * \brief Retrieves copies of the variables stored in the simulated calculator.
+ * \param handle the cable handle, which must be open.
+ * \param out_vars storage area for a NULL-terminated array of variables, to be freed with \a hpfiles_ve_delete_array.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_prime_sim_get_vars(cable_handle * handle, files_var_entry *** out_vars);
+/**
+ * \brief Sets the image returned by the simulated calculator for screenshots, whatever the requested format.
+ * \param handle the cable handle, which must be open.
+ * \param data the image, copied.
+ * \param size the size of the image.
+ * \return 0 upon success, nonzero otherwise.
+ * \note This drops the images set by \a hpcables_prime_sim_set_screen_format. Like the latter, it changes the small image returned for formats below 8, which a screencast polls.
+ */
+HPEXPORT int HPCALL hpcables_prime_sim_set_screen(cable_handle * handle, const uint8_t * data, uint32_t size);
+/**
+ * \brief Sets the image returned by the simulated calculator for screenshots in one of the formats 8 to 11, e.g. so that lower resolutions yield smaller images.
+ * \param handle the cable handle, which must be open.
+ * \param format the screenshot format.
+ * \param data the image, copied.
+ * \param size the size of the image, nonzero.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_prime_sim_set_screen_format(cable_handle * handle, uint8_t format, const uint8_t * data, uint32_t size);
+/**
+ * \brief Sets the data returned by the simulated calculator for infos requests.
+ * \param handle the cable handle, which must be open.
+ * \param data the data, copied.
+ * \param size the size of the data.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_prime_sim_set_infos(cable_handle * handle, const uint8_t * data, uint32_t size);
+/**
+ * \brief Queues a chat message, to be read by e.g. \a hpcalcs_calc_recv_chat.
+ * \param handle the cable handle, which must be open.
+ * \param data the message, UTF-16LE.
+ * \param size the size of the message, in bytes.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_prime_sim_queue_chat(cable_handle * handle, const uint16_t * data, uint32_t size);
+/**
+ * \brief Retrieves the date and time last set on the simulated calculator.
+ * \param handle the cable handle, which must be open.
+ * \param out_tm storage area for the broken-down date and time; only the fields transmitted by the protocol are set.
+ * \return 0 upon success, ERR_INVALID_PARAMETER if the date and time were never set, another error code otherwise.
+ */
+HPEXPORT int HPCALL hpcables_prime_sim_get_date_time(cable_handle * handle, struct tm * out_tm);
+/**
+ * \brief Retrieves the statistics of a simulated Prime cable.
+ * \param handle the cable handle, which must be open.
+ * \param out_stats storage area for the statistics.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_prime_sim_get_stats(cable_handle * handle, prime_sim_stats * out_stats);
+/**
+ * \brief Resets the statistics of a simulated Prime cable.
+ * \param handle the cable handle, which must be open.
+ * \return 0 upon success, nonzero otherwise.
+ */
+HPEXPORT int HPCALL hpcables_prime_sim_reset_stats(cable_handle * handle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -32,6 +32,7 @@
 #include "internal.h"
 #include "logging.h"
 #include "error.h"
+#include "crc16.h"
 
 #include "prime_cmd.h"
 
@@ -43,11 +44,44 @@
 // Calcs - HP Prime virtual packets
 // -----------------------------------------------
 
+// Reassembled data is fed to the CRC in batches of this size, small enough to still be in the L1 cache.
+#define PRIME_CRC_BATCH_SIZE (4096)
+
+// The size announced by the first packet of a reply comes straight from the device: the reassembly buffer is sized from it up to this bound only,
+// and grows as the data actually arrives beyond it.
+#define PRIME_RECV_PREALLOC_MAX (1024 * 1024)
+
+// Advances the CRC of the packet over bytes [*pos .. end) of the packet, counting the embedded CRC field as zeros.
+// data holds the bytes of the packet from offset base onwards.
+static void vtl_pkt_crc_advance(prime_vtl_pkt * pkt, const uint8_t * data, uint32_t base, uint32_t * pos, uint32_t end) {
+    static const uint8_t zeros[2] = { 0x00, 0x00 };
+    while (*pos < end) {
+        uint32_t stop = end;
+        if (*pos < pkt->crc_field) {
+            if (stop > pkt->crc_field) {
+                stop = pkt->crc_field;
+            }
+            pkt->crc = crc16_update(pkt->crc, data + (*pos - base), stop - *pos);
+        }
+        else if (*pos < pkt->crc_field + 2) {
+            if (stop > pkt->crc_field + 2) {
+                stop = pkt->crc_field + 2;
+            }
+            pkt->crc = crc16_update(pkt->crc, zeros, stop - *pos);
+        }
+        else {
+            pkt->crc = crc16_update(pkt->crc, data + (*pos - base), stop - *pos);
+        }
+        *pos = stop;
+    }
+}
+
 
 HPEXPORT prime_vtl_pkt * HPCALL prime_vtl_pkt_new(uint32_t size) {
     prime_vtl_pkt * pkt = (prime_vtl_pkt *)(hpcalcs_alloc_funcs.malloc)(sizeof(*pkt));
 
     if (pkt != NULL) {
+        memset(pkt, 0, sizeof(*pkt));
         pkt->size = size;
         if (size != 0) {
             pkt->data = (uint8_t *)(hpcalcs_alloc_funcs.calloc)(size, sizeof(*pkt->data));
@@ -66,6 +100,7 @@ HPEXPORT prime_vtl_pkt * HPCALL prime_vtl_pkt_new_with_data_ptr(uint32_t size, u
     prime_vtl_pkt * pkt = (prime_vtl_pkt *)(hpcalcs_alloc_funcs.malloc)(sizeof(*pkt));
 
     if (pkt != NULL) {
+        memset(pkt, 0, sizeof(*pkt));
         pkt->size = size;
         pkt->data = data;
     }
@@ -108,65 +143,207 @@ HPEXPORT int HPCALL prime_send_new_protocol_init(calc_handle * handle) {
     return res;
 }
 
-HPEXPORT int HPCALL prime_send_data(calc_handle * handle, prime_vtl_pkt * pkt) {
-    int res;
-    if (handle != NULL && pkt != NULL) {
-        prime_raw_hid_pkt raw;
-        uint32_t i, q, r;
-        uint32_t offset = 0;
-        uint8_t pkt_id = handle->protocol_version > 0 ? 0x01 : 0x00;
+HPEXPORT uint8_t HPCALL prime_pkt_id_first(int protocol_version) {
+    return protocol_version > 0 ? 0x01 : 0x00;
+}
+
+HPEXPORT uint8_t HPCALL prime_pkt_id_next(int protocol_version, uint8_t pkt_id) {
+    pkt_id++;
+    if (protocol_version > 0) {
+        // 0xFE and 0xFF are reserved, and 0x01 only starts virtual packets: wrap from 0xFD to 0x02.
+        if (pkt_id == 0xFE) {
+            pkt_id = 0x02;
+        }
+    }
+    else {
+        // Skip 0xFF, which is used for other purposes.
+        if (pkt_id == 0xFF) {
+            pkt_id = 0x00;
+        }
+    }
+    return pkt_id;
+}
+
+// Sequence state of a reply being received.
+typedef struct {
+    int protocol_version; // Numbering followed by the reply.
+    uint32_t count; // Reports accepted so far.
+    uint8_t expected; // Packet ID of the next report.
+} vtl_pkt_seq;
+
+// Classifies a report of a reply from its packet ID: returns 1 if the report is to be skipped, 0 if it is the next one, -1 if it is out of sequence.
+// protocol_version is the mode in which the reply is received, usually that of the handle.
+// In the new protocol mode, the calculator interleaves 0xFE keepalive reports. Its replies are numbered like ours (see prime_pkt_id_next),
+// but replies numbered the old way, starting from 0x00, are accepted as well: the first report tells which numbering the reply follows.
+static int vtl_pkt_seq_check(calc_handle * handle, int protocol_version, vtl_pkt_seq * seq, uint8_t pkt_id) {
+    if (pkt_id == 0xFF) {
+        // TODO: investigate whether the second byte could indicate an error code ?
+        hpcalcs_error("%s: skipping packet starting with 0xFF", __FUNCTION__);
+        return 1;
+    }
+    if (protocol_version > 0) {
+        // In the old numbering, 0xFE is also a legitimate packet ID, but only where it is expected.
+        if (pkt_id == 0xFE && (seq->protocol_version > 0 || seq->count == 0 || seq->expected != 0xFE)) {
+            __atomic_add_fetch(&handle->keepalives, 1, __ATOMIC_RELAXED);
+            hpcalcs_info("%s: skipping keepalive packet", __FUNCTION__);
+            return 1;
+        }
+        if (seq->count == 0) {
+            seq->protocol_version = pkt_id == prime_pkt_id_first(0) ? 0 : 1;
+            seq->expected = prime_pkt_id_first(seq->protocol_version);
+        }
+    }
+    if (pkt_id != seq->expected) {
+        hpcalcs_error("%s: packet out of sequence, got %d, expected %d", __FUNCTION__, (int)pkt_id, (int)seq->expected);
+        return -1;
+    }
+    seq->count++;
+    seq->expected = prime_pkt_id_next(seq->protocol_version, pkt_id);
+    return 0;
+}
 
-        memset((void *)&raw, 0, sizeof(raw));
-        q = (pkt->size) / (PRIME_RAW_HID_DATA_SIZE - 1);
-        r = (pkt->size) % (PRIME_RAW_HID_DATA_SIZE - 1);
+// Number of raw packets framed and sent at once by prime_send_data_parts.
+#define PRIME_SEND_BATCH_REPORTS (256)
 
-        hpcalcs_info("%s: q:%" PRIu32 "\tr:%" PRIu32, __FUNCTION__, q, r);
+// Returns the number of raw packets carrying a virtual packet of the given size. Even an empty virtual packet takes one.
+static uint32_t vtl_pkt_report_count(uint32_t size) {
+    uint32_t q = size / (PRIME_RAW_HID_DATA_SIZE - 1);
+    uint32_t r = size % (PRIME_RAW_HID_DATA_SIZE - 1);
+    return q + ((r || !size) ? 1 : 0);
+}
 
-        for (i = 1; i <= q; i++) {
-            raw.size = PRIME_RAW_HID_DATA_SIZE + 1;
-            raw.data[1] = pkt_id;
-            memcpy(raw.data + 2, pkt->data + offset, PRIME_RAW_HID_DATA_SIZE - 1);
-            offset += PRIME_RAW_HID_DATA_SIZE - 1;
+// Frames count raw packets of the virtual packet made of head followed by body, starting at the given offset in the virtual packet.
+// The data is gathered straight from head and body into the frames. *pkt_id is the ID of the first raw packet, and is advanced.
+static void vtl_pkt_frame_reports(const uint8_t * head, uint32_t head_size, const uint8_t * body, uint32_t body_size, int protocol_version,
+                                  uint32_t offset, uint32_t count, uint8_t * pkt_id, uint8_t * frames, cable_report * reports) {
+    uint32_t i;
+    uint32_t total = head_size + body_size;
+    for (i = 0; i < count; i++) {
+        uint8_t * frame = frames + i * (PRIME_RAW_HID_DATA_SIZE + 1);
+        uint32_t chunk = total - offset < PRIME_RAW_HID_DATA_SIZE - 1 ? total - offset : PRIME_RAW_HID_DATA_SIZE - 1;
+        uint32_t from_head = offset < head_size ? (head_size - offset < chunk ? head_size - offset : chunk) : 0;
+
+        frame[0] = 0x00; // Report ID.
+        frame[1] = *pkt_id;
+        if (from_head != 0) {
+            memcpy(frame + 2, head + offset, from_head);
+        }
+        if (chunk > from_head) {
+            memcpy(frame + 2 + from_head, body + (offset + from_head - head_size), chunk - from_head);
+        }
+        reports[i].data = frame;
+        reports[i].size = chunk + 2;
+        offset += chunk;
 
-            res = prime_send(handle, &raw);
-            if (res) {
-                hpcalcs_info("%s: send %" PRIu32 " failed", __FUNCTION__, i);
-                r = 0;
-                break;
-            }
-            else {
-                hpcalcs_info("%s: send %" PRIu32 " succeeded", __FUNCTION__, i);
-            }
+        // Increment packet ID, which seems to be necessary for computer -> calc packets
+        *pkt_id = prime_pkt_id_next(protocol_version, *pkt_id);
+    }
+}
 
-            // Increment packet ID, which seems to be necessary for computer -> calc packets
-            pkt_id++;
-            if (handle->protocol_version > 0) {
-                // Skip 0xFE to 0x01
-                if (pkt_id == 0xFE) {
-                    pkt_id = 0x02;
-                }
+HPEXPORT int HPCALL prime_frame_data(prime_vtl_pkt * pkt, int protocol_version, cable_report ** out_reports, uint8_t ** out_frames, uint32_t * out_count) {
+    int res;
+    if (pkt != NULL) {
+        res = prime_frame_data_parts(pkt->data, pkt->size, NULL, 0, protocol_version, out_reports, out_frames, out_count);
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL prime_frame_data_parts(const uint8_t * head, uint32_t head_size, const uint8_t * body, uint32_t body_size, int protocol_version, cable_report ** out_reports, uint8_t ** out_frames, uint32_t * out_count) {
+    int res;
+    if ((head != NULL || head_size == 0) && (body != NULL || body_size == 0) && out_reports != NULL && out_frames != NULL && out_count != NULL) {
+        uint32_t count = vtl_pkt_report_count(head_size + body_size);
+        uint8_t * frames;
+        cable_report * reports;
+        uint8_t pkt_id = prime_pkt_id_first(protocol_version);
+
+        hpcalcs_info("%s: size:%" PRIu32 "\tcount:%" PRIu32, __FUNCTION__, head_size + body_size, count);
+
+        frames = (uint8_t *)(hpcalcs_alloc_funcs.malloc)((size_t)count * (PRIME_RAW_HID_DATA_SIZE + 1));
+        reports = (cable_report *)(hpcalcs_alloc_funcs.malloc)((size_t)count * sizeof(*reports));
+        if (frames != NULL && reports != NULL) {
+            vtl_pkt_frame_reports(head, head_size, body, body_size, protocol_version, 0, count, &pkt_id, frames, reports);
+            *out_reports = reports;
+            *out_frames = frames;
+            *out_count = count;
+            res = ERR_SUCCESS;
+        }
+        else {
+            (hpcalcs_alloc_funcs.free)(reports);
+            (hpcalcs_alloc_funcs.free)(frames);
+            res = ERR_MALLOC;
+            hpcalcs_error("%s: couldn't allocate %" PRIu32 " packets", __FUNCTION__, count);
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT int HPCALL prime_send_data(calc_handle * handle, prime_vtl_pkt * pkt) {
+    int res;
+    if (handle != NULL && pkt != NULL) {
+        uint32_t count;
+        uint8_t * frames;
+        cable_report * reports;
+
+        // Frame the whole virtual packet up front, so that the cable can send all raw packets in one go.
+        res = prime_frame_data(pkt, handle->protocol_version, &reports, &frames, &count);
+        if (res == ERR_SUCCESS) {
+            res = prime_send_many(handle, reports, count);
+            if (res) {
+                hpcalcs_info("%s: send of %" PRIu32 " packets failed", __FUNCTION__, count);
             }
             else {
-                // Skip 0xFF, which is used for other purposes.
-                if (pkt_id == 0xFF) {
-                    pkt_id = 0x00;
-                }
+                hpcalcs_info("%s: send of %" PRIu32 " packets succeeded", __FUNCTION__, count);
             }
+            (hpcalcs_alloc_funcs.free)(reports);
+            (hpcalcs_alloc_funcs.free)(frames);
         }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
 
-        if (r || !pkt->size) {
-            raw.size = r + 2;
-            raw.data[1] = pkt_id;
-            memcpy(raw.data + 2, pkt->data + offset, r);
-
-            res = prime_send(handle, &raw);
+HPEXPORT int HPCALL prime_send_data_parts(calc_handle * handle, const uint8_t * head, uint32_t head_size, const uint8_t * body, uint32_t body_size) {
+    int res;
+    if (handle != NULL && (head != NULL || head_size == 0) && (body != NULL || body_size == 0)) {
+        uint32_t count = vtl_pkt_report_count(head_size + body_size);
+        uint32_t batch = count < PRIME_SEND_BATCH_REPORTS ? count : PRIME_SEND_BATCH_REPORTS;
+        // Frames are built a batch at a time in a fixed-size area, so that memory use doesn't depend on the size of the data.
+        uint8_t * frames = (uint8_t *)(hpcalcs_alloc_funcs.malloc)((size_t)batch * (PRIME_RAW_HID_DATA_SIZE + 1));
+        cable_report * reports = (cable_report *)(hpcalcs_alloc_funcs.malloc)((size_t)batch * sizeof(*reports));
+        if (frames != NULL && reports != NULL) {
+            uint8_t pkt_id = prime_pkt_id_first(handle->protocol_version);
+            uint32_t i;
+
+            res = ERR_SUCCESS;
+            for (i = 0; i < count && res == ERR_SUCCESS; i += batch) {
+                uint32_t n = count - i < batch ? count - i : batch;
+                vtl_pkt_frame_reports(head, head_size, body, body_size, handle->protocol_version, i * (PRIME_RAW_HID_DATA_SIZE - 1), n, &pkt_id, frames, reports);
+                res = prime_send_many(handle, reports, n);
+            }
             if (res) {
-                hpcalcs_info("%s: send remaining failed", __FUNCTION__);
+                hpcalcs_info("%s: send of %" PRIu32 " packets failed", __FUNCTION__, count);
             }
             else {
-                hpcalcs_info("%s: send remaining succeeded", __FUNCTION__);
+                hpcalcs_info("%s: send of %" PRIu32 " packets succeeded", __FUNCTION__, count);
             }
         }
+        else {
+            res = ERR_MALLOC;
+            hpcalcs_error("%s: couldn't allocate %" PRIu32 " packets", __FUNCTION__, batch);
+        }
+        (hpcalcs_alloc_funcs.free)(reports);
+        (hpcalcs_alloc_funcs.free)(frames);
     }
     else {
         res = ERR_INVALID_PARAMETER;
@@ -180,13 +357,19 @@ HPEXPORT int HPCALL prime_recv_data(calc_handle * handle, prime_vtl_pkt * pkt) {
     if (handle != NULL && pkt != NULL) {
         prime_raw_hid_pkt raw;
         uint32_t expected_size = 0;
-        uint32_t offset = 0;
-        uint32_t read_pkts_count = 0;
-        // WIP: reassembly.
+        uint32_t capacity = 0;
+        vtl_pkt_seq seq;
+        int crc_active = 0;
+        uint32_t crc_pos = 0;
+        uint32_t crc_end = 0;
 
-        //size = pkt->size;
         pkt->size = 0;
         pkt->data = NULL;
+        pkt->crc_computed = 0;
+        pkt->crc = 0;
+        seq.protocol_version = handle->protocol_version;
+        seq.count = 0;
+        seq.expected = prime_pkt_id_first(0);
 
         for(;;) {
             memset(&raw, 0, sizeof(raw));
@@ -200,72 +383,228 @@ HPEXPORT int HPCALL prime_recv_data(calc_handle * handle, prime_vtl_pkt * pkt) {
             }
             //hpcalcs_info("%s: raw.size=%" PRIu32, __FUNCTION__, raw.size);
             if (raw.size > 0) {
-                uint8_t * new_data;
-
-                uint8_t expected_seq = ((read_pkts_count + (read_pkts_count / 0xFF)) & 0xFF);
-                // Exclude those packets from reassembly (at least for screenshotting purposes, they seem to be spurious).
-                if (raw.data[0] == 0xFF) {
-                    // TODO: investigate whether the second byte could indicate an error code ?
-                    hpcalcs_error("%s: skipping packet starting with 0xFF", __FUNCTION__);
-                    continue;
-                }
-                // Once we enable the new protocol, we get these periodically.
-                else if (handle->protocol_version > 0 && raw.data[0] == 0xFE) {
-                    // TODO: investigate whether the second byte could indicate an error code ?
-                    hpcalcs_error("%s: skipping packet starting with 0xFE", __FUNCTION__);
+                uint32_t chunk_size;
+                // Sanity check. The first byte is the sequence number, see vtl_pkt_seq_check.
+                // 0xFF packets (and 0xFE keepalive packets in the new protocol mode) are excluded from reassembly.
+                int seq_res = vtl_pkt_seq_check(handle, handle->protocol_version, &seq, raw.data[0]);
+                if (seq_res > 0) {
                     continue;
                 }
-                // Sanity check. The first byte is the sequence number. After reaching 0xFE. it wraps back to 0 (skipping 0xFF).
-                // TODO: This is probably going to be different if we're in the new_protocol mode.
-                else if (raw.data[0] != expected_seq) {
+                else if (seq_res < 0) {
                     res = ERR_CALC_PACKET_FORMAT;
-                    hpcalcs_error("%s: packet out of sequence, got %d, expected %d", __FUNCTION__, (int)raw.data[0], (int)expected_seq);
                     break;
                 }
 
-                read_pkts_count++;
-
                 // Over-read prevention (hopefully ^^) code: pre-set the expected size of the reply to the given command.
-                if (read_pkts_count == 1) {
+                if (seq.count == 1) {
                     res = prime_data_size(pkt->cmd, raw.data + 1, &expected_size); // +1: skip leading byte.
                     if (res != ERR_SUCCESS) {
                         break;
                     }
+                    // Size the reassembly buffer once, from the size announced by the first packet.
+                    if (expected_size != 0) {
+                        capacity = expected_size < PRIME_RECV_PREALLOC_MAX ? expected_size : PRIME_RECV_PREALLOC_MAX;
+                        pkt->data = (hpcalcs_alloc_funcs.malloc)(capacity);
+                        if (pkt->data == NULL) {
+                            capacity = 0;
+                            res = ERR_MALLOC;
+                            hpcalcs_error("%s: cannot allocate %" PRIu32 " bytes", __FUNCTION__, expected_size);
+                            break;
+                        }
+                        // The range covered by the CRC can only be known in advance when the size is.
+                        if (pkt->crc_requested && expected_size >= pkt->crc_tail && expected_size - pkt->crc_tail >= pkt->crc_begin) {
+                            crc_active = 1;
+                            crc_pos = pkt->crc_begin;
+                            crc_end = expected_size - pkt->crc_tail;
+                        }
+                    }
                 }
 
-                pkt->size += raw.size - 1;
-                new_data = (hpcalcs_alloc_funcs.realloc)(pkt->data, pkt->size);
-                if (new_data != NULL) {
-                    pkt->data = new_data;
-                    // Skip first byte, which is usually 0x00.
-                    memcpy(pkt->data + offset, &(raw.data[1]), raw.size - 1);
-                    offset += raw.size - 1;
+                // Skip first byte, which is usually 0x00.
+                chunk_size = raw.size - 1;
+                // The tail of the last packet is padding.
+                if (expected_size != 0 && chunk_size > expected_size - pkt->size) {
+                    chunk_size = expected_size - pkt->size;
                 }
-                else {
-                    res = ERR_MALLOC;
-                    hpcalcs_error("%s: cannot reallocate memory", __FUNCTION__);
-                    break;
+                if (chunk_size > capacity - pkt->size) {
+                    // The size of the reply is unknown, or too large to be trusted: grow the buffer geometrically.
+                    uint8_t * new_data;
+                    uint32_t new_capacity = capacity != 0 ? capacity * 2 : 16 * PRIME_RAW_HID_DATA_SIZE;
+
+                    if (expected_size != 0 && (new_capacity > expected_size || new_capacity < capacity)) {
+                        new_capacity = expected_size;
+                    }
+
+                    new_data = (hpcalcs_alloc_funcs.realloc)(pkt->data, new_capacity);
+                    if (new_data != NULL) {
+                        pkt->data = new_data;
+                        capacity = new_capacity;
+                    }
+                    else {
+                        res = ERR_MALLOC;
+                        hpcalcs_error("%s: cannot reallocate memory", __FUNCTION__);
+                        break;
+                    }
+                }
+                memcpy(pkt->data + pkt->size, &(raw.data[1]), chunk_size);
+                pkt->size += chunk_size;
+
+                // CRC the data while it is still in cache, instead of walking the whole buffer again afterwards.
+                if (crc_active) {
+                    uint32_t available = pkt->size < crc_end ? pkt->size : crc_end;
+                    if (available - crc_pos >= PRIME_CRC_BATCH_SIZE || available == crc_end) {
+                        vtl_pkt_crc_advance(pkt, pkt->data, 0, &crc_pos, available);
+                    }
                 }
             }
 
             if (raw.size < PRIME_RAW_HID_DATA_SIZE) {
                 hpcalcs_info("%s: breaking due to short packet (1)", __FUNCTION__);
-                goto shorten_packet;
+                break;
             }
-            if (offset >= expected_size) {
+            if (expected_size != 0 && pkt->size >= expected_size) {
                 hpcalcs_info("%s: breaking because the expected size was reached (2)", __FUNCTION__);
-shorten_packet:
-                // Shorten packet.
-                if (expected_size <= pkt->size) {
-                    hpcalcs_info("%s: shortening packet from %" PRIu32 " to %" PRIu32, __FUNCTION__, pkt->size, expected_size);
+                break;
+            }
+            // As before, a reply of undetermined size is the first packet only.
+            if (expected_size == 0 && seq.count != 0) {
+                hpcalcs_info("%s: breaking because the size is undetermined (3)", __FUNCTION__);
+                break;
+            }
+        }
+
+        if (res == ERR_SUCCESS && pkt->size < expected_size) {
+            // Only complete the packet with zeros up to what was allocated: a size beyond that was not to be trusted.
+            if (expected_size <= capacity) {
+                hpcalcs_warning("%s: expected %" PRIu32 " bytes but only got %" PRIu32 " bytes, output corrupted", __FUNCTION__, expected_size, pkt->size);
+                memset(pkt->data + pkt->size, 0, expected_size - pkt->size);
+                pkt->size = expected_size;
+            }
+            else {
+                res = ERR_CALC_PACKET_FORMAT;
+                hpcalcs_error("%s: expected %" PRIu32 " bytes but only got %" PRIu32 " bytes", __FUNCTION__, expected_size, pkt->size);
+            }
+        }
+
+        if (res == ERR_SUCCESS && crc_active) {
+            vtl_pkt_crc_advance(pkt, pkt->data, 0, &crc_pos, crc_end);
+            pkt->crc_computed = 1;
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+// Hands data to the consumer of a streamed packet, after advancing the CRC over it.
+static int vtl_pkt_stream_chunk(prime_vtl_pkt * pkt, uint32_t expected_size, const uint8_t * data, uint32_t size, uint32_t * crc_pos, uint32_t crc_end, prime_recv_consumer consumer, void * user_data) {
+    int res;
+    if (*crc_pos < crc_end) {
+        vtl_pkt_crc_advance(pkt, data, pkt->size, crc_pos, pkt->size + size < crc_end ? pkt->size + size : crc_end);
+    }
+    res = (*consumer)(pkt, expected_size, data, size, user_data);
+    pkt->size += size;
+    return res;
+}
+
+HPEXPORT int HPCALL prime_recv_data_stream(calc_handle * handle, prime_vtl_pkt * pkt, prime_recv_consumer consumer, void * user_data) {
+    int res;
+    if (handle != NULL && pkt != NULL && consumer != NULL) {
+        prime_raw_hid_pkt raw;
+        uint32_t expected_size = 0;
+        vtl_pkt_seq seq;
+        int crc_active = 0;
+        uint32_t crc_pos = 0;
+        uint32_t crc_end = 0;
+
+        pkt->size = 0;
+        pkt->data = NULL;
+        pkt->crc_computed = 0;
+        pkt->crc = 0;
+        seq.protocol_version = handle->protocol_version;
+        seq.count = 0;
+        seq.expected = prime_pkt_id_first(0);
+
+        // Same framing rules as prime_recv_data, but each raw packet goes to the consumer instead of a reassembly buffer.
+        for(;;) {
+            memset(&raw, 0, sizeof(raw));
+            res = prime_recv(handle, &raw);
+            if (res) {
+                hpcalcs_warning("%s: recv failed", __FUNCTION__);
+                break;
+            }
+            if (raw.size > 0) {
+                uint32_t chunk_size;
+                int seq_res = vtl_pkt_seq_check(handle, handle->protocol_version, &seq, raw.data[0]);
+                if (seq_res > 0) {
+                    continue;
                 }
-                else {
-                    hpcalcs_warning("%s: expected %" PRIu32 " bytes but only got %" PRIu32 " bytes, output corrupted", __FUNCTION__, expected_size, pkt->size);
+                else if (seq_res < 0) {
+                    res = ERR_CALC_PACKET_FORMAT;
+                    break;
                 }
-                pkt->data = (hpcalcs_alloc_funcs.realloc)(pkt->data, expected_size);
-                pkt->size = expected_size;
+
+                if (seq.count == 1) {
+                    res = prime_data_size(pkt->cmd, raw.data + 1, &expected_size); // +1: skip leading byte.
+                    if (res != ERR_SUCCESS) {
+                        break;
+                    }
+                    if (pkt->crc_requested && expected_size != 0 && expected_size >= pkt->crc_tail && expected_size - pkt->crc_tail >= pkt->crc_begin) {
+                        crc_active = 1;
+                        crc_pos = pkt->crc_begin;
+                        crc_end = expected_size - pkt->crc_tail;
+                    }
+                }
+
+                // Skip first byte, which is usually 0x00. The tail of the last packet is padding.
+                chunk_size = raw.size - 1;
+                if (expected_size != 0 && chunk_size > expected_size - pkt->size) {
+                    chunk_size = expected_size - pkt->size;
+                }
+                if (chunk_size != 0) {
+                    res = vtl_pkt_stream_chunk(pkt, expected_size, &(raw.data[1]), chunk_size, &crc_pos, crc_end, consumer, user_data);
+                    if (res) {
+                        hpcalcs_info("%s: consumer aborted the reception", __FUNCTION__);
+                        break;
+                    }
+                }
+            }
+
+            if (raw.size < PRIME_RAW_HID_DATA_SIZE) {
+                hpcalcs_info("%s: breaking due to short packet (1)", __FUNCTION__);
+                break;
+            }
+            if (expected_size != 0 && pkt->size >= expected_size) {
+                hpcalcs_info("%s: breaking because the expected size was reached (2)", __FUNCTION__);
                 break;
             }
+            if (expected_size == 0 && seq.count != 0) {
+                hpcalcs_info("%s: breaking because the size is undetermined (3)", __FUNCTION__);
+                break;
+            }
+        }
+
+        if (res == ERR_SUCCESS && pkt->size < expected_size) {
+            // Like prime_recv_data, complete the packet with zeros, so that the consumer sees the announced size, unless that size is beyond
+            // what prime_recv_data would have allocated up front: it was not to be trusted.
+            if (expected_size <= PRIME_RECV_PREALLOC_MAX) {
+                static const uint8_t zeros[PRIME_RAW_HID_DATA_SIZE - 1] = { 0 };
+                hpcalcs_warning("%s: expected %" PRIu32 " bytes but only got %" PRIu32 " bytes, output corrupted", __FUNCTION__, expected_size, pkt->size);
+                while (res == ERR_SUCCESS && pkt->size < expected_size) {
+                    uint32_t chunk_size = expected_size - pkt->size < sizeof(zeros) ? expected_size - pkt->size : sizeof(zeros);
+                    res = vtl_pkt_stream_chunk(pkt, expected_size, zeros, chunk_size, &crc_pos, crc_end, consumer, user_data);
+                }
+            }
+            else {
+                res = ERR_CALC_PACKET_FORMAT;
+                hpcalcs_error("%s: expected %" PRIu32 " bytes but only got %" PRIu32 " bytes", __FUNCTION__, expected_size, pkt->size);
+            }
+        }
+
+        if (res == ERR_SUCCESS && crc_active) {
+            pkt->crc_computed = 1;
         }
     }
     else {
@@ -275,6 +614,57 @@ shorten_packet:
     return res;
 }
 
+HPEXPORT int HPCALL prime_reply_scan(calc_handle * handle, int protocol_version, prime_reply_progress * progress, prime_raw_hid_pkt * pkt, int * out_keep) {
+    int res;
+    if (handle != NULL && progress != NULL && pkt != NULL && out_keep != NULL) {
+        res = ERR_SUCCESS;
+        *out_keep = 0;
+        if (pkt->size > 0) {
+            vtl_pkt_seq seq;
+            int seq_res;
+            if (progress->count == 0) {
+                // Same starting point as prime_recv_data.
+                progress->protocol_version = protocol_version;
+                progress->expected = prime_pkt_id_first(0);
+            }
+            seq.protocol_version = progress->protocol_version;
+            seq.count = progress->count;
+            seq.expected = progress->expected;
+            seq_res = vtl_pkt_seq_check(handle, protocol_version, &seq, pkt->data[0]);
+            if (seq_res == 0) {
+                uint32_t chunk_size = pkt->size - 1;
+                progress->protocol_version = seq.protocol_version;
+                progress->count = seq.count;
+                progress->expected = seq.expected;
+                *out_keep = 1;
+                if (seq.count == 1) {
+                    res = prime_data_size(progress->cmd, pkt->data + 1, &progress->expected_size); // +1: skip leading byte.
+                }
+                if (progress->expected_size != 0 && chunk_size > progress->expected_size - progress->size) {
+                    chunk_size = progress->expected_size - progress->size;
+                }
+                progress->size += chunk_size;
+                // Same stopping rules as prime_recv_data.
+                if (res == ERR_SUCCESS && (pkt->size < PRIME_RAW_HID_DATA_SIZE || progress->expected_size == 0 || progress->size >= progress->expected_size)) {
+                    progress->complete = 1;
+                }
+            }
+            else if (seq_res < 0) {
+                res = ERR_CALC_PACKET_FORMAT;
+            }
+        }
+    }
+    else {
+        res = ERR_INVALID_PARAMETER;
+        hpcalcs_error("%s: an argument is NULL", __FUNCTION__);
+    }
+    return res;
+}
+
+HPEXPORT uint16_t HPCALL prime_crc16_block(const uint8_t * data, uint32_t size) {
+    return crc16_block(data, size);
+}
+
 HPEXPORT int HPCALL prime_data_size(uint8_t cmd, uint8_t * data, uint32_t * out_size) {
     int res = ERR_SUCCESS;
     if (data != NULL && out_size != NULL) {
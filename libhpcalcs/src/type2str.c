@@ -50,6 +50,9 @@ HPEXPORT const char * HPCALL hpcables_model_to_string(cable_model model) {
     switch (model) {
         case CABLE_NUL: return "<none>";
         case CABLE_PRIME_HID: return "Prime (HID)";
+        case CABLE_PRIME_SIM: return "Prime (simulated)";
+        case CABLE_REPLAY: return "Replay";
+        case CABLE_PRIME_HIDRAW: return "Prime (hidraw)";
         default: return "unknown";
     }
 }
@@ -59,6 +62,15 @@ HPEXPORT cable_model HPCALL hpcables_string_to_model(const char *str) {
         if (!strcasecmp("Prime HID", str) || !strcasecmp("Prime_HID", str) || !strcasecmp("HP Prime HID", str)) {
             return CABLE_PRIME_HID;
         }
+        else if (!strcasecmp("Prime sim", str) || !strcasecmp("Prime_sim", str) || !strcasecmp("HP Prime sim", str)) {
+            return CABLE_PRIME_SIM;
+        }
+        else if (!strcasecmp("Replay", str)) {
+            return CABLE_REPLAY;
+        }
+        else if (!strcasecmp("Prime hidraw", str) || !strcasecmp("Prime_hidraw", str) || !strcasecmp("HP Prime hidraw", str)) {
+            return CABLE_PRIME_HIDRAW;
+        }
         // else fall through.
     }
     return CABLE_NUL;
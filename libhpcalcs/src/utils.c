@@ -112,3 +112,34 @@ void hexdump(const char * direction, uint8_t *data, uint32_t size, uint32_t leve
         }
     }
 }
+
+uint64_t monotonic_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Timed waits are on CLOCK_MONOTONIC, so that changes of the wall clock don't affect them. Without pthread_condattr_setclock (macOS),
+// they can only be on the wall clock: deadlines are then translated to it, at the cost of being off by changes of the wall clock during the wait.
+void cond_init_monotonic(pthread_cond_t * cond) {
+#ifdef __APPLE__
+    pthread_cond_init(cond, NULL);
+#else
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+#endif
+}
+
+void cond_deadline(struct timespec * deadline, uint64_t monotonic_ns) {
+#ifdef __APPLE__
+    uint64_t now_ns = monotonic_now_ns();
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    monotonic_ns = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec + (monotonic_ns > now_ns ? monotonic_ns - now_ns : 0);
+#endif
+    deadline->tv_sec = (time_t)(monotonic_ns / 1000000000);
+    deadline->tv_nsec = (long)(monotonic_ns % 1000000000);
+}
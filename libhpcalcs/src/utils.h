@@ -28,11 +28,20 @@
 #ifndef __HPLIBS_UTILS_H__
 #define __HPLIBS_UTILS_H__
 
+#include <time.h>
+#include <pthread.h>
+
 //! Plain C equivalent of char_traits<char16_t>::length.
 uint32_t char16_strlen(char16_t * str);
 //! strncpy applied to char16_t.
 char16_t * char16_strncpy(char16_t * dst, const char16_t * src, uint32_t n);
 //! Hex dumping function.
 void hexdump(const char * direction, uint8_t *data, uint32_t size, uint32_t level);
+//! Current time on CLOCK_MONOTONIC, in ns.
+uint64_t monotonic_now_ns(void);
+//! Initializes a condition variable for timed waits on deadlines computed by \a cond_deadline.
+void cond_init_monotonic(pthread_cond_t * cond);
+//! Computes the deadline of a timed wait, on a condition variable initialized by \a cond_init_monotonic, for the given CLOCK_MONOTONIC time in ns.
+void cond_deadline(struct timespec * deadline, uint64_t monotonic_ns);
 
 #endif
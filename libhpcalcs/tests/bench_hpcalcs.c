@@ -0,0 +1,1449 @@
+/*
+ * libhpcalcs: hand-helds support libraries.
+ * Copyright (C) 2015 Lionel Debroux
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * \file bench_hpcalcs.c Calcs: benchmarks for the protocol layers, running without a calculator.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <png.h>
+
+#include "../src/hpfiles.h"
+#include "../src/hpcables.h"
+#include "../src/hpcalcs.h"
+#include "../src/hpopers.h"
+#include "../src/prime_cmd.h"
+#include "../src/prime_sim.h"
+#include "../src/cable_capture.h"
+#include "../src/cable_faults.h"
+
+// Allocation statistics, gathered through the allocation functions injected into the library.
+static uint64_t alloc_calls;
+static uint64_t realloc_calls;
+static uint64_t alloc_bytes;
+
+static void * counting_malloc(size_t size) {
+    alloc_calls++;
+    alloc_bytes += size;
+    return malloc(size);
+}
+
+static void * counting_calloc(size_t nmemb, size_t size) {
+    alloc_calls++;
+    alloc_bytes += nmemb * size;
+    return calloc(nmemb, size);
+}
+
+static void * counting_realloc(void * ptr, size_t size) {
+    realloc_calls++;
+    alloc_bytes += size;
+    return realloc(ptr, size);
+}
+
+static hplibs_malloc_funcs counting_alloc_funcs = {
+    .malloc = counting_malloc,
+    .calloc = counting_calloc,
+    .realloc = counting_realloc,
+    .free = free
+};
+
+
+// In-memory cable replaying a pre-built stream of calculator -> computer reports.
+typedef struct {
+    uint8_t * reports;
+    uint32_t count;
+    uint32_t current;
+} bench_stream;
+
+static bench_stream stream;
+static uint64_t send_calls;
+static uint64_t sent_reports;
+
+static int bench_cable_open(cable_handle * handle) {
+    handle->read_timeout = 0;
+    handle->open = 1;
+    return 0;
+}
+
+static int bench_cable_close(cable_handle * handle) {
+    return 0;
+}
+
+static int bench_cable_send(cable_handle * handle, uint8_t * data, uint32_t len) {
+    send_calls++;
+    sent_reports++;
+    return 0;
+}
+
+static int bench_cable_send_many(cable_handle * handle, cable_report * reports, uint32_t count) {
+    send_calls++;
+    sent_reports += count;
+    return 0;
+}
+
+static int bench_cable_recv(cable_handle * handle, uint8_t * data, uint32_t * len) {
+    if (stream.current < stream.count) {
+        memcpy(data, stream.reports + stream.current * PRIME_RAW_HID_DATA_SIZE, PRIME_RAW_HID_DATA_SIZE);
+        *len = PRIME_RAW_HID_DATA_SIZE;
+        stream.current++;
+    }
+    else {
+        *len = 0;
+    }
+    return 0;
+}
+
+static const cable_fncts bench_cable_fncts =
+{
+    CABLE_NUL,
+    "Benchmark cable",
+    "In-memory cable replaying pre-built reports",
+    NULL,
+    &bench_cable_open,
+    &bench_cable_close,
+    NULL,
+    &bench_cable_send,
+    &bench_cable_recv,
+    &bench_cable_send_many,
+    NULL,
+    NULL
+};
+
+// Splits a virtual packet into reports the way the calculator does: leading sequence number, which skips 0xFF.
+static void build_stream(const uint8_t * data, uint32_t size) {
+    uint32_t i;
+    stream.count = (size + PRIME_RAW_HID_DATA_SIZE - 2) / (PRIME_RAW_HID_DATA_SIZE - 1);
+    stream.current = 0;
+    stream.reports = (uint8_t *)calloc(stream.count, PRIME_RAW_HID_DATA_SIZE);
+    for (i = 0; i < stream.count; i++) {
+        uint8_t * report = stream.reports + i * PRIME_RAW_HID_DATA_SIZE;
+        uint32_t offset = i * (PRIME_RAW_HID_DATA_SIZE - 1);
+        uint32_t chunk = size - offset < PRIME_RAW_HID_DATA_SIZE - 1 ? size - offset : PRIME_RAW_HID_DATA_SIZE - 1;
+        report[0] = (uint8_t)((i + (i / 0xFF)) & 0xFF);
+        memcpy(report + 1, data + offset, chunk);
+    }
+}
+
+static uint8_t * make_reply(uint8_t cmd, uint32_t payload_size, uint32_t * out_size) {
+    uint8_t * data = (uint8_t *)malloc(payload_size + 6);
+    uint32_t i;
+    data[0] = cmd;
+    data[1] = 0x01;
+    data[2] = (uint8_t)((payload_size >> 24) & 0xFF);
+    data[3] = (uint8_t)((payload_size >> 16) & 0xFF);
+    data[4] = (uint8_t)((payload_size >>  8) & 0xFF);
+    data[5] = (uint8_t)((payload_size      ) & 0xFF);
+    for (i = 0; i < payload_size; i++) {
+        data[i + 6] = (uint8_t)(i * 7 + 3);
+    }
+    *out_size = payload_size + 6;
+    return data;
+}
+
+// If with_crc is nonzero, the file CRC (data[0 .. size - 6), with bytes 8 and 9 counted as zeros) is computed during reassembly, and checked.
+static int bench_recv_data(calc_handle * calc, const char * name, uint8_t cmd, uint32_t payload_size, unsigned int iterations, int with_crc) {
+    int res = 0;
+    uint32_t size;
+    uint8_t * reply = make_reply(cmd, payload_size, &size);
+    unsigned int i;
+    clock_t start, elapsed = 0;
+    uint16_t expected_crc = 0;
+
+    if (with_crc) {
+        uint8_t * copy = (uint8_t *)malloc(size);
+        memcpy(copy, reply, size);
+        copy[8] = 0x00;
+        copy[9] = 0x00;
+        expected_crc = prime_crc16_block(copy, size - 6);
+        free(copy);
+    }
+
+    build_stream(reply, size);
+    alloc_calls = 0;
+    realloc_calls = 0;
+
+    for (i = 0; i < iterations; i++) {
+        prime_vtl_pkt pkt;
+        memset(&pkt, 0, sizeof(pkt));
+        pkt.cmd = cmd;
+        if (with_crc) {
+            pkt.crc_requested = 1;
+            pkt.crc_tail = 6;
+            pkt.crc_field = 8;
+        }
+        stream.current = 0;
+        start = clock();
+        res = prime_recv_data(calc, &pkt);
+        elapsed += clock() - start;
+        if (res != 0 || pkt.size != size || memcmp(pkt.data, reply, size)) {
+            printf("%s: reassembly FAILED (res=%d, size=%" PRIu32 ")\n", name, res, pkt.size);
+            res = 1;
+        }
+        else if (with_crc && (!pkt.crc_computed || pkt.crc != expected_crc)) {
+            printf("%s: CRC FAILED (computed=%d, crc=%04X, expected %04X)\n", name, pkt.crc_computed, pkt.crc, expected_crc);
+            res = 1;
+        }
+        free(pkt.data);
+        if (res) {
+            break;
+        }
+    }
+
+    if (!res) {
+        double seconds = (double)elapsed / CLOCKS_PER_SEC;
+        printf("%-28s %9" PRIu32 " bytes  %6u reports  %10.1f allocs/xfer  %10.1f reallocs/xfer  %8.2f MB/s\n",
+               name, size, stream.count,
+               (double)alloc_calls / iterations, (double)realloc_calls / iterations,
+               seconds > 0 ? ((double)size * iterations) / seconds / 1e6 : 0.0);
+    }
+
+    free(stream.reports);
+    free(reply);
+    return res;
+}
+
+static int bench_send_data(calc_handle * calc, const char * name, uint32_t size, unsigned int iterations) {
+    int res = 0;
+    prime_vtl_pkt * pkt = prime_vtl_pkt_new(size);
+    unsigned int i;
+    clock_t start, elapsed = 0;
+
+    if (pkt == NULL) {
+        printf("%s: allocation FAILED\n", name);
+        return 1;
+    }
+    send_calls = 0;
+    sent_reports = 0;
+    alloc_calls = 0;
+    for (i = 0; i < iterations; i++) {
+        start = clock();
+        res = prime_send_data(calc, pkt);
+        elapsed += clock() - start;
+        if (res) {
+            printf("%s: send FAILED (res=%d)\n", name, res);
+            break;
+        }
+    }
+
+    if (!res) {
+        double seconds = (double)elapsed / CLOCKS_PER_SEC;
+        printf("%-28s %9" PRIu32 " bytes  %6" PRIu64 " reports  %10.1f cable calls/xfer  %10.1f allocs/xfer  %8.2f MB/s\n",
+               name, size, sent_reports / iterations, (double)send_calls / iterations, (double)alloc_calls / iterations,
+               seconds > 0 ? ((double)size * iterations) / seconds / 1e6 : 0.0);
+    }
+
+    prime_vtl_pkt_del(pkt);
+    return res;
+}
+
+// Sends the same file to a number of calculators, encoding it for each of them or once for all of them.
+static int bench_broadcast(calc_handle * calc, const char * name, uint32_t size, unsigned int targets, int encode_once) {
+    int res = 0;
+    files_var_entry * file = hpfiles_ve_create_with_data(NULL, size);
+    calc_encoded_file * encoded = NULL;
+    unsigned int i;
+    clock_t start, elapsed;
+
+    if (file == NULL) {
+        printf("%s: allocation FAILED\n", name);
+        return 1;
+    }
+    memset(file->data, 0x5A, size);
+    file->name[0] = 'A';
+    file->name[1] = 0;
+    file->type = PRIME_TYPE_PRGM;
+    calc->protocol_version = 1;
+    send_calls = 0;
+    sent_reports = 0;
+    alloc_calls = 0;
+    start = clock();
+    if (encode_once) {
+        res = calc_prime_frame_file(file, &encoded);
+    }
+    for (i = 0; i < targets && !res; i++) {
+        res = encode_once ? calc_prime_s_send_encoded_file(calc, encoded) : calc_prime_s_send_file(calc, file);
+    }
+    elapsed = clock() - start;
+    if (encoded != NULL) {
+        hpcalcs_encoded_file_unref(encoded);
+    }
+    calc->protocol_version = 0;
+
+    if (!res) {
+        double seconds = (double)elapsed / CLOCKS_PER_SEC;
+        printf("%-28s %9" PRIu32 " bytes  %6u targets  %10.1f allocs/target  %8.2f MB/s\n",
+               name, size, targets, (double)alloc_calls / targets,
+               seconds > 0 ? ((double)size * targets) / seconds / 1e6 : 0.0);
+    }
+    else {
+        printf("%s: send FAILED (res=%d)\n", name, res);
+    }
+
+    hpfiles_ve_delete(file);
+    return res;
+}
+
+// Classic one-table CRC16-CCITT, as a baseline for prime_crc16_block.
+static uint16_t bytewise_table[256];
+
+static uint16_t bytewise_crc16(const uint8_t * data, uint32_t size) {
+    uint16_t crc = 0;
+    while (size--) {
+        crc = bytewise_table[(crc >> 8) ^ *data++] ^ (uint16_t)(crc << 8);
+    }
+    return crc;
+}
+
+static int bench_crc16(uint32_t size, unsigned int iterations) {
+    int res = 0;
+    uint8_t * data = (uint8_t *)malloc(size);
+    uint32_t i;
+    unsigned int j;
+    uint16_t crc1 = 0, crc2 = 0;
+    clock_t start, elapsed1, elapsed2;
+
+    for (i = 0; i < 256; i++) {
+        uint16_t crc = (uint16_t)(i << 8);
+        int bit;
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+        bytewise_table[i] = crc;
+    }
+    for (i = 0; i < size; i++) {
+        data[i] = (uint8_t)(i * 7 + 3);
+    }
+
+    start = clock();
+    for (j = 0; j < iterations; j++) {
+        crc1 ^= bytewise_crc16(data, size - (j & 1));
+    }
+    elapsed1 = clock() - start;
+    start = clock();
+    for (j = 0; j < iterations; j++) {
+        crc2 ^= prime_crc16_block(data, size - (j & 1));
+    }
+    elapsed2 = clock() - start;
+
+    if (crc1 != crc2) {
+        printf("crc16: results differ (%04X != %04X)\n", crc1, crc2);
+        res = 1;
+    }
+    else {
+        printf("%-28s %9" PRIu32 " bytes  bytewise %8.1f MB/s  prime_crc16_block %8.1f MB/s\n", "crc16", size,
+               elapsed1 > 0 ? ((double)size * iterations) / ((double)elapsed1 / CLOCKS_PER_SEC) / 1e6 : 0.0,
+               elapsed2 > 0 ? ((double)size * iterations) / ((double)elapsed2 / CLOCKS_PER_SEC) / 1e6 : 0.0);
+    }
+
+    free(data);
+    return res;
+}
+
+// Full round trips through the calculator API and the simulated Prime cable, timed like a full-speed HID link:
+// one 64-byte report per 1 ms frame. Reports both the host CPU throughput and the modeled link time.
+static int bench_prime_sim(const char * name, uint32_t size, unsigned int iterations) {
+    int res = 1;
+    cable_handle * cable = hpcables_handle_new(CABLE_PRIME_SIM);
+    calc_handle * calc = hpcalcs_handle_new(CALC_PRIME);
+    files_var_entry * file = hpfiles_ve_create_with_data(NULL, size);
+    files_var_entry * received = NULL;
+    prime_sim_stats stats;
+    unsigned int i;
+    clock_t start, elapsed = 0;
+
+    if (cable != NULL && calc != NULL && file != NULL && !hpcalcs_cable_attach(calc, cable)) {
+        memset(file->data, 0xA5, size);
+        file->name[0] = 'S';
+        file->type = PRIME_TYPE_PRGM;
+        res = hpcables_prime_sim_set_timing(cable, 1000, 64000, 0);
+        alloc_calls = 0;
+        for (i = 0; i < iterations && !res; i++) {
+            start = clock();
+            res = hpcalcs_calc_send_file(calc, file);
+            if (!res) {
+                res = hpcalcs_calc_recv_file(calc, file, &received);
+            }
+            elapsed += clock() - start;
+            if (received != NULL) {
+                hpfiles_ve_delete(received);
+                received = NULL;
+            }
+        }
+        if (!res) {
+            res = hpcables_prime_sim_get_stats(cable, &stats);
+        }
+        if (!res) {
+            double seconds = (double)elapsed / CLOCKS_PER_SEC;
+            printf("%-28s %9" PRIu32 " bytes  %6" PRIu64 " reports  %10.1f allocs/xfer  %8.2f MB/s  %8.3f s simulated\n",
+                   name, size, (stats.reports_in + stats.reports_out) / iterations, (double)alloc_calls / iterations,
+                   seconds > 0 ? (2.0 * size * iterations) / seconds / 1e6 : 0.0, (double)stats.simulated_us / 1e6 / iterations);
+        }
+        else {
+            printf("%s: round trip FAILED (res=%d)\n", name, res);
+        }
+        hpcalcs_cable_detach(calc);
+    }
+    else {
+        printf("%s: setup FAILED\n", name);
+    }
+
+    if (file != NULL) {
+        hpfiles_ve_delete(file);
+    }
+    if (calc != NULL) {
+        hpcalcs_handle_del(calc);
+    }
+    if (cable != NULL) {
+        hpcables_handle_del(cable);
+    }
+    return res;
+}
+
+// Runs a mixed workload of status checks and small file transfers against the simulated Prime, either in the old protocol,
+// in which each file is sent in a temporary switch to the new protocol, or in the new protocol negotiated on attach.
+static int bench_protocol(const char * name, int negotiate, uint32_t size, unsigned int iterations) {
+    int res = 1;
+    cable_handle * cable = hpcables_handle_new(CABLE_PRIME_SIM);
+    calc_handle * calc = hpcalcs_handle_new(CALC_PRIME);
+    files_var_entry * file = hpfiles_ve_create_with_data(NULL, size);
+    files_var_entry * received = NULL;
+    prime_sim_stats stats;
+    unsigned int i;
+
+    if (cable != NULL && calc != NULL && file != NULL && !hpcalcs_options_set_negotiate_protocol(calc, negotiate) && !hpcalcs_cable_attach(calc, cable)) {
+        memset(file->data, 0x5A, size);
+        file->name[0] = 'V';
+        file->type = PRIME_TYPE_PRGM;
+        res = hpcables_prime_sim_set_timing(cable, 1000, 64000, 0);
+        if (!res) {
+            res = hpcables_prime_sim_reset_stats(cable);
+        }
+        for (i = 0; i < iterations && !res; i++) {
+            res = hpcalcs_calc_check_ready(calc, NULL, NULL);
+            if (!res) {
+                res = hpcalcs_calc_send_file(calc, file);
+            }
+            if (!res) {
+                res = hpcalcs_calc_recv_file(calc, file, &received);
+            }
+            if (received != NULL) {
+                hpfiles_ve_delete(received);
+                received = NULL;
+            }
+        }
+        if (!res) {
+            res = hpcables_prime_sim_get_stats(cable, &stats);
+        }
+        if (!res) {
+            double seconds = (double)stats.simulated_us / 1e6;
+            printf("%-28s %9" PRIu32 " bytes  %6" PRIu64 " reports  %8.2f ms/op simulated  %8.3f MB/s simulated\n",
+                   name, size, (stats.reports_in + stats.reports_out) / iterations, (double)stats.simulated_us / 1e3 / iterations,
+                   seconds > 0 ? (2.0 * size * iterations) / seconds / 1e6 : 0.0);
+        }
+        else {
+            printf("%s: workload FAILED (res=%d)\n", name, res);
+        }
+        hpcalcs_cable_detach(calc);
+    }
+    else {
+        printf("%s: setup FAILED\n", name);
+    }
+
+    if (file != NULL) {
+        hpfiles_ve_delete(file);
+    }
+    if (calc != NULL) {
+        hpcalcs_handle_del(calc);
+    }
+    if (cable != NULL) {
+        hpcables_handle_del(cable);
+    }
+    return res;
+}
+
+static void bench_checksum(uint32_t * sum, const uint8_t * data, uint32_t size) {
+    uint32_t i;
+    for (i = 0; i < size; i++) {
+        *sum = (*sum << 1 | *sum >> 31) ^ data[i];
+    }
+}
+
+// Consumer of a streamed file, folding the data into a checksum as it arrives, so that nothing is kept.
+static int bench_stream_callback(const calc_recv_chunk * chunk, const uint8_t * data, uint32_t size, void * user_data) {
+    bench_checksum((uint32_t *)user_data, data, size);
+    return chunk->complete && chunk->invalid;
+}
+
+// Receives a file from the simulated Prime, either buffered into a files_var_entry or streamed to a callback,
+// measuring the memory allocated by the library for each reception.
+static int bench_prime_stream(const char * name, uint32_t size, unsigned int iterations, int streamed) {
+    int res = 1;
+    cable_handle * cable = hpcables_handle_new(CABLE_PRIME_SIM);
+    calc_handle * calc = hpcalcs_handle_new(CALC_PRIME);
+    files_var_entry * file = hpfiles_ve_create_with_data(NULL, size);
+    files_var_entry * received = NULL;
+    uint32_t sum = 0;
+    uint64_t calls = 0, bytes = 0;
+    unsigned int i;
+    clock_t start, elapsed = 0;
+
+    if (cable != NULL && calc != NULL && file != NULL && !hpcalcs_cable_attach(calc, cable)) {
+        memset(file->data, 0x5A, size);
+        file->name[0] = 'R';
+        file->type = PRIME_TYPE_PRGM;
+        res = hpcables_prime_sim_set_timing(cable, 1000, 64000, 0);
+        if (!res) {
+            res = hpcalcs_calc_send_file(calc, file);
+        }
+        for (i = 0; i < iterations && !res; i++) {
+            alloc_calls = 0;
+            alloc_bytes = 0;
+            start = clock();
+            if (streamed) {
+                res = hpcalcs_calc_recv_file_stream(calc, file, bench_stream_callback, &sum);
+            }
+            else {
+                res = hpcalcs_calc_recv_file(calc, file, &received);
+                if (!res && received != NULL) {
+                    bench_checksum(&sum, received->data, received->size);
+                }
+            }
+            elapsed += clock() - start;
+            calls += alloc_calls;
+            bytes += alloc_bytes;
+            if (received != NULL) {
+                hpfiles_ve_delete(received);
+                received = NULL;
+            }
+        }
+        if (!res) {
+            double seconds = (double)elapsed / CLOCKS_PER_SEC;
+            printf("%-28s %9" PRIu32 " bytes  %10.1f allocs/xfer  %10.1f KB allocated/xfer  %8.2f MB/s\n",
+                   name, size, (double)calls / iterations, (double)bytes / 1024 / iterations,
+                   seconds > 0 ? ((double)size * iterations) / seconds / 1e6 : 0.0);
+        }
+        else {
+            printf("%s: reception FAILED (res=%d)\n", name, res);
+        }
+        hpcalcs_cable_detach(calc);
+    }
+    else {
+        printf("%s: setup FAILED\n", name);
+    }
+
+    if (file != NULL) {
+        hpfiles_ve_delete(file);
+    }
+    if (calc != NULL) {
+        hpcalcs_handle_del(calc);
+    }
+    if (cable != NULL) {
+        hpcables_handle_del(cable);
+    }
+    return res;
+}
+
+// Polls screenshots from the simulated Prime, either as payload views or through the legacy interface,
+// which moves each image to the beginning of its memory block.
+static int bench_screen_poll(const char * name, unsigned int iterations, int payload_view) {
+    int res = 1;
+    cable_handle * cable = hpcables_handle_new(CABLE_PRIME_SIM);
+    calc_handle * calc = hpcalcs_handle_new(CALC_PRIME);
+    calc_payload payload;
+    uint8_t * data;
+    uint32_t size = 0;
+    uint32_t sum = 0;
+    unsigned int i;
+    clock_t start, elapsed = 0;
+
+    if (cable != NULL && calc != NULL && !hpcalcs_cable_attach(calc, cable)) {
+        res = 0;
+        for (i = 0; i < iterations && !res; i++) {
+            start = clock();
+            if (payload_view) {
+                res = hpcalcs_calc_recv_screen_payload(calc, CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16, &payload);
+                if (!res) {
+                    size = payload.size;
+                    bench_checksum(&sum, CALC_PAYLOAD_DATA(&payload), payload.size);
+                    hpcalcs_payload_release(&payload);
+                }
+            }
+            else {
+                res = hpcalcs_calc_recv_screen(calc, CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16, &data, &size);
+                if (!res) {
+                    bench_checksum(&sum, data, size);
+                    free(data);
+                }
+            }
+            elapsed += clock() - start;
+        }
+        if (!res) {
+            double seconds = (double)elapsed / CLOCKS_PER_SEC;
+            printf("%-28s %9" PRIu32 " bytes  %10.1f us/screenshot  %8.2f MB/s\n",
+                   name, size, seconds * 1e6 / iterations, seconds > 0 ? ((double)size * iterations) / seconds / 1e6 : 0.0);
+        }
+        else {
+            printf("%s: screenshot FAILED (res=%d)\n", name, res);
+        }
+        hpcalcs_cable_detach(calc);
+    }
+    else {
+        printf("%s: setup FAILED\n", name);
+    }
+
+    if (calc != NULL) {
+        hpcalcs_handle_del(calc);
+    }
+    if (cable != NULL) {
+        hpcables_handle_del(cable);
+    }
+    return res;
+}
+
+typedef struct {
+    uint8_t * data;
+    uint32_t size;
+} bench_png_buffer;
+
+static void bench_png_write(png_structp png, png_bytep data, png_size_t length) {
+    bench_png_buffer * buffer = (bench_png_buffer *)png_get_io_ptr(png);
+    uint8_t * grown = (uint8_t *)realloc(buffer->data, buffer->size + length);
+    if (grown == NULL) {
+        png_error(png, "out of memory");
+    }
+    memcpy(grown + buffer->size, data, length);
+    buffer->data = grown;
+    buffer->size += (uint32_t)length;
+}
+
+static void bench_png_flush(png_structp png) {
+    (void)png;
+}
+
+// Encodes grey pixels with the given sample depth as a PNG image, in a buffer to be freed with free().
+static int bench_png_encode(const uint8_t * pixels, uint32_t width, uint32_t height, int bit_depth, bench_png_buffer * out) {
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png != NULL ? png_create_info_struct(png) : NULL;
+    uint32_t y;
+
+    if (info == NULL || setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        return 1;
+    }
+    png_set_write_fn(png, out, bench_png_write, bench_png_flush);
+    png_set_IHDR(png, info, width, height, bit_depth, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+    for (y = 0; y < height; y++) {
+        png_write_row(png, (png_bytep)(pixels + y * width * (uint32_t)bit_depth / 8));
+    }
+    png_write_end(png, info);
+    png_destroy_write_struct(&png, &info);
+    return 0;
+}
+
+// Converts 320x240 grey screenshots, with 16-bit samples holding X1R5G5B5 pixels or 4-bit samples holding grey levels,
+// filled with a gradient so that the input compresses about as well as actual screen contents.
+static int bench_screen_convert(const char * name, int bit_depth, unsigned int iterations) {
+    static uint8_t pixels[320 * 240 * 2];
+    int res;
+    bench_png_buffer input = { NULL, 0 };
+    uint32_t rowbytes = 320 * (uint32_t)bit_depth / 8;
+    uint8_t * output;
+    uint32_t size = 0;
+    uint32_t sum = 0;
+    unsigned int i;
+    clock_t start, elapsed = 0;
+
+    for (i = 0; i < rowbytes * 240; i++) {
+        pixels[i] = (uint8_t)((i % rowbytes) * 7 + (i / rowbytes) * 3);
+    }
+    res = bench_png_encode(pixels, 320, 240, bit_depth, &input);
+
+    for (i = 0; i < iterations && !res; i++) {
+        start = clock();
+        res = hpopers_oper_convert_raw_screen_to_png_r8g8b8(input.data, input.size, bit_depth == 16 ? CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16 : CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x4, &output, &size);
+        elapsed += clock() - start;
+        if (!res) {
+            bench_checksum(&sum, output, size);
+            free(output);
+        }
+    }
+    if (!res) {
+        double seconds = (double)elapsed / CLOCKS_PER_SEC;
+        printf("%-28s %9" PRIu32 " bytes  %10.1f us/screenshot  %8.1f screenshots/s  %9" PRIu32 " bytes out\n",
+               name, input.size, seconds * 1e6 / iterations, seconds > 0 ? iterations / seconds : 0.0, size);
+    }
+    else {
+        printf("%s: conversion FAILED (res=%d)\n", name, res);
+    }
+    free(input.data);
+    return res;
+}
+
+// Change times of the screen contents, and first delivery times of the frames showing them, by marker.
+typedef struct {
+    uint64_t changed_ns[16];
+    uint64_t delivered_ns[16];
+    uint32_t frames;
+} bench_screencast_record;
+
+static uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static int bench_screencast_frame(opers_screencast * cast, const screencast_frame * frame, void * user_data) {
+    bench_screencast_record * record = (bench_screencast_record *)user_data;
+    uint8_t marker = frame->data[0];
+    if (marker < 16 && record->delivered_ns[marker] == 0) {
+        record->delivered_ns[marker] = bench_now_ns();
+    }
+    record->frames++;
+    return 0;
+}
+
+// Casts the screen of a simulated Prime over a 256 KB/s link, while the screen changes every 250 ms.
+// Images are as large as raw ones, e.g. 150 KB at 320x240x16: with the best format only, each change takes seconds to show.
+static int bench_screencast(const char * name, uint32_t latency_budget_us) {
+    static const uint32_t sizes[4] = { 320 * 240 * 2, 320 * 240 / 2, 160 * 120 * 2, 160 * 120 / 2 };
+    static uint8_t image[320 * 240 * 2];
+    bench_screencast_record record;
+    cable_handle * cable = hpcables_handle_new(CABLE_PRIME_SIM);
+    calc_handle * calc = hpcalcs_handle_new(CALC_PRIME);
+    screencast_config config;
+    screencast_stats stats;
+    opers_screencast * cast = NULL;
+    uint8_t marker;
+    int res = 1;
+
+    memset(&record, 0, sizeof(record));
+    memset(&config, 0, sizeof(config));
+    config.format = CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16;
+    config.max_fps = 20;
+    config.latency_budget_us = latency_budget_us;
+    config.frame = bench_screencast_frame;
+    config.user_data = &record;
+
+    if (cable != NULL && calc != NULL && !hpcalcs_cable_attach(calc, cable)) {
+        res = hpcables_prime_sim_set_timing(cable, 0, 256 * 1024, 1);
+        for (marker = 0; marker < 13 && !res; marker++) {
+            struct timespec ts = { 0, 250000000 };
+            uint8_t format;
+            memset(image, marker, sizeof(image));
+            record.changed_ns[marker] = bench_now_ns();
+            for (format = 0; format < 4 && !res; format++) {
+                res = hpcables_prime_sim_set_screen_format(cable, CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16 + format, image, sizes[format]);
+            }
+            if (marker == 0) {
+                cast = hpopers_screencast_start(calc, &config);
+                res = cast == NULL;
+            }
+            nanosleep(&ts, NULL);
+        }
+        if (cast != NULL) {
+            res |= hpopers_screencast_get_stats(cast, &stats);
+            res |= hpopers_screencast_stop(cast);
+        }
+        if (!res) {
+            uint64_t lag_ns = 0;
+            uint32_t shown = 0;
+            for (marker = 1; marker < 13; marker++) {
+                if (record.delivered_ns[marker] != 0) {
+                    lag_ns += record.delivered_ns[marker] - record.changed_ns[marker];
+                    shown++;
+                }
+            }
+            printf("%-28s %6" PRIu32 " frames  %2" PRIu32 "/12 changes shown  %8.1f ms lag  %8.1f KB/frame  format %d\n",
+                   name, record.frames, shown, shown != 0 ? lag_ns / 1e6 / shown : 0.0,
+                   record.frames != 0 ? stats.bytes / 1024.0 / record.frames : 0.0, stats.format);
+        }
+        else {
+            printf("%s: screencast FAILED (res=%d)\n", name, res);
+        }
+        hpcalcs_cable_detach(calc);
+    }
+    else {
+        printf("%s: setup FAILED\n", name);
+    }
+
+    if (calc != NULL) {
+        hpcalcs_handle_del(calc);
+    }
+    if (cable != NULL) {
+        hpcables_handle_del(cable);
+    }
+    return res;
+}
+
+#define BENCH_ASYNC_CALCS (30)
+
+// Receives a 2 KB screenshot from each of 30 simulated Primes, over links with a 1 ms latency per report, 10 times:
+// either one calculator after another with the synchronous API, or from a single thread submitting all requests at once
+// and polling a completion queue, with the given number of worker threads.
+static int bench_async(const char * name, uint32_t workers) {
+    static uint8_t image[2048];
+    calc_handle * calcs[BENCH_ASYNC_CALCS];
+    cable_handle * cables[BENCH_ASYNC_CALCS];
+    calc_completion_queue * queue = hpcalcs_completion_queue_new();
+    calc_async_op op;
+    uint64_t start;
+    uint64_t elapsed = 0;
+    uint32_t created;
+    uint32_t i, iteration;
+    int res = queue == NULL || (workers != 0 && hpcalcs_async_set_workers(workers));
+
+    memset(image, 0x5A, sizeof(image));
+    memset(&op, 0, sizeof(op));
+    op.op = CALC_FNCT_RECV_SCREEN;
+    op.format = CALC_SCREENSHOT_FORMAT_PRIME_PNG_160x120x16;
+    for (created = 0; created < BENCH_ASYNC_CALCS && !res; created++) {
+        cables[created] = hpcables_handle_new(CABLE_PRIME_SIM);
+        calcs[created] = hpcalcs_handle_new(CALC_PRIME);
+        if (cables[created] == NULL || calcs[created] == NULL || hpcalcs_cable_attach(calcs[created], cables[created])) {
+            res = 1;
+            created++;
+            break;
+        }
+        res = hpcables_prime_sim_set_timing(cables[created], 1000, 0, 1)
+              || hpcables_prime_sim_set_screen(cables[created], image, sizeof(image));
+    }
+
+    for (iteration = 0; iteration < 10 && !res; iteration++) {
+        start = bench_now_ns();
+        if (workers == 0) {
+            for (i = 0; i < BENCH_ASYNC_CALCS && !res; i++) {
+                calc_payload payload;
+                res = hpcalcs_calc_recv_screen_payload(calcs[i], op.format, &payload);
+                if (!res) {
+                    hpcalcs_payload_release(&payload);
+                }
+            }
+        }
+        else {
+            for (i = 0; i < BENCH_ASYNC_CALCS && !res; i++) {
+                res = hpcalcs_async_submit(calcs[i], &op, NULL, queue, NULL) == NULL;
+            }
+            for (i = 0; i < BENCH_ASYNC_CALCS && !res; i++) {
+                calc_request * request = hpcalcs_completion_queue_poll(queue, 10000);
+                calc_async_result * result = hpcalcs_request_get_result(request);
+                res = result == NULL || result->res != 0;
+                if (request != NULL) {
+                    hpcalcs_request_del(request);
+                }
+            }
+        }
+        elapsed += bench_now_ns() - start;
+    }
+    if (!res) {
+        printf("%-28s %3" PRIu32 " workers  %8.1f ms/round of %u screenshots\n",
+               name, workers, elapsed / 1e6 / 10, BENCH_ASYNC_CALCS);
+    }
+    else {
+        printf("%s: FAILED (res=%d)\n", name, res);
+    }
+
+    while (created-- > 0) {
+        if (calcs[created] != NULL) {
+            hpcalcs_handle_del(calcs[created]);
+        }
+        if (cables[created] != NULL) {
+            hpcables_handle_del(cables[created]);
+        }
+    }
+    if (queue != NULL) {
+        hpcalcs_completion_queue_del(queue);
+    }
+    return res;
+}
+
+#define BENCH_WALL_CALCS (30)
+
+typedef struct {
+    uint32_t refreshes;
+    uint32_t failed;
+    uint64_t duration_us;
+    uint32_t width;
+    uint32_t height;
+} bench_wall_record;
+
+static int bench_wall_mosaic(opers_wall * wall, const wall_mosaic * mosaic, void * user_data) {
+    bench_wall_record * record = (bench_wall_record *)user_data;
+    record->refreshes++;
+    record->failed += mosaic->failed;
+    record->duration_us += mosaic->duration_us;
+    record->width = mosaic->width;
+    record->height = mosaic->height;
+    return record->refreshes == 5;
+}
+
+// Refreshes a screen wall of 30 simulated Primes with 160x120x16 screens, over links with a 1 ms latency per report,
+// with as many fleet workers as given: with one worker, the screens are captured one after another.
+static int bench_wall(const char * name, uint32_t workers) {
+    static uint8_t pixels[160 * 120 * 2];
+    static bench_wall_record record;
+    calc_handle * calcs[BENCH_WALL_CALCS];
+    bench_png_buffer screen = { NULL, 0 };
+    opers_fleet * fleet = NULL;
+    opers_wall * wall;
+    wall_config config;
+    calc_payload payload;
+    uint64_t single_ns = 0;
+    uint32_t i;
+    int res;
+
+    memset(&record, 0, sizeof(record));
+    memset(&config, 0, sizeof(config));
+    config.format = CALC_SCREENSHOT_FORMAT_PRIME_PNG_160x120x16;
+    config.fps = 1000;
+    config.mosaic = bench_wall_mosaic;
+    config.user_data = &record;
+
+    for (i = 0; i < sizeof(pixels); i++) {
+        pixels[i] = (uint8_t)((i % 320) * 7 + (i / 320) * 3);
+    }
+    res = bench_png_encode(pixels, 160, 120, 16, &screen);
+    for (i = 0; i < BENCH_WALL_CALCS && !res; i++) {
+        cable_handle * cable = hpcables_handle_new(CABLE_PRIME_SIM);
+        calcs[i] = hpcalcs_handle_new(CALC_PRIME);
+        res = cable == NULL || calcs[i] == NULL || hpcalcs_cable_attach(calcs[i], cable)
+              || hpcables_prime_sim_set_timing(cable, 1000, 0, 1)
+              || hpcables_prime_sim_set_screen(cable, screen.data, screen.size);
+        if (res) {
+            if (calcs[i] != NULL) {
+                hpcalcs_handle_del(calcs[i]);
+            }
+            if (cable != NULL) {
+                hpcables_handle_del(cable);
+            }
+            break;
+        }
+    }
+    free(screen.data);
+    if (!res) {
+        uint64_t start = bench_now_ns();
+        res = hpcalcs_calc_recv_screen_payload(calcs[0], config.format, &payload);
+        single_ns = bench_now_ns() - start;
+        if (!res) {
+            hpcalcs_payload_release(&payload);
+        }
+    }
+    if (!res) {
+        fleet = hpopers_fleet_new(calcs, BENCH_WALL_CALCS, workers, NULL);
+        res = fleet == NULL;
+    }
+    if (!res) {
+        wall = hpopers_wall_start(fleet, &config);
+        res = wall == NULL;
+        if (!res) {
+            wall_stats stats;
+            do {
+                struct timespec ts = { 0, 10000000 };
+                nanosleep(&ts, NULL);
+                res = hpopers_wall_get_stats(wall, &stats);
+            } while (!res && stats.running);
+            res |= hpopers_wall_stop(wall);
+        }
+        if (!res && record.failed == 0) {
+            printf("%-28s %3" PRIu32 " workers  %8.1f ms/refresh  %6.1f ms/screenshot  %" PRIu32 "x%" PRIu32 " mosaic\n",
+                   name, workers != 0 ? workers : BENCH_WALL_CALCS, record.duration_us / 1e3 / record.refreshes, single_ns / 1e6, record.width, record.height);
+        }
+        else {
+            printf("%s: wall FAILED (res=%d, %" PRIu32 " failed captures)\n", name, res, record.failed);
+            res = 1;
+        }
+    }
+    else {
+        printf("%s: setup FAILED\n", name);
+    }
+
+    if (fleet != NULL) {
+        hpopers_fleet_del(fleet);
+    }
+    else {
+        while (i-- > 0) {
+            cable_handle * cable = hpcalcs_cable_get(calcs[i]);
+            hpcalcs_cable_detach(calcs[i]);
+            hpcalcs_handle_del(calcs[i]);
+            hpcables_handle_del(cable);
+        }
+    }
+    return res;
+}
+
+// Records the 150 KB screen of a simulated Prime every millisecond for a second, into a 1 MB ring spilling to a file,
+// while the screen changes every 50 ms: memory stays at the ring, allocations only come from receiving screenshots.
+static int bench_recorder(const char * name, const char * path) {
+    static uint8_t image[320 * 240 * 2];
+    cable_handle * cable = hpcables_handle_new(CABLE_PRIME_SIM);
+    calc_handle * calc = hpcalcs_handle_new(CALC_PRIME);
+    recorder_config config;
+    recorder_stats stats;
+    opers_recorder * recorder;
+    unsigned int i;
+    int res = 1;
+
+    memset(&config, 0, sizeof(config));
+    config.format = CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16;
+    config.interval_ms = 1;
+    config.ring_size = 1024 * 1024;
+    config.spill_path = path;
+    remove(path);
+
+    if (cable != NULL && calc != NULL && !hpcalcs_cable_attach(calc, cable)) {
+        alloc_calls = 0;
+        alloc_bytes = 0;
+        recorder = hpopers_recorder_new(calc, &config);
+        if (recorder != NULL) {
+            uint64_t setup_calls = alloc_calls;
+            uint64_t setup_bytes = alloc_bytes;
+            res = 0;
+            for (i = 0; i < 20 && !res; i++) {
+                struct timespec ts = { 0, 50000000 };
+                memset(image, (int)i, sizeof(image));
+                res = hpcables_prime_sim_set_screen(cable, image, sizeof(image));
+                nanosleep(&ts, NULL);
+            }
+            res |= hpopers_recorder_get_stats(recorder, &stats);
+            res |= hpopers_recorder_del(recorder);
+            if (!res) {
+                printf("%-28s %6" PRIu32 " captures  %6" PRIu32 " duplicates  %3" PRIu32 " in memory  %6.1f KB setup  %4.2f allocs/capture  %6.1f MB spilled\n",
+                       name, stats.captures, stats.duplicates, stats.frames, setup_bytes / 1024.0,
+                       stats.captures != 0 ? (double)(alloc_calls - setup_calls) / stats.captures : 0.0, stats.spill_bytes / 1e6);
+            }
+            else {
+                printf("%s: recording FAILED (res=%d)\n", name, res);
+            }
+        }
+        else {
+            printf("%s: recorder FAILED\n", name);
+        }
+        hpcalcs_cable_detach(calc);
+    }
+    else {
+        printf("%s: setup FAILED\n", name);
+    }
+    remove(path);
+
+    if (calc != NULL) {
+        hpcalcs_handle_del(calc);
+    }
+    if (cable != NULL) {
+        hpcables_handle_del(cable);
+    }
+    return res;
+}
+
+// Sends a file to the simulated Prime, either read into memory by hpfiles_ve_create_from_file or mapped by hpfiles_ve_create_from_fd,
+// measuring the heap memory used per transfer: the file data copy, if any, plus what the library allocates to send it.
+static int bench_send_from_file(const char * name, const char * path, uint32_t size, unsigned int iterations, int mapped) {
+    int res = 1;
+    cable_handle * cable = hpcables_handle_new(CABLE_PRIME_SIM);
+    calc_handle * calc = hpcalcs_handle_new(CALC_PRIME);
+    FILE * f = fopen(path, "w+b");
+    uint64_t bytes = 0;
+    unsigned int i;
+    clock_t start, elapsed = 0;
+
+    if (f != NULL) {
+        for (i = 0; i < size; i++) {
+            fputc((int)(i & 0x7F), f);
+        }
+        fflush(f);
+    }
+    if (cable != NULL && calc != NULL && f != NULL && !hpcalcs_cable_attach(calc, cable)) {
+        res = hpcables_prime_sim_set_timing(cable, 1000, 64000, 0);
+        for (i = 0; i < iterations && !res; i++) {
+            files_var_entry * file;
+            alloc_bytes = 0;
+            start = clock();
+            file = mapped ? hpfiles_ve_create_from_fd(fileno(f), NULL) : hpfiles_ve_create_from_file(f, NULL);
+            if (file != NULL) {
+                file->name[0] = 'F';
+                file->type = PRIME_TYPE_PRGM;
+                res = hpcalcs_calc_send_file(calc, file);
+                bytes += alloc_bytes + (file->mapped ? 0 : file->size);
+                hpfiles_ve_delete(file);
+            }
+            else {
+                res = 1;
+            }
+            elapsed += clock() - start;
+        }
+        if (!res) {
+            double seconds = (double)elapsed / CLOCKS_PER_SEC;
+            printf("%-28s %9" PRIu32 " bytes  %10.1f KB heap/xfer  %8.2f MB/s\n",
+                   name, size, (double)bytes / 1024 / iterations, seconds > 0 ? ((double)size * iterations) / seconds / 1e6 : 0.0);
+        }
+        else {
+            printf("%s: send FAILED (res=%d)\n", name, res);
+        }
+        hpcalcs_cable_detach(calc);
+    }
+    else {
+        printf("%s: setup FAILED\n", name);
+    }
+
+    if (f != NULL) {
+        fclose(f);
+        remove(path);
+    }
+    if (calc != NULL) {
+        hpcalcs_handle_del(calc);
+    }
+    if (cable != NULL) {
+        hpcables_handle_del(cable);
+    }
+    return res;
+}
+
+// Records a backup from the simulated Prime into a capture file, then replays it through the receive path:
+// prime_recv_data, the CRC checks and calc_prime_r_recv_backup, as fast as the replay cable serves the reports.
+static int bench_replay_backup(const char * name, const char * path, unsigned int var_count, uint32_t var_size, unsigned int iterations) {
+    int res = 1;
+    cable_handle * cable = hpcables_handle_new(CABLE_PRIME_SIM);
+    calc_handle * calc = hpcalcs_handle_new(CALC_PRIME);
+    files_var_entry * file = hpfiles_ve_create_with_data(NULL, var_size);
+    files_var_entry ** vars = NULL;
+    cable_replay_stats stats;
+    unsigned int i;
+    clock_t start, elapsed = 0;
+
+    // The capture must only contain the backup, and be replayed in the same protocol.
+    if (cable != NULL && calc != NULL && file != NULL && !hpcalcs_options_set_negotiate_protocol(calc, 0) && !hpcalcs_cable_attach(calc, cable)) {
+        res = 0;
+        memset(file->data, 0x3C, var_size);
+        file->type = PRIME_TYPE_PRGM;
+        for (i = 0; i < var_count && !res; i++) {
+            file->name[0] = (char16_t)('A' + i % 26);
+            file->name[1] = (char16_t)('0' + i / 26);
+            res = hpcables_prime_sim_add_var(cable, file);
+        }
+        if (!res) {
+            res = hpcables_capture_start(cable, path);
+        }
+        if (!res) {
+            res = hpcalcs_calc_recv_backup(calc, &vars);
+        }
+        if (vars != NULL) {
+            hpfiles_ve_delete_array(vars);
+            vars = NULL;
+        }
+        // Closes the simulated cable, which ends the capture.
+        hpcalcs_cable_detach(calc);
+    }
+    if (cable != NULL) {
+        hpcables_handle_del(cable);
+    }
+
+    cable = res ? NULL : hpcables_handle_new(CABLE_REPLAY);
+    if (cable != NULL && !hpcables_options_set_device_path(cable, path) && !hpcalcs_cable_attach(calc, cable)) {
+        alloc_calls = 0;
+        for (i = 0; i < iterations && !res; i++) {
+            res = hpcables_replay_rewind(cable);
+            start = clock();
+            if (!res) {
+                res = hpcalcs_calc_recv_backup(calc, &vars);
+            }
+            elapsed += clock() - start;
+            if (vars != NULL) {
+                hpfiles_ve_delete_array(vars);
+                vars = NULL;
+            }
+        }
+        if (!res) {
+            res = hpcables_replay_get_stats(cable, &stats);
+        }
+        if (!res && stats.mismatches == 0) {
+            double seconds = (double)elapsed / CLOCKS_PER_SEC;
+            printf("%-28s %9" PRIu32 " bytes  %6" PRIu64 " reports  %10.1f allocs/xfer  %8.2f MB/s\n",
+                   name, var_count * var_size, stats.reports_received / iterations, (double)alloc_calls / iterations,
+                   seconds > 0 ? ((double)var_count * var_size * iterations) / seconds / 1e6 : 0.0);
+        }
+        else {
+            printf("%s: replay FAILED (res=%d, mismatches=%" PRIu64 ")\n", name, res, res ? 0 : stats.mismatches);
+            res = 1;
+        }
+        hpcalcs_cable_detach(calc);
+    }
+    else {
+        printf("%s: setup FAILED\n", name);
+        res = 1;
+    }
+
+    if (cable != NULL) {
+        hpcables_handle_del(cable);
+    }
+    if (file != NULL) {
+        hpfiles_ve_delete(file);
+    }
+    if (calc != NULL) {
+        hpcalcs_handle_del(calc);
+    }
+    remove(path);
+    return res;
+}
+
+// Receives a file from the simulated Prime repeatedly, through the fault injection wrapper, and reports how much work completes,
+// and how many transfers it takes to get a good one through again after a failure.
+static int bench_faults(const char * name, const cable_faults_config * config, uint32_t size, unsigned int iterations) {
+    int res = 1;
+    cable_handle * cable = hpcables_handle_new(CABLE_PRIME_SIM);
+    calc_handle * calc = hpcalcs_handle_new(CALC_PRIME);
+    files_var_entry * file = hpfiles_ve_create_with_data(NULL, size);
+    files_var_entry * received = NULL;
+    cable_faults_stats stats;
+    unsigned int i, completed = 0, failed_run = 0, recoveries = 0, recovery_transfers = 0;
+    clock_t start, elapsed = 0;
+
+    // Keepalive polls would draw from the pseudo-random generator of the wrapper, making the faults irreproducible.
+    if (cable != NULL && calc != NULL && file != NULL && !hpcalcs_options_set_negotiate_protocol(calc, 0) && !hpcalcs_cable_attach(calc, cable)) {
+        memset(file->data, 0xC3, size);
+        file->name[0] = 'F';
+        file->type = PRIME_TYPE_PRGM;
+        res = hpcables_prime_sim_add_var(cable, file);
+        if (!res) {
+            res = hpcables_faults_start(cable, config);
+        }
+        for (i = 0; i < iterations && !res; i++) {
+            start = clock();
+            if (!hpcalcs_calc_recv_file(calc, file, &received) && received != NULL && received->size == size) {
+                completed++;
+                if (failed_run != 0) {
+                    recoveries++;
+                    recovery_transfers += failed_run;
+                    failed_run = 0;
+                }
+            }
+            else {
+                failed_run++;
+            }
+            elapsed += clock() - start;
+            if (received != NULL) {
+                hpfiles_ve_delete(received);
+                received = NULL;
+            }
+        }
+        if (!res) {
+            res = hpcables_faults_get_stats(cable, &stats);
+        }
+        if (!res) {
+            double seconds = (double)elapsed / CLOCKS_PER_SEC;
+            printf("%-28s %6u/%-6u completed  %6" PRIu64 " faults  %6.1f failed xfers/recovery  %8.2f MB/s goodput\n",
+                   name, completed, iterations,
+                   stats.dropped + stats.duplicated + stats.shortened + stats.spurious + stats.delayed + stats.send_dropped,
+                   recoveries != 0 ? (double)recovery_transfers / recoveries : 0.0,
+                   seconds > 0 ? ((double)size * completed) / seconds / 1e6 : 0.0);
+        }
+        else {
+            printf("%s: setup FAILED (res=%d)\n", name, res);
+        }
+        hpcalcs_cable_detach(calc);
+    }
+    else {
+        printf("%s: setup FAILED\n", name);
+    }
+
+    if (file != NULL) {
+        hpfiles_ve_delete(file);
+    }
+    if (calc != NULL) {
+        hpcalcs_handle_del(calc);
+    }
+    if (cable != NULL) {
+        hpcables_handle_del(cable);
+    }
+    return res;
+}
+
+// Receives a backup of 30 files from the simulated Prime through the fault injection wrapper, and reports how many files come out intact.
+static int bench_faults_backup(const char * name, const cable_faults_config * config, int resync, unsigned int iterations) {
+    int res = 1;
+    files_var_entry * file = hpfiles_ve_create_with_data(NULL, 30 * 1024);
+    files_var_entry ** vars = NULL;
+    unsigned int i, j, intact = 0;
+    clock_t start, elapsed = 0;
+
+    if (file == NULL) {
+        printf("%s: allocation FAILED\n", name);
+        return 1;
+    }
+    memset(file->data, 0x96, file->size);
+    file->type = PRIME_TYPE_PRGM;
+    for (i = 0; i < iterations; i++) {
+        cable_faults_config seeded = *config;
+        cable_handle * cable = hpcables_handle_new(CABLE_PRIME_SIM);
+        calc_handle * calc = hpcalcs_handle_new(CALC_PRIME);
+        res = 1;
+        seeded.seed += i;
+        if (cable != NULL && calc != NULL && !hpcalcs_options_set_negotiate_protocol(calc, 0) && !hpcalcs_cable_attach(calc, cable)) {
+            res = hpcalcs_options_set_backup_resync(calc, resync);
+            for (j = 0; j < 30 && !res; j++) {
+                file->name[0] = (char16_t)('A' + j);
+                file->size = 1024 + j * 1000;
+                res = hpcables_prime_sim_add_var(cable, file);
+            }
+            if (!res) {
+                res = hpcables_faults_start(cable, &seeded);
+            }
+            if (!res) {
+                start = clock();
+                // A failed backup still counts the files received before the failure.
+                hpcalcs_calc_recv_backup(calc, &vars);
+                elapsed += clock() - start;
+            }
+            for (j = 0; vars != NULL && vars[j] != NULL; j++) {
+                intact += !vars[j]->invalid;
+            }
+            if (vars != NULL) {
+                hpfiles_ve_delete_array(vars);
+                vars = NULL;
+            }
+            hpcalcs_cable_detach(calc);
+        }
+        if (calc != NULL) {
+            hpcalcs_handle_del(calc);
+        }
+        if (cable != NULL) {
+            hpcables_handle_del(cable);
+        }
+        if (res) {
+            printf("%s: setup FAILED (res=%d)\n", name, res);
+            break;
+        }
+    }
+    if (!res) {
+        printf("%-36s %6u/%-6u intact files  %8.2f ms/backup\n", name, intact, 30 * iterations, (double)elapsed * 1000 / CLOCKS_PER_SEC / iterations);
+    }
+    hpfiles_ve_delete(file);
+    return res;
+}
+
+static int bench_all_faults(void) {
+    static const struct {
+        const char * name;
+        cable_faults_config config;
+    } modes[] = {
+        { "faults: none",                  { 1, 0, 0, 0, 0, 0, 0, 0 } },
+        { "faults: 0.1% drops",            { 1, 1000, 0, 0, 0, 0, 0, 0 } },
+        { "faults: 0.1% duplicates",       { 1, 0, 1000, 0, 0, 0, 0, 0 } },
+        { "faults: 0.1% short reads",      { 1, 0, 0, 1000, 0, 0, 0, 0 } },
+        { "faults: 1% spurious reports",   { 1, 0, 0, 0, 10000, 0, 0, 0 } },
+        { "faults: 1% delays of 100 us",   { 1, 0, 0, 0, 0, 10000, 100, 0 } },
+        { "faults: 0.1% send drops",       { 1, 0, 0, 0, 0, 0, 0, 1000 } }
+    };
+    int res = 0;
+    unsigned int i;
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        res |= bench_faults(modes[i].name, &modes[i].config, 16 * 1024, 200);
+    }
+    res |= bench_faults_backup("backup, 0.1% drops", &modes[1].config, 0, 20);
+    res |= bench_faults_backup("backup, 0.1% drops, resync", &modes[1].config, 1, 20);
+    res |= bench_faults_backup("backup, 0.1% short reads", &modes[3].config, 0, 20);
+    res |= bench_faults_backup("backup, 0.1% short reads, resync", &modes[3].config, 1, 20);
+    return res;
+}
+
+int main(int argc, char **argv) {
+    int res = 1;
+    cable_handle * cable;
+    calc_handle * calc;
+    hpcalcs_config hpcalcs_cfg = {
+        .version = HPCALCS_CONFIG_VERSION,
+        .log_callback = NULL,
+        .alloc_funcs = &counting_alloc_funcs
+    };
+    hpopers_config hpopers_cfg = {
+        .version = HPOPERS_CONFIG_VERSION,
+        .log_callback = NULL,
+        .alloc_funcs = &counting_alloc_funcs
+    };
+
+    if (hpfiles_init(NULL) || hpcables_init(NULL) || hpcalcs_init(&hpcalcs_cfg) || hpopers_init(&hpopers_cfg)) {
+        printf("Library initialization failed\n");
+        return 1;
+    }
+
+    cable = hpcables_handle_new(CABLE_NUL);
+    calc = hpcalcs_handle_new(CALC_PRIME);
+    if (cable != NULL && calc != NULL) {
+        cable->fncts = &bench_cable_fncts;
+        // The bench cable only serves the replies built by each benchmark.
+        hpcalcs_options_set_negotiate_protocol(calc, 0);
+        if (hpcalcs_cable_attach(calc, cable) == 0) {
+            res = 0;
+            res |= bench_crc16(2 * 1024 * 1024, 50);
+            res |= bench_send_data(calc, "send_data 2 MB file", 2 * 1024 * 1024, 10);
+            res |= bench_broadcast(calc, "send_file 1 MB x 30", 1024 * 1024, 30, 0);
+            res |= bench_broadcast(calc, "encoded send 1 MB x 30", 1024 * 1024, 30, 1);
+            res |= bench_recv_data(calc, "recv_data small file", CMD_PRIME_RECV_FILE, 1000, 2000, 0);
+            res |= bench_recv_data(calc, "recv_data screenshot", CMD_PRIME_RECV_SCREEN, 320 * 240 * 2, 50, 0);
+            res |= bench_recv_data(calc, "recv_data 2 MB backup file", CMD_PRIME_RECV_FILE, 2 * 1024 * 1024, 10, 0);
+            res |= bench_recv_data(calc, "recv_data 2 MB file + CRC", CMD_PRIME_RECV_FILE, 2 * 1024 * 1024, 10, 1);
+            res |= bench_recv_data(calc, "recv_data odd file + CRC", CMD_PRIME_RECV_FILE, 12345, 100, 1);
+            hpcalcs_cable_detach(calc);
+        }
+    }
+    res |= bench_prime_sim("simulated send+recv 64 KB", 64 * 1024, 20);
+    res |= bench_prime_sim("simulated send+recv 1 MB", 1024 * 1024, 5);
+    res |= bench_protocol("old protocol, 1 KB files", 0, 1024, 200);
+    res |= bench_protocol("new protocol, 1 KB files", 1, 1024, 200);
+    res |= bench_protocol("old protocol, 64 KB files", 0, 64 * 1024, 20);
+    res |= bench_protocol("new protocol, 64 KB files", 1, 64 * 1024, 20);
+    res |= bench_prime_stream("simulated recv 4 MB", 4 * 1024 * 1024, 5, 0);
+    res |= bench_prime_stream("simulated recv 4 MB stream", 4 * 1024 * 1024, 5, 1);
+    res |= bench_screen_poll("simulated screenshot memmove", 100, 0);
+    res |= bench_screen_poll("simulated screenshot view", 100, 1);
+    res |= bench_screen_convert("convert 320x240x16 screenshot", 16, 200);
+    res |= bench_screen_convert("convert 320x240x4 screenshot", 4, 200);
+    res |= bench_screencast("screencast, best format", 0);
+    res |= bench_screencast("screencast, 100 ms budget", 100000);
+    res |= bench_recorder("recorder, 150 KB screens", "bench_hpcalcs.rec");
+    res |= bench_async("synchronous x 30", 0);
+    res |= bench_async("asynchronous x 30", 4);
+    res |= bench_async("asynchronous x 30", 30);
+    res |= bench_wall("screen wall x 30, serial", 1);
+    res |= bench_wall("screen wall x 30, parallel", 0);
+    res |= bench_send_from_file("simulated send 4 MB read", "bench_hpcalcs.file", 4 * 1024 * 1024, 5, 0);
+    res |= bench_send_from_file("simulated send 4 MB mapped", "bench_hpcalcs.file", 4 * 1024 * 1024, 5, 1);
+    res |= bench_all_faults();
+    res |= bench_replay_backup("replayed backup 40 x 16 KB", "bench_hpcalcs.capture", 40, 16 * 1024, 20);
+
+    if (calc != NULL) {
+        hpcalcs_handle_del(calc);
+    }
+    if (cable != NULL) {
+        hpcables_handle_del(cable);
+    }
+
+    hpopers_exit();
+    hpcalcs_exit();
+    hpcables_exit();
+    hpfiles_exit();
+
+    return res;
+}
@@ -231,8 +231,7 @@ static int set_date_time(calc_handle * handle) {
 
 static int recv_screen(calc_handle * handle) {
     int res = 0;
-    uint8_t * data;
-    uint32_t size;
+    calc_payload payload;
     unsigned int format;
     int err;
 
@@ -246,18 +245,19 @@ static int recv_screen(calc_handle * handle) {
         err = scanf("%1023s", filename);
         if (err >= 1) {
             output_log(stdout, "\n%s\n", filename);
-            res = hpcalcs_calc_recv_screen(handle, format, &data, &size);
-            if (res == 0 && data != NULL) {
+            res = hpcalcs_calc_recv_screen_payload(handle, format, &payload);
+            if (res == 0 && payload.block != NULL) {
                 FILE * f;
                 output_log(stdout, "Receive screenshot success\n");
                 f = fopen(filename, "w+b");
                 if (f != NULL) {
-                    fwrite(data, 1, size, f);
+                    fwrite(CALC_PAYLOAD_DATA(&payload), 1, payload.size, f);
                     fclose(f);
                 }
                 else {
                     output_log(stdout, "Cannot open file for writing !\n");
                 }
+                hpcalcs_payload_release(&payload);
             }
             else {
                 output_log(stdout, "hpcalcs_calc_recv_screen failed\n");
@@ -297,31 +297,24 @@ static int send_file(calc_handle * handle) {
     if (err >= 1) {
         FILE * f = fopen(filename, "rb");
         if (f != NULL) {
-            uint32_t size;
             uint8_t type;
-            fseek(f, 0, SEEK_END);
-            size = (uint32_t)ftell(f);
-            fseek(f, 0, SEEK_SET);
-            output_log(stdout, "Input file has size %" PRIu32 " (%" PRIx32 ")\n", size, size);
-            entry = hpfiles_ve_create_with_size(size);
+            // The file is mapped rather than read into memory, and sent straight from the mapping.
+            entry = hpfiles_ve_create_from_fd(fileno(f), NULL);
+            fclose(f);
             if (entry != NULL) {
                 char * calcfilename = NULL;
+                output_log(stdout, "Input file has size %" PRIu32 " (%" PRIx32 ")\n", entry->size, entry->size);
                 if (!hpfiles_parsefilename(hpcalcs_get_model(handle), filename, &type, &calcfilename)) {
                     if (type != HPLIBS_FILE_TYPE_UNKNOWN && calcfilename != NULL) {
                         entry->type = type;
-                        if (fread(entry->data, 1, size, f) == size) {
-                            crude_convert_8bit_to_UTF16LE(calcfilename, entry->name);
-                            // We can at last send the file !
-                            res = hpcalcs_calc_send_file(handle, entry);
-                            if (res == 0 && entry != NULL) {
-                                output_log(stdout, "hpcalcs_calc_send_file succeeded\n");
-                            }
-                            else {
-                                output_log(stdout, "hpcalcs_calc_send_file failed\n");
-                            }
+                        crude_convert_8bit_to_UTF16LE(calcfilename, entry->name);
+                        // We can at last send the file !
+                        res = hpcalcs_calc_send_file(handle, entry);
+                        if (res == 0 && entry != NULL) {
+                            output_log(stdout, "hpcalcs_calc_send_file succeeded\n");
                         }
                         else {
-                            output_log(stdout, "Reading input file failed, aborted\n");
+                            output_log(stdout, "hpcalcs_calc_send_file failed\n");
                         }
                         free(calcfilename);
                     }
@@ -535,16 +528,16 @@ static int send_chat(calc_handle * handle) {
 
 static int recv_chat(calc_handle * handle) {
     int res = 0;
-    uint32_t size;
-    uint16_t * data;
+    calc_payload payload;
 
-    res = hpcalcs_calc_recv_chat(handle, &data, &size);
+    res = hpcalcs_calc_recv_chat_payload(handle, &payload);
     if (res == 0) {
-        output_log(stdout, "hpcalcs_calc_recv_chat succeeded\n");
+        output_log(stdout, "hpcalcs_calc_recv_chat_payload succeeded\n");
         // TODO: do something with chat data.
+        hpcalcs_payload_release(&payload);
     }
     else {
-        output_log(stdout, "hpcalcs_calc_recv_chat failed\n");
+        output_log(stdout, "hpcalcs_calc_recv_chat_payload failed\n");
     }
 
     return res;
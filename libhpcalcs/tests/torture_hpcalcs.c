@@ -1,10 +1,17 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <hpfiles.h>
 #include <hpcables.h>
 #include <hpcalcs.h>
 #include <hpopers.h>
 #include <filetypes.h>
 #include <prime_cmd.h>
+#include <prime_sim.h>
+#include <string.h>
+#include <time.h>
+#include <png.h>
+#include <pthread.h>
+#include <poll.h>
 
 #define PRINTF(FUNCTION, TYPE, args...) \
 fprintf(stderr, "%d\t" TYPE "\n", i, FUNCTION(args)); i++
@@ -22,8 +29,1321 @@ static void output_log_callback(const char *format, va_list args) {
     fflush(stdout);
 }
 
+// Bit-at-a-time CRC16-CCITT, independent from the table-driven and folding implementations of the library.
+static uint16_t reference_crc16(const uint8_t * data, uint32_t size) {
+    uint16_t crc = 0;
+    uint32_t i;
+    int bit;
+    for (i = 0; i < size; i++) {
+        crc ^= (uint16_t)(data[i] << 8);
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+static int torture_crc16(void) {
+    static uint8_t data[4096 + 16];
+    uint32_t i, offset, size;
+    for (i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 131 + (i >> 5));
+    }
+    for (offset = 0; offset < 16; offset += 3) {
+        for (size = 0; size <= 4096; size += (size < 520 ? 1 : 97)) {
+            if (prime_crc16_block(data + offset, size) != reference_crc16(data + offset, size)) {
+                fprintf(stderr, "CRC16 mismatch at offset %u size %u\n", offset, size);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Cable serving a scripted series of reports, for replies the simulated Prime wouldn't send.
+static uint8_t torture_reports[4][PRIME_RAW_HID_DATA_SIZE];
+static uint32_t torture_reports_count;
+static uint32_t torture_reports_current;
+
+static int torture_reports_open(cable_handle * handle) {
+    handle->open = 1;
+    return 0;
+}
+
+static int torture_reports_close(cable_handle * handle) {
+    return 0;
+}
+
+static int torture_reports_set_read_timeout(cable_handle * handle, int read_timeout) {
+    handle->read_timeout = read_timeout;
+    return 0;
+}
+
+static int torture_reports_send(cable_handle * handle, uint8_t * data, uint32_t len) {
+    return 0;
+}
+
+static int torture_reports_recv(cable_handle * handle, uint8_t * data, uint32_t * len) {
+    *len = 0;
+    if (torture_reports_current < torture_reports_count) {
+        memcpy(data, torture_reports[torture_reports_current++], PRIME_RAW_HID_DATA_SIZE);
+        *len = PRIME_RAW_HID_DATA_SIZE;
+    }
+    return 0;
+}
+
+static const cable_fncts torture_reports_fncts =
+{
+    CABLE_NUL,
+    "Torture cable",
+    "In-memory cable serving scripted reports",
+    NULL,
+    &torture_reports_open,
+    &torture_reports_close,
+    &torture_reports_set_read_timeout,
+    &torture_reports_send,
+    &torture_reports_recv,
+    NULL,
+    NULL,
+    NULL
+};
+
+static int torture_recv_limits_consumer(prime_vtl_pkt * pkt, uint32_t expected_size, const uint8_t * data, uint32_t size, void * user_data) {
+    (*(uint32_t *)user_data)++;
+    return 0;
+}
+
+// A reply announcing more than it delivers is rejected instead of being allocated and padded at the announced size, whether received
+// whole or streamed, and a reply of undetermined size is one report long, even when more follow.
+static int torture_recv_limits(void) {
+    int res = 1;
+    cable_handle * cable = hpcables_handle_new(CABLE_NUL);
+    calc_handle * calc = hpcalcs_handle_new(CALC_PRIME);
+    prime_vtl_pkt pkt;
+    uint32_t chunks = 0;
+
+    if (cable != NULL && calc != NULL) {
+        cable->fncts = &torture_reports_fncts;
+        if (!hpcalcs_cable_attach(calc, cable)) {
+            static const uint8_t header[6] = { CMD_PRIME_RECV_SCREEN, 0x01, 0xFF, 0xFF, 0xFF, 0xF0 };
+            memset(torture_reports, 0x5A, sizeof(torture_reports));
+            torture_reports[0][0] = 0x00;
+            memcpy(&torture_reports[0][1], header, sizeof(header));
+            torture_reports[1][0] = 0x01;
+            torture_reports_count = 2;
+            torture_reports_current = 0;
+            memset(&pkt, 0, sizeof(pkt));
+            pkt.cmd = CMD_PRIME_RECV_SCREEN;
+            res = prime_recv_data(calc, &pkt) == 0;
+            free(pkt.data);
+            if (!res) {
+                // The consumer only sees the reports received.
+                torture_reports_current = 0;
+                memset(&pkt, 0, sizeof(pkt));
+                pkt.cmd = CMD_PRIME_RECV_SCREEN;
+                res = prime_recv_data_stream(calc, &pkt, torture_recv_limits_consumer, &chunks) == 0 || chunks != 2;
+            }
+
+            if (!res) {
+                torture_reports[0][1] = 0x42;
+                torture_reports_current = 0;
+                memset(&pkt, 0, sizeof(pkt));
+                pkt.cmd = 0x42;
+                res = prime_recv_data(calc, &pkt) || pkt.size != PRIME_RAW_HID_DATA_SIZE - 1 || torture_reports_current != 1;
+                free(pkt.data);
+            }
+            if (res) {
+                fprintf(stderr, "reply size limits failed\n");
+            }
+            hpcalcs_cable_detach(calc);
+        }
+    }
+    if (calc != NULL) {
+        hpcalcs_handle_del(calc);
+    }
+    if (cable != NULL) {
+        hpcables_handle_del(cable);
+    }
+    return res;
+}
+
+// Creates a simulated Prime cable and a calculator handle, and attaches them, negotiating the new protocol if asked to.
+// Returns 0 upon success; upon failure, the handles are released and set to NULL.
+static int torture_sim_setup(cable_handle ** out_cable, calc_handle ** out_calc, int negotiate_protocol) {
+    cable_handle * cable = hpcables_handle_new(CABLE_PRIME_SIM);
+    calc_handle * calc = hpcalcs_handle_new(CALC_PRIME);
+
+    if (   cable != NULL && calc != NULL && !hpcalcs_options_set_negotiate_protocol(calc, negotiate_protocol)
+        && !hpcalcs_cable_attach(calc, cable)) {
+        *out_cable = cable;
+        *out_calc = calc;
+        return 0;
+    }
+    fprintf(stderr, "simulated Prime setup failed\n");
+    if (calc != NULL) {
+        hpcalcs_handle_del(calc);
+    }
+    if (cable != NULL) {
+        hpcables_handle_del(cable);
+    }
+    *out_cable = NULL;
+    *out_calc = NULL;
+    return 1;
+}
+
+// Releases the handles set up by torture_sim_setup, detaching them first if the test left them attached.
+static void torture_sim_teardown(cable_handle * cable, calc_handle * calc) {
+    if (calc->attached) {
+        hpcalcs_cable_detach(calc);
+    }
+    hpcalcs_handle_del(calc);
+    hpcables_handle_del(cable);
+}
+
+// Checks that the slices handed over by a streaming receive are contiguous and match the expected data.
+typedef struct {
+    const uint8_t * expected;
+    uint32_t received;
+    int complete;
+    int bad;
+} torture_stream_state;
+
+static int torture_stream_callback(const calc_recv_chunk * chunk, const uint8_t * data, uint32_t size, void * user_data) {
+    torture_stream_state * state = (torture_stream_state *)user_data;
+    if (chunk->complete) {
+        state->complete = 1;
+        state->bad |= chunk->invalid || chunk->size != state->received;
+    }
+    else {
+        state->bad |= chunk->offset != state->received || chunk->offset + size > chunk->size || memcmp(data, state->expected + chunk->offset, size);
+        state->received += size;
+    }
+    return 0;
+}
+
+// Round trip through the simulated Prime cable: every byte sent must come back, with consistent framing and CRCs.
+static int torture_prime_sim(void) {
+    static uint8_t data[5000];
+    int res = 1;
+    uint32_t i;
+    cable_handle * cable;
+    calc_handle * calc;
+    files_var_entry * file = hpfiles_ve_create();
+    files_var_entry * received = NULL;
+    prime_sim_stats stats;
+    torture_stream_state stream;
+
+    for (i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 7 + (i >> 8));
+    }
+    if (file != NULL && !torture_sim_setup(&cable, &calc, 0)) {
+        file->type = PRIME_TYPE_PRGM;
+        file->name[0] = 'T';
+        for (i = 1; i < sizeof(data) && res; i += (i < 200 ? 1 : 611)) {
+            file->data = data;
+            file->size = i;
+            if (   hpcalcs_calc_send_file(calc, file)
+                || hpcalcs_calc_recv_file(calc, file, &received)
+                || received == NULL || received->size != i || memcmp(received->data, data, i)) {
+                fprintf(stderr, "simulated Prime round trip failed at size %u\n", i);
+                break;
+            }
+            hpfiles_ve_delete(received);
+            received = NULL;
+            memset(&stream, 0, sizeof(stream));
+            stream.expected = data;
+            if (   hpcalcs_calc_recv_file_stream(calc, file, torture_stream_callback, &stream)
+                || !stream.complete || stream.bad || stream.received != i) {
+                fprintf(stderr, "simulated Prime streaming receive failed at size %u\n", i);
+                break;
+            }
+        }
+        if (i >= sizeof(data)) {
+            // The payload view and the legacy interface must yield the same screenshot.
+            calc_payload payload;
+            uint8_t * image = NULL;
+            uint32_t image_size = 0;
+            memset(&payload, 0, sizeof(payload));
+            if (   hpcables_prime_sim_set_screen(cable, data, sizeof(data))
+                || hpcalcs_calc_recv_screen_payload(calc, CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16, &payload)
+                || payload.size != sizeof(data) || memcmp(CALC_PAYLOAD_DATA(&payload), data, sizeof(data))
+                || hpcalcs_calc_recv_screen(calc, CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16, &image, &image_size)
+                || image_size != sizeof(data) || memcmp(image, data, sizeof(data))) {
+                fprintf(stderr, "simulated Prime screenshot failed\n");
+                i = 0;
+            }
+            hpcalcs_payload_release(&payload);
+            free(image);
+        }
+        if (i >= sizeof(data)) {
+            res = hpcables_prime_sim_get_stats(cable, &stats) || stats.crc_errors != 0 || stats.sequence_errors != 0 || stats.unknown_commands != 0;
+        }
+        if (received != NULL) {
+            hpfiles_ve_delete(received);
+        }
+        file->data = NULL;
+        torture_sim_teardown(cable, calc);
+    }
+    hpfiles_ve_delete(file);
+    return res;
+}
+
+// Sends a file mapped by hpfiles_ve_create_from_fd, large enough to be framed in several batches, and checks what the simulated Prime stored.
+static int torture_prime_sim_mapped(void) {
+    int res = 1;
+    uint32_t i;
+    cable_handle * cable;
+    calc_handle * calc;
+    files_var_entry * file = NULL;
+    files_var_entry ** vars = NULL;
+    FILE * f = tmpfile();
+
+    if (f != NULL) {
+        for (i = 0; i < 100000; i++) {
+            fputc((int)((i * 11 + (i >> 9)) & 0xFF), f);
+        }
+        fflush(f);
+        file = hpfiles_ve_create_from_fd(fileno(f), NULL);
+        fclose(f);
+    }
+    if (file != NULL && file->size == 100000 && !torture_sim_setup(&cable, &calc, 0)) {
+        file->type = PRIME_TYPE_PRGM;
+        file->name[0] = 'M';
+        if (   !hpcalcs_calc_send_file(calc, file)
+            && !hpcables_prime_sim_get_vars(cable, &vars)
+            && vars != NULL && vars[0] != NULL && vars[0]->size == file->size && !memcmp(vars[0]->data, file->data, file->size)) {
+            res = 0;
+        }
+        else {
+            fprintf(stderr, "simulated Prime send of a mapped file failed\n");
+        }
+        if (vars != NULL) {
+            hpfiles_ve_delete_array(vars);
+        }
+        torture_sim_teardown(cable, calc);
+    }
+    if (file != NULL) {
+        hpfiles_ve_delete(file);
+    }
+    return res;
+}
+
+// Checks the negotiation of the new protocol on attach, its packet numbering past one wrap in both directions, the consumption of idle keepalives,
+// and the fallback to the old protocol with a firmware which doesn't support the new one.
+static int torture_prime_sim_protocol(void) {
+    static uint8_t data[20000];
+    int res = 1;
+    uint32_t i;
+    cable_handle * cable;
+    calc_handle * calc;
+    files_var_entry * file = hpfiles_ve_create();
+    files_var_entry * received = NULL;
+    prime_sim_stats stats;
+
+    for (i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 13 + (i >> 7));
+    }
+    if (file != NULL && !torture_sim_setup(&cable, &calc, 1)) {
+        struct timespec ts = { 0, 50 * 1000 * 1000 };
+        file->type = PRIME_TYPE_PRGM;
+        file->name[0] = 'P';
+        file->data = data;
+        file->size = sizeof(data);
+        if (   calc->protocol_version != 1
+            || hpcalcs_calc_send_file(calc, file)
+            || hpcalcs_calc_recv_file(calc, file, &received)
+            || received == NULL || received->size != sizeof(data) || memcmp(received->data, data, sizeof(data))) {
+            fprintf(stderr, "simulated Prime round trip in the new protocol failed\n");
+        }
+        else {
+            // Idle keepalives must be absorbed in the background, without disturbing the next command.
+            uint64_t keepalives = calc->keepalives;
+            hpcables_prime_sim_set_protocol(cable, 1, 1000);
+            nanosleep(&ts, NULL);
+            hpcables_prime_sim_set_protocol(cable, 1, 0);
+            if (   calc->keepalives <= keepalives
+                || hpcalcs_calc_check_ready(calc, NULL, NULL)
+                || hpcables_prime_sim_get_stats(cable, &stats) || stats.sequence_errors != 0 || stats.crc_errors != 0) {
+                fprintf(stderr, "simulated Prime keepalive handling failed\n");
+            }
+            else {
+                res = 0;
+            }
+        }
+        hpcalcs_cable_detach(calc);
+        if (received != NULL) {
+            hpfiles_ve_delete(received);
+            received = NULL;
+        }
+        if (!res) {
+            // Same commands with a firmware which ignores the request to switch, negotiating once the cable is set up.
+            res = 1;
+            hpcalcs_options_set_negotiate_protocol(calc, 0);
+            if (!hpcalcs_cable_attach(calc, cable)) {
+                if (   hpcables_prime_sim_set_protocol(cable, 0, 0)
+                    || hpcalcs_calc_negotiate_protocol(calc) || calc->protocol_version != 0
+                    || hpcalcs_calc_send_file(calc, file)
+                    || hpcalcs_calc_recv_file(calc, file, &received)
+                    || received == NULL || received->size != sizeof(data) || memcmp(received->data, data, sizeof(data))
+                    // Packets numbered the new way, e.g. the probe, are reported as out of sequence by the simulated calculator, but it mustn't send keepalives.
+                    || hpcables_prime_sim_get_stats(cable, &stats) || stats.keepalives != 0) {
+                    fprintf(stderr, "simulated Prime fallback to the old protocol failed\n");
+                }
+                else {
+                    res = 0;
+                }
+            }
+        }
+        if (received != NULL) {
+            hpfiles_ve_delete(received);
+        }
+        torture_sim_teardown(cable, calc);
+    }
+    if (file != NULL) {
+        file->data = NULL;
+        hpfiles_ve_delete(file);
+    }
+    return res;
+}
+
+typedef struct {
+    uint8_t * data;
+    uint32_t size;
+    uint32_t offset;
+} torture_png_buffer;
+
+static void torture_png_write(png_structp png, png_bytep data, png_size_t length) {
+    torture_png_buffer * buffer = (torture_png_buffer *)png_get_io_ptr(png);
+    uint8_t * grown = (uint8_t *)realloc(buffer->data, buffer->size + length);
+    if (grown == NULL) {
+        png_error(png, "out of memory");
+    }
+    memcpy(grown + buffer->size, data, length);
+    buffer->data = grown;
+    buffer->size += (uint32_t)length;
+}
+
+static void torture_png_flush(png_structp png) {
+    (void)png;
+}
+
+static void torture_png_read(png_structp png, png_bytep data, png_size_t length) {
+    torture_png_buffer * buffer = (torture_png_buffer *)png_get_io_ptr(png);
+    if (length > buffer->size - buffer->offset) {
+        png_error(png, "truncated image");
+    }
+    memcpy(data, buffer->data + buffer->offset, length);
+    buffer->offset += (uint32_t)length;
+}
+
+// Encodes rows of raw samples as a PNG image, in a buffer to be freed with free().
+static int torture_png_encode(const uint8_t * pixels, uint32_t width, uint32_t height, int bit_depth, int color_type, torture_png_buffer * out) {
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png != NULL ? png_create_info_struct(png) : NULL;
+    uint32_t rowbytes = (width * (color_type == PNG_COLOR_TYPE_RGB ? 3 : 1) * (uint32_t)bit_depth + 7) / 8;
+    uint32_t y;
+    memset(out, 0, sizeof(*out));
+    if (info == NULL || setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        return 1;
+    }
+    png_set_write_fn(png, out, torture_png_write, torture_png_flush);
+    png_set_IHDR(png, info, width, height, bit_depth, color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+    for (y = 0; y < height; y++) {
+        png_write_row(png, (png_bytep)(pixels + y * rowbytes));
+    }
+    png_write_end(png, info);
+    png_destroy_write_struct(&png, &info);
+    return 0;
+}
+
+// Decodes a PNG image, which must be R8G8B8, and compares its pixels.
+static int torture_png_check_rgb(uint8_t * data, uint32_t size, const uint8_t * expected, uint32_t width, uint32_t height) {
+    static uint8_t row[4096 * 3];
+    torture_png_buffer buffer = { data, size, 0 };
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png != NULL ? png_create_info_struct(png) : NULL;
+    int res = 1;
+    uint32_t y;
+    if (info == NULL || setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, NULL);
+        return 1;
+    }
+    png_set_read_fn(png, &buffer, torture_png_read);
+    png_read_info(png, info);
+    if (   png_get_image_width(png, info) == width && png_get_image_height(png, info) == height
+        && png_get_bit_depth(png, info) == 8 && png_get_color_type(png, info) == PNG_COLOR_TYPE_RGB) {
+        for (y = 0; y < height; y++) {
+            png_read_row(png, row, NULL);
+            if (memcmp(row, expected + y * width * 3, width * 3)) {
+                break;
+            }
+        }
+        res = y != height;
+    }
+    png_destroy_read_struct(&png, &info, NULL);
+    return res;
+}
+
+// Converts screenshots in the pixel formats of the Prime, at widths exercising the tails of the conversion kernels, and through the simulated Prime.
+static int torture_screen_png(void) {
+    static const uint32_t widths[] = { 320, 160, 37, 1 };
+    static uint8_t raw[320 * 240 * 2];
+    static uint8_t expected[320 * 240 * 3];
+    uint32_t seed = 0x13579BDF;
+    uint32_t i, w;
+    int res = 0;
+    uint8_t * converted = NULL;
+    uint32_t converted_size = 0;
+    torture_png_buffer png;
+
+    for (i = 0; i < sizeof(raw); i++) {
+        seed = seed * 1103515245 + 12345;
+        raw[i] = (uint8_t)(seed >> 24);
+    }
+    for (w = 0; w < sizeof(widths) / sizeof(widths[0]) && !res; w++) {
+        uint32_t width = widths[w];
+        uint32_t height = width == 320 ? 240 : 7;
+        // 16-bit samples hold big-endian X1R5G5B5 pixels.
+        for (i = 0; i < width * height; i++) {
+            uint32_t v = ((uint32_t)raw[2 * i] << 8) | raw[2 * i + 1];
+            uint32_t r = (v >> 10) & 0x1F, g = (v >> 5) & 0x1F, b = v & 0x1F;
+            expected[3 * i] = (uint8_t)((r << 3) | (r >> 2));
+            expected[3 * i + 1] = (uint8_t)((g << 3) | (g >> 2));
+            expected[3 * i + 2] = (uint8_t)((b << 3) | (b >> 2));
+        }
+        res = torture_png_encode(raw, width, height, 16, PNG_COLOR_TYPE_GRAY, &png)
+              || hpopers_oper_convert_raw_screen_to_png_r8g8b8(png.data, png.size, CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16, &converted, &converted_size)
+              || torture_png_check_rgb(converted, converted_size, expected, width, height);
+        free(png.data);
+        free(converted);
+        converted = NULL;
+        if (res) {
+            fprintf(stderr, "16-bit screenshot conversion failed at width %u\n", width);
+            break;
+        }
+        // 4-bit samples are grey levels, the first pixel in the high nibble; rows are padded to a byte.
+        for (i = 0; i < width * height; i++) {
+            uint32_t x = i % width, y = i / width;
+            uint8_t byte = raw[y * ((width + 1) / 2) + x / 2];
+            uint8_t grey = (uint8_t)(((x & 1) ? (byte & 0x0F) : (byte >> 4)) * 0x11);
+            expected[3 * i] = grey;
+            expected[3 * i + 1] = grey;
+            expected[3 * i + 2] = grey;
+        }
+        res = torture_png_encode(raw, width, height, 4, PNG_COLOR_TYPE_GRAY, &png)
+              || hpopers_oper_convert_raw_screen_to_png_r8g8b8(png.data, png.size, CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x4, &converted, &converted_size)
+              || torture_png_check_rgb(converted, converted_size, expected, width, height);
+        free(png.data);
+        free(converted);
+        converted = NULL;
+        if (res) {
+            fprintf(stderr, "4-bit screenshot conversion failed at width %u\n", width);
+        }
+    }
+    if (!res) {
+        // Other images go through libpng; R8G8B8 ones come out unchanged.
+        res = torture_png_encode(raw, 37, 7, 8, PNG_COLOR_TYPE_RGB, &png)
+              || hpopers_oper_convert_raw_screen_to_png_r8g8b8(png.data, png.size, CALC_SCREENSHOT_FORMAT_PRIME_PNG_160x120x16, &converted, &converted_size)
+              || torture_png_check_rgb(converted, converted_size, raw, 37, 7);
+        free(converted);
+        converted = NULL;
+        if (!res) {
+            // Truncated images and unknown formats must fail cleanly.
+            res = hpopers_oper_convert_raw_screen_to_png_r8g8b8(png.data, png.size / 2, CALC_SCREENSHOT_FORMAT_PRIME_PNG_160x120x16, &converted, &converted_size) == 0
+                  || hpopers_oper_convert_raw_screen_to_png_r8g8b8(raw, sizeof(raw), CALC_SCREENSHOT_FORMAT_PRIME_PNG_160x120x16, &converted, &converted_size) == 0
+                  || hpopers_oper_convert_raw_screen_to_png_r8g8b8(png.data, png.size, CALC_SCREENSHOT_FORMAT_LAST, &converted, &converted_size) == 0;
+        }
+        free(png.data);
+        if (res) {
+            fprintf(stderr, "generic screenshot conversion failed\n");
+        }
+    }
+    if (!res) {
+        cable_handle * cable;
+        calc_handle * calc;
+        res = 1;
+        for (i = 0; i < 320 * 240; i++) {
+            uint32_t v = ((uint32_t)raw[2 * i] << 8) | raw[2 * i + 1];
+            uint32_t r = (v >> 10) & 0x1F, g = (v >> 5) & 0x1F, b = v & 0x1F;
+            expected[3 * i] = (uint8_t)((r << 3) | (r >> 2));
+            expected[3 * i + 1] = (uint8_t)((g << 3) | (g >> 2));
+            expected[3 * i + 2] = (uint8_t)((b << 3) | (b >> 2));
+        }
+        if (!torture_png_encode(raw, 320, 240, 16, PNG_COLOR_TYPE_GRAY, &png)) {
+            if (!torture_sim_setup(&cable, &calc, 0)) {
+                res = hpcables_prime_sim_set_screen(cable, png.data, png.size)
+                      || hpopers_oper_recv_screen_png_r8g8b8(calc, CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16, &converted, &converted_size)
+                      || torture_png_check_rgb(converted, converted_size, expected, 320, 240);
+                free(converted);
+                torture_sim_teardown(cable, calc);
+            }
+            free(png.data);
+        }
+        if (res) {
+            fprintf(stderr, "screenshot conversion through the simulated Prime failed\n");
+        }
+    }
+    return res;
+}
+
+typedef struct {
+    uint32_t count; // Written last by the callback, read by the main thread with __atomic_load_n.
+    uint8_t markers[64];
+    calc_screenshot_format formats[64];
+    uint32_t sequences[64];
+    uint32_t sizes[64];
+} torture_screencast_record;
+
+static int torture_screencast_frame(opers_screencast * cast, const screencast_frame * frame, void * user_data) {
+    torture_screencast_record * record = (torture_screencast_record *)user_data;
+    uint32_t count = record->count;
+    if (count < 64) {
+        record->markers[count] = frame->data[0];
+        record->formats[count] = frame->format;
+        record->sequences[count] = frame->sequence;
+        record->sizes[count] = frame->size;
+        __atomic_store_n(&record->count, count + 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+// Waits for at least count frames, or at least polls polls if count is 0, for at most 5 seconds.
+static int torture_screencast_wait(opers_screencast * cast, torture_screencast_record * record, uint32_t count, uint32_t polls) {
+    unsigned int i;
+    for (i = 0; i < 5000; i++) {
+        struct timespec ts = { 0, 1000000 };
+        screencast_stats stats;
+        if (hpopers_screencast_get_stats(cast, &stats) || !stats.running) {
+            return 1;
+        }
+        if (count != 0 ? __atomic_load_n(&record->count, __ATOMIC_ACQUIRE) >= count : stats.polls >= polls) {
+            return 0;
+        }
+        nanosleep(&ts, NULL);
+    }
+    return 1;
+}
+
+// Screencasts from the simulated Prime: frames only upon changes, format stepping down to fit a latency budget, polls spaced out by a bandwidth budget.
+static int torture_screencast(void) {
+    static uint8_t image[320 * 240 * 2];
+    static torture_screencast_record record;
+    cable_handle * cable;
+    calc_handle * calc;
+    screencast_config config;
+    screencast_stats stats;
+    opers_screencast * cast;
+    uint32_t i;
+    int res = 1;
+
+    memset(&config, 0, sizeof(config));
+    config.format = CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16;
+    config.max_fps = 1000;
+    config.frame = torture_screencast_frame;
+    config.user_data = &record;
+
+    if (!torture_sim_setup(&cable, &calc, 0)) {
+        memset(image, 'A', sizeof(image));
+        memset(&record, 0, sizeof(record));
+        cast = hpcables_prime_sim_set_screen(cable, image, sizeof(image)) ? NULL : hpopers_screencast_start(calc, &config);
+        if (cast != NULL) {
+            // One frame, then neither fetches nor frames while the screen doesn't change, then one frame for the change.
+            // Stats are updated after the frame callback returns: wait for the poll which fetched the first frame to be accounted.
+            screencast_stats before;
+            res = torture_screencast_wait(cast, &record, 1, 0)
+                  || torture_screencast_wait(cast, &record, 0, 1)
+                  || hpopers_screencast_get_stats(cast, &before)
+                  || torture_screencast_wait(cast, &record, 0, before.polls + 20)
+                  || hpopers_screencast_get_stats(cast, &stats)
+                  || stats.bytes - before.bytes > (uint64_t)(stats.polls - before.polls) * 64
+                  || __atomic_load_n(&record.count, __ATOMIC_ACQUIRE) != 1;
+            if (!res) {
+                memset(image, 'B', sizeof(image));
+                res = hpcables_prime_sim_set_screen(cable, image, sizeof(image))
+                      || torture_screencast_wait(cast, &record, 2, 0);
+            }
+            res |= hpopers_screencast_stop(cast);
+            res |= record.count != 2 || record.markers[0] != 'A' || record.markers[1] != 'B' || record.sequences[1] != 1
+                   || record.formats[1] != CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16 || record.sizes[1] != sizeof(image);
+            if (res) {
+                fprintf(stderr, "screencast change detection failed\n");
+            }
+        }
+
+        if (!res) {
+            // No fetch fits a 1 us budget: the format steps down to the lowest one, a frame at a time, and never steps up.
+            config.latency_budget_us = 1;
+            memset(&record, 0, sizeof(record));
+            res = 1;
+            cast = hpopers_screencast_start(calc, &config);
+            if (cast != NULL) {
+                res = 0;
+                for (i = 0; i < 8 && !res; i++) {
+                    uint8_t format;
+                    for (format = CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16; format <= CALC_SCREENSHOT_FORMAT_PRIME_PNG_160x120x4 && !res; format++) {
+                        memset(image, 'a' + (int)i, sizeof(image));
+                        image[1] = format;
+                        res = hpcables_prime_sim_set_screen_format(cable, format, image, (format & 1) ? 9600 : 38400);
+                    }
+                    res = res || torture_screencast_wait(cast, &record, i + 1, 0);
+                }
+                res |= hpopers_screencast_get_stats(cast, &stats);
+                res |= hpopers_screencast_stop(cast);
+                res |= stats.format != CALC_SCREENSHOT_FORMAT_PRIME_PNG_160x120x4 || stats.format_changes != 2;
+                for (i = 1; i < record.count && !res; i++) {
+                    res = record.formats[i] < record.formats[i - 1] || record.sequences[i] != i;
+                }
+                res |= record.formats[0] != CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16 || record.formats[record.count - 1] != CALC_SCREENSHOT_FORMAT_PRIME_PNG_160x120x4;
+                if (res) {
+                    fprintf(stderr, "screencast format adaptation failed\n");
+                }
+            }
+        }
+
+        if (!res) {
+            // 150 KB frames at 1 MB/s: polls at least 150 ms apart, and stopping must not wait for the next one.
+            struct timespec start, end;
+            config.latency_budget_us = 0;
+            config.bandwidth_budget = 1000000;
+            memset(&record, 0, sizeof(record));
+            res = 1;
+            cast = hpcables_prime_sim_set_screen(cable, image, sizeof(image)) ? NULL : hpopers_screencast_start(calc, &config);
+            if (cast != NULL) {
+                res = torture_screencast_wait(cast, &record, 0, 1)
+                      || hpopers_screencast_get_stats(cast, &stats)
+                      || stats.interval_us < sizeof(image);
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                res |= hpopers_screencast_stop(cast);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                res |= (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec) > 100000000L;
+                if (res) {
+                    fprintf(stderr, "screencast bandwidth budget failed\n");
+                }
+            }
+        }
+        torture_sim_teardown(cable, calc);
+    }
+
+    return res;
+}
+
+typedef struct {
+    uint8_t markers[64];
+    uint32_t sizes[64];
+    uint32_t captures;
+    uint32_t count;
+    int bad;
+} torture_recorder_record;
+
+static int torture_recorder_frame(const recorder_frame * frame, void * user_data) {
+    torture_recorder_record * record = (torture_recorder_record *)user_data;
+    uint32_t i;
+    for (i = 1; i < frame->size; i++) {
+        record->bad |= frame->data[i] != frame->data[0];
+    }
+    record->bad |= frame->last_us < frame->first_us || frame->captures == 0 || frame->format != CALC_SCREENSHOT_FORMAT_PRIME_PNG_160x120x4;
+    if (record->count < 64) {
+        record->markers[record->count] = frame->data[0];
+        record->sizes[record->count] = frame->size;
+        record->count++;
+    }
+    record->captures += frame->captures;
+    return 0;
+}
+
+// Waits until a recorder has made at least captures captures, for at most 5 seconds.
+static int torture_recorder_wait(opers_recorder * recorder, uint32_t captures, recorder_stats * out_stats) {
+    unsigned int i;
+    for (i = 0; i < 5000; i++) {
+        struct timespec ts = { 0, 1000000 };
+        if (hpopers_recorder_get_stats(recorder, out_stats)) {
+            return 1;
+        }
+        if (out_stats->captures >= captures) {
+            return 0;
+        }
+        nanosleep(&ts, NULL);
+    }
+    return 1;
+}
+
+// Records the simulated Prime's screen into a ring which holds about 6 screenshots: identical captures are merged,
+// older screenshots are spilled, in order, and the ring and the spill file together hold every distinct screenshot once.
+static int torture_recorder(void) {
+    static const char spill_path[] = "torture_hpcalcs.rec";
+    static uint8_t image[2048];
+    static torture_recorder_record record;
+    cable_handle * cable;
+    calc_handle * calc;
+    recorder_config config;
+    recorder_stats stats;
+    opers_recorder * recorder;
+    uint32_t i;
+    int res = 1;
+
+    memset(&config, 0, sizeof(config));
+    config.format = CALC_SCREENSHOT_FORMAT_PRIME_PNG_160x120x4;
+    config.interval_ms = 1;
+    config.ring_size = 4000;
+    config.max_frames = 8;
+    config.spill_path = spill_path;
+    remove(spill_path);
+
+    if (!torture_sim_setup(&cable, &calc, 0)) {
+        memset(&record, 0, sizeof(record));
+        memset(image, 0, sizeof(image));
+        recorder = hpcables_prime_sim_set_screen(cable, image, 500) ? NULL : hpopers_recorder_new(calc, &config);
+        if (recorder != NULL) {
+            res = torture_recorder_wait(recorder, 5, &stats)
+                  || stats.duplicates + 1 != stats.captures || stats.frames != 1;
+            for (i = 1; i < 10 && !res; i++) {
+                memset(image, (int)i, sizeof(image));
+                res = hpcables_prime_sim_set_screen(cable, image, 500 + i * 37)
+                      || torture_recorder_wait(recorder, stats.captures + 3, &stats)
+                      || stats.bytes > config.ring_size;
+            }
+            res |= hpopers_recorder_foreach(recorder, torture_recorder_frame, &record);
+            res |= record.bad || record.count != stats.frames || record.count < 3 || record.count > 7
+                   || stats.evicted != 10 - record.count || stats.spilled != stats.evicted || stats.dropped != 0 || stats.errors != 0;
+            for (i = 0; i < record.count && !res; i++) {
+                res = record.markers[i] != 10 - record.count + i || record.sizes[i] != 500 + record.markers[i] * 37u;
+            }
+            res |= hpopers_recorder_del(recorder);
+            if (!res) {
+                memset(&record, 0, sizeof(record));
+                res = hpopers_recorder_read(spill_path, torture_recorder_frame, &record)
+                      || record.bad || record.count != 10 || record.captures < stats.captures;
+                for (i = 0; i < record.count && !res; i++) {
+                    res = record.markers[i] != i;
+                }
+            }
+            if (res) {
+                fprintf(stderr, "recorder ring or spill failed\n");
+            }
+        }
+
+        if (!res) {
+            // Without spill file, screenshots last seen longer ago than max_age_ms are dropped, whatever room is left.
+            config.ring_size = 1000000;
+            config.max_age_ms = 20;
+            config.spill_path = NULL;
+            res = 1;
+            recorder = hpopers_recorder_new(calc, &config);
+            if (recorder != NULL) {
+                struct timespec ts = { 0, 100000000 };
+                res = torture_recorder_wait(recorder, 2, &stats)
+                      || hpcables_prime_sim_set_screen(cable, image, 500)
+                      || (nanosleep(&ts, NULL), torture_recorder_wait(recorder, stats.captures + 2, &stats))
+                      || stats.frames != 1 || stats.evicted != 1 || stats.spilled != 0;
+                res |= hpopers_recorder_del(recorder);
+                if (res) {
+                    fprintf(stderr, "recorder age limit failed\n");
+                }
+            }
+        }
+        torture_sim_teardown(cable, calc);
+    }
+    remove(spill_path);
+
+    return res;
+}
+
+typedef struct {
+    uint32_t count; // Only written by the worker notifying the requests of the calculator.
+    uintptr_t order[16];
+} torture_async_record;
+
+static void torture_async_completed(calc_request * request, void * user_data) {
+    torture_async_record * record = (torture_async_record *)hpcalcs_request_get_user_data(request);
+    (void)user_data;
+    if (record->count < 16 && hpcalcs_request_get_result(request) != NULL) {
+        record->order[record->count++] = (uintptr_t)hpcalcs_request_get_handle(request);
+    }
+}
+
+// Queues operations on the simulated Prime: they run and complete in order, are notified through the callback and the completion queue,
+// and the queued ones can be cancelled or deleted before they start.
+static int torture_async(void) {
+    static uint8_t image[1000];
+    static torture_async_record record;
+    static const calc_fncts_idx ops[6] = {
+        CALC_FNCT_SET_DATE_TIME, CALC_FNCT_RECV_SCREEN, CALC_FNCT_SEND_KEY, CALC_FNCT_CHECK_READY, CALC_FNCT_RECV_SCREEN, CALC_FNCT_SEND_KEY
+    };
+    cable_handle * cable;
+    calc_handle * calc;
+    calc_completion_queue * queue = hpcalcs_completion_queue_new();
+    calc_request * requests[6];
+    calc_async_op op;
+    calc_async_result * result;
+    prime_sim_stats stats;
+    uint32_t i;
+    int res = 1;
+
+    memset(image, 'S', sizeof(image));
+    memset(&record, 0, sizeof(record));
+    if (queue != NULL && !torture_sim_setup(&cable, &calc, 0)) {
+        res = hpcables_prime_sim_set_screen(cable, image, sizeof(image))
+              || hpcables_prime_sim_set_timing(cable, 200, 0, 1);
+        for (i = 0; i < 6 && !res; i++) {
+            memset(&op, 0, sizeof(op));
+            op.op = ops[i];
+            op.timestamp = 1400000000;
+            op.format = CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16;
+            op.code = 42;
+            requests[i] = hpcalcs_async_submit(calc, &op, torture_async_completed, queue, &record);
+            res = requests[i] == NULL;
+        }
+        // Requests of a calculator complete in order; the callback runs before the request reaches the queue.
+        for (i = 0; i < 6 && !res; i++) {
+            calc_request * request = hpcalcs_completion_queue_poll(queue, 5000);
+            result = hpcalcs_request_get_result(request);
+            res = request != requests[i] || result == NULL || result->res != 0 || record.count < i + 1
+                  || record.order[i] != (uintptr_t)calc || hpcalcs_request_get_user_data(request) != &record;
+            if (!res && ops[i] == CALC_FNCT_RECV_SCREEN) {
+                res = result->payload.size != sizeof(image) || memcmp(CALC_PAYLOAD_DATA(&result->payload), image, sizeof(image));
+            }
+            hpcalcs_request_del(request);
+        }
+        res |= hpcalcs_completion_queue_poll(queue, 0) != NULL;
+        if (!res) {
+            // Waited for, without callback nor queue; the payload is kept past the request.
+            calc_payload payload;
+            memset(&op, 0, sizeof(op));
+            op.op = CALC_FNCT_RECV_SCREEN;
+            op.format = CALC_SCREENSHOT_FORMAT_PRIME_PNG_160x120x4;
+            requests[0] = hpcalcs_async_submit(calc, &op, NULL, NULL, NULL);
+            res = requests[0] == NULL || hpcalcs_request_wait(requests[0]) != 0 || (result = hpcalcs_request_get_result(requests[0])) == NULL;
+            if (!res) {
+                payload = result->payload;
+                result->payload.block = NULL;
+                hpcalcs_request_del(requests[0]);
+                res = payload.size != sizeof(image);
+                hpcalcs_payload_release(&payload);
+            }
+            memset(&op, 0, sizeof(op));
+            op.op = CALC_FNCT_NEGOTIATE_PROTOCOL;
+            res |= hpcalcs_async_submit(calc, &op, NULL, NULL, NULL) != NULL;
+        }
+        if (res) {
+            fprintf(stderr, "asynchronous operations failed\n");
+        }
+
+        if (!res) {
+            // Slow keys: the first one is running or about to, the others are queued. The third is deleted, the others cancelled.
+            uint32_t succeeded = 0;
+            res = hpcables_prime_sim_set_timing(cable, 20000, 0, 1) || hpcables_prime_sim_reset_stats(cable);
+            memset(&op, 0, sizeof(op));
+            op.op = CALC_FNCT_SEND_KEY;
+            op.code = 7;
+            for (i = 0; i < 5 && !res; i++) {
+                requests[i] = hpcalcs_async_submit(calc, &op, NULL, queue, NULL);
+                res = requests[i] == NULL;
+            }
+            res = res || hpcalcs_request_del(requests[2]) || hpcalcs_async_cancel(calc);
+            for (i = 0; i < 5 && !res; i++) {
+                if (i != 2) {
+                    calc_request * request = hpcalcs_completion_queue_poll(queue, 0);
+                    result = hpcalcs_request_get_result(request);
+                    // Successes, then cancellations.
+                    res = request != requests[i] || result == NULL || (result->res == 0 && succeeded != i);
+                    if (!res && result->res == 0) {
+                        succeeded++;
+                    }
+                    hpcalcs_request_del(request);
+                }
+            }
+            res = res || hpcalcs_completion_queue_poll(queue, 0) != NULL || succeeded > 2
+                  || hpcables_prime_sim_get_stats(cable, &stats) || stats.keys != succeeded;
+            if (!res) {
+                // Left in the queue: deleted along with it.
+                requests[0] = hpcalcs_async_submit(calc, &op, NULL, queue, NULL);
+                res = requests[0] == NULL || hpcalcs_request_wait(requests[0]) != 0;
+            }
+            if (res) {
+                fprintf(stderr, "asynchronous cancellation failed\n");
+            }
+        }
+        torture_sim_teardown(cable, calc);
+    }
+
+    if (queue != NULL) {
+        hpcalcs_completion_queue_del(queue);
+    }
+    return res;
+}
+
+#define TORTURE_BUSY_CALLERS (4)
+
+typedef struct {
+    calc_handle * calc;
+    uint32_t * finished;
+    uint32_t rank;
+    int res;
+} torture_busy_caller;
+
+static void * torture_busy_thread(void * arg) {
+    torture_busy_caller * caller = (torture_busy_caller *)arg;
+    caller->res = hpcalcs_calc_send_key(caller->calc, 7);
+    caller->rank = __atomic_fetch_add(caller->finished, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+// A callback which talks to the calculator it is called for fails instead of waiting for itself.
+static int torture_busy_callback(const calc_recv_chunk * chunk, const uint8_t * data, uint32_t size, void * user_data) {
+    torture_busy_caller * caller = (torture_busy_caller *)user_data;
+    if (chunk->complete) {
+        caller->res = hpcalcs_calc_send_key(caller->calc, 7);
+    }
+    return 0;
+}
+
+// Concurrent callers of a calculator handle are served one at a time, in arrival order, unless they give up after the busy timeout.
+static int torture_busy(void) {
+    static uint8_t image[1000];
+    cable_handle * cable;
+    calc_handle * calc;
+    torture_busy_caller callers[TORTURE_BUSY_CALLERS];
+    pthread_t threads[TORTURE_BUSY_CALLERS];
+    struct timespec ts = { 0, 20000000 };
+    prime_sim_stats stats;
+    uint32_t finished = 0;
+    uint32_t started = 0;
+    uint32_t i;
+    int res = 1;
+
+    memset(image, 'B', sizeof(image));
+    memset(callers, 0, sizeof(callers));
+    if (!torture_sim_setup(&cable, &calc, 0)) {
+        res = hpcalcs_options_get_busy_timeout(calc) >= 0 || hpcables_options_get_busy_timeout(cable) >= 0
+              || hpcables_prime_sim_set_screen(cable, image, sizeof(image))
+              || hpcables_prime_sim_set_timing(cable, 50000, 0, 1) || hpcables_prime_sim_reset_stats(cable);
+        // Arrivals 20 ms apart, while each key takes longer than that.
+        for (i = 0; i < TORTURE_BUSY_CALLERS && !res; i++) {
+            callers[i].calc = calc;
+            callers[i].finished = &finished;
+            res = pthread_create(&threads[i], NULL, torture_busy_thread, &callers[i]) != 0;
+            if (!res) {
+                started++;
+                nanosleep(&ts, NULL);
+            }
+        }
+        for (i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+            res |= callers[i].res != 0 || callers[i].rank != i;
+        }
+        res = res || hpcables_prime_sim_get_stats(cable, &stats) || stats.keys != TORTURE_BUSY_CALLERS;
+        if (res) {
+            fprintf(stderr, "serialization of concurrent callers failed\n");
+        }
+
+        if (!res) {
+            // Callers who don't wait, or not long enough, give up; the default is to wait.
+            finished = 0;
+            res = pthread_create(&threads[0], NULL, torture_busy_thread, &callers[0]) != 0;
+            if (!res) {
+                nanosleep(&ts, NULL);
+                res = hpcalcs_options_set_busy_timeout(calc, 0) || !hpcalcs_calc_send_key(calc, 7)
+                      || hpcalcs_options_set_busy_timeout(calc, 1) || !hpcalcs_calc_send_key(calc, 7)
+                      || hpcalcs_options_set_busy_timeout(calc, -1) || hpcalcs_calc_send_key(calc, 7);
+                pthread_join(threads[0], NULL);
+                res = res || callers[0].res != 0 || callers[0].rank != 0
+                      || hpcables_prime_sim_get_stats(cable, &stats) || stats.keys != TORTURE_BUSY_CALLERS + 2;
+            }
+            if (res) {
+                fprintf(stderr, "busy timeout failed\n");
+            }
+        }
+
+        if (!res) {
+            callers[0].res = 0;
+            res = hpcables_prime_sim_set_timing(cable, 0, 0, 0)
+                  || hpcalcs_calc_recv_screen_stream(calc, CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16, torture_busy_callback, &callers[0])
+                  || callers[0].res == 0 || hpcalcs_calc_send_key(calc, 7);
+            if (res) {
+                fprintf(stderr, "nested call from a callback failed\n");
+            }
+        }
+        torture_sim_teardown(cable, calc);
+    }
+
+    return res;
+}
+
+// Drives the operations of the simulated Prime from an event loop: the descriptor of the cable polls readable while a reply is pending,
+// and each pump call completes what it can, in order, from the calling thread, without waiting.
+static int torture_pump(void) {
+    static uint8_t image[5000];
+    static torture_async_record record;
+    static const calc_fncts_idx ops[4] = { CALC_FNCT_CHECK_READY, CALC_FNCT_RECV_SCREEN, CALC_FNCT_SEND_KEY, CALC_FNCT_GET_INFOS };
+    static const uint16_t chat[3] = { 0x48, 0x69, 0x21 };
+    cable_handle * cable;
+    calc_handle * calc;
+    calc_completion_queue * queue = hpcalcs_completion_queue_new();
+    calc_request * requests[4];
+    calc_request * request;
+    calc_async_op op;
+    calc_async_result * result;
+    prime_sim_stats stats;
+    struct pollfd pfd;
+    uint32_t completed = 0;
+    uint32_t i;
+    int res = 1;
+
+    memset(image, 'P', sizeof(image));
+    memset(&record, 0, sizeof(record));
+    if (queue != NULL && !torture_sim_setup(&cable, &calc, 0)) {
+        pfd.fd = -1;
+        pfd.events = POLLIN;
+        res = hpcables_prime_sim_set_screen(cable, image, sizeof(image))
+              || hpcables_options_set_read_timeout(cable, 0)
+              || hpcables_cable_get_fd(cable, &pfd.fd) || poll(&pfd, 1, 0) != 0
+              || hpcalcs_async_set_pumped(calc, 1) || hpcables_prime_sim_reset_stats(cable);
+        for (i = 0; i < 4 && !res; i++) {
+            memset(&op, 0, sizeof(op));
+            op.op = ops[i];
+            op.format = CALC_SCREENSHOT_FORMAT_PRIME_PNG_320x240x16;
+            op.code = 42;
+            requests[i] = hpcalcs_async_submit(calc, &op, torture_async_completed, queue, &record);
+            res = requests[i] == NULL;
+        }
+        // Backups span many packets: not for pumped calculators. Nothing is sent until the calculator is pumped.
+        memset(&op, 0, sizeof(op));
+        op.op = CALC_FNCT_RECV_BACKUP;
+        res = res || hpcalcs_async_submit(calc, &op, NULL, NULL, NULL) != NULL
+              || hpcables_prime_sim_get_stats(cable, &stats) || stats.commands != 0;
+        // The simulated calculator answers at once, so that a single call completes everything.
+        res = res || hpcalcs_async_pump(calc, &completed) || completed != 4 || record.count != 4 || poll(&pfd, 1, 0) != 0;
+        for (i = 0; i < 4 && !res; i++) {
+            request = hpcalcs_completion_queue_poll(queue, 0);
+            result = hpcalcs_request_get_result(request);
+            res = request != requests[i] || result == NULL || result->res != 0 || record.order[i] != (uintptr_t)calc;
+            if (!res && ops[i] == CALC_FNCT_RECV_SCREEN) {
+                res = result->payload.size != sizeof(image) || memcmp(CALC_PAYLOAD_DATA(&result->payload), image, sizeof(image));
+            }
+            hpcalcs_request_del(request);
+        }
+        res = res || hpcables_prime_sim_get_stats(cable, &stats) || stats.keys != 1;
+        if (res) {
+            fprintf(stderr, "pumped operations failed\n");
+        }
+
+        if (!res) {
+            // The calculator sends chat data on its own: the request stays in flight until the descriptor polls readable.
+            memset(&op, 0, sizeof(op));
+            op.op = CALC_FNCT_RECV_CHAT;
+            requests[0] = hpcalcs_async_submit(calc, &op, NULL, queue, NULL);
+            res = requests[0] == NULL || hpcalcs_async_pump(calc, &completed) || completed != 0 || poll(&pfd, 1, 0) != 0
+                  || hpcables_prime_sim_queue_chat(cable, chat, sizeof(chat)) || poll(&pfd, 1, 1000) != 1
+                  || hpcalcs_async_pump(calc, &completed) || completed != 1 || poll(&pfd, 1, 0) != 0;
+            request = hpcalcs_completion_queue_poll(queue, 0);
+            result = hpcalcs_request_get_result(request);
+            res = res || request != requests[0] || result == NULL || result->res != 0
+                  || result->payload.size != sizeof(chat) || memcmp(CALC_PAYLOAD_DATA(&result->payload), chat, sizeof(chat));
+            hpcalcs_request_del(request);
+
+            // In flight again: deleted without waiting, then cancelled along with the request queued behind it.
+            if (!res) {
+                requests[0] = hpcalcs_async_submit(calc, &op, NULL, NULL, NULL);
+                op.op = CALC_FNCT_SEND_KEY;
+                requests[1] = hpcalcs_async_submit(calc, &op, NULL, queue, NULL);
+                res = requests[0] == NULL || requests[1] == NULL || hpcalcs_async_pump(calc, &completed) || completed != 0
+                      || hpcalcs_request_del(requests[0]) || hpcalcs_async_cancel(calc);
+                request = hpcalcs_completion_queue_poll(queue, 0);
+                result = hpcalcs_request_get_result(request);
+                res = res || request != requests[1] || result == NULL || result->res == 0;
+                hpcalcs_request_del(request);
+            }
+            // A file goes through the steps of hpcalcs_calc_send_file; the reads don't wait, and leave the read timeout alone.
+            if (!res) {
+                files_var_entry * file = hpfiles_ve_create();
+                files_var_entry * received = NULL;
+                res = file == NULL || hpcables_options_set_read_timeout(cable, 1500);
+                if (!res) {
+                    file->type = PRIME_TYPE_PRGM;
+                    file->name[0] = 'P';
+                    file->data = image;
+                    file->size = 300;
+                    memset(&op, 0, sizeof(op));
+                    op.op = CALC_FNCT_SEND_FILE;
+                    op.file = file;
+                    // The transfer blocks: refused on a real device.
+                    cable->model = CABLE_PRIME_HIDRAW;
+                    res = hpcalcs_async_submit(calc, &op, NULL, NULL, NULL) != NULL;
+                    cable->model = CABLE_PRIME_SIM;
+                    requests[0] = hpcalcs_async_submit(calc, &op, NULL, queue, NULL);
+                    res = res || requests[0] == NULL || hpcalcs_async_pump(calc, &completed) || completed != 1
+                          || hpcables_options_get_read_timeout(cable) != 1500;
+                    request = hpcalcs_completion_queue_poll(queue, 0);
+                    result = hpcalcs_request_get_result(request);
+                    res = res || request != requests[0] || result == NULL || result->res != 0;
+                    hpcalcs_request_del(request);
+                    res = res || hpcalcs_async_set_pumped(calc, 0) || hpcalcs_calc_recv_file(calc, file, &received)
+                          || received == NULL || received->size != 300 || memcmp(received->data, image, 300);
+                    hpfiles_ve_delete(received);
+                    file->data = NULL;
+                }
+                hpfiles_ve_delete(file);
+            }
+            // Back to the worker threads and the synchronous functions.
+            res = res || hpcalcs_async_set_pumped(calc, 0) || hpcalcs_async_pump(calc, NULL) == 0
+                  || hpcalcs_calc_check_ready(calc, NULL, NULL)
+                  || hpcables_prime_sim_get_stats(cable, &stats) || stats.keys != 1;
+            if (res) {
+                fprintf(stderr, "pumped operation in flight failed\n");
+            }
+        }
+        torture_sim_teardown(cable, calc);
+    }
+
+    if (queue != NULL) {
+        hpcalcs_completion_queue_del(queue);
+    }
+    return res;
+}
+
+#define TORTURE_WALL_CALCS (5)
+
+typedef struct {
+    uint32_t count; // Written last by the callback, read by the main thread with __atomic_load_n.
+    uint32_t sequences[3];
+    uint32_t failed[3];
+    int results[TORTURE_WALL_CALCS];
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint8_t pixels[3 * 160 * 2 * 120 * 3];
+} torture_wall_record;
+
+static int torture_wall_mosaic(opers_wall * wall, const wall_mosaic * mosaic, void * user_data) {
+    torture_wall_record * record = (torture_wall_record *)user_data;
+    uint32_t count = record->count;
+    record->sequences[count] = mosaic->sequence;
+    record->failed[count] = mosaic->failed;
+    if (count == 0) {
+        memcpy(record->results, mosaic->results, sizeof(record->results));
+        record->width = mosaic->width;
+        record->height = mosaic->height;
+        record->stride = mosaic->stride;
+        if (mosaic->stride * mosaic->height <= sizeof(record->pixels)) {
+            memcpy(record->pixels, mosaic->pixels, mosaic->stride * mosaic->height);
+        }
+    }
+    __atomic_store_n(&record->count, count + 1, __ATOMIC_RELEASE);
+    return count + 1 == 3;
+}
+
+// Composites the 160x120 screens of a fleet of simulated Primes, one of which isn't a PNG image, into a 3x2 mosaic.
+static int torture_wall(void) {
+    static uint8_t raw[160 * 120 * 2];
+    static torture_wall_record record;
+    calc_handle * calcs[TORTURE_WALL_CALCS];
+    opers_fleet * fleet = NULL;
+    opers_wall * wall;
+    wall_config config;
+    wall_stats stats;
+    torture_png_buffer png;
+    uint32_t i, x, y;
+    int res = 0;
+
+    memset(&record, 0, sizeof(record));
+    memset(&config, 0, sizeof(config));
+    config.format = CALC_SCREENSHOT_FORMAT_PRIME_PNG_160x120x16;
+    config.fps = 100;
+    config.mosaic = torture_wall_mosaic;
+    config.user_data = &record;
+
+    for (i = 0; i < TORTURE_WALL_CALCS; i++) {
+        cable_handle * cable;
+        for (y = 0; y < 120; y++) {
+            for (x = 0; x < 160; x++) {
+                uint32_t v = (i * 1000 + x * 7 + y * 131) & 0x7FFF;
+                raw[(y * 160 + x) * 2] = (uint8_t)(v >> 8);
+                raw[(y * 160 + x) * 2 + 1] = (uint8_t)v;
+            }
+        }
+        if (torture_sim_setup(&cable, &calcs[i], 0)) {
+            res = 1;
+        }
+        else if (i == 3) {
+            res |= hpcables_prime_sim_set_screen(cable, raw, 1000);
+        }
+        else {
+            res |= torture_png_encode(raw, 160, 120, 16, PNG_COLOR_TYPE_GRAY, &png)
+                   || hpcables_prime_sim_set_screen(cable, png.data, png.size);
+            free(png.data);
+        }
+        if (res) {
+            fprintf(stderr, "wall setup failed\n");
+            if (calcs[i] != NULL) {
+                torture_sim_teardown(cable, calcs[i]);
+            }
+            break;
+        }
+    }
+    if (!res) {
+        fleet = hpopers_fleet_new(calcs, TORTURE_WALL_CALCS, 0, NULL);
+        res = fleet == NULL || hpopers_fleet_get_count(fleet) != TORTURE_WALL_CALCS;
+    }
+    if (!res) {
+        wall = hpopers_wall_start(fleet, &config);
+        res = 1;
+        if (wall != NULL) {
+            for (i = 0; i < 5000; i++) {
+                struct timespec ts = { 0, 1000000 };
+                if (hpopers_wall_get_stats(wall, &stats) || !stats.running) {
+                    break;
+                }
+                nanosleep(&ts, NULL);
+            }
+            res = __atomic_load_n(&record.count, __ATOMIC_ACQUIRE) != 3 || stats.running || stats.refreshes != 3 || stats.failed != 3
+                  || record.width != 480 || record.height != 240 || record.stride != 480 * 3;
+            for (i = 0; i < 3 && !res; i++) {
+                res = record.sequences[i] != i || record.failed[i] != 1;
+            }
+            for (i = 0; i < TORTURE_WALL_CALCS && !res; i++) {
+                res = (record.results[i] != 0) != (i == 3);
+            }
+            // Each tile holds its calculator's screen, the failed one and the unused one stay black.
+            for (i = 0; i < 6 && !res; i++) {
+                for (y = 0; y < 120 && !res; y++) {
+                    const uint8_t * row = record.pixels + ((i / 3) * 120 + y) * record.stride + (i % 3) * 160 * 3;
+                    for (x = 0; x < 160 && !res; x++) {
+                        uint32_t v = (i * 1000 + x * 7 + y * 131) & 0x7FFF;
+                        uint32_t r = (v >> 10) & 0x1F, g = (v >> 5) & 0x1F, b = v & 0x1F;
+                        if (i == 3 || i == 5) {
+                            r = g = b = 0;
+                        }
+                        else {
+                            r = (r << 3) | (r >> 2);
+                            g = (g << 3) | (g >> 2);
+                            b = (b << 3) | (b >> 2);
+                        }
+                        res = row[x * 3] != r || row[x * 3 + 1] != g || row[x * 3 + 2] != b;
+                    }
+                }
+            }
+            res |= hpopers_wall_stop(wall);
+            if (res) {
+                fprintf(stderr, "wall mosaic failed\n");
+            }
+        }
+    }
+    if (fleet != NULL) {
+        res |= hpopers_fleet_del(fleet);
+    }
+    else {
+        while (i-- > 0) {
+            torture_sim_teardown(hpcalcs_cable_get(calcs[i]), calcs[i]);
+        }
+    }
+    return res;
+}
+
 int main(int argc, char **argv) {
     int i = 1;
+    int res = 0;
 
     hpfiles_init(NULL);
     hpfiles_exit();
@@ -32,10 +1352,31 @@ int main(int argc, char **argv) {
     hpcables_exit();
 
     hpcalcs_init(NULL);
+    res |= torture_crc16();
     hpcalcs_exit();
 
     hpopers_init(NULL);
     hpopers_exit();
 
-    return 0;
+    hpfiles_init(NULL);
+    hpcables_init(NULL);
+    hpcalcs_init(NULL);
+    res |= torture_recv_limits();
+    res |= torture_prime_sim();
+    res |= torture_prime_sim_mapped();
+    res |= torture_prime_sim_protocol();
+    res |= torture_async();
+    res |= torture_busy();
+    res |= torture_pump();
+    hpopers_init(NULL);
+    res |= torture_screen_png();
+    res |= torture_screencast();
+    res |= torture_recorder();
+    res |= torture_wall();
+    hpopers_exit();
+    hpcalcs_exit();
+    hpcables_exit();
+    hpfiles_exit();
+
+    return res;
 }